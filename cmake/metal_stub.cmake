@@ -0,0 +1,72 @@
+# Stand-in for `xcrun metal` and `xcrun metallib`, enabled with
+# -DMETAL_STUB_COMPILER=ON. It doesn't compile anything, it only reproduces
+# the compiler's inputs and outputs (an .air per source, a depfile listing
+# the headers it includes, one linked .metallib) so the shader build graph
+# can be exercised on machines without Xcode.
+#
+#   cmake -DMODE=compile -DSOURCE=<.metal> -DOUTPUT=<.air> -DDEPFILE=<.d>
+#         -DINCLUDE_DIR=<dir> -P metal_stub.cmake
+#   cmake -DMODE=link -DOUTPUT=<.metallib> -P metal_stub.cmake <.air>...
+
+# Script mode starts with every policy unset, IN_LIST needs CMP0057
+cmake_minimum_required(VERSION 3.20)
+
+# Collects the quoted includes of FILE, recursively. Includes are looked up
+# next to the including file first and then in INCLUDE_DIR, like the real
+# compiler with -I. Angle bracket includes are system headers and ignored.
+function(collect_includes FILE)
+    file(STRINGS ${FILE} INCLUDE_LINES REGEX "^[ \t]*#[ \t]*include[ \t]*\"")
+    get_filename_component(FILE_DIR ${FILE} DIRECTORY)
+    foreach(LINE ${INCLUDE_LINES})
+        string(REGEX REPLACE "^[ \t]*#[ \t]*include[ \t]*\"([^\"]+)\".*" "\\1" HEADER ${LINE})
+        set(RESOLVED "")
+        foreach(DIR ${FILE_DIR} ${INCLUDE_DIR})
+            if(EXISTS ${DIR}/${HEADER})
+                get_filename_component(RESOLVED ${DIR}/${HEADER} ABSOLUTE)
+                break()
+            endif()
+        endforeach()
+        if(RESOLVED STREQUAL "")
+            message(FATAL_ERROR "${FILE}: can't find include \"${HEADER}\"")
+        endif()
+        if(NOT RESOLVED IN_LIST DEPENDENCIES)
+            list(APPEND DEPENDENCIES ${RESOLVED})
+            collect_includes(${RESOLVED})
+        endif()
+    endforeach()
+    set(DEPENDENCIES ${DEPENDENCIES} PARENT_SCOPE)
+endfunction()
+
+if(MODE STREQUAL "compile")
+    set(DEPENDENCIES "")
+    collect_includes(${SOURCE})
+
+    # The .air changes whenever the source or any header does, like a real
+    # compiler's output would
+    file(SHA256 ${SOURCE} HASH)
+    set(AIR "stub-air ${SOURCE} ${HASH}\n")
+    set(DEPFILE_CONTENT "${OUTPUT}: ${SOURCE}")
+    foreach(DEPENDENCY ${DEPENDENCIES})
+        file(SHA256 ${DEPENDENCY} HASH)
+        string(APPEND AIR "  ${DEPENDENCY} ${HASH}\n")
+        string(APPEND DEPFILE_CONTENT " \\\n  ${DEPENDENCY}")
+    endforeach()
+    file(WRITE ${OUTPUT} ${AIR})
+    file(WRITE ${DEPFILE} "${DEPFILE_CONTENT}\n")
+elseif(MODE STREQUAL "link")
+    # Inputs are the arguments following `-P <script>`
+    set(LIBRARY "stub-metallib\n")
+    set(FIRST_INPUT 0)
+    math(EXPR LAST_ARG "${CMAKE_ARGC} - 1")
+    foreach(INDEX RANGE ${LAST_ARG})
+        if(FIRST_INPUT GREATER 0 AND INDEX GREATER_EQUAL FIRST_INPUT)
+            file(READ ${CMAKE_ARGV${INDEX}} AIR)
+            string(APPEND LIBRARY ${AIR})
+        elseif(CMAKE_ARGV${INDEX} STREQUAL "-P")
+            math(EXPR FIRST_INPUT "${INDEX} + 2")
+        endif()
+    endforeach()
+    file(WRITE ${OUTPUT} ${LIBRARY})
+else()
+    message(FATAL_ERROR "metal_stub.cmake: unknown MODE '${MODE}'")
+endif()
@@ -1,2 +1,7 @@
 #define STB_IMAGE_IMPLEMENTATION
+// stb picks up SSE2 on its own but only uses its NEON IDCT and YCbCr to RGB
+// loops when asked to
+#if defined(__ARM_NEON)
+#define STBI_NEON
+#endif
 #include "stb_image.h"
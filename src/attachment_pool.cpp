@@ -0,0 +1,116 @@
+#include "attachment_pool.hpp"
+
+#include <cassert>
+
+AttachmentPool::AttachmentPool(CreateFunction create, DestroyFunction destroy,
+                               uint32_t maxIdleFrames,
+                               uint32_t maxIdleAttachments)
+    : create(std::move(create)), destroy(std::move(destroy)),
+      maxIdleFrames(maxIdleFrames), maxIdleAttachments(maxIdleAttachments) {}
+
+AttachmentPool::~AttachmentPool() {
+  for (Entry &entry : entries) {
+    destroy(entry.handle);
+  }
+}
+
+AttachmentPool::Handle AttachmentPool::acquire(const AttachmentKey &key) {
+  // Prefer the most recently released match, it's the most likely to still
+  // be warm in whatever caches the driver keeps
+  Entry *best = nullptr;
+  for (Entry &entry : entries) {
+    if (!entry.inUse && entry.key == key &&
+        (!best || entry.idleFrames < best->idleFrames)) {
+      best = &entry;
+    }
+  }
+  if (best) {
+    best->inUse = true;
+    best->idleFrames = 0;
+    poolStats.reused++;
+    poolStats.inUse++;
+    poolStats.idle--;
+    return best->handle;
+  }
+
+  Handle handle = create(key);
+  entries.push_back({key, handle, true, 0});
+  poolStats.created++;
+  poolStats.inUse++;
+  return handle;
+}
+
+void AttachmentPool::release(Handle handle) {
+  if (!handle) {
+    return;
+  }
+  for (Entry &entry : entries) {
+    if (entry.handle == handle) {
+      assert(entry.inUse);
+      entry.inUse = false;
+      entry.idleFrames = 0;
+      poolStats.inUse--;
+      poolStats.idle++;
+      break;
+    }
+  }
+
+  // Bound the idle set, dropping the oldest first
+  while (poolStats.idle > maxIdleAttachments) {
+    size_t oldest = entries.size();
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (!entries[i].inUse &&
+          (oldest == entries.size() ||
+           entries[i].idleFrames > entries[oldest].idleFrames)) {
+        oldest = i;
+      }
+    }
+    destroyEntry(oldest);
+  }
+}
+
+void AttachmentPool::endFrame() {
+  for (size_t i = 0; i < entries.size();) {
+    Entry &entry = entries[i];
+    if (!entry.inUse && ++entry.idleFrames > maxIdleFrames) {
+      destroyEntry(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void AttachmentPool::trim() {
+  for (size_t i = 0; i < entries.size();) {
+    if (!entries[i].inUse) {
+      destroyEntry(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void AttachmentPool::destroyEntry(size_t index) {
+  destroy(entries[index].handle);
+  entries[index] = entries.back();
+  entries.pop_back();
+  poolStats.destroyed++;
+  poolStats.idle--;
+}
+
+void ResizeDebouncer::request(int width, int height, double now) {
+  hasPending = true;
+  pendingWidth = width;
+  pendingHeight = height;
+  lastRequestTime = now;
+}
+
+bool ResizeDebouncer::poll(double now, int &width, int &height) {
+  if (!hasPending || now - lastRequestTime < settleSeconds) {
+    return false;
+  }
+  hasPending = false;
+  width = pendingWidth;
+  height = pendingHeight;
+  return true;
+}
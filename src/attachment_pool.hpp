@@ -0,0 +1,92 @@
+#pragma once
+// Pool of transient render pass attachments (MSAA colour, depth, ...).
+//
+// Attachments are keyed by everything that makes two textures
+// interchangeable. Released attachments stay idle in the pool for a few
+// frames so that a window going back and forth between sizes, or a pass
+// that only runs some frames, picks up an existing texture instead of
+// allocating a new one. Creation and destruction go through callbacks so the
+// pool policy itself has no Metal dependency.
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct AttachmentKey {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // MTL::PixelFormat, MTL::TextureUsage and MTL::StorageMode values
+  uint32_t pixelFormat = 0;
+  uint32_t sampleCount = 1;
+  uint32_t usage = 0;
+  uint32_t storageMode = 0;
+
+  bool operator==(const AttachmentKey &other) const = default;
+};
+
+struct AttachmentPoolStats {
+  uint32_t created = 0;
+  uint32_t reused = 0;
+  uint32_t destroyed = 0;
+  uint32_t inUse = 0;
+  uint32_t idle = 0;
+};
+
+class AttachmentPool {
+public:
+  using Handle = void *;
+  using CreateFunction = std::function<Handle(const AttachmentKey &)>;
+  using DestroyFunction = std::function<void(Handle)>;
+
+  AttachmentPool(CreateFunction create, DestroyFunction destroy,
+                 uint32_t maxIdleFrames = 8, uint32_t maxIdleAttachments = 8);
+  ~AttachmentPool();
+
+  // Hands out an idle attachment with a matching key, or creates one
+  Handle acquire(const AttachmentKey &key);
+  // Returns an attachment to the pool, where it stays idle until reused or
+  // it ages out
+  void release(Handle handle);
+  // Ages idle attachments and destroys those unused for maxIdleFrames
+  void endFrame();
+  // Destroys every idle attachment straight away
+  void trim();
+
+  const AttachmentPoolStats &stats() const { return poolStats; }
+
+private:
+  struct Entry {
+    AttachmentKey key;
+    Handle handle;
+    bool inUse;
+    uint32_t idleFrames;
+  };
+
+  void destroyEntry(size_t index);
+
+  CreateFunction create;
+  DestroyFunction destroy;
+  uint32_t maxIdleFrames;
+  uint32_t maxIdleAttachments;
+  std::vector<Entry> entries;
+  AttachmentPoolStats poolStats;
+};
+
+// Collapses the burst of resize events produced while dragging a window edge
+// into one resize, once the size has stopped changing for `settleSeconds`.
+class ResizeDebouncer {
+public:
+  explicit ResizeDebouncer(double settleSeconds = 0.1)
+      : settleSeconds(settleSeconds) {}
+
+  void request(int width, int height, double now);
+  // Returns true (once) when a requested size has settled
+  bool poll(double now, int &width, int &height);
+  bool pending() const { return hasPending; }
+
+private:
+  double settleSeconds;
+  bool hasPending = false;
+  int pendingWidth = 0;
+  int pendingHeight = 0;
+  double lastRequestTime = 0.0;
+};
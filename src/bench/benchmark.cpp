@@ -0,0 +1,105 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+static double elapsedNanoseconds(const std::function<void()> &run,
+                                 uint64_t calls) {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now();
+  for (uint64_t call = 0; call < calls; call++) {
+    run();
+  }
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+BenchmarkResult runBenchmark(const Benchmark &benchmark,
+                             const BenchmarkOptions &options) {
+  double minSampleNanoseconds = options.minSampleMilliseconds * 1e6;
+  uint64_t calls = 1;
+  while (elapsedNanoseconds(benchmark.run, calls) < minSampleNanoseconds) {
+    calls *= 2;
+  }
+
+  std::vector<double> samples;
+  for (uint32_t sample = 0; sample < options.samples; sample++) {
+    samples.push_back(elapsedNanoseconds(benchmark.run, calls) / calls);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  BenchmarkResult result;
+  result.name = benchmark.name;
+  result.items = benchmark.items;
+  result.callsPerSample = calls;
+  result.samples = (uint32_t)samples.size();
+  if (samples.empty()) {
+    return result;
+  }
+  size_t middle = samples.size() / 2;
+  result.median = samples.size() % 2
+                      ? samples[middle]
+                      : (samples[middle - 1] + samples[middle]) / 2.0;
+  result.minimum = samples.front();
+  double total = 0.0;
+  for (double sample : samples) {
+    total += sample;
+  }
+  result.mean = total / samples.size();
+  double squares = 0.0;
+  for (double sample : samples) {
+    squares += (sample - result.mean) * (sample - result.mean);
+  }
+  result.standardDeviation = std::sqrt(squares / samples.size());
+  if (benchmark.counters) {
+    result.counters = benchmark.counters();
+  }
+  return result;
+}
+
+std::string benchmarkResultsJson(const std::vector<BenchmarkResult> &results,
+                                 const BenchmarkOptions &options) {
+  char line[512];
+  std::string json = "{\n  \"suite\": \"engine_bench\",\n";
+#if defined(__VERSION__)
+  // Version strings have no quotes or backslashes to escape
+  json += "  \"compiler\": \"" __VERSION__ "\",\n";
+#endif
+#if defined(NDEBUG)
+  json += "  \"optimized\": true,\n";
+#else
+  json += "  \"optimized\": false,\n";
+#endif
+  snprintf(line, sizeof(line),
+           "  \"samples\": %u,\n  \"min_sample_ms\": %.3f,\n"
+           "  \"benchmarks\": [",
+           options.samples, options.minSampleMilliseconds);
+  json += line;
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchmarkResult &result = results[i];
+    // Names are the suite's own, plain identifiers and slashes
+    snprintf(line, sizeof(line),
+             "%s\n    {\"name\": \"%s\", \"items\": %llu, "
+             "\"calls_per_sample\": %llu, \"samples\": %u, "
+             "\"median_ns\": %.1f, \"min_ns\": %.1f, \"mean_ns\": %.1f, "
+             "\"stddev_ns\": %.1f, \"items_per_second\": %.1f",
+             i ? "," : "", result.name.c_str(),
+             (unsigned long long)result.items,
+             (unsigned long long)result.callsPerSample, result.samples,
+             result.median, result.minimum, result.mean,
+             result.standardDeviation, result.itemsPerSecond());
+    json += line;
+    // Counter names are plain identifiers as well
+    for (size_t c = 0; c < result.counters.size(); c++) {
+      snprintf(line, sizeof(line), "%s\"%s\": %.6g",
+               c ? ", " : ", \"counters\": {", result.counters[c].name.c_str(),
+               result.counters[c].value);
+      json += line;
+    }
+    json += result.counters.empty() ? "}" : "}}";
+  }
+  json += "\n  ]\n}\n";
+  return json;
+}
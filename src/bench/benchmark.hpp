@@ -0,0 +1,100 @@
+#pragma once
+// The microbenchmark harness behind engine_bench.
+//
+// A benchmark is a function called over and over on inputs built once up
+// front. It's first calibrated: the calls per sample are doubled until a
+// sample takes at least minSampleMilliseconds, which also warms up caches
+// and branch predictors. Then `samples` samples are timed and summarized by
+// their median, which a stray interrupt or page fault in one sample doesn't
+// move the way it moves the mean.
+//
+// Inputs come from fixed seeds through BenchmarkRandom, so every run does
+// exactly the same work and only the machine and the build change the
+// numbers. Benchmarks run on the calling thread unless their name says
+// otherwise ("_pool", "_concurrent", "_threads"); those go through
+// ThreadPool::shared() and scale with the machine's core count.
+// "_threads_<n>" ones run on a pool of exactly n threads, to show scaling.
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Something a benchmark measures besides time, e.g. fragmentation
+struct BenchmarkCounter {
+  std::string name;
+  double value = 0.0;
+};
+
+struct Benchmark {
+  // Grouped by prefix, e.g. "culling/frustum_lod"
+  std::string name;
+  // Work items per call (vertices, objects, pixels...), for throughput
+  uint64_t items = 1;
+  std::function<void()> run;
+  // Read once after the samples, optional
+  std::function<std::vector<BenchmarkCounter>()> counters;
+};
+
+struct BenchmarkOptions {
+  uint32_t samples = 15;
+  double minSampleMilliseconds = 20.0;
+  // Only benchmarks whose name contains this run, unless it's empty
+  std::string filter;
+};
+
+struct BenchmarkResult {
+  std::string name;
+  uint64_t items = 0;
+  uint64_t callsPerSample = 0;
+  uint32_t samples = 0;
+  // Nanoseconds per call
+  double median = 0.0;
+  double minimum = 0.0;
+  double mean = 0.0;
+  double standardDeviation = 0.0;
+  std::vector<BenchmarkCounter> counters;
+
+  double itemsPerSecond() const {
+    return median > 0.0 ? items * 1e9 / median : 0.0;
+  }
+};
+
+BenchmarkResult runBenchmark(const Benchmark &benchmark,
+                             const BenchmarkOptions &options);
+
+// The results with what they were measured with, for tracking over time
+std::string benchmarkResultsJson(const std::vector<BenchmarkResult> &results,
+                                 const BenchmarkOptions &options);
+
+// Keeps the compiler from optimizing away a result nobody reads
+template <typename T> inline void doNotOptimize(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+  asm volatile("" : : "g"(&value) : "memory");
+#else
+  const volatile char *bytes = reinterpret_cast<const volatile char *>(&value);
+  (void)*bytes;
+#endif
+}
+
+// xorshift64*. The standard distributions aren't specified exactly, so they
+// would give different inputs with different standard libraries.
+class BenchmarkRandom {
+public:
+  explicit BenchmarkRandom(uint64_t seed) : state(seed ? seed : 1) {}
+
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+  }
+  // In [low, high)
+  float uniform(float low, float high) {
+    return low + (high - low) * ((next() >> 40) * (1.0f / (1 << 24)));
+  }
+  // In [0, count)
+  uint32_t below(uint32_t count) { return (uint32_t)(next() % count); }
+
+private:
+  uint64_t state;
+};
@@ -0,0 +1,1135 @@
+// engine_bench: microbenchmarks of the engine's CPU hot paths.
+//
+//   engine_bench [--filter text] [--out results.json] [--samples n]
+//                [--min-sample-ms ms] [--assets dir] [--list]
+//
+// Results go to --out, or stdout, as JSON. Progress and a readable table go
+// to stderr. Build with optimizations (CMAKE_BUILD_TYPE=Release), the JSON
+// records whether they were on.
+#include "benchmark.hpp"
+
+#include "cluster_lighting.hpp"
+#include "command_encoding.hpp"
+#include "draw_sorting.hpp"
+#include "engine_math.hpp"
+#include "entity_store.hpp"
+#include "gpu_culling.hpp"
+#include "hiz_culling.hpp"
+#include "image_decode.hpp"
+#include "image_encode.hpp"
+#include "obj_loading.hpp"
+#include "occlusion_culling.hpp"
+#include "position_stream.hpp"
+#include "procedural_geometry.hpp"
+#include "profiler.hpp"
+#include "scene_graph.hpp"
+#include "thread_pool.hpp"
+#include "tlsf_allocator.hpp"
+#include "uniform_ring.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+#ifndef ENGINE_BENCH_ASSET_DIR
+#define ENGINE_BENCH_ASSET_DIR "src/assets"
+#endif
+
+// Obj text of a mesh, with positions, texture coordinates and normals all
+// indexed the same way
+static std::string writeObj(const Mesh &mesh) {
+  std::string obj;
+  char line[128];
+  for (const MeshVertex &vertex : mesh.vertices) {
+    snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", vertex.position.x,
+             vertex.position.y, vertex.position.z);
+    obj += line;
+  }
+  for (const MeshVertex &vertex : mesh.vertices) {
+    snprintf(line, sizeof(line), "vt %.6f %.6f\n", vertex.textureCoordinate.x,
+             vertex.textureCoordinate.y);
+    obj += line;
+  }
+  for (const MeshVertex &vertex : mesh.vertices) {
+    snprintf(line, sizeof(line), "vn %.6f %.6f %.6f\n", vertex.normal.x,
+             vertex.normal.y, vertex.normal.z);
+    obj += line;
+  }
+  for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+    uint32_t a = mesh.indices[i] + 1;
+    uint32_t b = mesh.indices[i + 1] + 1;
+    uint32_t c = mesh.indices[i + 2] + 1;
+    snprintf(line, sizeof(line), "f %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b,
+             b, b, c, c, c);
+    obj += line;
+  }
+  return obj;
+}
+
+// A 65k triangle sphere, parsed from memory and flattened to one vertex per
+// corner the way MTLEngine::loadObjModel does
+static Benchmark objParseBenchmark() {
+  Mesh mesh = generateUVSphere(128, 256, 1.0f, nullptr);
+  auto stream = std::make_shared<std::istringstream>(writeObj(mesh));
+  auto vertices = std::make_shared<std::vector<MeshVertex>>();
+  return {"obj/parse_convert", mesh.indices.size(), [stream, vertices] {
+            stream->clear();
+            stream->seekg(0);
+            vertices->clear();
+            parseObjVertices(*stream, *vertices);
+            doNotOptimize(vertices->data());
+          }};
+}
+
+// The vertex and triangle counts of a generated mesh
+static std::function<std::vector<BenchmarkCounter>()>
+meshCounters(const Mesh &mesh) {
+  double vertices = (double)mesh.vertices.size();
+  double triangles = (double)mesh.triangleCount();
+  return [vertices, triangles]() -> std::vector<BenchmarkCounter> {
+    return {{"vertices", vertices}, {"triangles", triangles}};
+  };
+}
+
+// MTLEngine::createSphere's default sphere, and a dense one. Before it was
+// indexed, createSphere stored 6 vertices per quad, rings * segments * 6.
+static Benchmark sphereBenchmark(uint32_t rings, uint32_t segments,
+                                 bool pool) {
+  Mesh sample = generateUVSphere(rings, segments, 1.0f, nullptr);
+  return {"geometry/uv_sphere_" + std::to_string(rings) + "x" +
+              std::to_string(segments) + (pool ? "_pool" : ""),
+          sample.vertices.size(),
+          [rings, segments, pool] {
+            Mesh mesh =
+                generateUVSphere(rings, segments, 1.0f,
+                                 pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(mesh.vertices.data());
+          },
+          meshCounters(sample)};
+}
+
+static Benchmark icosphereBenchmark(uint32_t subdivisions, bool pool) {
+  Mesh sample = generateIcosphere(subdivisions, 1.0f, nullptr);
+  return {"geometry/icosphere_" + std::to_string(subdivisions) +
+              (pool ? "_pool" : ""),
+          sample.vertices.size(),
+          [subdivisions, pool] {
+            Mesh mesh = generateIcosphere(
+                subdivisions, 1.0f, pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(mesh.vertices.data());
+          },
+          meshCounters(sample)};
+}
+
+static Benchmark torusBenchmark(uint32_t majorSegments, uint32_t minorSegments,
+                                bool pool) {
+  Mesh sample =
+      generateTorus(1.0f, 0.25f, majorSegments, minorSegments, nullptr);
+  return {"geometry/torus_" + std::to_string(majorSegments) + "x" +
+              std::to_string(minorSegments) + (pool ? "_pool" : ""),
+          sample.vertices.size(),
+          [majorSegments, minorSegments, pool] {
+            Mesh mesh =
+                generateTorus(1.0f, 0.25f, majorSegments, minorSegments,
+                              pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(mesh.vertices.data());
+          },
+          meshCounters(sample)};
+}
+
+// The depth pre-pass's position stream, from the vertices of a dense
+// sphere. The counter is the stream's size against the full vertices'.
+static Benchmark positionStreamBenchmark() {
+  auto mesh = std::make_shared<Mesh>(generateUVSphere(512, 512, 1.0f, nullptr));
+  auto positions = std::make_shared<std::vector<float>>(
+      mesh->vertices.size() * positionStreamComponents);
+  return {"geometry/extract_positions", mesh->vertices.size(),
+          [mesh, positions] {
+            extractPositions(mesh->vertices.data(), mesh->vertices.size(),
+                             sizeof(MeshVertex), positions->data());
+            doNotOptimize(positions->data());
+          },
+          []() -> std::vector<BenchmarkCounter> {
+            return {{"stream_bytes_ratio",
+                     positionStreamComponents * sizeof(float) /
+                         (double)sizeof(MeshVertex)}};
+          }};
+}
+
+// What Texture gets from a file: decoded, expanded to RGBA and flipped
+static bool decodeBenchmark(const std::string &assetDirectory,
+                            Benchmark &benchmark) {
+  std::string path = assetDirectory + "/mars_texture.jpg";
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  auto encoded = std::make_shared<std::vector<uint8_t>>(
+      std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  DecodedImage sample =
+      decodeImageMemory(encoded->data(), encoded->size(), true);
+  if (!sample.valid()) {
+    return false;
+  }
+  benchmark = {"texture/decode_jpeg", (uint64_t)sample.width * sample.height,
+               [encoded] {
+                 DecodedImage image = decodeImageMemory(
+                     encoded->data(), encoded->size(), true);
+                 doNotOptimize(image.pixels.data());
+               }};
+  return true;
+}
+
+static std::vector<uint8_t> randomBytes(size_t count, uint64_t seed) {
+  BenchmarkRandom random(seed);
+  std::vector<uint8_t> bytes(count);
+  for (uint8_t &byte : bytes) {
+    byte = (uint8_t)random.next();
+  }
+  return bytes;
+}
+
+// The mars texture's size
+static Benchmark expandBenchmark() {
+  const size_t pixels = 1380 * 690;
+  auto rgb = std::make_shared<std::vector<uint8_t>>(randomBytes(pixels * 3, 1));
+  auto rgba = std::make_shared<std::vector<uint8_t>>(pixels * 4);
+  return {"texture/expand_rgb_to_rgba", pixels, [rgb, rgba] {
+            expandRGBToRGBA(rgb->data(), rgba->data(), rgb->size() / 3);
+            doNotOptimize(rgba->data());
+          }};
+}
+
+// A smooth gradient with a little noise, which compresses about as well as
+// a photo. encodePng only writes RGBA, so this is a PNG of its own with
+// unfiltered rows, to go through the RGB expansion when decoded.
+static std::vector<uint8_t> syntheticRgbPng(uint32_t width, uint32_t height,
+                                            uint64_t seed) {
+  BenchmarkRandom random(seed);
+  std::vector<uint8_t> rows;
+  rows.reserve((size_t)(width * 3 + 1) * height);
+  for (uint32_t y = 0; y < height; y++) {
+    rows.push_back(0);
+    for (uint32_t x = 0; x < width; x++) {
+      uint8_t noise = (uint8_t)(random.next() & 15);
+      rows.push_back((uint8_t)(x * 239 / width + noise));
+      rows.push_back((uint8_t)(y * 239 / height + noise));
+      rows.push_back((uint8_t)((x + y) * 119 / (width + height) + noise));
+    }
+  }
+
+  std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  auto appendBigEndian = [&png](uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      png.push_back((uint8_t)(value >> shift));
+    }
+  };
+  auto appendChunk = [&](const char *type, const std::vector<uint8_t> &data) {
+    appendBigEndian((uint32_t)data.size());
+    size_t typeStart = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    appendBigEndian(crc32Update(png.data() + typeStart, data.size() + 4));
+  };
+  std::vector<uint8_t> header;
+  for (uint32_t value : {width, height}) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      header.push_back((uint8_t)(value >> shift));
+    }
+  }
+  // 8 bits per channel, RGB, default compression, filtering and no interlace
+  header.insert(header.end(), {8, 2, 0, 0, 0});
+  appendChunk("IHDR", header);
+  appendChunk("IDAT", zlibCompress(rows.data(), rows.size()));
+  appendChunk("IEND", {});
+  return png;
+}
+
+// A 4K by 2K RGB texture, converted on the calling thread and with its rows
+// split across the shared pool
+static Benchmark largeDecodeBenchmark(bool pool) {
+  const uint32_t width = 4096, height = 2048;
+  auto encoded =
+      std::make_shared<std::vector<uint8_t>>(syntheticRgbPng(width, height, 4));
+  return {pool ? "texture/decode_png_4096x2048_pool"
+               : "texture/decode_png_4096x2048",
+          (uint64_t)width * height, [encoded, pool] {
+            DecodedImage image =
+                decodeImageMemory(encoded->data(), encoded->size(), true,
+                                  pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(image.pixels.data());
+          }};
+}
+
+// A batch of textures loading at once, one after the other and as
+// concurrent pool tasks the way decodeImageFilesAsync runs them
+static Benchmark concurrentDecodeBenchmark(bool concurrent) {
+  const uint32_t imageCount = 8, size = 1024;
+  auto images = std::make_shared<std::vector<std::vector<uint8_t>>>();
+  for (uint32_t i = 0; i < imageCount; i++) {
+    images->push_back(syntheticRgbPng(size, size, 5 + i));
+  }
+  return {concurrent ? "texture/decode_png_8x1024_concurrent"
+                     : "texture/decode_png_8x1024_serial",
+          (uint64_t)imageCount * size * size, [images, concurrent] {
+            if (!concurrent) {
+              for (const std::vector<uint8_t> &encoded : *images) {
+                DecodedImage image =
+                    decodeImageMemory(encoded.data(), encoded.size(), true);
+                doNotOptimize(image.pixels.data());
+              }
+              return;
+            }
+            ThreadPool &pool = ThreadPool::shared();
+            std::vector<std::future<DecodedImage>> results;
+            for (const std::vector<uint8_t> &encoded : *images) {
+              const std::vector<uint8_t> *data = &encoded;
+              results.push_back(pool.submit([data, &pool] {
+                return decodeImageMemory(data->data(), data->size(), true,
+                                         &pool);
+              }));
+            }
+            for (std::future<DecodedImage> &result : results) {
+              doNotOptimize(result.get().pixels.data());
+            }
+          }};
+}
+
+// A streamed texture's upload preparation
+static Benchmark mipChainBenchmark() {
+  const int size = 1024;
+  auto pixels = std::make_shared<std::vector<uint8_t>>(
+      randomBytes((size_t)size * size * 4, 2));
+  return {"texture/mip_chain_1024", (uint64_t)size * size, [pixels, size] {
+            auto chain = buildMipChain(pixels->data(), size, size);
+            doNotOptimize(chain.back().data());
+          }};
+}
+
+// GpuBufferAllocator's page allocator in a steady state: 4096 live
+// allocations of mesh and uniform sized ranges, one released and one made
+// per item
+static Benchmark tlsfChurnBenchmark() {
+  const uint32_t liveCount = 4096, rounds = 1024;
+  struct Fixture {
+    TlsfAllocator allocator{256ull << 20};
+    std::vector<uint32_t> live;
+    BenchmarkRandom random{6};
+  };
+  auto fixture = std::make_shared<Fixture>();
+  auto randomSize = [](BenchmarkRandom &random) {
+    return (uint64_t)16 + random.below(1u << (6 + random.below(11)));
+  };
+  for (uint32_t i = 0; i < liveCount; i++) {
+    fixture->live.push_back(
+        fixture->allocator.allocate(randomSize(fixture->random), 256).id);
+  }
+  return {"allocator/tlsf_release_allocate", rounds, [fixture, randomSize] {
+            for (uint32_t i = 0; i < rounds; i++) {
+              uint32_t &slot =
+                  fixture->live[fixture->random.below(liveCount)];
+              fixture->allocator.release(slot);
+              slot = fixture->allocator
+                         .allocate(randomSize(fixture->random), 256)
+                         .id;
+            }
+            doNotOptimize(fixture->live.data());
+          }};
+}
+
+// A frame's uniforms: per object a transformation block and a colour, and
+// the odd larger block, as sizes in bytes
+static std::vector<uint64_t> frameUniformSizes(uint32_t objectCount) {
+  BenchmarkRandom random(7);
+  std::vector<uint64_t> sizes;
+  for (uint32_t i = 0; i < objectCount; i++) {
+    sizes.push_back(208);
+    sizes.push_back(16);
+    if (random.below(16) == 0) {
+      sizes.push_back(1024 + random.below(3072));
+    }
+  }
+  return sizes;
+}
+
+// UniformRingAllocator over a frame of uniforms, with the padding its 256
+// byte alignment wastes. As a ring it can't fragment otherwise.
+static Benchmark uniformRingBenchmark() {
+  struct Fixture {
+    UniformRingAllocator ring{3 * (4 << 20), 3};
+    std::vector<uint64_t> sizes = frameUniformSizes(2048);
+  };
+  auto fixture = std::make_shared<Fixture>();
+  return {"allocator/uniform_ring_frame", fixture->sizes.size(),
+          [fixture] {
+            fixture->ring.beginFrame();
+            for (uint64_t size : fixture->sizes) {
+              doNotOptimize(fixture->ring.allocate(size));
+            }
+          },
+          [fixture]() -> std::vector<BenchmarkCounter> {
+            const UniformRingAllocator::Stats &stats =
+                fixture->ring.frameStats();
+            return {{"padding", stats.paddingRatio()},
+                    {"failed", (double)stats.failedAllocations}};
+          }};
+}
+
+// The same frame through a TlsfAllocator, each range released at the end of
+// the frame, which is what the ring replaces. Fragmentation is that of the
+// free memory once the frame's ranges are allocated.
+static Benchmark tlsfFrameBenchmark() {
+  struct Fixture {
+    TlsfAllocator allocator{4 << 20};
+    std::vector<uint64_t> sizes = frameUniformSizes(2048);
+    std::vector<uint32_t> ids;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  auto allocateFrame = [](Fixture &fixture) {
+    fixture.ids.clear();
+    for (uint64_t size : fixture.sizes) {
+      fixture.ids.push_back(fixture.allocator.allocate(size, 256).id);
+    }
+  };
+  return {"allocator/tlsf_frame_uniforms", fixture->sizes.size(),
+          [fixture, allocateFrame] {
+            allocateFrame(*fixture);
+            for (uint32_t id : fixture->ids) {
+              fixture->allocator.release(id);
+            }
+          },
+          [fixture, allocateFrame]() -> std::vector<BenchmarkCounter> {
+            allocateFrame(*fixture);
+            TlsfAllocator::Stats stats = fixture->allocator.stats();
+            uint64_t requested = 0;
+            for (uint64_t size : fixture->sizes) {
+              requested += size;
+            }
+            for (uint32_t id : fixture->ids) {
+              fixture->allocator.release(id);
+            }
+            return {{"padding", 1.0 - (double)requested / stats.usedBytes},
+                    {"fragmentation", stats.fragmentation}};
+          }};
+}
+
+// The per-object matrices of a frame: model from translation, rotation and
+// scale, model-view, model-view-projection and the normal matrix, after the
+// camera's view, projection and frustum
+static Benchmark frameMatricesBenchmark() {
+  const uint32_t objectCount = 1024;
+  struct Object {
+    Float3 position;
+    Float3 axis;
+    float angle;
+  };
+  auto objects = std::make_shared<std::vector<Object>>();
+  BenchmarkRandom random(3);
+  for (uint32_t i = 0; i < objectCount; i++) {
+    Float3 axis = normalize({random.uniform(-1, 1), random.uniform(-1, 1),
+                             random.uniform(0.1f, 1)});
+    objects->push_back({{random.uniform(-20, 20), random.uniform(-5, 5),
+                         random.uniform(-40, -1)},
+                        axis,
+                        random.uniform(0, 6.28f)});
+  }
+  struct Output {
+    Float4x4 modelViewProjection;
+    Float4x4 normal;
+  };
+  auto outputs = std::make_shared<std::vector<Output>>(objectCount);
+  return {"math/frame_matrices", objectCount, [objects, outputs] {
+            Float4x4 projection =
+                makePerspectiveRightHand(0.785f, 16.0f / 9.0f, 0.1f, 100.0f);
+            Float4x4 view = makeLookAt({0, 2, 5}, {0, 0, -10}, {0, 1, 0});
+            Float4x4 viewProjection = mul(projection, view);
+            Frustum frustum = makeFrustum(viewProjection);
+            doNotOptimize(frustum);
+            for (size_t i = 0; i < objects->size(); i++) {
+              const Object &object = (*objects)[i];
+              Float4x4 model =
+                  mul(makeTranslation(object.position),
+                      mul(makeRotation(object.angle, object.axis),
+                          makeScale({1.2f, 1.2f, 1.2f})));
+              Float4x4 modelView = mul(view, model);
+              (*outputs)[i] = {mul(projection, modelView),
+                               transpose(inverse(modelView))};
+            }
+            doNotOptimize(outputs->data());
+          }};
+}
+
+// 64 roots of 4 levels with 4 children each below them, every tree moved
+// each frame
+static Benchmark sceneGraphBenchmark() {
+  auto scene = std::make_shared<SceneGraph>();
+  auto roots = std::make_shared<std::vector<SceneNodeId>>();
+  BenchmarkRandom random(4);
+  auto randomLocal = [&random] {
+    return makeTranslation({random.uniform(-1, 1), random.uniform(-1, 1),
+                            random.uniform(-1, 1)});
+  };
+  for (int root = 0; root < 64; root++) {
+    std::vector<SceneNodeId> level = {scene->createNode()};
+    roots->push_back(level[0]);
+    for (int depth = 0; depth < 4; depth++) {
+      std::vector<SceneNodeId> next;
+      for (SceneNodeId parent : level) {
+        for (int child = 0; child < 4; child++) {
+          next.push_back(scene->createNode(parent, randomLocal()));
+        }
+      }
+      level = std::move(next);
+    }
+  }
+  scene->updateWorldTransforms(nullptr);
+  auto frame = std::make_shared<uint32_t>(0);
+  return {"scene/update_world_transforms", scene->nodeCount(),
+          [scene, roots, frame] {
+            float angle = (*frame)++ * 0.01f;
+            for (SceneNodeId root : *roots) {
+              scene->setLocalTransform(root, makeRotation(angle, {0, 1, 0}));
+            }
+            scene->updateWorldTransforms(nullptr);
+            doNotOptimize(scene->worldTransform(roots->back()));
+          }};
+}
+
+// 100k nodes under 100 roots, four children per node level by level, with
+// `dirtyPercent` of them animated every frame. A dirty node drags its
+// subtree along, the "updated" counter is how many matrices that came to.
+static Benchmark sceneDirtyBenchmark(uint32_t dirtyPercent, bool pool) {
+  const uint32_t nodeCount = 100000;
+  struct Fixture {
+    SceneGraph scene;
+    std::vector<SceneNodeId> animated;
+    std::vector<Float4x4> locals;
+    uint32_t frame = 0;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  BenchmarkRandom random(13);
+  std::vector<SceneNodeId> nodes;
+  for (uint32_t root = 0; root < 100; root++) {
+    nodes.push_back(fixture->scene.createNode());
+  }
+  for (size_t parent = 0; nodes.size() < nodeCount; parent++) {
+    for (int child = 0; child < 4 && nodes.size() < nodeCount; child++) {
+      nodes.push_back(fixture->scene.createNode(
+          nodes[parent],
+          makeTranslation({random.uniform(-1, 1), random.uniform(-1, 1),
+                           random.uniform(-1, 1)})));
+    }
+  }
+  for (SceneNodeId node : nodes) {
+    if (random.below(100) < dirtyPercent) {
+      fixture->animated.push_back(node);
+      fixture->locals.push_back(fixture->scene.localTransform(node));
+    }
+  }
+  fixture->scene.updateWorldTransforms(nullptr);
+  return {"scene/update_100k_dirty_" + std::to_string(dirtyPercent) + "pct" +
+              (pool ? "_pool" : ""),
+          nodeCount,
+          [fixture, pool] {
+            Float4x4 spin = makeRotation(fixture->frame++ * 0.01f, {0, 1, 0});
+            for (size_t i = 0; i < fixture->animated.size(); i++) {
+              fixture->scene.setLocalTransform(
+                  fixture->animated[i], mul(fixture->locals[i], spin));
+            }
+            fixture->scene.updateWorldTransforms(
+                pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(fixture->scene.stats());
+          },
+          [fixture]() -> std::vector<BenchmarkCounter> {
+            return {{"animated", (double)fixture->animated.size()},
+                    {"updated",
+                     (double)fixture->scene.stats().updatedNodes}};
+          }};
+}
+
+// 1M renderable entities, stored both in an EntityStore and in the array of
+// structs the engine kept them in before, one struct per object with every
+// component in it. Shared by the entity benchmarks.
+struct EntityFixture {
+  struct RenderObject {
+    TransformComponent transform;
+    MeshComponent mesh;
+    MaterialComponent material;
+    BoundsComponent bounds;
+  };
+
+  EntityStore store;
+  std::vector<RenderObject> objects;
+};
+
+static std::shared_ptr<EntityFixture> entityFixture() {
+  const uint32_t entityCount = 1 << 20;
+  auto fixture = std::make_shared<EntityFixture>();
+  fixture->objects.reserve(entityCount);
+  BenchmarkRandom random(14);
+  for (uint32_t i = 0; i < entityCount; i++) {
+    EntityFixture::RenderObject object;
+    object.transform.model =
+        makeTranslation({random.uniform(-50, 50), random.uniform(-5, 5),
+                         random.uniform(-50, 50)});
+    object.mesh.mesh = random.below(4);
+    object.material.color = {random.uniform(0, 1), random.uniform(0, 1),
+                             random.uniform(0, 1), 1.0f};
+    object.material.pipeline = random.below(2);
+    object.bounds.sphere = {0.0f, 0.0f, 0.0f, random.uniform(0.5f, 2.0f)};
+    fixture->objects.push_back(object);
+    // A quarter follow a scene node, which puts them in an archetype of
+    // their own
+    Entity entity = fixture->store.create(object.transform, object.mesh,
+                                          object.material, object.bounds);
+    if (i % 4 == 0) {
+      fixture->store.set(entity, SceneNodeComponent{i});
+    }
+  }
+  return fixture;
+}
+
+// Two passes over every entity: the culling pass's world space bounds
+// (transforms and bounds) and a material pass that only reads colours.
+// "bytes_per_entity" is what each entity brings into the cache: its
+// components' arrays with the store, the whole struct without it.
+static Benchmark entityIterationBenchmark(
+    std::shared_ptr<EntityFixture> fixture, bool bounds, bool arrayOfStructs) {
+  std::string name = bounds ? "ecs/transform_bounds_1m" : "ecs/materials_1m";
+  size_t stride = sizeof(EntityFixture::RenderObject);
+  if (!arrayOfStructs) {
+    stride = bounds ? sizeof(TransformComponent) + sizeof(BoundsComponent)
+                    : sizeof(MaterialComponent);
+  }
+  return {name + (arrayOfStructs ? "_aos" : ""),
+          fixture->objects.size(),
+          [fixture, bounds, arrayOfStructs] {
+            Float4 sum = {};
+            if (arrayOfStructs) {
+              for (const EntityFixture::RenderObject &object :
+                   fixture->objects) {
+                const Float4 &sphere = object.bounds.sphere;
+                if (bounds) {
+                  sum = sum + mul(object.transform.model,
+                                  Float4{sphere.x, sphere.y, sphere.z, 1.0f});
+                } else {
+                  sum = sum + object.material.color;
+                }
+              }
+            } else if (bounds) {
+              fixture->store.forEachChunk<TransformComponent, BoundsComponent>(
+                  [&](size_t count, const Entity *,
+                      TransformComponent *transforms,
+                      BoundsComponent *spheres) {
+                    for (size_t i = 0; i < count; i++) {
+                      const Float4 &sphere = spheres[i].sphere;
+                      sum = sum + mul(transforms[i].model,
+                                      Float4{sphere.x, sphere.y, sphere.z,
+                                             1.0f});
+                    }
+                  });
+            } else {
+              fixture->store.forEachChunk<MaterialComponent>(
+                  [&](size_t count, const Entity *,
+                      MaterialComponent *materials) {
+                    for (size_t i = 0; i < count; i++) {
+                      sum = sum + materials[i].color;
+                    }
+                  });
+            }
+            doNotOptimize(sum);
+          },
+          [stride]() -> std::vector<BenchmarkCounter> {
+            return {{"bytes_per_entity", (double)stride}};
+          }};
+}
+
+static std::vector<CullObject> randomCullObjects(uint32_t count,
+                                                 uint64_t seed) {
+  BenchmarkRandom random(seed);
+  std::vector<CullObject> objects(count);
+  for (CullObject &object : objects) {
+    Float3 center = {random.uniform(-50, 50), random.uniform(-10, 10),
+                     random.uniform(-100, 10)};
+    object.center[0] = center.x;
+    object.center[1] = center.y;
+    object.center[2] = center.z;
+    object.radius = random.uniform(0.25f, 2.0f);
+    Float4x4 model = makeTranslation(center);
+    memcpy(object.model, &model, sizeof(object.model));
+  }
+  return objects;
+}
+
+static const Float4x4 &cameraViewProjection() {
+  static const Float4x4 viewProjection =
+      mul(makePerspectiveRightHand(0.785f, 16.0f / 9.0f, 0.1f, 100.0f),
+          makeLookAt({0, 2, 5}, {0, 0, -10}, {0, 1, 0}));
+  return viewProjection;
+}
+
+// gpu_culling's reference kernel: frustum test and three LODs
+static Benchmark frustumCullingBenchmark() {
+  const uint32_t objectCount = 16384;
+  struct Fixture {
+    std::vector<CullObject> objects;
+    CullLod lods[3];
+    CullUniforms uniforms;
+    std::vector<IndirectDrawArguments> arguments;
+    std::vector<Float4x4> instances;
+    std::vector<uint32_t> visibility;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  fixture->objects = randomCullObjects(objectCount, 5);
+  fixture->lods[0] = {0, 30000, 15.0f};
+  fixture->lods[1] = {30000, 8000, 40.0f};
+  fixture->lods[2] = {38000, 2000, 1000.0f};
+  fixture->uniforms =
+      makeCullUniforms(makeFrustum(cameraViewProjection()), {0, 2, 5},
+                       fixture->lods, 3, objectCount, objectCount);
+  fixture->arguments.resize(3);
+  fixture->instances.resize(3 * objectCount);
+  fixture->visibility.resize(objectCount);
+  return {"culling/frustum_lod", objectCount, [fixture] {
+            resetCullArguments(fixture->arguments.data(), fixture->lods, 3,
+                               fixture->uniforms.instanceCapacity);
+            cullObjectsReference(fixture->uniforms, fixture->objects.data(),
+                                 fixture->arguments.data(),
+                                 fixture->instances.data(),
+                                 fixture->visibility.data());
+            doNotOptimize(fixture->visibility.data());
+          }};
+}
+
+// The CPU occlusion culler at the engine's resolution: 64 walls rasterized,
+// then 4096 boxes tested
+static Benchmark occlusionCullingBenchmark() {
+  struct Fixture {
+    OcclusionCuller culler{256, 144};
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+    std::vector<Float4x4> walls;
+    std::vector<CullObject> objects;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  Mesh cube = generateCube(1.0f);
+  for (const MeshVertex &vertex : cube.vertices) {
+    fixture->positions.insert(fixture->positions.end(),
+                              {vertex.position.x, vertex.position.y,
+                               vertex.position.z});
+  }
+  fixture->indices = cube.indices;
+  BenchmarkRandom random(6);
+  for (int i = 0; i < 64; i++) {
+    fixture->walls.push_back(mul(
+        makeTranslation({random.uniform(-20, 20), random.uniform(-2, 2),
+                         random.uniform(-40, -5)}),
+        makeScale({random.uniform(2, 6), random.uniform(2, 4), 0.25f})));
+  }
+  fixture->objects = randomCullObjects(4096, 7);
+  return {"culling/occlusion", fixture->objects.size(), [fixture] {
+            OcclusionCuller &culler = fixture->culler;
+            culler.beginFrame(cameraViewProjection());
+            for (const Float4x4 &wall : fixture->walls) {
+              culler.addOccluder(fixture->positions.data(),
+                                 (uint32_t)fixture->positions.size() / 3,
+                                 fixture->indices.data(),
+                                 (uint32_t)fixture->indices.size(), wall);
+            }
+            culler.rasterize(nullptr);
+            uint32_t occluded = 0;
+            for (const CullObject &object : fixture->objects) {
+              Float3 center = {object.center[0], object.center[1],
+                               object.center[2]};
+              Float3 extent = {object.radius, object.radius, object.radius};
+              occluded += culler.isOccluded(center - extent, center + extent);
+            }
+            doNotOptimize(occluded);
+          }};
+}
+
+// The Hi-Z pyramid of a 1080p depth buffer, as built for validation
+static Benchmark hizPyramidBenchmark() {
+  const uint32_t width = 1920, height = 1080;
+  auto depth = std::make_shared<std::vector<float>>((size_t)width * height);
+  BenchmarkRandom random(8);
+  for (float &value : *depth) {
+    value = random.uniform(0, 1);
+  }
+  return {"culling/hiz_pyramid_1080p", (uint64_t)width * height,
+          [depth, width, height] {
+            HiZPyramid pyramid = buildHiZPyramid(depth->data(), width, height);
+            doNotOptimize(pyramid.levels.back().data());
+          }};
+}
+
+// Keys spread over 8 pipelines, 64 materials and random depths
+static std::vector<DrawPacket> randomDrawPackets(uint32_t count,
+                                                 uint64_t seed) {
+  BenchmarkRandom random(seed);
+  std::vector<DrawPacket> packets(count);
+  for (uint32_t i = 0; i < count; i++) {
+    packets[i] = {makeDrawSortKey(0, random.below(8), random.below(64),
+                                  drawKeyDepth(random.uniform(0.1f, 100))),
+                  i};
+  }
+  return packets;
+}
+
+// Each call sorts a fresh copy of the same unsorted packets, the copy
+// included
+static Benchmark drawSortBenchmark(bool radix) {
+  const uint32_t packetCount = 16384;
+  struct Fixture {
+    std::vector<DrawPacket> unsorted;
+    std::vector<DrawPacket> packets;
+    std::vector<DrawPacket> scratch;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  fixture->unsorted = randomDrawPackets(packetCount, 9);
+  return {radix ? "sorting/radix_draw_packets" : "sorting/std_sort_baseline",
+          packetCount, [fixture, radix] {
+            fixture->packets = fixture->unsorted;
+            if (radix) {
+              radixSortDrawPackets(fixture->packets, fixture->scratch);
+            } else {
+              std::stable_sort(fixture->packets.begin(),
+                               fixture->packets.end(),
+                               [](const DrawPacket &a, const DrawPacket &b) {
+                                 return a.key < b.key;
+                               });
+            }
+            doNotOptimize(fixture->packets.data());
+          }};
+}
+
+// Encoding 4096 draws through a StateTrackingSink, in key order or in
+// submission order. The counters are the binds per frame that reach the
+// encoder and those the tracker drops, which is what sorting buys.
+static Benchmark stateTrackingBenchmark(bool sorted) {
+  const uint32_t drawCount = 4096;
+  struct Fixture {
+    std::vector<DrawPacket> packets;
+    CommandRecorder recorder;
+    StateTrackerStats stats;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  fixture->packets = randomDrawPackets(drawCount, 12);
+  if (sorted) {
+    std::vector<DrawPacket> scratch;
+    radixSortDrawPackets(fixture->packets, scratch);
+  }
+  return {sorted ? "sorting/state_tracked_encode_sorted"
+                 : "sorting/state_tracked_encode_unsorted",
+          drawCount,
+          [fixture] {
+            fixture->recorder.clear();
+            StateTrackingSink sink(fixture->recorder);
+            const void *depthStencil = (const void *)0x100;
+            const void *uniforms = (const void *)0x200;
+            for (const DrawPacket &packet : fixture->packets) {
+              uint32_t pipeline = drawKeyPipeline(packet.key);
+              uint32_t material = drawKeyMaterial(packet.key);
+              sink.setRenderPipelineState(
+                  (const void *)(uintptr_t)(0x1000 + pipeline));
+              sink.setDepthStencilState(depthStencil);
+              // A mesh per material, and uniforms of its own per draw
+              sink.setVertexBuffer(
+                  (const void *)(uintptr_t)(0x2000 + material), 0, 0);
+              sink.setVertexBuffer(uniforms, (uint64_t)packet.index * 256, 1);
+              sink.setFragmentTexture(
+                  (const void *)(uintptr_t)(0x3000 + material), 0);
+              sink.drawPrimitives(3, 0, 36, 1);
+            }
+            fixture->stats = sink.stats();
+            doNotOptimize(fixture->recorder.commands().data());
+          },
+          [fixture]() -> std::vector<BenchmarkCounter> {
+            return {{"binds", (double)fixture->stats.issued},
+                    {"skipped", (double)fixture->stats.skipped}};
+          }};
+}
+
+// `lightCount` point lights into the cluster grid of a 1080p view, all in
+// the same volume, so the lists get longer as the count goes up. With
+// `pool` the lights and slices are spread over ThreadPool::shared().
+static Benchmark clusterBenchmark(uint32_t lightCount, bool pool) {
+  struct Fixture {
+    LightClusterer clusterer{4 * 1024 * 1024};
+    ClusterGridParams params;
+    std::vector<PointLight> lights;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  fixture->params.view = makeLookAt({0, 2, 5}, {0, 0, -10}, {0, 1, 0});
+  fixture->params.fovyRadians = 0.785f;
+  fixture->params.aspect = 16.0f / 9.0f;
+  fixture->params.screenWidth = 1920;
+  fixture->params.screenHeight = 1080;
+  BenchmarkRandom random(10);
+  for (uint32_t i = 0; i < lightCount; i++) {
+    PointLight light = {};
+    light.position[0] = random.uniform(-30, 30);
+    light.position[1] = random.uniform(-5, 5);
+    light.position[2] = random.uniform(-80, 5);
+    light.radius = random.uniform(1, 6);
+    light.color[0] = light.color[1] = light.color[2] = light.color[3] = 1.0f;
+    fixture->lights.push_back(light);
+  }
+  return {"lighting/cluster_assign_" + std::to_string(lightCount / 1024) +
+              "k" + (pool ? "_pool" : ""),
+          lightCount,
+          [fixture, pool] {
+            fixture->clusterer.assign(fixture->params, fixture->lights.data(),
+                                      (uint32_t)fixture->lights.size(),
+                                      pool ? &ThreadPool::shared() : nullptr);
+            doNotOptimize(fixture->clusterer.lightIndices().data());
+          },
+          [fixture]() -> std::vector<BenchmarkCounter> {
+            const ClusterStats &stats = fixture->clusterer.stats();
+            return {{"indices", (double)stats.lightIndices},
+                    {"max_per_cluster", (double)stats.maxLightsPerCluster},
+                    {"dropped", (double)stats.droppedIndices}};
+          }};
+}
+
+// The forward pass's encoding: 8192 sorted draws over 8 pipelines and 64
+// textures, each binding its state and drawing, recorded into a
+// CommandRecorder per range the way the sub-encoders of a
+// ParallelRenderCommandEncoder are filled. Runs on `threads` threads of a
+// pool of its own, so the scaling doesn't depend on the machine it runs on
+// beyond its core count.
+static Benchmark encodeBenchmark(uint32_t threads) {
+  const uint32_t drawCount = 8192;
+  struct Draw {
+    uintptr_t pipeline;
+    uintptr_t texture;
+    uint64_t vertexOffset;
+    uint64_t uniformOffset;
+    uint64_t indexCount;
+  };
+  struct Fixture {
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<Draw> draws;
+    std::vector<EncodeRange> ranges;
+    std::vector<CommandRecorder> recorders;
+    std::vector<RenderCommandSink *> sinks;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  // The calling thread encodes as well
+  if (threads > 1) {
+    fixture->pool = std::make_unique<ThreadPool>(threads - 1);
+  }
+  BenchmarkRandom random(11);
+  for (uint32_t i = 0; i < drawCount; i++) {
+    fixture->draws.push_back({0x1000 + (i * 8 / drawCount) * 0x100,
+                              0x8000 + random.below(64) * 0x100,
+                              (uint64_t)random.below(1024) * 4096,
+                              (uint64_t)i * 256,
+                              (uint64_t)3 * (64 + random.below(4096))});
+  }
+  fixture->ranges = partitionDraws(drawCount, threads, 64);
+  fixture->recorders.resize(fixture->ranges.size());
+  for (CommandRecorder &recorder : fixture->recorders) {
+    fixture->sinks.push_back(&recorder);
+  }
+  return {"encoding/record_8192_draws_threads_" + std::to_string(threads),
+          drawCount, [fixture] {
+            for (CommandRecorder &recorder : fixture->recorders) {
+              recorder.clear();
+            }
+            const void *uniforms = (const void *)0x100;
+            const void *indices = (const void *)0x200;
+            encodeParallel(
+                fixture->ranges, fixture->sinks,
+                [&](RenderCommandSink &sink, size_t begin, size_t end) {
+                  for (size_t i = begin; i < end; i++) {
+                    const Draw &draw = fixture->draws[i];
+                    sink.setRenderPipelineState((const void *)draw.pipeline);
+                    sink.setVertexBuffer(uniforms, draw.vertexOffset, 0);
+                    sink.setVertexBuffer(uniforms, draw.uniformOffset, 1);
+                    sink.setFragmentBuffer(uniforms, draw.uniformOffset + 208,
+                                           0);
+                    sink.setFragmentTexture((const void *)draw.texture, 0);
+                    sink.drawIndexedPrimitives(3, draw.indexCount, indices,
+                                               0, 1);
+                  }
+                },
+                fixture->pool ? *fixture->pool : ThreadPool::shared());
+            doNotOptimize(fixture->recorders.back().commands().data());
+          }};
+}
+
+// 1, 2, 4... threads up to the machine's, and the machine's
+static std::vector<uint32_t> encodeThreadCounts() {
+  uint32_t hardwareThreads =
+      std::max(1u, std::thread::hardware_concurrency());
+  std::vector<uint32_t> counts;
+  for (uint32_t threads = 1; threads < hardwareThreads; threads *= 2) {
+    counts.push_back(threads);
+  }
+  counts.push_back(hardwareThreads);
+  return counts;
+}
+
+// What a ProfileScope costs: 1024 empty zones recorded and collected the
+// way the engine does once a frame, and the same with the profiler disabled
+static Benchmark profilerBenchmark(bool enabled) {
+  const uint32_t zoneCount = 1024;
+  struct Fixture {
+    Profiler profiler{zoneCount};
+    std::vector<ProfileEvent> events;
+  };
+  auto fixture = std::make_shared<Fixture>();
+  fixture->profiler.setEnabled(enabled);
+  return {enabled ? "profiler/scope_record_collect"
+                  : "profiler/scope_disabled",
+          zoneCount, [fixture] {
+            for (uint32_t i = 0; i < zoneCount; i++) {
+              ProfileScope zone("Zone", fixture->profiler);
+            }
+            fixture->events.clear();
+            fixture->profiler.collect(fixture->events);
+            doNotOptimize(fixture->events.data());
+          }};
+}
+
+static void printUsage() {
+  std::cerr << "Usage: engine_bench [--filter text] [--out results.json] "
+               "[--samples n] [--min-sample-ms ms] [--assets dir] [--list]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  BenchmarkOptions options;
+  const char *outPath = nullptr;
+  std::string assetDirectory = ENGINE_BENCH_ASSET_DIR;
+  bool list = false;
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (argument == "--filter" && hasValue) {
+      options.filter = argv[++i];
+    } else if (argument == "--out" && hasValue) {
+      outPath = argv[++i];
+    } else if (argument == "--samples" && hasValue) {
+      options.samples = std::max(1, atoi(argv[++i]));
+    } else if (argument == "--min-sample-ms" && hasValue) {
+      options.minSampleMilliseconds = atof(argv[++i]);
+    } else if (argument == "--assets" && hasValue) {
+      assetDirectory = argv[++i];
+    } else if (argument == "--list") {
+      list = true;
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+#if !defined(NDEBUG)
+  std::cerr << "engine_bench: built without optimizations, the numbers "
+               "won't mean much"
+            << std::endl;
+#endif
+
+  std::shared_ptr<EntityFixture> entities = entityFixture();
+  std::vector<Benchmark> benchmarks = {
+      objParseBenchmark(),
+      sphereBenchmark(34, 34, false),
+      sphereBenchmark(512, 512, false),
+      sphereBenchmark(512, 512, true),
+      icosphereBenchmark(3, false),
+      icosphereBenchmark(7, false),
+      icosphereBenchmark(7, true),
+      torusBenchmark(48, 24, false),
+      torusBenchmark(1024, 512, false),
+      torusBenchmark(1024, 512, true),
+      positionStreamBenchmark(),
+      expandBenchmark(),
+      largeDecodeBenchmark(false),
+      largeDecodeBenchmark(true),
+      concurrentDecodeBenchmark(false),
+      concurrentDecodeBenchmark(true),
+      mipChainBenchmark(),
+      tlsfChurnBenchmark(),
+      uniformRingBenchmark(),
+      tlsfFrameBenchmark(),
+      frameMatricesBenchmark(),
+      sceneGraphBenchmark(),
+      sceneDirtyBenchmark(1, false),
+      sceneDirtyBenchmark(10, false),
+      sceneDirtyBenchmark(100, false),
+      sceneDirtyBenchmark(100, true),
+      entityIterationBenchmark(entities, true, false),
+      entityIterationBenchmark(entities, true, true),
+      entityIterationBenchmark(entities, false, false),
+      entityIterationBenchmark(entities, false, true),
+      frustumCullingBenchmark(),
+      occlusionCullingBenchmark(),
+      hizPyramidBenchmark(),
+      drawSortBenchmark(true),
+      drawSortBenchmark(false),
+      stateTrackingBenchmark(true),
+      stateTrackingBenchmark(false),
+      profilerBenchmark(true),
+      profilerBenchmark(false),
+  };
+  for (uint32_t lightCount = 1024; lightCount <= 64 * 1024; lightCount *= 4) {
+    benchmarks.push_back(clusterBenchmark(lightCount, false));
+    benchmarks.push_back(clusterBenchmark(lightCount, true));
+  }
+  for (uint32_t threads : encodeThreadCounts()) {
+    benchmarks.push_back(encodeBenchmark(threads));
+  }
+  Benchmark decode;
+  if (decodeBenchmark(assetDirectory, decode)) {
+    benchmarks.insert(benchmarks.begin() + 11, std::move(decode));
+  } else {
+    std::cerr << "engine_bench: no mars_texture.jpg in " << assetDirectory
+              << ", skipping texture/decode_jpeg" << std::endl;
+  }
+
+  std::vector<BenchmarkResult> results;
+  for (const Benchmark &benchmark : benchmarks) {
+    if (!options.filter.empty() &&
+        benchmark.name.find(options.filter) == std::string::npos) {
+      continue;
+    }
+    if (list) {
+      std::cout << benchmark.name << std::endl;
+      continue;
+    }
+    BenchmarkResult result = runBenchmark(benchmark, options);
+    char line[160];
+    snprintf(line, sizeof(line), "%-40s %12.3f us  +-%5.1f%%  %10.2f M items/s",
+             result.name.c_str(), result.median / 1000.0,
+             result.mean > 0.0 ? 100.0 * result.standardDeviation / result.mean
+                               : 0.0,
+             result.itemsPerSecond() / 1e6);
+    std::cerr << line;
+    for (const BenchmarkCounter &counter : result.counters) {
+      std::cerr << "  " << counter.name << " " << counter.value;
+    }
+    std::cerr << std::endl;
+    results.push_back(result);
+  }
+  if (list) {
+    return 0;
+  }
+
+  std::string json = benchmarkResultsJson(results, options);
+  if (!outPath) {
+    std::cout << json;
+    return 0;
+  }
+  std::ofstream file(outPath, std::ios::trunc);
+  if (!file || !(file << json)) {
+    std::cerr << "engine_bench: can't write " << outPath << std::endl;
+    return 1;
+  }
+  return 0;
+}
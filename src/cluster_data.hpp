@@ -0,0 +1,45 @@
+#pragma once
+// Buffer layouts of clustered forward lighting (see cluster_lighting.hpp).
+//
+// Included by both the engine and the Metal shaders, so like
+// culling_data.hpp this must stay plain enough for both compilers: only
+// scalar members, so the layout is the same on either side without simd.
+#ifndef __METAL_VERSION__
+#include <cstdint>
+#endif
+
+enum ClusterLimits {
+  // Screen tiles across and down, and depth slices from near to far
+  ClusterTilesX = 16,
+  ClusterTilesY = 9,
+  ClusterSlices = 24,
+  ClusterCount = ClusterTilesX * ClusterTilesY * ClusterSlices,
+};
+
+struct PointLight {
+  // World space
+  float position[3];
+  // Contributes nothing from this distance on
+  float radius;
+  float color[4];
+};
+
+// Lights of one cluster are lightIndices[offset, offset + count)
+struct ClusterRange {
+  uint32_t offset;
+  uint32_t count;
+};
+
+struct ClusterUniforms {
+  // Third row of the view matrix: dot(viewDepthRow, worldPosition) is the
+  // view space z, negative in front of the camera
+  float viewDepthRow[4];
+  float ambientColor[4];
+  // Drawable size in pixels, to find the tile of a fragment
+  float screenSize[2];
+  // Slice of view depth d (positive) is log(d) * sliceScale + sliceBias
+  float sliceScale;
+  float sliceBias;
+  uint32_t lightCount;
+  uint32_t padding[3];
+};
@@ -0,0 +1,300 @@
+#include "cluster_lighting.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static_assert(ClusterTilesX % 4 == 0, "tile rows are tested four at a time");
+
+constexpr uint32_t tilesPerSlice = ClusterTilesX * ClusterTilesY;
+
+// Bit t set if tile firstTile + t of the row is within reach of the light.
+// dyz is the squared distance along y and z, shared by the whole row.
+static inline uint32_t reachedTiles(const float *minX, const float *maxX,
+                                    uint32_t firstTile, float x, float dyz,
+                                    float radiusSquared) {
+#if defined(__ARM_NEON)
+  float32x4_t px = vdupq_n_f32(x);
+  float32x4_t below = vsubq_f32(vld1q_f32(minX + firstTile), px);
+  float32x4_t above = vsubq_f32(px, vld1q_f32(maxX + firstTile));
+  float32x4_t dx = vmaxq_f32(vmaxq_f32(below, above), vdupq_n_f32(0.0f));
+  float32x4_t distance = vfmaq_f32(vdupq_n_f32(dyz), dx, dx);
+  uint32x4_t inside = vcleq_f32(distance, vdupq_n_f32(radiusSquared));
+  const uint32x4_t bits = {1, 2, 4, 8};
+  return vaddvq_u32(vandq_u32(inside, bits));
+#elif defined(__SSE2__)
+  __m128 px = _mm_set1_ps(x);
+  __m128 below = _mm_sub_ps(_mm_load_ps(minX + firstTile), px);
+  __m128 above = _mm_sub_ps(px, _mm_load_ps(maxX + firstTile));
+  __m128 dx = _mm_max_ps(_mm_max_ps(below, above), _mm_setzero_ps());
+  __m128 distance = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_set1_ps(dyz));
+  return (uint32_t)_mm_movemask_ps(
+      _mm_cmple_ps(distance, _mm_set1_ps(radiusSquared)));
+#else
+  uint32_t mask = 0;
+  for (uint32_t lane = 0; lane < 4; lane++) {
+    float dx = std::max(std::max(minX[firstTile + lane] - x,
+                                 x - maxX[firstTile + lane]),
+                        0.0f);
+    if (dx * dx + dyz <= radiusSquared) {
+      mask |= 1u << lane;
+    }
+  }
+  return mask;
+#endif
+}
+
+// Distance outside [low, high], 0 inside
+static inline float outside(float value, float low, float high) {
+  return std::max(std::max(low - value, value - high), 0.0f);
+}
+
+LightClusterer::LightClusterer(uint32_t indexCapacity)
+    : indexCapacity(indexCapacity), clusterRanges(ClusterCount) {
+  indices.reserve(indexCapacity);
+}
+
+void LightClusterer::buildClusterBounds(const ClusterGridParams &params) {
+  float key[4] = {params.fovyRadians, params.aspect, params.nearZ,
+                  params.farZ};
+  if (std::equal(key, key + 4, boundsParams)) {
+    return;
+  }
+  std::copy(key, key + 4, boundsParams);
+
+  float tanY = std::tan(params.fovyRadians * 0.5f);
+  float tanX = tanY * params.aspect;
+  float depthRatio = params.farZ / params.nearZ;
+  for (uint32_t slice = 0; slice < ClusterSlices; slice++) {
+    float nearDepth =
+        params.nearZ * std::pow(depthRatio, slice / (float)ClusterSlices);
+    float farDepth = params.nearZ *
+                     std::pow(depthRatio, (slice + 1) / (float)ClusterSlices);
+    sliceNear[slice] = nearDepth;
+    sliceFar[slice] = farDepth;
+    // A tile's edges are planes through the eye, so its box is spanned by
+    // the edges at the near and far depth of the slice
+    for (uint32_t tile = 0; tile < ClusterTilesX; tile++) {
+      float left = (-1.0f + 2.0f * tile / (float)ClusterTilesX) * tanX;
+      float right = (-1.0f + 2.0f * (tile + 1) / (float)ClusterTilesX) * tanX;
+      tileMinX[slice][tile] = std::min(left * nearDepth, left * farDepth);
+      tileMaxX[slice][tile] = std::max(right * nearDepth, right * farDepth);
+    }
+    // Row 0 is the top of the screen, where pixel y is 0
+    for (uint32_t tile = 0; tile < ClusterTilesY; tile++) {
+      float top = (1.0f - 2.0f * tile / (float)ClusterTilesY) * tanY;
+      float bottom = (1.0f - 2.0f * (tile + 1) / (float)ClusterTilesY) * tanY;
+      tileMinY[slice][tile] = std::min(bottom * nearDepth, bottom * farDepth);
+      tileMaxY[slice][tile] = std::max(top * nearDepth, top * farDepth);
+    }
+  }
+}
+
+void LightClusterer::prepareLights(const ClusterGridParams &params,
+                                   const PointLight *lights, size_t begin,
+                                   size_t end) {
+  const Float4x4 &view = params.view;
+  float tanY = std::tan(params.fovyRadians * 0.5f);
+  float tanX = tanY * params.aspect;
+  float sliceScale = clusterUniforms.sliceScale;
+  float sliceBias = clusterUniforms.sliceBias;
+  auto sliceOf = [&](float depth) {
+    int slice = (int)std::floor(std::log(depth) * sliceScale + sliceBias);
+    return (uint32_t)std::clamp(slice, 0, (int)ClusterSlices - 1);
+  };
+  // Screen tile of a normalized device coordinate, x from the left and y
+  // from the top
+  auto tileOf = [](float ndc, uint32_t tiles) {
+    int tile = (int)std::floor((ndc + 1.0f) * 0.5f * tiles);
+    return (uint32_t)std::clamp(tile, 0, (int)tiles - 1);
+  };
+
+  for (size_t i = begin; i < end; i++) {
+    const PointLight &light = lights[i];
+    Float4 position = mul(view, Float4{light.position[0], light.position[1],
+                                       light.position[2], 1.0f});
+    ViewLight &viewLight = viewLights[i];
+    viewLight.x = position.x;
+    viewLight.y = position.y;
+    viewLight.z = position.z;
+    viewLight.radiusSquared = light.radius * light.radius;
+
+    float depth = -position.z;
+    float radius = light.radius;
+    viewLight.visible =
+        depth + radius > params.nearZ && depth - radius < params.farZ;
+    if (!viewLight.visible) {
+      continue;
+    }
+    float nearDepth = std::max(depth - radius, params.nearZ);
+    float farDepth = std::min(depth + radius, params.farZ);
+    viewLight.sliceMin = sliceOf(nearDepth);
+    viewLight.sliceMax = sliceOf(farDepth);
+
+    // The sphere is inside the box [x - r, x + r] x [nearDepth, depth + r],
+    // and x / depth over that box is largest and smallest at its corners
+    float nearX = 1.0f / (nearDepth * tanX);
+    float farX = 1.0f / ((depth + radius) * tanX);
+    float nearY = 1.0f / (nearDepth * tanY);
+    float farY = 1.0f / ((depth + radius) * tanY);
+    float left = std::min((position.x - radius) * nearX,
+                          (position.x - radius) * farX);
+    float right = std::max((position.x + radius) * nearX,
+                           (position.x + radius) * farX);
+    float bottom = std::min((position.y - radius) * nearY,
+                            (position.y - radius) * farY);
+    float top = std::max((position.y + radius) * nearY,
+                         (position.y + radius) * farY);
+    viewLight.visible = left <= 1.0f && right >= -1.0f && bottom <= 1.0f &&
+                        top >= -1.0f;
+    viewLight.tileMin[0] = tileOf(left, ClusterTilesX);
+    viewLight.tileMax[0] = tileOf(right, ClusterTilesX);
+    viewLight.tileMin[1] = tileOf(-top, ClusterTilesY);
+    viewLight.tileMax[1] = tileOf(-bottom, ClusterTilesY);
+  }
+}
+
+void LightClusterer::assignSlices(uint32_t firstSlice, uint32_t lastSlice) {
+  uint32_t lightCount = (uint32_t)viewLights.size();
+  for (uint32_t slice = firstSlice; slice < lastSlice; slice++) {
+    std::vector<uint64_t> &hits = sliceHits[slice];
+    hits.clear();
+    const float *minX = tileMinX[slice];
+    const float *maxX = tileMaxX[slice];
+
+    for (uint32_t light = 0; light < lightCount; light++) {
+      const ViewLight &viewLight = viewLights[light];
+      if (!viewLight.visible || slice < viewLight.sliceMin ||
+          slice > viewLight.sliceMax) {
+        continue;
+      }
+      float dz = outside(-viewLight.z, sliceNear[slice], sliceFar[slice]);
+      uint32_t firstBlock = viewLight.tileMin[0] & ~3u;
+      for (uint32_t row = viewLight.tileMin[1]; row <= viewLight.tileMax[1];
+           row++) {
+        float dy = outside(viewLight.y, tileMinY[slice][row],
+                           tileMaxY[slice][row]);
+        float dyz = dy * dy + dz * dz;
+        if (dyz > viewLight.radiusSquared) {
+          continue;
+        }
+        for (uint32_t block = firstBlock; block <= viewLight.tileMax[0];
+             block += 4) {
+          uint32_t mask = reachedTiles(minX, maxX, block, viewLight.x, dyz,
+                                       viewLight.radiusSquared);
+          while (mask) {
+            uint32_t tile = block + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (tile >= viewLight.tileMin[0] && tile <= viewLight.tileMax[0]) {
+              hits.push_back((uint64_t)(row * ClusterTilesX + tile) << 32 |
+                             light);
+            }
+          }
+        }
+      }
+    }
+
+    // Group the hits by tile, lights staying in ascending order
+    std::vector<uint32_t> &counts = sliceCounts[slice];
+    counts.assign(tilesPerSlice + 1, 0);
+    for (uint64_t hit : hits) {
+      counts[(hit >> 32) + 1]++;
+    }
+    for (uint32_t tile = 0; tile < tilesPerSlice; tile++) {
+      counts[tile + 1] += counts[tile];
+    }
+    std::vector<uint32_t> &sorted = sliceIndices[slice];
+    sorted.resize(hits.size());
+    std::vector<uint32_t> next(counts.begin(), counts.end() - 1);
+    for (uint64_t hit : hits) {
+      sorted[next[hit >> 32]++] = (uint32_t)hit;
+    }
+  }
+}
+
+void LightClusterer::assign(const ClusterGridParams &params,
+                            const PointLight *lights, uint32_t lightCount,
+                            ThreadPool *pool) {
+  buildClusterBounds(params);
+
+  float depthRatioLog = std::log(params.farZ / params.nearZ);
+  clusterUniforms.sliceScale = (float)ClusterSlices / depthRatioLog;
+  clusterUniforms.sliceBias =
+      -ClusterSlices * std::log(params.nearZ) / depthRatioLog;
+  for (int column = 0; column < 4; column++) {
+    const Float4 &viewColumn = params.view.columns[column];
+    clusterUniforms.viewDepthRow[column] = viewColumn.z;
+  }
+  clusterUniforms.ambientColor[0] = params.ambientColor.x;
+  clusterUniforms.ambientColor[1] = params.ambientColor.y;
+  clusterUniforms.ambientColor[2] = params.ambientColor.z;
+  clusterUniforms.ambientColor[3] = params.ambientColor.w;
+  clusterUniforms.screenSize[0] = params.screenWidth;
+  clusterUniforms.screenSize[1] = params.screenHeight;
+  clusterUniforms.lightCount = lightCount;
+
+  viewLights.resize(lightCount);
+  bool parallel = pool && lightCount >= parallelLightCount;
+  if (parallel) {
+    pool->parallelFor(lightCount, parallelLightCount,
+                      [&](size_t begin, size_t end) {
+                        prepareLights(params, lights, begin, end);
+                      });
+    pool->parallelFor(ClusterSlices, 1, [&](size_t begin, size_t end) {
+      assignSlices((uint32_t)begin, (uint32_t)end);
+    });
+  } else {
+    prepareLights(params, lights, 0, lightCount);
+    assignSlices(0, ClusterSlices);
+  }
+
+  // Concatenate the slices, truncating clusters once the capacity is full
+  clusterStats = ClusterStats();
+  indices.clear();
+  for (uint32_t slice = 0; slice < ClusterSlices; slice++) {
+    const std::vector<uint32_t> &counts = sliceCounts[slice];
+    const std::vector<uint32_t> &sorted = sliceIndices[slice];
+    for (uint32_t tile = 0; tile < tilesPerSlice; tile++) {
+      uint32_t count = counts[tile + 1] - counts[tile];
+      uint32_t kept =
+          std::min(count, indexCapacity - (uint32_t)indices.size());
+      ClusterRange &range = clusterRanges[slice * tilesPerSlice + tile];
+      range.offset = (uint32_t)indices.size();
+      range.count = kept;
+      indices.insert(indices.end(), sorted.begin() + counts[tile],
+                     sorted.begin() + counts[tile] + kept);
+      clusterStats.maxLightsPerCluster =
+          std::max(clusterStats.maxLightsPerCluster, count);
+      clusterStats.droppedIndices += count - kept;
+    }
+  }
+  for (const ViewLight &viewLight : viewLights) {
+    clusterStats.visibleLights += viewLight.visible;
+  }
+  clusterStats.lightIndices = (uint32_t)indices.size();
+}
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+ClusterFrameLayout makeClusterFrameLayout(uint32_t lightCapacity,
+                                          uint32_t indexCapacity) {
+  // Metal wants 256 byte aligned offsets for constant buffers
+  constexpr size_t alignment = 256;
+  ClusterFrameLayout layout;
+  layout.uniformsOffset = 0;
+  layout.lightsOffset = alignUp(sizeof(ClusterUniforms), alignment);
+  layout.rangesOffset = alignUp(
+      layout.lightsOffset + lightCapacity * sizeof(PointLight), alignment);
+  layout.indicesOffset = alignUp(
+      layout.rangesOffset + ClusterCount * sizeof(ClusterRange), alignment);
+  layout.size = alignUp(
+      layout.indicesOffset + indexCapacity * sizeof(uint32_t), alignment);
+  return layout;
+}
@@ -0,0 +1,128 @@
+#pragma once
+// Clustered forward lighting: CPU light assignment.
+//
+// The view frustum is divided into a grid of clusters, ClusterTilesX by
+// ClusterTilesY screen tiles and ClusterSlices depth slices. Slices are
+// spaced exponentially, so near clusters are thin and far ones deep, and
+// each cluster is roughly as deep as it is wide. Every frame each light is
+// tested against the clusters its bounding sphere can reach, and every
+// cluster gets a compact list of the lights touching it. The fragment
+// shader finds its cluster from the pixel position and view depth and only
+// loops over that list, so the cost per fragment depends on the lights
+// nearby rather than the lights in the scene.
+//
+// Assignment runs in two steps. Lights are first moved to view space and
+// given the range of tiles and slices their sphere covers, spread over the
+// thread pool. Then each task takes a band of slices, which owns its
+// clusters outright so no locking is needed, and tests the lights against
+// every cluster in their range. The sphere against box test runs on four
+// tiles of a row at once with NEON or SSE.
+#include "cluster_data.hpp"
+#include "engine_math.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct ClusterGridParams {
+  Float4x4 view;
+  float fovyRadians = 1.0f;
+  float aspect = 1.0f;
+  float nearZ = 0.1f;
+  float farZ = 100.0f;
+  float screenWidth = 1.0f;
+  float screenHeight = 1.0f;
+  Float4 ambientColor = {0.2f, 0.2f, 0.2f, 1.0f};
+};
+
+struct ClusterStats {
+  // Lights in front of the camera, overlapping at least one cluster
+  uint32_t visibleLights = 0;
+  uint32_t lightIndices = 0;
+  uint32_t maxLightsPerCluster = 0;
+  // Cluster entries that didn't fit in the index capacity and were dropped
+  uint32_t droppedIndices = 0;
+};
+
+class LightClusterer {
+public:
+  // Below this many lights the work isn't split across the pool
+  static constexpr size_t parallelLightCount = 256;
+
+  // At most `indexCapacity` light indices over all clusters
+  explicit LightClusterer(uint32_t indexCapacity);
+
+  // Rebuilds the cluster lists. `pool` may be null to run on the calling
+  // thread.
+  void assign(const ClusterGridParams &params, const PointLight *lights,
+              uint32_t lightCount, ThreadPool *pool = &ThreadPool::shared());
+
+  // Uniforms matching the last assign()
+  const ClusterUniforms &uniforms() const { return clusterUniforms; }
+  // ClusterCount entries, indexed by clusterIndex
+  const std::vector<ClusterRange> &ranges() const { return clusterRanges; }
+  const std::vector<uint32_t> &lightIndices() const { return indices; }
+  const ClusterStats &stats() const { return clusterStats; }
+
+  static uint32_t clusterIndex(uint32_t tileX, uint32_t tileY,
+                               uint32_t slice) {
+    return (slice * ClusterTilesY + tileY) * ClusterTilesX + tileX;
+  }
+
+private:
+  // Light in view space, with the clusters it may touch
+  struct ViewLight {
+    float x, y, z;
+    float radiusSquared;
+    uint32_t tileMin[2];
+    uint32_t tileMax[2];
+    uint32_t sliceMin;
+    uint32_t sliceMax;
+    bool visible;
+  };
+
+  // View space bounds of every cluster, rebuilt when the projection changes
+  void buildClusterBounds(const ClusterGridParams &params);
+  void prepareLights(const ClusterGridParams &params, const PointLight *lights,
+                     size_t begin, size_t end);
+  void assignSlices(uint32_t firstSlice, uint32_t lastSlice);
+
+  uint32_t indexCapacity;
+  // Projection the bounds were built for
+  float boundsParams[4] = {};
+  // Box of cluster (x, y, slice): x in tileMinX/MaxX[slice][x], y likewise,
+  // z in sliceNear/Far[slice]. Stored per axis so a row of tiles is
+  // contiguous for SIMD.
+  alignas(16) float tileMinX[ClusterSlices][ClusterTilesX];
+  alignas(16) float tileMaxX[ClusterSlices][ClusterTilesX];
+  float tileMinY[ClusterSlices][ClusterTilesY];
+  float tileMaxY[ClusterSlices][ClusterTilesY];
+  // Positive view depths
+  float sliceNear[ClusterSlices];
+  float sliceFar[ClusterSlices];
+
+  std::vector<ViewLight> viewLights;
+  // Per slice (tile, light) hits, then the lights grouped by tile and the
+  // count of each tile. Concatenated into indices at the end.
+  std::vector<uint64_t> sliceHits[ClusterSlices];
+  std::vector<uint32_t> sliceIndices[ClusterSlices];
+  std::vector<uint32_t> sliceCounts[ClusterSlices];
+
+  ClusterUniforms clusterUniforms = {};
+  std::vector<ClusterRange> clusterRanges;
+  std::vector<uint32_t> indices;
+  ClusterStats clusterStats;
+};
+
+// Offsets of one frame's clustering data inside a buffer, each aligned for
+// binding as a Metal buffer
+struct ClusterFrameLayout {
+  size_t uniformsOffset;
+  size_t lightsOffset;
+  size_t rangesOffset;
+  size_t indicesOffset;
+  size_t size;
+};
+
+ClusterFrameLayout makeClusterFrameLayout(uint32_t lightCapacity,
+                                          uint32_t indexCapacity);
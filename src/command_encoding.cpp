@@ -0,0 +1,112 @@
+#include "command_encoding.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+void CommandRecorder::setRenderPipelineState(const void *pipeline) {
+  recorded.push_back({RecordedCommandType::SetRenderPipelineState, 0, pipeline});
+}
+
+void CommandRecorder::setDepthStencilState(const void *depthStencil) {
+  recorded.push_back(
+      {RecordedCommandType::SetDepthStencilState, 0, depthStencil});
+}
+
+void CommandRecorder::setFrontFacingWinding(uint32_t winding) {
+  recorded.push_back({RecordedCommandType::SetFrontFacingWinding, winding});
+}
+
+void CommandRecorder::setCullMode(uint32_t cullMode) {
+  recorded.push_back({RecordedCommandType::SetCullMode, cullMode});
+}
+
+void CommandRecorder::setVertexBuffer(const void *buffer, uint64_t offset,
+                                      uint32_t index) {
+  recorded.push_back(
+      {RecordedCommandType::SetVertexBuffer, index, buffer, {offset}});
+}
+
+void CommandRecorder::setFragmentBuffer(const void *buffer, uint64_t offset,
+                                        uint32_t index) {
+  recorded.push_back(
+      {RecordedCommandType::SetFragmentBuffer, index, buffer, {offset}});
+}
+
+void CommandRecorder::setFragmentTexture(const void *texture, uint32_t index) {
+  recorded.push_back({RecordedCommandType::SetFragmentTexture, index, texture});
+}
+
+void CommandRecorder::drawPrimitives(uint32_t primitiveType,
+                                     uint64_t vertexStart, uint64_t vertexCount,
+                                     uint64_t instanceCount) {
+  recorded.push_back({RecordedCommandType::DrawPrimitives,
+                      primitiveType,
+                      nullptr,
+                      {vertexStart, vertexCount, instanceCount}});
+  draws++;
+}
+
+void CommandRecorder::drawIndexedPrimitives(uint32_t primitiveType,
+                                            uint64_t indexCount,
+                                            const void *indexBuffer,
+                                            uint64_t indexOffset,
+                                            uint64_t instanceCount) {
+  recorded.push_back({RecordedCommandType::DrawIndexedPrimitives,
+                      primitiveType,
+                      indexBuffer,
+                      {indexCount, indexOffset, instanceCount}});
+  draws++;
+}
+
+void CommandRecorder::drawPrimitivesIndirect(uint32_t primitiveType,
+                                             const void *indirectBuffer,
+                                             uint64_t indirectOffset) {
+  recorded.push_back({RecordedCommandType::DrawPrimitivesIndirect,
+                      primitiveType,
+                      indirectBuffer,
+                      {indirectOffset}});
+  draws++;
+}
+
+void CommandRecorder::append(const CommandRecorder &other) {
+  recorded.insert(recorded.end(), other.recorded.begin(), other.recorded.end());
+  draws += other.draws;
+}
+
+std::vector<EncodeRange> partitionDraws(size_t drawCount, size_t maxRanges,
+                                        size_t minDrawsPerRange) {
+  std::vector<EncodeRange> ranges;
+  if (drawCount == 0) {
+    return ranges;
+  }
+  size_t rangeCount = drawCount / std::max<size_t>(minDrawsPerRange, 1);
+  rangeCount = std::clamp<size_t>(rangeCount, 1, std::max<size_t>(maxRanges, 1));
+
+  // The first `drawCount % rangeCount` ranges take one extra draw
+  size_t base = drawCount / rangeCount;
+  size_t extra = drawCount % rangeCount;
+  size_t begin = 0;
+  for (size_t i = 0; i < rangeCount; i++) {
+    size_t size = base + (i < extra ? 1 : 0);
+    ranges.push_back({begin, begin + size});
+    begin += size;
+  }
+  return ranges;
+}
+
+void encodeParallel(
+    const std::vector<EncodeRange> &ranges,
+    const std::vector<RenderCommandSink *> &sinks,
+    const std::function<void(RenderCommandSink &, size_t, size_t)> &encode,
+    ThreadPool &pool) {
+  assert(sinks.size() >= ranges.size());
+  if (ranges.size() == 1) {
+    encode(*sinks[0], ranges[0].begin, ranges[0].end);
+    return;
+  }
+  pool.parallelFor(ranges.size(), 1, [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      encode(*sinks[i], ranges[i].begin, ranges[i].end);
+    }
+  });
+}
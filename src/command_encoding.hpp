@@ -0,0 +1,130 @@
+#pragma once
+// Parallel draw encoding.
+//
+// The visible draw list is split into contiguous ranges, and each range is
+// encoded on its own thread into its own command sink. On Metal the sinks
+// wrap the sub-encoders of an MTL::ParallelRenderCommandEncoder, which run
+// on the GPU in the order they were created, not in the order threads
+// finish. Creating them in range order on the calling thread therefore
+// keeps submission identical to encoding the whole list serially.
+//
+// RenderCommandSink is the part of MTL::RenderCommandEncoder the engine
+// uses, with Metal objects passed as opaque handles. CommandRecorder
+// implements it by recording the calls, so partitioning and encoding can be
+// run and checked without a GPU.
+#include "thread_pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class RenderCommandSink {
+public:
+  virtual ~RenderCommandSink() = default;
+
+  // Enum arguments are the MTL::Winding, MTL::CullMode and
+  // MTL::PrimitiveType values
+  virtual void setRenderPipelineState(const void *pipeline) = 0;
+  virtual void setDepthStencilState(const void *depthStencil) = 0;
+  virtual void setFrontFacingWinding(uint32_t winding) = 0;
+  virtual void setCullMode(uint32_t cullMode) = 0;
+  virtual void setVertexBuffer(const void *buffer, uint64_t offset,
+                               uint32_t index) = 0;
+  virtual void setFragmentBuffer(const void *buffer, uint64_t offset,
+                                 uint32_t index) = 0;
+  virtual void setFragmentTexture(const void *texture, uint32_t index) = 0;
+  virtual void drawPrimitives(uint32_t primitiveType, uint64_t vertexStart,
+                              uint64_t vertexCount,
+                              uint64_t instanceCount = 1) = 0;
+  // 32-bit indices, `indexCount` of them from `indexOffset` in `indexBuffer`
+  virtual void drawIndexedPrimitives(uint32_t primitiveType,
+                                     uint64_t indexCount,
+                                     const void *indexBuffer,
+                                     uint64_t indexOffset,
+                                     uint64_t instanceCount = 1) = 0;
+  // Reads an IndirectDrawArguments at `indirectOffset` in `indirectBuffer`
+  virtual void drawPrimitivesIndirect(uint32_t primitiveType,
+                                      const void *indirectBuffer,
+                                      uint64_t indirectOffset) = 0;
+};
+
+enum class RecordedCommandType : uint8_t {
+  SetRenderPipelineState,
+  SetDepthStencilState,
+  SetFrontFacingWinding,
+  SetCullMode,
+  SetVertexBuffer,
+  SetFragmentBuffer,
+  SetFragmentTexture,
+  DrawPrimitives,
+  DrawIndexedPrimitives,
+  DrawPrimitivesIndirect,
+};
+
+struct RecordedCommand {
+  RecordedCommandType type;
+  // Binding index, or the enum value for state commands
+  uint32_t index = 0;
+  const void *object = nullptr;
+  // Buffer offset, or vertex start, count and instance count for draws.
+  // Indexed draws keep the index buffer in object and index count, offset
+  // and instance count in values. Indirect draws keep the buffer in object
+  // and its offset in values[0].
+  uint64_t values[3] = {};
+
+  bool operator==(const RecordedCommand &other) const = default;
+};
+
+// Recording stand-in for a render command encoder
+class CommandRecorder : public RenderCommandSink {
+public:
+  void setRenderPipelineState(const void *pipeline) override;
+  void setDepthStencilState(const void *depthStencil) override;
+  void setFrontFacingWinding(uint32_t winding) override;
+  void setCullMode(uint32_t cullMode) override;
+  void setVertexBuffer(const void *buffer, uint64_t offset,
+                       uint32_t index) override;
+  void setFragmentBuffer(const void *buffer, uint64_t offset,
+                         uint32_t index) override;
+  void setFragmentTexture(const void *texture, uint32_t index) override;
+  void drawPrimitives(uint32_t primitiveType, uint64_t vertexStart,
+                      uint64_t vertexCount, uint64_t instanceCount) override;
+  void drawIndexedPrimitives(uint32_t primitiveType, uint64_t indexCount,
+                             const void *indexBuffer, uint64_t indexOffset,
+                             uint64_t instanceCount) override;
+  void drawPrimitivesIndirect(uint32_t primitiveType,
+                              const void *indirectBuffer,
+                              uint64_t indirectOffset) override;
+
+  const std::vector<RecordedCommand> &commands() const { return recorded; }
+  // Appends another stream, the merge step for recorded streams
+  void append(const CommandRecorder &other);
+  void clear() { recorded.clear(); }
+  size_t drawCount() const { return draws; }
+
+private:
+  std::vector<RecordedCommand> recorded;
+  size_t draws = 0;
+};
+
+struct EncodeRange {
+  size_t begin;
+  size_t end;
+};
+
+// Splits [0, drawCount) into at most maxRanges contiguous ranges of nearly
+// equal size, each at least minDrawsPerRange long. A short list stays in
+// one range: every extra encoder has a fixed cost, and has to bind its own
+// state before its first draw.
+std::vector<EncodeRange> partitionDraws(size_t drawCount, size_t maxRanges,
+                                        size_t minDrawsPerRange);
+
+// Calls encode(*sinks[i], range.begin, range.end) for every range, spread
+// over the pool with the calling thread helping out. Sinks start with no
+// state bound, so `encode` must bind everything its draws need.
+void encodeParallel(
+    const std::vector<EncodeRange> &ranges,
+    const std::vector<RenderCommandSink *> &sinks,
+    const std::function<void(RenderCommandSink &, size_t, size_t)> &encode,
+    ThreadPool &pool = ThreadPool::shared());
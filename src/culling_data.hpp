@@ -0,0 +1,67 @@
+#pragma once
+// Buffer layouts of the culling kernel (shaders/culling.metal).
+//
+// Included by both the engine and the Metal shaders, so like
+// shader_features.hpp this must stay plain enough for both compilers: only
+// scalar members, so the layout is the same on either side without simd.
+#ifndef __METAL_VERSION__
+#include <cstdint>
+#endif
+
+enum CullLimits {
+  // LOD levels of one culled mesh, each with its own indirect draw
+  CullMaxLods = 4,
+  CullThreadgroupSize = 64,
+  // Width and height of the threadgroups building the Hi-Z pyramid
+  HiZThreadgroupSize = 8,
+};
+
+// Set in an object's visibility entry, on top of its LOD + 1, when the early
+// pass found it hidden behind last frame's Hi-Z pyramid. The late pass tests
+// those objects again, and draws the ones that have come into view.
+enum CullVisibility : uint32_t { CullVisibilityOccluded = 0x80000000u };
+
+// Same layout as MTLDrawPrimitivesIndirectArguments
+struct IndirectDrawArguments {
+  uint32_t vertexCount;
+  uint32_t instanceCount;
+  uint32_t vertexStart;
+  uint32_t baseInstance;
+};
+
+// One instance of the culled mesh
+struct CullObject {
+  // World space bounding sphere
+  float center[3];
+  float radius;
+  // Model matrix, column major, copied to the instance buffer when visible
+  float model[16];
+};
+
+struct CullUniforms {
+  // (normal, d) with dot(normal, p) + d >= 0 on the inside
+  float planes[6][4];
+  float cameraPosition[4];
+  // An object uses the first LOD whose distance it is nearer than. Objects
+  // past the last one are culled, so make it huge to disable that.
+  float lodDistanceSquared[CullMaxLods];
+  uint32_t lodCount;
+  uint32_t objectCount;
+  // Instances of LOD l are written from l * instanceCapacity onwards
+  uint32_t instanceCapacity;
+  uint32_t padding;
+};
+
+// Occlusion test of a culling pass against a Hi-Z pyramid (see
+// hiz_culling.hpp)
+struct HiZUniforms {
+  // World to clip space of the frame whose depth the pyramid holds, column
+  // major
+  float viewProjection[16];
+  // Size of mip 0, which is the depth buffer's
+  uint32_t width;
+  uint32_t height;
+  uint32_t mipCount;
+  // Nothing is occluded while this is 0, e.g. before the first pyramid exists
+  uint32_t enabled;
+};
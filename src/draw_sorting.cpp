@@ -0,0 +1,183 @@
+#include "draw_sorting.hpp"
+
+#include <cstring>
+
+uint32_t drawKeyDepth(float depth, bool backToFront) {
+  if (!(depth > 0.0f)) {
+    depth = 0.0f;
+  }
+  // Positive IEEE floats compare the same as their bit patterns
+  uint32_t bits;
+  memcpy(&bits, &depth, sizeof(bits));
+  return backToFront ? ~bits : bits;
+}
+
+static uint64_t fieldMask(uint32_t bits) { return (uint64_t(1) << bits) - 1; }
+
+uint64_t makeDrawSortKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                         uint32_t depth) {
+  uint64_t key = pass & fieldMask(drawKeyPassBits);
+  key = (key << drawKeyPipelineBits) |
+        (pipeline & fieldMask(drawKeyPipelineBits));
+  key = (key << drawKeyMaterialBits) |
+        (material & fieldMask(drawKeyMaterialBits));
+  return (key << drawKeyDepthBits) | depth;
+}
+
+uint32_t drawKeyPass(uint64_t key) {
+  return uint32_t(key >> (drawKeyDepthBits + drawKeyMaterialBits +
+                          drawKeyPipelineBits));
+}
+
+uint32_t drawKeyPipeline(uint64_t key) {
+  return uint32_t(key >> (drawKeyDepthBits + drawKeyMaterialBits) &
+                  fieldMask(drawKeyPipelineBits));
+}
+
+uint32_t drawKeyMaterial(uint64_t key) {
+  return uint32_t(key >> drawKeyDepthBits & fieldMask(drawKeyMaterialBits));
+}
+
+void radixSortDrawPackets(std::vector<DrawPacket> &packets,
+                          std::vector<DrawPacket> &scratch) {
+  size_t count = packets.size();
+  if (count < 2) {
+    return;
+  }
+  scratch.resize(count);
+
+  // Histograms for all eight bytes in one pass over the keys
+  uint32_t histograms[8][256] = {};
+  for (const DrawPacket &packet : packets) {
+    for (uint32_t byte = 0; byte < 8; byte++) {
+      histograms[byte][(packet.key >> (byte * 8)) & 0xFF]++;
+    }
+  }
+
+  DrawPacket *source = packets.data();
+  DrawPacket *destination = scratch.data();
+  for (uint32_t byte = 0; byte < 8; byte++) {
+    uint32_t *histogram = histograms[byte];
+    uint32_t shift = byte * 8;
+    // Every key has the same byte here, this pass wouldn't move anything
+    if (histogram[(source[0].key >> shift) & 0xFF] == count) {
+      continue;
+    }
+
+    uint32_t offset = 0;
+    for (uint32_t bucket = 0; bucket < 256; bucket++) {
+      uint32_t bucketCount = histogram[bucket];
+      histogram[bucket] = offset;
+      offset += bucketCount;
+    }
+    for (size_t i = 0; i < count; i++) {
+      destination[histogram[(source[i].key >> shift) & 0xFF]++] = source[i];
+    }
+    std::swap(source, destination);
+  }
+
+  if (source != packets.data()) {
+    packets.swap(scratch);
+  }
+}
+
+uint32_t DrawKeyIds::id(const void *object) {
+  auto [it, inserted] =
+      ids.try_emplace(object, uint32_t(ids.size()) % limit);
+  return it->second;
+}
+
+bool StateTrackingSink::update(StateBinding &binding, uint64_t value) {
+  if (binding.bound && binding.value == value) {
+    trackerStats.skipped++;
+    return false;
+  }
+  binding.value = value;
+  binding.bound = true;
+  trackerStats.issued++;
+  return true;
+}
+
+bool StateTrackingSink::update(BufferBinding &binding, const void *buffer,
+                               uint64_t offset) {
+  if (binding.bound && binding.buffer == buffer && binding.offset == offset) {
+    trackerStats.skipped++;
+    return false;
+  }
+  binding.buffer = buffer;
+  binding.offset = offset;
+  binding.bound = true;
+  trackerStats.issued++;
+  return true;
+}
+
+void StateTrackingSink::setRenderPipelineState(const void *state) {
+  if (update(pipeline, reinterpret_cast<uintptr_t>(state))) {
+    sink.setRenderPipelineState(state);
+  }
+}
+
+void StateTrackingSink::setDepthStencilState(const void *state) {
+  if (update(depthStencil, reinterpret_cast<uintptr_t>(state))) {
+    sink.setDepthStencilState(state);
+  }
+}
+
+void StateTrackingSink::setFrontFacingWinding(uint32_t value) {
+  if (update(winding, value)) {
+    sink.setFrontFacingWinding(value);
+  }
+}
+
+void StateTrackingSink::setCullMode(uint32_t value) {
+  if (update(cullMode, value)) {
+    sink.setCullMode(value);
+  }
+}
+
+void StateTrackingSink::setVertexBuffer(const void *buffer, uint64_t offset,
+                                        uint32_t index) {
+  // Slots past the tracked ones are always forwarded
+  if (index >= maxBufferBindings ||
+      update(vertexBuffers[index], buffer, offset)) {
+    sink.setVertexBuffer(buffer, offset, index);
+  }
+}
+
+void StateTrackingSink::setFragmentBuffer(const void *buffer, uint64_t offset,
+                                          uint32_t index) {
+  if (index >= maxBufferBindings ||
+      update(fragmentBuffers[index], buffer, offset)) {
+    sink.setFragmentBuffer(buffer, offset, index);
+  }
+}
+
+void StateTrackingSink::setFragmentTexture(const void *texture,
+                                           uint32_t index) {
+  if (index >= maxTextureBindings ||
+      update(fragmentTextures[index], reinterpret_cast<uintptr_t>(texture))) {
+    sink.setFragmentTexture(texture, index);
+  }
+}
+
+void StateTrackingSink::drawPrimitives(uint32_t primitiveType,
+                                       uint64_t vertexStart,
+                                       uint64_t vertexCount,
+                                       uint64_t instanceCount) {
+  sink.drawPrimitives(primitiveType, vertexStart, vertexCount, instanceCount);
+}
+
+void StateTrackingSink::drawIndexedPrimitives(uint32_t primitiveType,
+                                              uint64_t indexCount,
+                                              const void *indexBuffer,
+                                              uint64_t indexOffset,
+                                              uint64_t instanceCount) {
+  sink.drawIndexedPrimitives(primitiveType, indexCount, indexBuffer,
+                             indexOffset, instanceCount);
+}
+
+void StateTrackingSink::drawPrimitivesIndirect(uint32_t primitiveType,
+                                               const void *indirectBuffer,
+                                               uint64_t indirectOffset) {
+  sink.drawPrimitivesIndirect(primitiveType, indirectBuffer, indirectOffset);
+}
@@ -0,0 +1,126 @@
+#pragma once
+// Draw packet sorting and redundant state elimination.
+//
+// Every draw gets a 64-bit sort key, most significant field first:
+//
+//   | pass: 4 | pipeline: 12 | material: 16 | depth: 32 |
+//
+// Sorting the keys groups draws by pass, then by pipeline (the most
+// expensive state to change), then by material, and finally orders them by
+// depth: front to back for opaque passes so early depth testing rejects
+// hidden fragments, back to front for blended ones. Keys are radix sorted,
+// which is linear in the draw count and doesn't branch on the data.
+//
+// StateTrackingSink sits in front of a RenderCommandSink and drops binds
+// that would set what is already bound, which after sorting is most of them.
+#include "command_encoding.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+constexpr uint32_t drawKeyPassBits = 4;
+constexpr uint32_t drawKeyPipelineBits = 12;
+constexpr uint32_t drawKeyMaterialBits = 16;
+constexpr uint32_t drawKeyDepthBits = 32;
+
+// Maps a view depth to an unsigned integer with the same ordering, flipped
+// when backToFront so that the furthest draw sorts first. Negative depths
+// (behind the camera) clamp to 0.
+uint32_t drawKeyDepth(float depth, bool backToFront = false);
+
+// Fields wider than their bits are truncated
+uint64_t makeDrawSortKey(uint32_t pass, uint32_t pipeline, uint32_t material,
+                         uint32_t depth);
+
+uint32_t drawKeyPass(uint64_t key);
+uint32_t drawKeyPipeline(uint64_t key);
+uint32_t drawKeyMaterial(uint64_t key);
+
+struct DrawPacket {
+  uint64_t key;
+  // Index of the draw in the caller's draw list
+  uint32_t index;
+};
+
+// Stable LSD radix sort on the key, 8 bits per pass. Passes where every key
+// has the same byte are skipped, so unused key fields cost nothing.
+// `scratch` is resized to match, keep it around between frames.
+void radixSortDrawPackets(std::vector<DrawPacket> &packets,
+                          std::vector<DrawPacket> &scratch);
+
+// Hands out small dense ids for objects (pipelines, materials) to put in
+// sort keys. Ids are handed out in first use order and kept until clear(),
+// which the engine calls once per frame.
+class DrawKeyIds {
+public:
+  explicit DrawKeyIds(uint32_t bits) : limit(1u << bits) {}
+
+  // Ids wrap once the field is full, which only costs some sorting quality
+  uint32_t id(const void *object);
+  void clear() { ids.clear(); }
+
+private:
+  uint32_t limit;
+  std::unordered_map<const void *, uint32_t> ids;
+};
+
+struct StateTrackerStats {
+  // Calls forwarded to the sink, and calls dropped as redundant
+  uint32_t issued = 0;
+  uint32_t skipped = 0;
+};
+
+class StateTrackingSink : public RenderCommandSink {
+public:
+  static constexpr uint32_t maxBufferBindings = 8;
+  static constexpr uint32_t maxTextureBindings = 8;
+
+  // Assumes nothing is bound on `sink` yet
+  explicit StateTrackingSink(RenderCommandSink &sink) : sink(sink) {}
+
+  void setRenderPipelineState(const void *pipeline) override;
+  void setDepthStencilState(const void *depthStencil) override;
+  void setFrontFacingWinding(uint32_t winding) override;
+  void setCullMode(uint32_t cullMode) override;
+  void setVertexBuffer(const void *buffer, uint64_t offset,
+                       uint32_t index) override;
+  void setFragmentBuffer(const void *buffer, uint64_t offset,
+                         uint32_t index) override;
+  void setFragmentTexture(const void *texture, uint32_t index) override;
+  void drawPrimitives(uint32_t primitiveType, uint64_t vertexStart,
+                      uint64_t vertexCount, uint64_t instanceCount) override;
+  void drawIndexedPrimitives(uint32_t primitiveType, uint64_t indexCount,
+                             const void *indexBuffer, uint64_t indexOffset,
+                             uint64_t instanceCount) override;
+  void drawPrimitivesIndirect(uint32_t primitiveType,
+                              const void *indirectBuffer,
+                              uint64_t indirectOffset) override;
+
+  const StateTrackerStats &stats() const { return trackerStats; }
+
+private:
+  struct BufferBinding {
+    const void *buffer = nullptr;
+    uint64_t offset = 0;
+    bool bound = false;
+  };
+  struct StateBinding {
+    uint64_t value = 0;
+    bool bound = false;
+  };
+
+  // Records value into binding, returns false if it was already bound
+  bool update(StateBinding &binding, uint64_t value);
+  bool update(BufferBinding &binding, const void *buffer, uint64_t offset);
+
+  RenderCommandSink &sink;
+  StateBinding pipeline;
+  StateBinding depthStencil;
+  StateBinding winding;
+  StateBinding cullMode;
+  BufferBinding vertexBuffers[maxBufferBindings];
+  BufferBinding fragmentBuffers[maxBufferBindings];
+  StateBinding fragmentTextures[maxTextureBindings];
+  StateTrackerStats trackerStats;
+};
@@ -0,0 +1,283 @@
+#pragma once
+// Small, platform independent vector and matrix types.
+//
+// The renderer itself uses Apple's <simd/simd.h> types so that data can be
+// handed straight to Metal, but those headers only exist on Apple platforms.
+// The CPU side systems (streaming, culling, scheduling, ...) are written
+// against these types instead so that they can be built and exercised
+// headlessly on Linux. The memory layout intentionally matches simd's
+// float4/float4x4 (16 byte aligned, column major) so values can be memcpy'd
+// across when needed.
+#include <cmath>
+#include <cstdint>
+
+struct Float2 {
+  float x = 0.0f, y = 0.0f;
+};
+
+struct Float3 {
+  float x = 0.0f, y = 0.0f, z = 0.0f;
+};
+
+struct alignas(16) Float4 {
+  float x = 0.0f, y = 0.0f, z = 0.0f, w = 0.0f;
+
+  Float3 xyz() const { return {x, y, z}; }
+};
+
+// Column major, matching simd::float4x4 / matrix_float4x4
+struct alignas(16) Float4x4 {
+  Float4 columns[4];
+};
+
+inline Float3 operator+(Float3 a, Float3 b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+inline Float3 operator-(Float3 a, Float3 b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+inline Float3 operator-(Float3 a) { return {-a.x, -a.y, -a.z}; }
+inline Float3 operator*(Float3 a, float s) { return {a.x * s, a.y * s, a.z * s}; }
+inline Float3 operator*(float s, Float3 a) { return a * s; }
+inline Float3 operator*(Float3 a, Float3 b) {
+  return {a.x * b.x, a.y * b.y, a.z * b.z};
+}
+
+inline Float4 operator+(Float4 a, Float4 b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w};
+}
+inline Float4 operator-(Float4 a, Float4 b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w};
+}
+inline Float4 operator*(Float4 a, float s) {
+  return {a.x * s, a.y * s, a.z * s, a.w * s};
+}
+
+inline float dot(Float3 a, Float3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline float dot(Float4 a, Float4 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+inline Float3 cross(Float3 a, Float3 b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+inline float length(Float3 a) { return std::sqrt(dot(a, a)); }
+inline Float3 normalize(Float3 a) {
+  float len = length(a);
+  return len > 0.0f ? a * (1.0f / len) : a;
+}
+inline Float3 minimum(Float3 a, Float3 b) {
+  return {std::fmin(a.x, b.x), std::fmin(a.y, b.y), std::fmin(a.z, b.z)};
+}
+inline Float3 maximum(Float3 a, Float3 b) {
+  return {std::fmax(a.x, b.x), std::fmax(a.y, b.y), std::fmax(a.z, b.z)};
+}
+
+// Indices are m<column><row>, same convention as matrix_make_rows in
+// AAPLMathUtilities: the arguments read like the rows of the matrix.
+inline Float4x4 makeRows(float m00, float m10, float m20, float m30, float m01,
+                         float m11, float m21, float m31, float m02, float m12,
+                         float m22, float m32, float m03, float m13, float m23,
+                         float m33) {
+  return {{{m00, m01, m02, m03},
+           {m10, m11, m12, m13},
+           {m20, m21, m22, m23},
+           {m30, m31, m32, m33}}};
+}
+
+inline Float4x4 makeIdentity() {
+  return makeRows(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+}
+
+inline Float4x4 makeTranslation(Float3 t) {
+  return makeRows(1, 0, 0, t.x, 0, 1, 0, t.y, 0, 0, 1, t.z, 0, 0, 0, 1);
+}
+
+inline Float4x4 makeScale(Float3 s) {
+  return makeRows(s.x, 0, 0, 0, 0, s.y, 0, 0, 0, 0, s.z, 0, 0, 0, 0, 1);
+}
+
+inline Float4x4 makeRotation(float radians, Float3 axis) {
+  axis = normalize(axis);
+  float ct = std::cos(radians);
+  float st = std::sin(radians);
+  float ci = 1 - ct;
+  float x = axis.x, y = axis.y, z = axis.z;
+  return makeRows(ct + x * x * ci, x * y * ci - z * st, x * z * ci + y * st, 0,
+                  y * x * ci + z * st, ct + y * y * ci, y * z * ci - x * st, 0,
+                  z * x * ci - y * st, z * y * ci + x * st, ct + z * z * ci, 0,
+                  0, 0, 0, 1);
+}
+
+// Same as matrix_perspective_right_hand in AAPLMathUtilities
+inline Float4x4 makePerspectiveRightHand(float fovyRadians, float aspect,
+                                         float nearZ, float farZ) {
+  float ys = 1 / std::tan(fovyRadians * 0.5f);
+  float xs = ys / aspect;
+  float zs = farZ / (nearZ - farZ);
+  return makeRows(xs, 0, 0, 0, 0, ys, 0, 0, 0, 0, zs, nearZ * zs, 0, 0, -1, 0);
+}
+
+// Same as matrix_ortho_right_hand in AAPLMathUtilities: view space z from
+// -nearZ to -farZ maps to clip space depth 0 to 1
+inline Float4x4 makeOrthographicRightHand(float left, float right,
+                                          float bottom, float top,
+                                          float nearZ, float farZ) {
+  float xs = 2 / (right - left);
+  float ys = 2 / (top - bottom);
+  float zs = -1 / (farZ - nearZ);
+  return makeRows(xs, 0, 0, -(left + right) * 0.5f * xs, 0, ys, 0,
+                  -(top + bottom) * 0.5f * ys, 0, 0, zs, nearZ * zs, 0, 0, 0,
+                  1);
+}
+
+// Right handed look-at view matrix, same layout as the view matrix built in
+// MTLEngine::encodeRenderCommand from the camera's right/up/forward vectors.
+inline Float4x4 makeLookAt(Float3 eye, Float3 target, Float3 up) {
+  Float3 F = normalize(target - eye);
+  Float3 R = normalize(cross(F, up));
+  Float3 U = cross(R, F);
+  return makeRows(R.x, R.y, R.z, dot(-R, eye), U.x, U.y, U.z, dot(-U, eye),
+                  -F.x, -F.y, -F.z, dot(F, eye), 0, 0, 0, 1);
+}
+
+inline Float4 mul(const Float4x4 &m, Float4 v) {
+  return m.columns[0] * v.x + m.columns[1] * v.y + m.columns[2] * v.z +
+         m.columns[3] * v.w;
+}
+
+inline Float4x4 mul(const Float4x4 &a, const Float4x4 &b) {
+  Float4x4 result;
+  for (int c = 0; c < 4; c++) {
+    result.columns[c] = mul(a, b.columns[c]);
+  }
+  return result;
+}
+
+inline Float3 transformPoint(const Float4x4 &m, Float3 p) {
+  return mul(m, Float4{p.x, p.y, p.z, 1.0f}).xyz();
+}
+
+inline Float4x4 transpose(const Float4x4 &m) {
+  const Float4 *c = m.columns;
+  return {{{c[0].x, c[1].x, c[2].x, c[3].x},
+           {c[0].y, c[1].y, c[2].y, c[3].y},
+           {c[0].z, c[1].z, c[2].z, c[3].z},
+           {c[0].w, c[1].w, c[2].w, c[3].w}}};
+}
+
+// General 4x4 inverse (cofactor expansion). Returns identity for singular
+// matrices rather than producing NaNs.
+inline Float4x4 inverse(const Float4x4 &matrix) {
+  float m[16];
+  for (int c = 0; c < 4; c++) {
+    m[c * 4 + 0] = matrix.columns[c].x;
+    m[c * 4 + 1] = matrix.columns[c].y;
+    m[c * 4 + 2] = matrix.columns[c].z;
+    m[c * 4 + 3] = matrix.columns[c].w;
+  }
+  float inv[16];
+  inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] +
+           m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+  inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] -
+           m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+  inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] +
+           m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+  inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] -
+            m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+  inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] -
+           m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+  inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] +
+           m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+  inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] -
+           m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+  inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] +
+            m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+  inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] +
+           m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+  inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] -
+           m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+  inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] +
+            m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+  inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] -
+            m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+  inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] -
+           m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+  inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] +
+           m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+  inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] -
+            m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+  inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] +
+            m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+  float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+  if (det == 0.0f) {
+    return makeIdentity();
+  }
+  float invDet = 1.0f / det;
+  Float4x4 result;
+  for (int c = 0; c < 4; c++) {
+    result.columns[c] = {inv[c * 4 + 0] * invDet, inv[c * 4 + 1] * invDet,
+                         inv[c * 4 + 2] * invDet, inv[c * 4 + 3] * invDet};
+  }
+  return result;
+}
+
+// Axis aligned bounding box
+struct Bounds {
+  Float3 min;
+  Float3 max;
+
+  Float3 center() const { return (min + max) * 0.5f; }
+  Float3 extents() const { return (max - min) * 0.5f; }
+};
+
+// Plane stored as (normal, d) with dot(normal, p) + d >= 0 on the inside
+struct Plane {
+  Float3 normal;
+  float d = 0.0f;
+};
+
+struct Frustum {
+  Plane planes[6];
+};
+
+// Extracts the six clip planes from a view-projection matrix using the
+// Gribb/Hartmann method, adjusted for Metal's [0, 1] clip space depth range.
+inline Frustum makeFrustum(const Float4x4 &viewProjection) {
+  Float4x4 t = transpose(viewProjection);
+  const Float4 &r0 = t.columns[0];
+  const Float4 &r1 = t.columns[1];
+  const Float4 &r2 = t.columns[2];
+  const Float4 &r3 = t.columns[3];
+  Float4 raw[6] = {r3 + r0, r3 - r0, r3 + r1, r3 - r1, r2, r3 - r2};
+  Frustum frustum;
+  for (int i = 0; i < 6; i++) {
+    float len = length(raw[i].xyz());
+    float inv = len > 0.0f ? 1.0f / len : 0.0f;
+    frustum.planes[i] = {raw[i].xyz() * inv, raw[i].w * inv};
+  }
+  return frustum;
+}
+
+inline bool sphereInFrustum(const Frustum &frustum, Float3 center,
+                            float radius) {
+  for (const Plane &plane : frustum.planes) {
+    if (dot(plane.normal, center) + plane.d < -radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool boundsInFrustum(const Frustum &frustum, const Bounds &bounds) {
+  Float3 c = bounds.center();
+  Float3 e = bounds.extents();
+  for (const Plane &plane : frustum.planes) {
+    float r = e.x * std::fabs(plane.normal.x) + e.y * std::fabs(plane.normal.y) +
+              e.z * std::fabs(plane.normal.z);
+    if (dot(plane.normal, c) + plane.d < -r) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,124 @@
+#include "entity_store.hpp"
+
+// Calls function(column) for every column of the archetype in `mask`
+template <typename F>
+static void forEachColumn(Archetype &archetype, ComponentMask mask,
+                          F &&function) {
+  if (mask & componentBit<TransformComponent>()) {
+    function(archetype.transforms);
+  }
+  if (mask & componentBit<MeshComponent>()) {
+    function(archetype.meshes);
+  }
+  if (mask & componentBit<MaterialComponent>()) {
+    function(archetype.materials);
+  }
+  if (mask & componentBit<BoundsComponent>()) {
+    function(archetype.bounds);
+  }
+  if (mask & componentBit<SceneNodeComponent>()) {
+    function(archetype.sceneNodes);
+  }
+  if (mask & componentBit<OccluderComponent>()) {
+    function(archetype.occluders);
+  }
+}
+
+Entity EntityStore::allocate(ComponentMask mask) {
+  uint32_t index;
+  if (!freeIndices.empty()) {
+    index = freeIndices.back();
+    freeIndices.pop_back();
+  } else {
+    index = (uint32_t)records.size();
+    records.emplace_back();
+  }
+
+  Archetype &archetype = archetypes[mask];
+  Record &record = records[index];
+  record.archetype = mask;
+  record.row = (uint32_t)archetype.entities.size();
+  record.alive = true;
+
+  Entity entity{index, record.generation};
+  archetype.entities.push_back(entity);
+  forEachColumn(archetype, mask, [](auto &column) { column.emplace_back(); });
+  liveEntities++;
+  return entity;
+}
+
+void EntityStore::destroy(Entity entity) {
+  if (!alive(entity)) {
+    return;
+  }
+  Record &record = records[entity.index];
+  removeRow(record.archetype, record.row);
+  record.alive = false;
+  record.generation++;
+  freeIndices.push_back(entity.index);
+  liveEntities--;
+}
+
+bool EntityStore::alive(Entity entity) const {
+  return entity.index < records.size() && records[entity.index].alive &&
+         records[entity.index].generation == entity.generation;
+}
+
+void EntityStore::clear() {
+  for (Archetype &archetype : archetypes) {
+    archetype = Archetype();
+  }
+  // Generations survive, so handles from before stay dead
+  freeIndices.clear();
+  for (uint32_t index = 0; index < records.size(); index++) {
+    if (records[index].alive) {
+      records[index].alive = false;
+      records[index].generation++;
+    }
+    freeIndices.push_back(index);
+  }
+  liveEntities = 0;
+}
+
+void EntityStore::changeArchetype(Entity entity, ComponentMask mask) {
+  Record &record = records[entity.index];
+  ComponentMask oldMask = record.archetype;
+  if (oldMask == mask) {
+    return;
+  }
+  Archetype &source = archetypes[oldMask];
+  Archetype &target = archetypes[mask];
+  uint32_t row = record.row;
+
+  target.entities.push_back(entity);
+  forEachColumn(target, mask, [&](auto &column) {
+    using Component = typename std::decay_t<decltype(column)>::value_type;
+    if (oldMask & componentBit<Component>()) {
+      column.push_back(source.column<Component>()[row]);
+    } else {
+      column.emplace_back();
+    }
+  });
+  removeRow(oldMask, row);
+
+  // removeRow may have moved another entity, but never this one
+  record.archetype = mask;
+  record.row = (uint32_t)target.entities.size() - 1;
+}
+
+void EntityStore::removeRow(ComponentMask mask, uint32_t row) {
+  Archetype &archetype = archetypes[mask];
+  uint32_t last = (uint32_t)archetype.entities.size() - 1;
+  if (row != last) {
+    Entity moved = archetype.entities[last];
+    archetype.entities[row] = moved;
+    records[moved.index].row = row;
+  }
+  archetype.entities.pop_back();
+  forEachColumn(archetype, mask, [&](auto &column) {
+    if (row != last) {
+      column[row] = column[last];
+    }
+    column.pop_back();
+  });
+}
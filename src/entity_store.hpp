@@ -0,0 +1,216 @@
+#pragma once
+// Archetype based entity-component storage for renderable objects.
+//
+// An entity is just an id. Its data lives in components (transform, mesh,
+// material, bounds, scene node, occluder), and every entity with exactly the
+// same set of components belongs to the same archetype. Each archetype stores
+// its components as tightly packed arrays, one per component type, where row
+// i of every array belongs to the archetype's i-th entity. A system that wants,
+// say, transforms and bounds walks every archetype that has both and streams
+// through two contiguous arrays, never touching the materials in between.
+//
+// There are few enough component types that the set of components, as a bit
+// mask, directly indexes the archetype array. Adding or removing an entity
+// appends a row or moves the last row into the hole, and adding or removing
+// a component moves the entity's row to another archetype the same way, so
+// all of these are O(1).
+#include "engine_math.hpp"
+#include "scene_graph.hpp"
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// Model to world
+struct TransformComponent {
+  Float4x4 model = makeIdentity();
+};
+
+// Index into the renderer's mesh table
+struct MeshComponent {
+  uint32_t mesh = 0;
+};
+
+constexpr uint32_t noMaterialTexture = UINT32_MAX;
+
+struct MaterialComponent {
+  Float4 color = {1.0f, 1.0f, 1.0f, 1.0f};
+  // Index into the renderer's pipeline and texture tables
+  uint32_t pipeline = 0;
+  uint32_t texture = noMaterialTexture;
+};
+
+// Model space bounding sphere, centre in xyz and radius in w
+struct BoundsComponent {
+  Float4 sphere;
+};
+
+// Node whose world transform is copied into TransformComponent
+struct SceneNodeComponent {
+  SceneNodeId node = invalidSceneNode;
+};
+
+// Rasterized into the CPU occlusion buffer (see occlusion_culling.hpp) with
+// the entity's transform
+struct OccluderComponent {
+  // Index into the renderer's occluder mesh table
+  uint32_t mesh = 0;
+};
+
+using ComponentMask = uint32_t;
+constexpr uint32_t componentTypeCount = 6;
+constexpr uint32_t archetypeCount = 1u << componentTypeCount;
+
+template <typename T> constexpr ComponentMask componentBit() {
+  if constexpr (std::is_same_v<T, TransformComponent>) {
+    return 1u << 0;
+  } else if constexpr (std::is_same_v<T, MeshComponent>) {
+    return 1u << 1;
+  } else if constexpr (std::is_same_v<T, MaterialComponent>) {
+    return 1u << 2;
+  } else if constexpr (std::is_same_v<T, BoundsComponent>) {
+    return 1u << 3;
+  } else if constexpr (std::is_same_v<T, SceneNodeComponent>) {
+    return 1u << 4;
+  } else {
+    static_assert(std::is_same_v<T, OccluderComponent>,
+                  "not a component type");
+    return 1u << 5;
+  }
+}
+
+template <typename... T> constexpr ComponentMask componentMask() {
+  return (componentBit<T>() | ... | 0u);
+}
+
+struct Entity {
+  uint32_t index = UINT32_MAX;
+  // Bumped when the index is reused, so stale handles stop being alive
+  uint32_t generation = 0;
+
+  bool operator==(const Entity &other) const = default;
+};
+
+constexpr Entity invalidEntity{};
+
+// Entities with exactly the same components. Only the columns of components
+// in the archetype's mask are used.
+struct Archetype {
+  std::vector<Entity> entities;
+  std::vector<TransformComponent> transforms;
+  std::vector<MeshComponent> meshes;
+  std::vector<MaterialComponent> materials;
+  std::vector<BoundsComponent> bounds;
+  std::vector<SceneNodeComponent> sceneNodes;
+  std::vector<OccluderComponent> occluders;
+
+  template <typename T> std::vector<T> &column() {
+    if constexpr (std::is_same_v<T, TransformComponent>) {
+      return transforms;
+    } else if constexpr (std::is_same_v<T, MeshComponent>) {
+      return meshes;
+    } else if constexpr (std::is_same_v<T, MaterialComponent>) {
+      return materials;
+    } else if constexpr (std::is_same_v<T, BoundsComponent>) {
+      return bounds;
+    } else if constexpr (std::is_same_v<T, SceneNodeComponent>) {
+      return sceneNodes;
+    } else {
+      return occluders;
+    }
+  }
+};
+
+class EntityStore {
+public:
+  template <typename... T> Entity create(const T &...components) {
+    Entity entity = allocate(componentMask<T...>());
+    ((get<T>(entity) = components), ...);
+    return entity;
+  }
+  void destroy(Entity entity);
+  bool alive(Entity entity) const;
+  size_t size() const { return liveEntities; }
+  void clear();
+
+  template <typename T> bool has(Entity entity) const {
+    return alive(entity) &&
+           (records[entity.index].archetype & componentBit<T>());
+  }
+
+  template <typename T> T &get(Entity entity) {
+    assert(has<T>(entity));
+    const Record &record = records[entity.index];
+    return archetypes[record.archetype].column<T>()[record.row];
+  }
+
+  // Adds the component, or overwrites it if the entity already has one
+  template <typename T> void set(Entity entity, const T &component) {
+    assert(alive(entity));
+    ComponentMask mask = records[entity.index].archetype;
+    if (!(mask & componentBit<T>())) {
+      changeArchetype(entity, mask | componentBit<T>());
+    }
+    get<T>(entity) = component;
+  }
+
+  template <typename T> void remove(Entity entity) {
+    if (has<T>(entity)) {
+      changeArchetype(entity, records[entity.index].archetype &
+                                  ~componentBit<T>());
+    }
+  }
+
+  // Calls function(count, entities, columns...) once for every non-empty
+  // archetype with all of T, with the archetype's packed arrays. Components
+  // may be modified, but entities must not be created, destroyed or change
+  // components until it returns.
+  template <typename... T, typename F> void forEachChunk(F &&function) {
+    constexpr ComponentMask required = componentMask<T...>();
+    for (ComponentMask mask = 0; mask < archetypeCount; mask++) {
+      Archetype &archetype = archetypes[mask];
+      if ((mask & required) != required || archetype.entities.empty()) {
+        continue;
+      }
+      function(archetype.entities.size(), archetype.entities.data(),
+               archetype.column<T>().data()...);
+    }
+  }
+
+  // Calls function(entity, components...) for every entity with all of T
+  template <typename... T, typename F> void forEach(F &&function) {
+    forEachChunk<T...>(
+        [&](size_t count, const Entity *entities, T *...columns) {
+          for (size_t i = 0; i < count; i++) {
+            function(entities[i], columns[i]...);
+          }
+        });
+  }
+
+  // Entities with exactly these components
+  size_t archetypeSize(ComponentMask mask) const {
+    return archetypes[mask].entities.size();
+  }
+
+private:
+  struct Record {
+    uint32_t generation = 0;
+    ComponentMask archetype = 0;
+    uint32_t row = 0;
+    bool alive = false;
+  };
+
+  // New entity with default constructed components
+  Entity allocate(ComponentMask mask);
+  // Moves the entity's row, keeping the components both archetypes have
+  void changeArchetype(Entity entity, ComponentMask mask);
+  // Fills the hole with the archetype's last row
+  void removeRow(ComponentMask mask, uint32_t row);
+
+  std::array<Archetype, archetypeCount> archetypes;
+  std::vector<Record> records;
+  std::vector<uint32_t> freeIndices;
+  size_t liveEntities = 0;
+};
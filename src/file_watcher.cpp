@@ -0,0 +1,264 @@
+#include "file_watcher.hpp"
+
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <unordered_set>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <CoreServices/CoreServices.h>
+#endif
+
+static std::string parentDirectory(const std::string &file) {
+  return std::filesystem::path(file).parent_path().string();
+}
+
+#if defined(__linux__)
+
+struct FileWatcher::Backend {
+  int fd = -1;
+  // Watch descriptor to directory, and back
+  std::unordered_map<int, std::string> directories;
+  std::unordered_map<std::string, int> directoryWatches;
+  std::unordered_set<std::string> files;
+
+  Backend() { fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC); }
+  ~Backend() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  const char *name() const { return "inotify"; }
+
+  bool add(const std::string &file) {
+    if (fd < 0) {
+      return false;
+    }
+    std::string directory = parentDirectory(file);
+    if (!directoryWatches.count(directory)) {
+      // MODIFY for writers that keep the file open, CLOSE_WRITE for a
+      // finished save, MOVED_TO and CREATE for saves that replace the file
+      int wd = inotify_add_watch(fd, directory.c_str(),
+                                 IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO |
+                                     IN_CREATE);
+      if (wd < 0) {
+        return false;
+      }
+      directories[wd] = directory;
+      directoryWatches[directory] = wd;
+    }
+    files.insert(file);
+    return true;
+  }
+
+  void collect(std::vector<std::string> &changed) {
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+      ssize_t length = read(fd, buffer, sizeof(buffer));
+      if (length <= 0) {
+        // EAGAIN: nothing left to read
+        return;
+      }
+      for (char *p = buffer; p < buffer + length;) {
+        const inotify_event *event = reinterpret_cast<inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // Events were dropped, assume everything changed
+          changed.insert(changed.end(), files.begin(), files.end());
+          continue;
+        }
+        auto directory = directories.find(event->wd);
+        if (directory == directories.end() || event->len == 0) {
+          continue;
+        }
+        std::string file = directory->second + "/" + event->name;
+        if (files.count(file)) {
+          changed.push_back(file);
+        }
+      }
+    }
+  }
+};
+
+#elif defined(__APPLE__)
+
+struct FileWatcher::Backend {
+  dispatch_queue_t queue;
+  FSEventStreamRef stream = nullptr;
+  std::unordered_set<std::string> files;
+  std::unordered_set<std::string> directories;
+
+  // Filled in on the dispatch queue, drained by collect()
+  std::mutex mutex;
+  std::vector<std::string> events;
+
+  Backend() { queue = dispatch_queue_create("FileWatcher", nullptr); }
+  ~Backend() {
+    stop();
+    dispatch_release(queue);
+  }
+
+  const char *name() const { return "fsevents"; }
+
+  static void callback(ConstFSEventStreamRef, void *info, size_t count,
+                       void *paths, const FSEventStreamEventFlags flags[],
+                       const FSEventStreamEventId[]) {
+    Backend *backend = static_cast<Backend *>(info);
+    char **changedPaths = static_cast<char **>(paths);
+    std::lock_guard<std::mutex> lock(backend->mutex);
+    for (size_t i = 0; i < count; i++) {
+      if (flags[i] & kFSEventStreamEventFlagMustScanSubDirs) {
+        // Events were dropped, assume everything changed
+        backend->events.insert(backend->events.end(), backend->files.begin(),
+                               backend->files.end());
+      } else {
+        backend->events.push_back(changedPaths[i]);
+      }
+    }
+  }
+
+  void stop() {
+    if (!stream) {
+      return;
+    }
+    FSEventStreamStop(stream);
+    FSEventStreamInvalidate(stream);
+    // Let a callback that's already running finish before the stream goes
+    dispatch_sync_f(queue, nullptr, [](void *) {});
+    FSEventStreamRelease(stream);
+    stream = nullptr;
+  }
+
+  // A stream's directories are fixed, so adding one means a new stream
+  bool restart() {
+    stop();
+    CFMutableArrayRef paths =
+        CFArrayCreateMutable(nullptr, 0, &kCFTypeArrayCallBacks);
+    for (const std::string &directory : directories) {
+      CFStringRef path = CFStringCreateWithCString(
+          nullptr, directory.c_str(), kCFStringEncodingUTF8);
+      CFArrayAppendValue(paths, path);
+      CFRelease(path);
+    }
+    FSEventStreamContext context = {0, this, nullptr, nullptr, nullptr};
+    stream = FSEventStreamCreate(
+        nullptr, &callback, &context, paths, kFSEventStreamEventIdSinceNow,
+        0.05,
+        kFSEventStreamCreateFlagFileEvents | kFSEventStreamCreateFlagNoDefer);
+    CFRelease(paths);
+    if (!stream) {
+      return false;
+    }
+    FSEventStreamSetDispatchQueue(stream, queue);
+    return FSEventStreamStart(stream);
+  }
+
+  bool add(const std::string &file) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      files.insert(file);
+    }
+    if (directories.insert(parentDirectory(file)).second) {
+      return restart();
+    }
+    return stream != nullptr;
+  }
+
+  void collect(std::vector<std::string> &changed) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const std::string &path : events) {
+      if (files.count(path)) {
+        changed.push_back(path);
+      }
+    }
+    events.clear();
+  }
+};
+
+#else
+
+struct FileWatcher::Backend {
+  // Last seen modification time, or min() while the file doesn't exist
+  std::unordered_map<std::string, std::filesystem::file_time_type> files;
+
+  const char *name() const { return "polling"; }
+
+  static std::filesystem::file_time_type modificationTime(
+      const std::string &file) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(file, error);
+    return error ? std::filesystem::file_time_type::min() : time;
+  }
+
+  bool add(const std::string &file) {
+    files[file] = modificationTime(file);
+    return true;
+  }
+
+  void collect(std::vector<std::string> &changed) {
+    for (auto &[file, lastTime] : files) {
+      auto time = modificationTime(file);
+      if (time != lastTime) {
+        lastTime = time;
+        changed.push_back(file);
+      }
+    }
+  }
+};
+
+#endif
+
+FileWatcher::FileWatcher(double settleSeconds)
+    : backend(std::make_unique<Backend>()), settleSeconds(settleSeconds) {}
+
+FileWatcher::~FileWatcher() = default;
+
+std::string FileWatcher::canonicalPath(const std::string &path) {
+  std::error_code error;
+  std::filesystem::path absolute = std::filesystem::absolute(path, error);
+  if (error) {
+    return "";
+  }
+  std::filesystem::path canonical =
+      std::filesystem::weakly_canonical(absolute, error);
+  return error ? "" : canonical.string();
+}
+
+std::string FileWatcher::watch(const std::string &path) {
+  std::string file = canonicalPath(path);
+  if (file.empty() || !std::filesystem::is_directory(parentDirectory(file))) {
+    std::cerr << "FileWatcher: can't watch " << path << std::endl;
+    return "";
+  }
+  if (!backend->add(file)) {
+    std::cerr << "FileWatcher: " << backend->name() << " failed to watch "
+              << file << std::endl;
+    return "";
+  }
+  return file;
+}
+
+std::vector<std::string> FileWatcher::poll(double now) {
+  std::vector<std::string> changed;
+  backend->collect(changed);
+  for (const std::string &file : changed) {
+    pending[file] = now;
+  }
+
+  std::vector<std::string> settled;
+  for (auto it = pending.begin(); it != pending.end();) {
+    if (now - it->second >= settleSeconds) {
+      settled.push_back(it->first);
+      it = pending.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return settled;
+}
+
+const char *FileWatcher::backendName() const { return backend->name(); }
@@ -0,0 +1,49 @@
+#pragma once
+// Reports when watched files change on disk.
+//
+// Uses inotify on Linux and FSEvents on macOS, falling back to checking
+// modification times on other platforms. Files are watched through their
+// parent directory, so editors and build tools that save by writing a new
+// file and renaming it over the old one are picked up too.
+//
+// Saving usually touches a file several times in a row (truncate, write,
+// rename, chmod), so a change is only reported once the file has been quiet
+// for `settleSeconds`.
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class FileWatcher {
+public:
+  explicit FileWatcher(double settleSeconds = 0.2);
+  ~FileWatcher();
+
+  FileWatcher(const FileWatcher &) = delete;
+  FileWatcher &operator=(const FileWatcher &) = delete;
+
+  // The file doesn't have to exist yet, but its directory does. Returns the
+  // path changes will be reported under (absolute, symlinks resolved), or an
+  // empty string if it can't be watched.
+  std::string watch(const std::string &path);
+
+  // Returns the watched files that changed and have since settled, each
+  // once. `now` is in seconds on any monotonic clock.
+  std::vector<std::string> poll(double now);
+
+  // "inotify", "fsevents" or "polling"
+  const char *backendName() const;
+
+  // Resolves `path` the same way watch() does
+  static std::string canonicalPath(const std::string &path);
+
+private:
+  // Platform specific part, collects changed paths in whatever thread the OS
+  // delivers them on
+  struct Backend;
+
+  std::unique_ptr<Backend> backend;
+  double settleSeconds;
+  // Changed files waiting to settle, with the time of their last change
+  std::unordered_map<std::string, double> pending;
+};
@@ -0,0 +1,331 @@
+#include "frame_capture.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+uint32_t CaptureHandles::id(const void *object) {
+  if (!object) {
+    return 0;
+  }
+  auto [it, inserted] = ids.try_emplace(object, (uint32_t)ids.size() + 1);
+  return it->second;
+}
+
+void captureCommands(const CommandRecorder &recorder, CaptureHandles &handles,
+                     std::vector<CapturedCommand> &commands) {
+  commands.reserve(commands.size() + recorder.commands().size());
+  for (const RecordedCommand &recorded : recorder.commands()) {
+    CapturedCommand command;
+    command.type = recorded.type;
+    command.index = recorded.index;
+    command.object = handles.id(recorded.object);
+    for (int i = 0; i < 3; i++) {
+      command.values[i] = recorded.values[i];
+    }
+    commands.push_back(command);
+  }
+}
+
+void FrameCapturer::start(const std::string &scene, uint32_t frameCount) {
+  current = FrameCapture();
+  current.scene = scene;
+  current.frames.reserve(frameCount);
+  handles.clear();
+  framesLeft = frameCount;
+  frameBegun = false;
+}
+
+void FrameCapturer::addChange(const SceneChange &change) {
+  if (active()) {
+    pendingChanges.push_back(change);
+  }
+}
+
+void FrameCapturer::beginFrame(double time, uint32_t frameInFlight,
+                               const FrameCamera &camera) {
+  if (!active()) {
+    return;
+  }
+  CapturedFrame frame;
+  frame.time = time;
+  frame.frameInFlight = frameInFlight;
+  frame.camera = camera;
+  frame.changes = std::move(pendingChanges);
+  pendingChanges.clear();
+  current.frames.push_back(std::move(frame));
+  frameBegun = true;
+}
+
+bool FrameCapturer::endFrame(const CommandRecorder &recorder) {
+  if (!active() || !frameBegun) {
+    return false;
+  }
+  captureCommands(recorder, handles, current.frames.back().commands);
+  frameBegun = false;
+  return --framesLeft == 0;
+}
+
+static constexpr const char *captureHeader = "frame-capture 1";
+
+static const char *const commandNames[] = {
+    "SetRenderPipelineState", "SetDepthStencilState",  "SetFrontFacingWinding",
+    "SetCullMode",            "SetVertexBuffer",       "SetFragmentBuffer",
+    "SetFragmentTexture",     "DrawPrimitives",        "DrawIndexedPrimitives",
+    "DrawPrimitivesIndirect",
+};
+static constexpr size_t commandNameCount =
+    sizeof(commandNames) / sizeof(commandNames[0]);
+static_assert(commandNameCount ==
+                  (size_t)RecordedCommandType::DrawPrimitivesIndirect + 1,
+              "every RecordedCommandType needs a name");
+
+static bool parseCommandType(const std::string &name,
+                             RecordedCommandType &type) {
+  for (size_t i = 0; i < commandNameCount; i++) {
+    if (name == commandNames[i]) {
+      type = (RecordedCommandType)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Nine significant digits bring a float back exactly, seventeen a double
+static void writeFloats(std::ostream &file, const float *values, int count) {
+  char text[32];
+  for (int i = 0; i < count; i++) {
+    snprintf(text, sizeof(text), " %.9g", values[i]);
+    file << text;
+  }
+}
+
+static void writeFloat3(std::ostream &file, Float3 value) {
+  float values[3] = {value.x, value.y, value.z};
+  writeFloats(file, values, 3);
+}
+
+static bool readFloat3(std::istream &fields, Float3 &value) {
+  return (bool)(fields >> value.x >> value.y >> value.z);
+}
+
+// Format, after the header line and a "scene <name>" line:
+//   frame <time> <frameInFlight> <position xyz> <forward xyz> <up xyz>
+//         <fov> <nearZ> <farZ> <viewportWidth> <viewportHeight>
+//   change transform <node> <16 floats, column by column>
+//   change setting <id> <value>
+//   command <type name> <index> <object> <value> <value> <value>
+// Changes and commands belong to the frame line above them.
+bool saveFrameCapture(const char *path, const FrameCapture &capture) {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file) {
+    std::cerr << "FrameCapture: can't write " << path << std::endl;
+    return false;
+  }
+  file << captureHeader << "\n";
+  file << "scene " << capture.scene << "\n";
+  for (const CapturedFrame &frame : capture.frames) {
+    char time[32];
+    snprintf(time, sizeof(time), "%.17g", frame.time);
+    const FrameCamera &camera = frame.camera;
+    file << "frame " << time << " " << frame.frameInFlight;
+    writeFloat3(file, camera.position);
+    writeFloat3(file, camera.forward);
+    writeFloat3(file, camera.up);
+    float projection[5] = {camera.fov, camera.nearZ, camera.farZ,
+                           camera.viewportWidth, camera.viewportHeight};
+    writeFloats(file, projection, 5);
+    file << "\n";
+
+    for (const SceneChange &change : frame.changes) {
+      if (change.type == SceneChangeType::LocalTransform) {
+        float values[16];
+        memcpy(values, &change.transform, sizeof(values));
+        file << "change transform " << change.target;
+        writeFloats(file, values, 16);
+      } else {
+        file << "change setting " << change.target << " " << change.value;
+      }
+      file << "\n";
+    }
+    for (const CapturedCommand &command : frame.commands) {
+      file << "command " << commandNames[(size_t)command.type] << " "
+           << command.index << " " << command.object << " "
+           << command.values[0] << " " << command.values[1] << " "
+           << command.values[2] << "\n";
+    }
+  }
+  if (!file) {
+    std::cerr << "FrameCapture: failed writing " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool loadFrameCapture(const char *path, FrameCapture &capture) {
+  capture = FrameCapture();
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "FrameCapture: can't read " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  if (!std::getline(file, line) || line != captureHeader) {
+    std::cerr << "FrameCapture: " << path << " isn't a version 1 capture"
+              << std::endl;
+    return false;
+  }
+  if (!std::getline(file, line) || line.compare(0, 6, "scene ") != 0) {
+    std::cerr << "FrameCapture: " << path << " has no scene line" << std::endl;
+    return false;
+  }
+  capture.scene = line.substr(6);
+
+  size_t lineNumber = 2;
+  while (std::getline(file, line)) {
+    lineNumber++;
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    bool valid = false;
+    if (kind == "frame") {
+      CapturedFrame frame;
+      FrameCamera &camera = frame.camera;
+      valid = fields >> frame.time >> frame.frameInFlight &&
+              readFloat3(fields, camera.position) &&
+              readFloat3(fields, camera.forward) &&
+              readFloat3(fields, camera.up) &&
+              fields >> camera.fov >> camera.nearZ >> camera.farZ >>
+                  camera.viewportWidth >> camera.viewportHeight;
+      capture.frames.push_back(std::move(frame));
+    } else if (kind == "change" && !capture.frames.empty()) {
+      SceneChange change;
+      std::string type;
+      fields >> type >> change.target;
+      if (type == "transform") {
+        change.type = SceneChangeType::LocalTransform;
+        float values[16];
+        for (float &value : values) {
+          fields >> value;
+        }
+        memcpy(&change.transform, values, sizeof(values));
+        valid = (bool)fields;
+      } else if (type == "setting") {
+        change.type = SceneChangeType::Setting;
+        valid = (bool)(fields >> change.value);
+      }
+      capture.frames.back().changes.push_back(change);
+    } else if (kind == "command" && !capture.frames.empty()) {
+      CapturedCommand command;
+      std::string name;
+      valid = fields >> name >> command.index >> command.object >>
+                  command.values[0] >> command.values[1] >>
+                  command.values[2] &&
+              parseCommandType(name, command.type);
+      capture.frames.back().commands.push_back(command);
+    }
+    if (!valid) {
+      std::cerr << "FrameCapture: " << path << ":" << lineNumber
+                << " can't be read: " << line << std::endl;
+      capture = FrameCapture();
+      return false;
+    }
+  }
+  return true;
+}
+
+CommandStreamDiff
+diffCommandStreams(const std::vector<CapturedCommand> &expected,
+                   const std::vector<CapturedCommand> &actual) {
+  CommandStreamDiff diff;
+  diff.expectedCount = expected.size();
+  diff.actualCount = actual.size();
+  size_t common = std::min(expected.size(), actual.size());
+  size_t i = 0;
+  while (i < common && expected[i] == actual[i]) {
+    i++;
+  }
+  diff.firstMismatch = i;
+  diff.matches = i == expected.size() && i == actual.size();
+  return diff;
+}
+
+std::string describeCommand(const CapturedCommand &command) {
+  std::ostringstream text;
+  text << commandNames[(size_t)command.type] << " index " << command.index
+       << " object " << command.object << " values " << command.values[0]
+       << " " << command.values[1] << " " << command.values[2];
+  return text.str();
+}
+
+static void reportMismatch(uint32_t pass, size_t frameIndex,
+                           const CommandStreamDiff &diff,
+                           const std::vector<CapturedCommand> &expected,
+                           const std::vector<CapturedCommand> &actual) {
+  std::cerr << "Replay: frame " << frameIndex;
+  if (pass) {
+    std::cerr << " (pass " << pass + 1 << ")";
+  }
+  std::cerr << " differs at command " << diff.firstMismatch << " of "
+            << diff.expectedCount << " captured, " << diff.actualCount
+            << " replayed" << std::endl;
+  std::cerr << "  captured: "
+            << (diff.firstMismatch < expected.size()
+                    ? describeCommand(expected[diff.firstMismatch])
+                    : "end of stream")
+            << std::endl;
+  std::cerr << "  replayed: "
+            << (diff.firstMismatch < actual.size()
+                    ? describeCommand(actual[diff.firstMismatch])
+                    : "end of stream")
+            << std::endl;
+}
+
+ReplayReport replayFrameCapture(
+    const FrameCapture &capture,
+    const std::function<void(const CapturedFrame &, RenderCommandSink &)>
+        &frame,
+    const ReplayOptions &options) {
+  using Clock = std::chrono::steady_clock;
+  ReplayReport report;
+  FrameTimeHistory frameTimes(
+      std::max<uint32_t>(1, (uint32_t)capture.frames.size() * options.repeat));
+  CommandRecorder recorder;
+  CaptureHandles handles;
+  std::vector<CapturedCommand> commands;
+
+  for (uint32_t pass = 0; pass < options.repeat; pass++) {
+    handles.clear();
+    if (options.beginPass) {
+      options.beginPass();
+    }
+    for (size_t i = 0; i < capture.frames.size(); i++) {
+      const CapturedFrame &captured = capture.frames[i];
+      recorder.clear();
+      Clock::time_point start = Clock::now();
+      frame(captured, recorder);
+      double milliseconds =
+          std::chrono::duration<double, std::milli>(Clock::now() - start)
+              .count();
+      frameTimes.add(milliseconds);
+      report.totalMilliseconds += milliseconds;
+      report.frames++;
+
+      commands.clear();
+      captureCommands(recorder, handles, commands);
+      CommandStreamDiff diff = diffCommandStreams(captured.commands, commands);
+      if (!diff.matches) {
+        if (report.mismatchedFrames < options.maxReportedMismatches) {
+          reportMismatch(pass, i, diff, captured.commands, commands);
+        }
+        report.mismatchedFrames++;
+      }
+    }
+  }
+  report.frameTimes = frameTimes.summary();
+  return report;
+}
@@ -0,0 +1,176 @@
+#pragma once
+// Deterministic frame capture and replay.
+//
+// A capture holds, for every frame, what the frame was built from (the time
+// it was built for, the camera, and whatever changed in the scene since the
+// frame before) and the forward pass's command stream it produced. Replaying
+// feeds the inputs back through the frame code as fast as it will go, with a
+// CommandRecorder standing in for the GPU's encoder, and compares what gets
+// recorded against the captured streams. Any change that alters what is
+// drawn, or in what order, shows up as a diff, and the CPU time each frame
+// took is reported like the profiler's frame times.
+//
+// Commands bind objects by pointer, which differ from run to run. A capture
+// stores them as small ids instead, handed out in the order objects are
+// first seen, so two runs binding the same objects in the same order give
+// the same ids.
+#include "command_encoding.hpp"
+#include "engine_math.hpp"
+#include "profiler.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct FrameCamera {
+  Float3 position;
+  Float3 forward = {0, 0, -1};
+  Float3 up = {0, 1, 0};
+  // Vertical, in radians
+  float fov = 1.5707964f;
+  float nearZ = 0.1f;
+  float farZ = 100.0f;
+  // In pixels
+  float viewportWidth = 1.0f;
+  float viewportHeight = 1.0f;
+
+  float aspectRatio() const { return viewportWidth / viewportHeight; }
+};
+
+enum class SceneChangeType : uint8_t {
+  // A scene graph node's local transform
+  LocalTransform,
+  // A setting switched on or off, e.g. by a key press
+  Setting,
+};
+
+struct SceneChange {
+  SceneChangeType type = SceneChangeType::Setting;
+  // The scene node, or the id the frame code gives the setting
+  uint32_t target = 0;
+  uint32_t value = 0;
+  Float4x4 transform = makeIdentity();
+};
+
+// A RecordedCommand with its object replaced by a capture id, 0 for null
+struct CapturedCommand {
+  RecordedCommandType type = RecordedCommandType::SetRenderPipelineState;
+  uint32_t index = 0;
+  uint32_t object = 0;
+  uint64_t values[3] = {};
+
+  bool operator==(const CapturedCommand &other) const = default;
+};
+
+struct CapturedFrame {
+  // Seconds, whatever the frame animates by
+  double time = 0.0;
+  // Which of the frames in flight the frame was, for frame code whose
+  // buffer offsets depend on it
+  uint32_t frameInFlight = 0;
+  FrameCamera camera;
+  // Applied in order before the frame is built
+  std::vector<SceneChange> changes;
+  std::vector<CapturedCommand> commands;
+};
+
+struct FrameCapture {
+  // What produced the capture. Only the same frame code can replay it.
+  std::string scene;
+  std::vector<CapturedFrame> frames;
+};
+
+// Hands out capture ids for objects, in the order they're first seen
+class CaptureHandles {
+public:
+  // 0 for null
+  uint32_t id(const void *object);
+  void clear() { ids.clear(); }
+
+private:
+  std::unordered_map<const void *, uint32_t> ids;
+};
+
+// Appends `recorder`'s commands to `commands`, objects turned into ids
+void captureCommands(const CommandRecorder &recorder, CaptureHandles &handles,
+                     std::vector<CapturedCommand> &commands);
+
+// Collects the next few frames of a running renderer into a FrameCapture.
+// Changes may be added at any time, and go to the next frame begun.
+class FrameCapturer {
+public:
+  // Starts capturing the next `frameCount` frames, dropping what was
+  // captured before
+  void start(const std::string &scene, uint32_t frameCount);
+  bool active() const { return framesLeft > 0; }
+
+  void addChange(const SceneChange &change);
+  void beginFrame(double time, uint32_t frameInFlight,
+                  const FrameCamera &camera);
+  // Ends the frame begun last with the commands it produced. Returns true
+  // when that was the last frame, and capture() is complete.
+  bool endFrame(const CommandRecorder &recorder);
+
+  const FrameCapture &capture() const { return current; }
+
+private:
+  FrameCapture current;
+  CaptureHandles handles;
+  std::vector<SceneChange> pendingChanges;
+  uint32_t framesLeft = 0;
+  bool frameBegun = false;
+};
+
+// Text, one line per frame, change and command. Both return false, and say
+// why on std::cerr, on failure.
+bool saveFrameCapture(const char *path, const FrameCapture &capture);
+bool loadFrameCapture(const char *path, FrameCapture &capture);
+
+struct CommandStreamDiff {
+  bool matches = true;
+  // Index of the first command that differs. When one stream is a prefix of
+  // the other, the shorter one's length.
+  size_t firstMismatch = 0;
+  size_t expectedCount = 0;
+  size_t actualCount = 0;
+};
+
+CommandStreamDiff
+diffCommandStreams(const std::vector<CapturedCommand> &expected,
+                   const std::vector<CapturedCommand> &actual);
+
+// e.g. "SetVertexBuffer index 1 object 3 values 256 0 0"
+std::string describeCommand(const CapturedCommand &command);
+
+struct ReplayOptions {
+  // Passes over the whole capture, every one of them diffed
+  uint32_t repeat = 1;
+  // Mismatched frames described on std::cerr, the rest are only counted
+  uint32_t maxReportedMismatches = 8;
+  // Called before every pass, untimed, to put the frame code back in the
+  // state the capture started from
+  std::function<void()> beginPass;
+};
+
+struct ReplayReport {
+  // Over every pass
+  uint32_t frames = 0;
+  uint32_t mismatchedFrames = 0;
+  // Milliseconds of CPU time per frame
+  FrameTimeSummary frameTimes;
+  double totalMilliseconds = 0.0;
+
+  bool matches() const { return mismatchedFrames == 0; }
+};
+
+// Calls `frame` for every captured frame in order, as fast as it returns,
+// and diffs what it encodes into the sink against the frame's commands.
+// Only the call itself is timed. Capture ids start over with every pass.
+ReplayReport replayFrameCapture(
+    const FrameCapture &capture,
+    const std::function<void(const CapturedFrame &, RenderCommandSink &)>
+        &frame,
+    const ReplayOptions &options = {});
@@ -0,0 +1,215 @@
+#include "frame_readback.hpp"
+#include "image_encode.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+ReadbackQueue::ReadbackQueue(std::vector<uint8_t *> slotMemory)
+    : slots(std::move(slotMemory)) {
+  assert(!slots.empty() && "A readback queue needs at least one slot");
+  // Handed out lowest first
+  for (uint32_t slot = slotCount(); slot > 0; slot--) {
+    freeSlots.push_back(slot - 1);
+  }
+}
+
+uint32_t ReadbackQueue::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  counters.acquired++;
+  if (freeSlots.empty()) {
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    slotFreed.wait(lock, [this]() { return !freeSlots.empty(); });
+    counters.stalls++;
+    counters.stallMilliseconds +=
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count();
+  }
+  uint32_t slot = freeSlots.back();
+  freeSlots.pop_back();
+  return slot;
+}
+
+void ReadbackQueue::complete(uint32_t slot, uint64_t frame, uint32_t width,
+                             uint32_t height, uint32_t bytesPerRow) {
+  ReadbackFrame completedFrame;
+  completedFrame.frame = frame;
+  completedFrame.slot = slot;
+  completedFrame.width = width;
+  completedFrame.height = height;
+  completedFrame.bytesPerRow = bytesPerRow;
+  completedFrame.pixels = slots[slot];
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    completed.push_back(completedFrame);
+  }
+  frameCompleted.notify_one();
+}
+
+void ReadbackQueue::close() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+  }
+  frameCompleted.notify_all();
+}
+
+bool ReadbackQueue::next(ReadbackFrame &frame) {
+  std::unique_lock<std::mutex> lock(mutex);
+  frameCompleted.wait(lock, [this]() { return closed || !completed.empty(); });
+  if (completed.empty()) {
+    return false;
+  }
+  frame = completed.front();
+  completed.pop_front();
+  return true;
+}
+
+void ReadbackQueue::release(uint32_t slot) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    freeSlots.push_back(slot);
+  }
+  slotFreed.notify_one();
+}
+
+ReadbackStats ReadbackQueue::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+FrameWriter::FrameWriter(ReadbackQueue &queue, FrameWriterOptions options)
+    : queue(queue), options(std::move(options)) {
+  std::error_code error;
+  std::filesystem::create_directories(this->options.directory, error);
+  if (error) {
+    std::cerr << "FrameWriter: can't create " << this->options.directory
+              << ": " << error.message() << std::endl;
+    counters.failed = true;
+  }
+
+  if (this->options.format == FrameFileFormat::Raw) {
+    workers.emplace_back([this]() { writeRaw(); });
+    return;
+  }
+  uint32_t threadCount = this->options.threads;
+  if (threadCount == 0) {
+    uint32_t hardwareThreads = std::thread::hardware_concurrency();
+    threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+  }
+  for (uint32_t i = 0; i < threadCount; i++) {
+    workers.emplace_back([this]() { writePngs(); });
+  }
+}
+
+FrameWriter::~FrameWriter() { finish(); }
+
+void FrameWriter::finish() {
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+}
+
+FrameWriterStats FrameWriter::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return counters;
+}
+
+std::string FrameWriter::framePath(const std::string &directory,
+                                   FrameFileFormat format, uint64_t frame) {
+  if (format == FrameFileFormat::Raw) {
+    return directory + "/frames.bgra";
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "frame_%06llu.png", (unsigned long long)frame);
+  return directory + "/" + name;
+}
+
+void FrameWriter::addWritten(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.frames++;
+  counters.bytes += bytes;
+}
+
+void FrameWriter::fail() {
+  std::lock_guard<std::mutex> lock(mutex);
+  counters.failed = true;
+}
+
+void FrameWriter::writePngs() {
+  std::vector<uint8_t> pixels;
+  ReadbackFrame frame;
+  while (queue.next(frame)) {
+    // Once one file has failed, the rest are only taken off the queue, so
+    // the renderer doesn't stall on it and the error isn't repeated for
+    // every frame
+    if (stats().failed) {
+      queue.release(frame.slot);
+      continue;
+    }
+    // Copied out first, so the slot goes back to the renderer after a
+    // memcpy rather than after the encode
+    size_t rowSize = (size_t)frame.width * 4;
+    pixels.resize(rowSize * frame.height);
+    for (uint32_t y = 0; y < frame.height; y++) {
+      memcpy(pixels.data() + rowSize * y,
+             frame.pixels + (size_t)frame.bytesPerRow * y, rowSize);
+    }
+    queue.release(frame.slot);
+
+    std::vector<uint8_t> png =
+        encodePng(pixels.data(), frame.width, frame.height,
+                  (uint32_t)rowSize, PixelOrder::Bgra);
+    std::string path =
+        framePath(options.directory, FrameFileFormat::Png, frame.frame);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write((const char *)png.data(), (std::streamsize)png.size());
+    if (!file) {
+      std::cerr << "FrameWriter: failed writing " << path << std::endl;
+      fail();
+      continue;
+    }
+    addWritten(png.size());
+  }
+}
+
+void FrameWriter::writeRaw() {
+  std::string path = framePath(options.directory, FrameFileFormat::Raw, 0);
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cerr << "FrameWriter: can't write " << path << std::endl;
+    fail();
+  }
+  // Written straight from the slot. The queue hands frames out in the order
+  // they completed, which with one thread is the order they're written in.
+  ReadbackFrame frame;
+  while (queue.next(frame)) {
+    size_t rowSize = (size_t)frame.width * 4;
+    if (file && !stats().failed) {
+      if (frame.bytesPerRow == rowSize) {
+        file.write((const char *)frame.pixels,
+                   (std::streamsize)(rowSize * frame.height));
+      } else {
+        for (uint32_t y = 0; y < frame.height; y++) {
+          file.write((const char *)frame.pixels +
+                         (size_t)frame.bytesPerRow * y,
+                     (std::streamsize)rowSize);
+        }
+      }
+      if (file) {
+        addWritten(rowSize * frame.height);
+      } else {
+        std::cerr << "FrameWriter: failed writing " << path << std::endl;
+        fail();
+      }
+    }
+    // Frames that can't be written are still taken, as with PNGs
+    queue.release(frame.slot);
+  }
+}
@@ -0,0 +1,142 @@
+#pragma once
+// Reading rendered frames back from the GPU and writing them to files.
+//
+// An offscreen renderer copies every frame into one of a few readback
+// buffers, three by default, and carries on with the next frame while the
+// copy runs. ReadbackQueue hands out those buffers (slots): the renderer
+// acquires a free one before encoding the copy, the copy's completion
+// handler marks it complete, and writer threads take complete frames in
+// order, save them, and release their slot for reuse. The renderer only
+// ever waits when every slot is still being copied into or saved, which is
+// how far ahead of the disk it may run.
+//
+// Nothing in here touches Metal. Slots are plain memory, the contents of
+// shared MTL::Buffers in the engine, or of vectors filled by a stand-in for
+// the GPU in offscreen_stub.
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A frame copied into a slot, 8-bit BGRA, rows top to bottom
+struct ReadbackFrame {
+  uint64_t frame = 0;
+  uint32_t slot = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t bytesPerRow = 0;
+  const uint8_t *pixels = nullptr;
+};
+
+// Rows of BGRA readback buffers are padded to 256 bytes, which blits copy
+// into fastest
+inline uint32_t readbackBytesPerRow(uint32_t width) {
+  return (width * 4 + 255) & ~255u;
+}
+
+struct ReadbackStats {
+  uint64_t acquired = 0;
+  // Acquires that had to wait for a slot, and how long they waited in all
+  uint64_t stalls = 0;
+  double stallMilliseconds = 0.0;
+};
+
+class ReadbackQueue {
+public:
+  // The memory of each slot, which stays the caller's and must hold a whole
+  // frame
+  explicit ReadbackQueue(std::vector<uint8_t *> slotMemory);
+
+  ReadbackQueue(const ReadbackQueue &) = delete;
+  ReadbackQueue &operator=(const ReadbackQueue &) = delete;
+
+  uint32_t slotCount() const { return (uint32_t)slots.size(); }
+  uint8_t *slotMemory(uint32_t slot) const { return slots[slot]; }
+
+  // Renderer side. Waits until a slot is free and returns it, to copy the
+  // next frame into.
+  uint32_t acquire();
+  // The copy into `slot` is done, e.g. from a command buffer's completion
+  // handler. Frames are taken in the order they complete.
+  void complete(uint32_t slot, uint64_t frame, uint32_t width,
+                uint32_t height, uint32_t bytesPerRow);
+  // No more frames will complete. Writers finish the ones already queued.
+  void close();
+
+  // Writer side. Waits for the next complete frame, false once the queue is
+  // closed and empty.
+  bool next(ReadbackFrame &frame);
+  // Done with the frame in `slot`, which can be copied into again
+  void release(uint32_t slot);
+
+  ReadbackStats stats() const;
+
+private:
+  std::vector<uint8_t *> slots;
+  std::vector<uint32_t> freeSlots;
+  std::deque<ReadbackFrame> completed;
+  mutable std::mutex mutex;
+  std::condition_variable slotFreed;
+  std::condition_variable frameCompleted;
+  ReadbackStats counters;
+  bool closed = false;
+};
+
+enum class FrameFileFormat : uint8_t {
+  // frame_000000.png, frame_000001.png, ... one file per frame
+  Png,
+  // frames.bgra, every frame's rows packed one after the other, as ffmpeg
+  // reads with -f rawvideo -pix_fmt bgra
+  Raw,
+};
+
+struct FrameWriterOptions {
+  std::string directory = "frames";
+  FrameFileFormat format = FrameFileFormat::Png;
+  // Threads encoding PNGs, 0 for one per hardware thread minus one. Raw
+  // frames all go to one file, in order, from a single thread.
+  uint32_t threads = 0;
+};
+
+struct FrameWriterStats {
+  uint64_t frames = 0;
+  // Written to disk
+  uint64_t bytes = 0;
+  // A file couldn't be written, said why on std::cerr
+  bool failed = false;
+};
+
+// Saves every frame a ReadbackQueue completes, from threads of its own,
+// until the queue is closed
+class FrameWriter {
+public:
+  FrameWriter(ReadbackQueue &queue, FrameWriterOptions options = {});
+  // Finishes
+  ~FrameWriter();
+
+  FrameWriter(const FrameWriter &) = delete;
+  FrameWriter &operator=(const FrameWriter &) = delete;
+
+  // Waits until the closed queue's frames are all written
+  void finish();
+  FrameWriterStats stats() const;
+
+  static std::string framePath(const std::string &directory,
+                               FrameFileFormat format, uint64_t frame);
+
+private:
+  void writePngs();
+  void writeRaw();
+  void addWritten(uint64_t bytes);
+  void fail();
+
+  ReadbackQueue &queue;
+  FrameWriterOptions options;
+  std::vector<std::thread> workers;
+  mutable std::mutex mutex;
+  FrameWriterStats counters;
+};
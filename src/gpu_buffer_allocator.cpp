@@ -0,0 +1,94 @@
+#include "gpu_buffer_allocator.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+GpuBufferAllocator::GpuBufferAllocator(MTL::Device *device,
+                                       NS::UInteger pageSize,
+                                       MTL::ResourceOptions options)
+    : device(device), pageSize(pageSize), options(options) {}
+
+GpuBufferAllocator::~GpuBufferAllocator() {
+  for (Page &page : pages) {
+    page.buffer->release();
+  }
+}
+
+GpuBufferAllocator::Page &GpuBufferAllocator::addPage(NS::UInteger size) {
+  MTL::Buffer *buffer = device->newBuffer(size, options);
+  if (!buffer) {
+    std::cerr << "ERROR: failed to create buffer page of " << size
+              << " bytes" << std::endl;
+    std::exit(-1);
+  }
+  buffer->setLabel(
+      NS::String::string("Sub-allocated buffer page", NS::ASCIIStringEncoding));
+  pages.push_back({buffer, TlsfAllocator(size)});
+  return pages.back();
+}
+
+BufferSlice GpuBufferAllocator::allocate(NS::UInteger size,
+                                         NS::UInteger alignment) {
+  // Try the existing pages first, newest last so the long lived, early
+  // allocations stay packed together
+  for (uint32_t i = 0; i < pages.size(); i++) {
+    TlsfAllocator::Allocation allocation =
+        pages[i].allocator.allocate(size, alignment);
+    if (allocation.valid()) {
+      return {pages[i].buffer, (NS::UInteger)allocation.offset, size, i,
+              allocation.id};
+    }
+  }
+
+  // Room for the allocation at any alignment, after the allocator rounds
+  // the size up to its granularity. The search for a request this close to
+  // the page's size ends in the allocator's exact class fallback, which
+  // finds the page's single free block.
+  NS::UInteger newPageSize = std::max(
+      pageSize,
+      (NS::UInteger)(size + alignment + TlsfAllocator::granularity));
+  Page &page = addPage(newPageSize);
+  TlsfAllocator::Allocation allocation = page.allocator.allocate(size, alignment);
+  if (!allocation.valid()) {
+    std::cerr << "ERROR: failed to allocate " << size << " bytes from a new "
+              << newPageSize << " byte buffer page" << std::endl;
+    std::exit(-1);
+  }
+  return {page.buffer, (NS::UInteger)allocation.offset, size,
+          (uint32_t)pages.size() - 1, allocation.id};
+}
+
+BufferSlice GpuBufferAllocator::allocate(const void *data, NS::UInteger size,
+                                         NS::UInteger alignment) {
+  BufferSlice slice = allocate(size, alignment);
+  memcpy(slice.contents(), data, size);
+  return slice;
+}
+
+void GpuBufferAllocator::release(BufferSlice &slice) {
+  if (!slice.valid()) {
+    return;
+  }
+  pages[slice.page].allocator.release(slice.allocationId);
+  slice = {};
+}
+
+TlsfAllocator::Stats GpuBufferAllocator::stats() const {
+  TlsfAllocator::Stats total;
+  for (const Page &page : pages) {
+    TlsfAllocator::Stats stats = page.allocator.stats();
+    total.capacity += stats.capacity;
+    total.usedBytes += stats.usedBytes;
+    total.freeBytes += stats.freeBytes;
+    total.largestFreeBlock =
+        std::max(total.largestFreeBlock, stats.largestFreeBlock);
+    total.allocationCount += stats.allocationCount;
+    total.freeBlockCount += stats.freeBlockCount;
+  }
+  if (total.freeBytes > 0) {
+    total.fragmentation =
+        1.0f - (float)((double)total.largestFreeBlock / total.freeBytes);
+  }
+  return total;
+}
@@ -0,0 +1,62 @@
+#pragma once
+// Sub-allocates vertex, index and uniform ranges out of a few large
+// MTL::Buffers instead of creating one buffer (one kernel allocation and one
+// residency entry) per mesh or uniform block. Offsets inside every page are
+// managed by a TlsfAllocator.
+#include "tlsf_allocator.hpp"
+#include <Metal/Metal.hpp>
+
+#include <vector>
+
+struct BufferSlice {
+  MTL::Buffer *buffer = nullptr;
+  NS::UInteger offset = 0;
+  NS::UInteger size = 0;
+  uint32_t page = 0;
+  uint32_t allocationId = TlsfAllocator::invalidId;
+
+  bool valid() const { return buffer != nullptr; }
+  // CPU pointer to the start of the slice (shared storage only)
+  void *contents() const {
+    return static_cast<char *>(buffer->contents()) + offset;
+  }
+};
+
+class GpuBufferAllocator {
+public:
+  // Offsets used with setVertexBuffer/setFragmentBuffer for `constant`
+  // buffers must be 256 byte aligned on macOS GPUs
+  static constexpr NS::UInteger uniformAlignment = 256;
+  static constexpr NS::UInteger vertexAlignment = 16;
+
+  GpuBufferAllocator(MTL::Device *device,
+                     NS::UInteger pageSize = 16 * 1024 * 1024,
+                     MTL::ResourceOptions options =
+                         MTL::ResourceStorageModeShared);
+  ~GpuBufferAllocator();
+
+  // Allocations that don't fit in a page get a dedicated page of their own
+  BufferSlice allocate(NS::UInteger size,
+                       NS::UInteger alignment = vertexAlignment);
+  // Allocates and copies `size` bytes of `data` into the slice
+  BufferSlice allocate(const void *data, NS::UInteger size,
+                       NS::UInteger alignment = vertexAlignment);
+  void release(BufferSlice &slice);
+
+  // Combined statistics over every page
+  TlsfAllocator::Stats stats() const;
+  size_t pageCount() const { return pages.size(); }
+
+private:
+  struct Page {
+    MTL::Buffer *buffer;
+    TlsfAllocator allocator;
+  };
+
+  Page &addPage(NS::UInteger size);
+
+  MTL::Device *device;
+  NS::UInteger pageSize;
+  MTL::ResourceOptions options;
+  std::vector<Page> pages;
+};
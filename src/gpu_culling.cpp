@@ -0,0 +1,178 @@
+#include "gpu_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+CullUniforms makeCullUniforms(const Frustum &frustum, Float3 cameraPosition,
+                              const CullLod *lods, uint32_t lodCount,
+                              uint32_t objectCount, uint32_t instanceCapacity) {
+  CullUniforms uniforms = {};
+  for (int i = 0; i < 6; i++) {
+    const Plane &plane = frustum.planes[i];
+    uniforms.planes[i][0] = plane.normal.x;
+    uniforms.planes[i][1] = plane.normal.y;
+    uniforms.planes[i][2] = plane.normal.z;
+    uniforms.planes[i][3] = plane.d;
+  }
+  uniforms.cameraPosition[0] = cameraPosition.x;
+  uniforms.cameraPosition[1] = cameraPosition.y;
+  uniforms.cameraPosition[2] = cameraPosition.z;
+  uniforms.cameraPosition[3] = 1.0f;
+  uniforms.lodCount = std::min<uint32_t>(lodCount, CullMaxLods);
+  for (uint32_t lod = 0; lod < uniforms.lodCount; lod++) {
+    uniforms.lodDistanceSquared[lod] = lods[lod].maxDistance * lods[lod].maxDistance;
+  }
+  uniforms.objectCount = std::min(objectCount, instanceCapacity);
+  uniforms.instanceCapacity = instanceCapacity;
+  return uniforms;
+}
+
+void resetCullArguments(IndirectDrawArguments *arguments, const CullLod *lods,
+                        uint32_t lodCount, uint32_t instanceCapacity) {
+  lodCount = std::min<uint32_t>(lodCount, CullMaxLods);
+  for (uint32_t lod = 0; lod < lodCount; lod++) {
+    arguments[lod].vertexCount = lods[lod].vertexCount;
+    arguments[lod].instanceCount = 0;
+    arguments[lod].vertexStart = lods[lod].vertexStart;
+    arguments[lod].baseInstance = lod * instanceCapacity;
+  }
+}
+
+// Keep in step with cullInstances in shaders/culling.metal
+uint32_t cullObject(const CullUniforms &uniforms, const CullObject &object) {
+  float x = object.center[0];
+  float y = object.center[1];
+  float z = object.center[2];
+  for (int i = 0; i < 6; i++) {
+    const float *plane = uniforms.planes[i];
+    float distance =
+        std::fma(plane[0], x, std::fma(plane[1], y, std::fma(plane[2], z, plane[3])));
+    if (distance < -object.radius) {
+      return 0;
+    }
+  }
+
+  float dx = x - uniforms.cameraPosition[0];
+  float dy = y - uniforms.cameraPosition[1];
+  float dz = z - uniforms.cameraPosition[2];
+  float distanceSquared = std::fma(dx, dx, std::fma(dy, dy, dz * dz));
+  for (uint32_t lod = 0; lod < uniforms.lodCount; lod++) {
+    if (distanceSquared < uniforms.lodDistanceSquared[lod]) {
+      return lod + 1;
+    }
+  }
+  return 0;
+}
+
+static Float4x4 modelMatrix(const CullObject &object) {
+  Float4x4 model;
+  memcpy(&model, object.model, sizeof(model));
+  return model;
+}
+
+void cullObjectsReference(const CullUniforms &uniforms,
+                          const CullObject *objects,
+                          IndirectDrawArguments *arguments,
+                          Float4x4 *instances, uint32_t *visibility) {
+  for (uint32_t i = 0; i < uniforms.objectCount; i++) {
+    uint32_t result = cullObject(uniforms, objects[i]);
+    visibility[i] = result;
+    if (result == 0) {
+      continue;
+    }
+    uint32_t lod = result - 1;
+    uint32_t slot = arguments[lod].instanceCount++;
+    instances[lod * uniforms.instanceCapacity + slot] = modelMatrix(objects[i]);
+  }
+}
+
+// Orders matrices bytewise, so instance lists can be compared as sets
+static bool matrixLess(const Float4x4 &a, const Float4x4 &b) {
+  return memcmp(&a, &b, sizeof(Float4x4)) < 0;
+}
+
+bool validateCullOutput(const CullUniforms &uniforms, const CullObject *objects,
+                        const IndirectDrawArguments *arguments,
+                        const Float4x4 *instances, const uint32_t *visibility) {
+  uint32_t objectCount = uniforms.objectCount;
+  uint32_t capacity = uniforms.instanceCapacity;
+  std::vector<IndirectDrawArguments> expectedArguments(
+      arguments, arguments + uniforms.lodCount);
+  for (IndirectDrawArguments &lodArguments : expectedArguments) {
+    lodArguments.instanceCount = 0;
+  }
+  std::vector<Float4x4> expectedInstances((size_t)uniforms.lodCount * capacity);
+  std::vector<uint32_t> expectedVisibility(objectCount);
+  cullObjectsReference(uniforms, objects, expectedArguments.data(),
+                       expectedInstances.data(), expectedVisibility.data());
+
+  for (uint32_t i = 0; i < objectCount; i++) {
+    if (visibility[i] != expectedVisibility[i]) {
+      std::cerr << "Culling mismatch: object " << i << " got " << visibility[i]
+                << ", expected " << expectedVisibility[i] << std::endl;
+      return false;
+    }
+  }
+  for (uint32_t lod = 0; lod < uniforms.lodCount; lod++) {
+    uint32_t count = arguments[lod].instanceCount;
+    if (count != expectedArguments[lod].instanceCount) {
+      std::cerr << "Culling mismatch: LOD " << lod << " has " << count
+                << " instances, expected "
+                << expectedArguments[lod].instanceCount << std::endl;
+      return false;
+    }
+    const Float4x4 *first = instances + (size_t)lod * capacity;
+    std::vector<Float4x4> actual(first, first + count);
+    std::vector<Float4x4> expected(expectedInstances.begin() + lod * capacity,
+                                   expectedInstances.begin() + lod * capacity +
+                                       count);
+    std::sort(actual.begin(), actual.end(), matrixLess);
+    std::sort(expected.begin(), expected.end(), matrixLess);
+    if (memcmp(actual.data(), expected.data(), count * sizeof(Float4x4)) != 0) {
+      std::cerr << "Culling mismatch: LOD " << lod
+                << " instance matrices differ" << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+CullFrameLayout makeCullFrameLayout(uint32_t objectCapacity) {
+  // Metal wants 256 byte aligned offsets for constant buffers, the rest just
+  // follow suit
+  constexpr size_t alignment = 256;
+  CullFrameLayout layout;
+  layout.uniformsOffset = 0;
+  layout.objectsOffset = alignUp(sizeof(CullUniforms), alignment);
+  layout.argumentsOffset = alignUp(
+      layout.objectsOffset + objectCapacity * sizeof(CullObject), alignment);
+  layout.instancesOffset =
+      alignUp(layout.argumentsOffset +
+                  CullMaxLods * sizeof(IndirectDrawArguments),
+              alignment);
+  layout.visibilityOffset = alignUp(
+      layout.instancesOffset +
+          (size_t)CullMaxLods * objectCapacity * sizeof(Float4x4),
+      alignment);
+  layout.lateArgumentsOffset = alignUp(
+      layout.visibilityOffset + objectCapacity * sizeof(uint32_t), alignment);
+  layout.lateInstancesOffset =
+      alignUp(layout.lateArgumentsOffset +
+                  CullMaxLods * sizeof(IndirectDrawArguments),
+              alignment);
+  layout.earlyHiZOffset = alignUp(
+      layout.lateInstancesOffset +
+          (size_t)CullMaxLods * objectCapacity * sizeof(Float4x4),
+      alignment);
+  layout.lateHiZOffset =
+      alignUp(layout.earlyHiZOffset + sizeof(HiZUniforms), alignment);
+  layout.size = alignUp(layout.lateHiZOffset + sizeof(HiZUniforms), alignment);
+  return layout;
+}
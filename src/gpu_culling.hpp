@@ -0,0 +1,74 @@
+#pragma once
+// GPU driven culling and LOD selection.
+//
+// Every instance of a mesh is tested against the view frustum and given a
+// LOD by a compute kernel (shaders/culling.metal), which appends the model
+// matrices of the survivors to one instance list per LOD and bumps the
+// instance count of that LOD's indirect draw. The CPU then issues one
+// indirect draw per LOD, however many instances there are.
+//
+// cullObjectsReference is the kernel written in C++. It does the same float
+// operations in the same order, with explicit fused multiply-adds so neither
+// compiler can contract them differently, and is used to check the GPU's
+// output (and as the CPU baseline to measure it against). The only thing
+// that differs is the order of instances within a LOD, which on the GPU
+// depends on thread timing; validateCullOutput compares those as sets.
+#include "culling_data.hpp"
+#include "engine_math.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+struct CullLod {
+  uint32_t vertexStart = 0;
+  uint32_t vertexCount = 0;
+  // Used up to this distance from the camera
+  float maxDistance = 0.0f;
+};
+
+CullUniforms makeCullUniforms(const Frustum &frustum, Float3 cameraPosition,
+                              const CullLod *lods, uint32_t lodCount,
+                              uint32_t objectCount, uint32_t instanceCapacity);
+
+// Indirect arguments as they must be before the kernel runs: vertex ranges
+// and base instances filled in, instance counts zero
+void resetCullArguments(IndirectDrawArguments *arguments, const CullLod *lods,
+                        uint32_t lodCount, uint32_t instanceCapacity);
+
+// Returns 0 if the object is culled, otherwise its LOD + 1
+uint32_t cullObject(const CullUniforms &uniforms, const CullObject &object);
+
+// Runs the kernel over every object. `arguments` must have been reset,
+// `instances` holds lodCount * instanceCapacity matrices and `visibility`
+// one entry per object.
+void cullObjectsReference(const CullUniforms &uniforms,
+                          const CullObject *objects,
+                          IndirectDrawArguments *arguments,
+                          Float4x4 *instances, uint32_t *visibility);
+
+// Compares the kernel's output against the reference, reporting the first
+// mismatch on std::cerr
+bool validateCullOutput(const CullUniforms &uniforms, const CullObject *objects,
+                        const IndirectDrawArguments *arguments,
+                        const Float4x4 *instances, const uint32_t *visibility);
+
+// Offsets of one frame's culling data inside a buffer, each aligned for
+// binding as a Metal buffer
+struct CullFrameLayout {
+  size_t uniformsOffset;
+  size_t objectsOffset;
+  size_t argumentsOffset;
+  size_t instancesOffset;
+  size_t visibilityOffset;
+  // Hi-Z occlusion culling's late pass draws from its own arguments and
+  // instances, laid out like the early ones
+  size_t lateArgumentsOffset;
+  size_t lateInstancesOffset;
+  // HiZUniforms of the early pass, against last frame's pyramid, and of the
+  // late pass, against this frame's
+  size_t earlyHiZOffset;
+  size_t lateHiZOffset;
+  size_t size;
+};
+
+CullFrameLayout makeCullFrameLayout(uint32_t objectCapacity);
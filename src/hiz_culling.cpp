@@ -0,0 +1,191 @@
+#include "hiz_culling.hpp"
+#include "gpu_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+uint32_t hizMipCount(uint32_t width, uint32_t height) {
+  uint32_t size = std::max(width, height);
+  uint32_t count = 1;
+  while (size > 1) {
+    size >>= 1;
+    count++;
+  }
+  return count;
+}
+
+// Keep in step with downsampleHiZ in shaders/culling.metal
+void downsampleHiZ(const float *source, uint32_t sourceWidth,
+                   uint32_t sourceHeight, float *destination) {
+  uint32_t width = hizMipSize(sourceWidth, 1);
+  uint32_t height = hizMipSize(sourceHeight, 1);
+  for (uint32_t y = 0; y < height; y++) {
+    uint32_t lastY = y == height - 1 ? sourceHeight - 1 : 2 * y + 1;
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t lastX = x == width - 1 ? sourceWidth - 1 : 2 * x + 1;
+      float farthest = 0.0f;
+      for (uint32_t sy = 2 * y; sy <= lastY; sy++) {
+        for (uint32_t sx = 2 * x; sx <= lastX; sx++) {
+          farthest = std::max(farthest, source[(size_t)sy * sourceWidth + sx]);
+        }
+      }
+      destination[(size_t)y * width + x] = farthest;
+    }
+  }
+}
+
+HiZPyramid buildHiZPyramid(const float *depth, uint32_t width,
+                           uint32_t height) {
+  HiZPyramid pyramid;
+  pyramid.width = width;
+  pyramid.height = height;
+  uint32_t mipCount = hizMipCount(width, height);
+  pyramid.levels.resize(mipCount);
+  pyramid.levels[0].assign(depth, depth + (size_t)width * height);
+  for (uint32_t level = 1; level < mipCount; level++) {
+    pyramid.levels[level].resize((size_t)hizMipSize(width, level) *
+                                 hizMipSize(height, level));
+    downsampleHiZ(pyramid.levels[level - 1].data(),
+                  hizMipSize(width, level - 1), hizMipSize(height, level - 1),
+                  pyramid.levels[level].data());
+  }
+  return pyramid;
+}
+
+HiZUniforms makeHiZUniforms(const Float4x4 &viewProjection, uint32_t width,
+                            uint32_t height, bool enabled) {
+  HiZUniforms uniforms = {};
+  memcpy(uniforms.viewProjection, &viewProjection,
+         sizeof(uniforms.viewProjection));
+  uniforms.width = width;
+  uniforms.height = height;
+  uniforms.mipCount = hizMipCount(width, height);
+  uniforms.enabled = enabled && width && height;
+  return uniforms;
+}
+
+// Texel of a mip holding mip 0's texel `x`. The last texel of an odd sized
+// mip also covers the leftover one.
+static uint32_t hizMipTexel(uint32_t x, uint32_t level, uint32_t size) {
+  return std::min(x >> level, hizMipSize(size, level) - 1);
+}
+
+// Mip 0 texel holding a screen coordinate, in texels
+static uint32_t hizTexel(float coordinate, uint32_t size) {
+  return (uint32_t)std::clamp(std::floor(coordinate), 0.0f, size - 1.0f);
+}
+
+// Keep in step with hizOccluded in shaders/culling.metal. The GPU's
+// division may round differently, which only moves a box that lies exactly
+// on a texel edge by one texel.
+bool hizOccluded(const HiZUniforms &uniforms, const HiZPyramid &pyramid,
+                 const CullObject &object) {
+  if (!uniforms.enabled) {
+    return false;
+  }
+  const float *m = uniforms.viewProjection;
+  float minX = INFINITY, minY = INFINITY;
+  float maxX = -INFINITY, maxY = -INFINITY;
+  float nearest = INFINITY;
+  float radius = object.radius;
+  for (int corner = 0; corner < 8; corner++) {
+    float x = object.center[0] + (corner & 1 ? radius : -radius);
+    float y = object.center[1] + (corner & 2 ? radius : -radius);
+    float z = object.center[2] + (corner & 4 ? radius : -radius);
+    float clipX =
+        std::fma(m[0], x, std::fma(m[4], y, std::fma(m[8], z, m[12])));
+    float clipY =
+        std::fma(m[1], x, std::fma(m[5], y, std::fma(m[9], z, m[13])));
+    float clipZ =
+        std::fma(m[2], x, std::fma(m[6], y, std::fma(m[10], z, m[14])));
+    float clipW =
+        std::fma(m[3], x, std::fma(m[7], y, std::fma(m[11], z, m[15])));
+    // In front of the near plane, where the pyramid knows nothing
+    if (clipZ < 0.0f || clipW <= 0.0f) {
+      return false;
+    }
+    float inverseW = 1.0f / clipW;
+    minX = std::min(minX, clipX * inverseW);
+    maxX = std::max(maxX, clipX * inverseW);
+    minY = std::min(minY, clipY * inverseW);
+    maxY = std::max(maxY, clipY * inverseW);
+    nearest = std::min(nearest, clipZ * inverseW);
+  }
+
+  // Normalized device y points up, texel rows go down
+  uint32_t width = uniforms.width;
+  uint32_t height = uniforms.height;
+  uint32_t left = hizTexel(std::fma(minX, 0.5f, 0.5f) * width, width);
+  uint32_t right = hizTexel(std::fma(maxX, 0.5f, 0.5f) * width, width);
+  uint32_t top = hizTexel(std::fma(-maxY, 0.5f, 0.5f) * height, height);
+  uint32_t bottom = hizTexel(std::fma(-minY, 0.5f, 0.5f) * height, height);
+
+  // The first mip where the rectangle spans at most 2x2 texels
+  uint32_t level = 0;
+  for (; level + 1 < uniforms.mipCount; level++) {
+    uint32_t columns =
+        hizMipTexel(right, level, width) - hizMipTexel(left, level, width);
+    uint32_t rows =
+        hizMipTexel(bottom, level, height) - hizMipTexel(top, level, height);
+    if (columns <= 1 && rows <= 1) {
+      break;
+    }
+  }
+
+  float farthest = 0.0f;
+  for (uint32_t y = hizMipTexel(top, level, height);
+       y <= hizMipTexel(bottom, level, height); y++) {
+    for (uint32_t x = hizMipTexel(left, level, width);
+         x <= hizMipTexel(right, level, width); x++) {
+      farthest = std::max(farthest, pyramid.texel(level, x, y));
+    }
+  }
+  return nearest > farthest;
+}
+
+static void appendInstance(const CullUniforms &uniforms,
+                           const CullObject &object, uint32_t lod,
+                           IndirectDrawArguments *arguments,
+                           Float4x4 *instances) {
+  uint32_t slot = arguments[lod].instanceCount++;
+  memcpy(&instances[lod * uniforms.instanceCapacity + slot], object.model,
+         sizeof(Float4x4));
+}
+
+void cullObjectsEarlyReference(const CullUniforms &uniforms,
+                               const HiZUniforms &hizUniforms,
+                               const HiZPyramid &pyramid,
+                               const CullObject *objects,
+                               IndirectDrawArguments *arguments,
+                               Float4x4 *instances, uint32_t *visibility) {
+  for (uint32_t i = 0; i < uniforms.objectCount; i++) {
+    uint32_t result = cullObject(uniforms, objects[i]);
+    if (result && hizOccluded(hizUniforms, pyramid, objects[i])) {
+      visibility[i] = result | CullVisibilityOccluded;
+      continue;
+    }
+    visibility[i] = result;
+    if (result) {
+      appendInstance(uniforms, objects[i], result - 1, arguments, instances);
+    }
+  }
+}
+
+void cullObjectsLateReference(const CullUniforms &uniforms,
+                              const HiZUniforms &hizUniforms,
+                              const HiZPyramid &pyramid,
+                              const CullObject *objects,
+                              IndirectDrawArguments *lateArguments,
+                              Float4x4 *lateInstances, uint32_t *visibility) {
+  for (uint32_t i = 0; i < uniforms.objectCount; i++) {
+    if (!(visibility[i] & CullVisibilityOccluded) ||
+        hizOccluded(hizUniforms, pyramid, objects[i])) {
+      continue;
+    }
+    uint32_t result = visibility[i] & ~CullVisibilityOccluded;
+    visibility[i] = result;
+    appendInstance(uniforms, objects[i], result - 1, lateArguments,
+                   lateInstances);
+  }
+}
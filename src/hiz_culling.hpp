@@ -0,0 +1,89 @@
+#pragma once
+// Hierarchical-Z occlusion culling against the previous frame's depth.
+//
+// After the forward pass, its depth buffer is reduced into a mip pyramid
+// where every texel holds the farthest depth of the texels below it. An
+// object's bounding box, projected to the screen, is then hidden if its
+// nearest depth is behind the pyramid texels covering it, and a mip is
+// picked where that takes at most 2x2 texels, however big the box is.
+//
+// The culling kernel runs twice a frame (two-phase occlusion culling):
+//  - the early pass tests the objects against last frame's pyramid,
+//    reprojected with last frame's view-projection, and draws the ones it
+//    can't prove hidden. The rest are marked CullVisibilityOccluded.
+//  - the pyramid is rebuilt from what the early draws left in the depth
+//    buffer, and the late pass tests the marked objects against it with this
+//    frame's view-projection, drawing the ones that turn out to be visible.
+// Nothing visible this frame is ever missing, whatever the camera did: last
+// frame's depth only decides what can wait for the late pass.
+//
+// The test only ever errs towards visible: boxes reaching in front of the
+// near plane are always visible, and the covered texels are found by the
+// pixels the box's corners fall in, rounded outwards.
+//
+// buildHiZPyramid and hizOccluded are the pyramid kernels and the test in
+// shaders/culling.metal written in C++, for validation. They do the same
+// float operations in the same order, with explicit fused multiply-adds.
+#include "culling_data.hpp"
+#include "engine_math.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Mips of a full chain down to 1x1, counted the way Metal does
+uint32_t hizMipCount(uint32_t width, uint32_t height);
+
+// Width or height of a mip, given mip 0's
+inline uint32_t hizMipSize(uint32_t size, uint32_t level) {
+  uint32_t mipSize = size >> level;
+  return mipSize ? mipSize : 1;
+}
+
+struct HiZPyramid {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // Row major, hizMipSize(width, l) x hizMipSize(height, l) depths. Level 0
+  // is a copy of the depth buffer.
+  std::vector<std::vector<float>> levels;
+
+  float texel(uint32_t level, uint32_t x, uint32_t y) const {
+    return levels[level][(size_t)y * hizMipSize(width, level) + x];
+  }
+};
+
+// One step of the reduction, from a mip to the next. Every destination texel
+// keeps the farthest of its 2x2 source texels, and the last row and column
+// take in the extra source texel left over by an odd size.
+void downsampleHiZ(const float *source, uint32_t sourceWidth,
+                   uint32_t sourceHeight, float *destination);
+
+// `depth` is row major, 0 near and 1 far
+HiZPyramid buildHiZPyramid(const float *depth, uint32_t width,
+                           uint32_t height);
+
+HiZUniforms makeHiZUniforms(const Float4x4 &viewProjection, uint32_t width,
+                            uint32_t height, bool enabled);
+
+// True if the box around the object's bounding sphere is behind the
+// pyramid's depth wherever it covers the screen
+bool hizOccluded(const HiZUniforms &uniforms, const HiZPyramid &pyramid,
+                 const CullObject &object);
+
+// The early pass: cullObjectsReference plus the test against `pyramid`.
+// Objects it hides are marked occluded in `visibility` but not drawn.
+void cullObjectsEarlyReference(const CullUniforms &uniforms,
+                               const HiZUniforms &hizUniforms,
+                               const HiZPyramid &pyramid,
+                               const CullObject *objects,
+                               IndirectDrawArguments *arguments,
+                               Float4x4 *instances, uint32_t *visibility);
+
+// The late pass: tests the objects the early pass marked occluded again,
+// appending the ones now visible to `lateArguments` and `lateInstances` and
+// clearing their mark
+void cullObjectsLateReference(const CullUniforms &uniforms,
+                              const HiZUniforms &hizUniforms,
+                              const HiZPyramid &pyramid,
+                              const CullObject *objects,
+                              IndirectDrawArguments *lateArguments,
+                              Float4x4 *lateInstances, uint32_t *visibility);
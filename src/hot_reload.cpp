@@ -0,0 +1,103 @@
+#include "hot_reload.hpp"
+
+#include <chrono>
+#include <iostream>
+
+void RetireQueue::retire(std::function<void()> release) {
+  retired.push_back({frame, std::move(release)});
+}
+
+void RetireQueue::endFrame() {
+  frame++;
+  while (!retired.empty() && frame - retired.front().frame > framesToKeep) {
+    retired.front().release();
+    retired.pop_front();
+  }
+}
+
+void RetireQueue::flush() {
+  for (Retired &entry : retired) {
+    entry.release();
+  }
+  retired.clear();
+}
+
+HotReloader::HotReloader(FileWatcher &watcher, ThreadPool &pool)
+    : watcher(watcher), pool(pool) {}
+
+HotReloader::~HotReloader() {
+  for (Asset &asset : assets) {
+    if (asset.inFlight.valid()) {
+      asset.inFlight.wait();
+    }
+  }
+}
+
+bool HotReloader::add(const std::string &path, ReloadFunction reload) {
+  std::string file = watcher.watch(path);
+  if (file.empty()) {
+    return false;
+  }
+  Asset asset;
+  asset.path = file;
+  asset.reload = std::move(reload);
+  assets.push_back(std::move(asset));
+  return true;
+}
+
+void HotReloader::start(Asset &asset) {
+  std::cout << "Reloading " << asset.path << std::endl;
+  reloadStats.started++;
+  asset.inFlight = pool.submit(asset.reload);
+}
+
+uint32_t HotReloader::update(double now) {
+  for (const std::string &file : watcher.poll(now)) {
+    for (Asset &asset : assets) {
+      if (asset.path != file) {
+        continue;
+      }
+      if (asset.inFlight.valid()) {
+        asset.dirty = true;
+      } else {
+        start(asset);
+      }
+    }
+  }
+
+  uint32_t applied = 0;
+  for (Asset &asset : assets) {
+    if (!asset.inFlight.valid() ||
+        asset.inFlight.wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready) {
+      continue;
+    }
+    std::function<void()> swap = asset.inFlight.get();
+    if (asset.dirty) {
+      // What was just loaded is already out of date
+      asset.dirty = false;
+      reloadStats.superseded++;
+      start(asset);
+      continue;
+    }
+    if (!swap) {
+      std::cerr << "Reloading " << asset.path
+                << " failed, keeping the previous version" << std::endl;
+      reloadStats.failed++;
+      continue;
+    }
+    swap();
+    reloadStats.applied++;
+    applied++;
+  }
+  return applied;
+}
+
+bool HotReloader::busy() const {
+  for (const Asset &asset : assets) {
+    if (asset.inFlight.valid()) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,102 @@
+#pragma once
+// Hot reloading of shaders and assets.
+//
+// HotReloader ties a FileWatcher to reload functions. When a watched file
+// changes, its reload function runs on the thread pool (parsing, decoding,
+// compiling: all the slow parts) and hands back a small swap function. Swaps
+// are run by update(), which the engine calls between frames, so a frame
+// always sees either the old or the new asset and rendering never waits for
+// a reload.
+//
+// The asset being replaced may still be in use by frames queued on the GPU,
+// so swaps hand it to a RetireQueue instead of releasing it straight away.
+#include "file_watcher.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+// Releases resources a fixed number of frames after they were retired
+class RetireQueue {
+public:
+  explicit RetireQueue(uint32_t framesToKeep) : framesToKeep(framesToKeep) {}
+  // Releases everything still queued, the GPU must be idle by then
+  ~RetireQueue() { flush(); }
+
+  RetireQueue(const RetireQueue &) = delete;
+  RetireQueue &operator=(const RetireQueue &) = delete;
+
+  void retire(std::function<void()> release);
+  // Runs the releases retired framesToKeep frames ago
+  void endFrame();
+  void flush();
+  size_t pending() const { return retired.size(); }
+
+private:
+  struct Retired {
+    uint64_t frame;
+    std::function<void()> release;
+  };
+
+  uint32_t framesToKeep;
+  uint64_t frame = 0;
+  std::deque<Retired> retired;
+};
+
+struct HotReloadStats {
+  uint32_t started = 0;
+  uint32_t applied = 0;
+  uint32_t failed = 0;
+  // Reloads thrown away because the file changed again while they ran
+  uint32_t superseded = 0;
+};
+
+class HotReloader {
+public:
+  // Runs on a pool thread. Returns the function that swaps the reloaded
+  // asset in, or an empty function if the reload failed, in which case the
+  // old asset stays. A swap function may be dropped without running (the
+  // file changed again, or shutdown), so whatever it captures should free
+  // itself when destroyed.
+  using ReloadFunction = std::function<std::function<void()>()>;
+
+  explicit HotReloader(FileWatcher &watcher,
+                       ThreadPool &pool = ThreadPool::shared());
+  // Waits for reloads still running and drops their swaps
+  ~HotReloader();
+
+  HotReloader(const HotReloader &) = delete;
+  HotReloader &operator=(const HotReloader &) = delete;
+
+  // Several reload functions may watch the same file
+  bool add(const std::string &path, ReloadFunction reload);
+
+  // Call between frames. Starts reloads for files that changed and runs the
+  // swaps of those that finished, in the order they were added. Returns the
+  // number of swaps run.
+  uint32_t update(double now);
+  // True while any reload is running
+  bool busy() const;
+
+  const HotReloadStats &stats() const { return reloadStats; }
+
+private:
+  struct Asset {
+    std::string path;
+    ReloadFunction reload;
+    std::future<std::function<void()>> inFlight;
+    // Changed again while a reload was running
+    bool dirty = false;
+  };
+
+  void start(Asset &asset);
+
+  FileWatcher &watcher;
+  ThreadPool &pool;
+  std::vector<Asset> assets;
+  HotReloadStats reloadStats;
+};
@@ -0,0 +1,193 @@
+#include "image_decode.hpp"
+
+#include <stb/stb_image.h>
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Rows per parallelFor chunk, large enough that a chunk is a few hundred KB
+static constexpr size_t rowsPerChunk = 64;
+
+void expandRGBToRGBA(const uint8_t *src, uint8_t *dst, size_t pixelCount) {
+  size_t i = 0;
+#if defined(__ARM_NEON)
+  // De-interleave 16 pixels into R, G, B planes and re-interleave with alpha
+  uint8x16x4_t rgba;
+  rgba.val[3] = vdupq_n_u8(255);
+  for (; i + 16 <= pixelCount; i += 16) {
+    uint8x16x3_t rgb = vld3q_u8(src + i * 3);
+    rgba.val[0] = rgb.val[0];
+    rgba.val[1] = rgb.val[1];
+    rgba.val[2] = rgb.val[2];
+    vst4q_u8(dst + i * 4, rgba);
+  }
+#elif defined(__SSSE3__)
+  // Each 16 byte load holds 5 and a bit pixels, shuffle 4 of them into place
+  const __m128i shuffle =
+      _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  // Stop while there are still 16 readable bytes left for the load
+  for (; i + 6 <= pixelCount; i += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *)(src + i * 3));
+    __m128i rgba = _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha);
+    _mm_storeu_si128((__m128i *)(dst + i * 4), rgba);
+  }
+#elif defined(__SSE2__)
+  // Plain x86-64 has no byte shuffle. Put pixels 0-1 in the low 64 bits and
+  // 2-3 in the high ones, then in each half keep the first pixel where it is
+  // and shift the second up one byte into the upper 32 bits.
+  const __m128i firstPixel = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+  const __m128i secondPixel = _mm_set_epi32(0x00FFFFFF, 0, 0x00FFFFFF, 0);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  for (; i + 6 <= pixelCount; i += 4) {
+    __m128i rgb = _mm_loadu_si128((const __m128i *)(src + i * 3));
+    __m128i pairs = _mm_unpacklo_epi64(rgb, _mm_srli_si128(rgb, 6));
+    __m128i rgba = _mm_or_si128(
+        _mm_and_si128(pairs, firstPixel),
+        _mm_and_si128(_mm_slli_epi64(pairs, 8), secondPixel));
+    _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_or_si128(rgba, alpha));
+  }
+#endif
+  for (; i < pixelCount; i++) {
+    dst[i * 4 + 0] = src[i * 3 + 0];
+    dst[i * 4 + 1] = src[i * 3 + 1];
+    dst[i * 4 + 2] = src[i * 3 + 2];
+    dst[i * 4 + 3] = 255;
+  }
+}
+
+// Converts the stb output into the final RGBA8 image, flipping rows on the
+// way so the data is only touched once
+static void convertRows(const uint8_t *src, int channels, DecodedImage &image,
+                        bool flipVertically, ThreadPool *pool) {
+  size_t width = image.width;
+  size_t height = image.height;
+  image.pixels.resize(width * height * 4);
+
+  auto convert = [&](size_t begin, size_t end) {
+    for (size_t row = begin; row < end; row++) {
+      size_t dstRow = flipVertically ? height - 1 - row : row;
+      const uint8_t *srcLine = src + row * width * channels;
+      uint8_t *dstLine = image.pixels.data() + dstRow * width * 4;
+      if (channels == 4) {
+        memcpy(dstLine, srcLine, width * 4);
+      } else {
+        expandRGBToRGBA(srcLine, dstLine, width);
+      }
+    }
+  };
+
+  if (pool) {
+    pool->parallelFor(height, rowsPerChunk, convert);
+  } else {
+    convert(0, height);
+  }
+}
+
+static DecodedImage finishDecode(uint8_t *decoded, int width, int height,
+                                 int fileChannels, int decodedChannels,
+                                 bool flipVertically, ThreadPool *pool) {
+  DecodedImage image;
+  if (!decoded) {
+    image.error = stbi_failure_reason() ? stbi_failure_reason() : "unknown";
+    return image;
+  }
+  image.width = width;
+  image.height = height;
+  image.channels = fileChannels;
+  convertRows(decoded, decodedChannels, image, flipVertically, pool);
+  stbi_image_free(decoded);
+  return image;
+}
+
+// Decode at the native channel count when it's RGB or RGBA so the expansion
+// is done by us. Grey and grey+alpha images are rare, let stb expand those.
+static int channelsToRequest(int fileChannels) {
+  return fileChannels == 3 ? 3 : 4;
+}
+
+DecodedImage decodeImageFile(const char *filepath, bool flipVertically,
+                             ThreadPool *pool) {
+  int width, height, fileChannels;
+  if (!stbi_info(filepath, &width, &height, &fileChannels)) {
+    DecodedImage image;
+    image.error = stbi_failure_reason() ? stbi_failure_reason() : "unknown";
+    return image;
+  }
+  int requested = channelsToRequest(fileChannels);
+  uint8_t *decoded =
+      stbi_load(filepath, &width, &height, &fileChannels, requested);
+  return finishDecode(decoded, width, height, fileChannels, requested,
+                      flipVertically, pool);
+}
+
+DecodedImage decodeImageMemory(const uint8_t *data, size_t size,
+                               bool flipVertically, ThreadPool *pool) {
+  int width, height, fileChannels;
+  if (!stbi_info_from_memory(data, (int)size, &width, &height,
+                             &fileChannels)) {
+    DecodedImage image;
+    image.error = stbi_failure_reason() ? stbi_failure_reason() : "unknown";
+    return image;
+  }
+  int requested = channelsToRequest(fileChannels);
+  uint8_t *decoded = stbi_load_from_memory(data, (int)size, &width, &height,
+                                           &fileChannels, requested);
+  return finishDecode(decoded, width, height, fileChannels, requested,
+                      flipVertically, pool);
+}
+
+std::vector<std::future<DecodedImage>>
+decodeImageFilesAsync(const std::vector<std::string> &filepaths,
+                      bool flipVertically, ThreadPool &pool) {
+  std::vector<std::future<DecodedImage>> results;
+  results.reserve(filepaths.size());
+  for (const std::string &filepath : filepaths) {
+    results.push_back(pool.submit([filepath, flipVertically, &pool]() {
+      return decodeImageFile(filepath.c_str(), flipVertically, &pool);
+    }));
+  }
+  return results;
+}
+
+std::vector<std::vector<uint8_t>> buildMipChain(const uint8_t *pixels,
+                                                int width, int height) {
+  std::vector<std::vector<uint8_t>> mipChain;
+  mipChain.emplace_back(pixels, pixels + (size_t)width * height * 4);
+
+  // 2x2 box filter down to 1x1, clamping at the edges for odd sizes
+  int mipWidth = width, mipHeight = height;
+  while (mipWidth > 1 || mipHeight > 1) {
+    int nextWidth = std::max(1, mipWidth / 2);
+    int nextHeight = std::max(1, mipHeight / 2);
+    const std::vector<uint8_t> &src = mipChain.back();
+    std::vector<uint8_t> dst((size_t)nextWidth * nextHeight * 4);
+    for (int y = 0; y < nextHeight; y++) {
+      int y0 = std::min(y * 2, mipHeight - 1);
+      int y1 = std::min(y * 2 + 1, mipHeight - 1);
+      for (int x = 0; x < nextWidth; x++) {
+        int x0 = std::min(x * 2, mipWidth - 1);
+        int x1 = std::min(x * 2 + 1, mipWidth - 1);
+        for (int c = 0; c < 4; c++) {
+          int sum = src[((size_t)y0 * mipWidth + x0) * 4 + c] +
+                    src[((size_t)y0 * mipWidth + x1) * 4 + c] +
+                    src[((size_t)y1 * mipWidth + x0) * 4 + c] +
+                    src[((size_t)y1 * mipWidth + x1) * 4 + c];
+          dst[((size_t)y * nextWidth + x) * 4 + c] = (uint8_t)(sum / 4);
+        }
+      }
+    }
+    mipChain.push_back(std::move(dst));
+    mipWidth = nextWidth;
+    mipHeight = nextHeight;
+  }
+  return mipChain;
+}
@@ -0,0 +1,52 @@
+#pragma once
+// Image decoding stage used by Texture.
+//
+// stb_image does the entropy decoding and (with its SSE2/NEON paths) the
+// YCbCr to RGB conversion. What it does not do well is the forced RGBA
+// expansion and vertical flip it applies when asked for STBI_rgb_alpha: both
+// are scalar loops over the whole image on the decoding thread. Here we decode
+// at the native channel count and do the expansion and flip ourselves, with
+// SIMD and split across rows on the thread pool. Multiple images are decoded
+// concurrently by submitting each one to the pool.
+#include "thread_pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+struct DecodedImage {
+  int width = 0;
+  int height = 0;
+  // Channels in the source file, the pixels are always RGBA8
+  int channels = 0;
+  std::vector<uint8_t> pixels;
+  // Empty on success
+  std::string error;
+
+  bool valid() const { return error.empty() && !pixels.empty(); }
+};
+
+// Decodes a JPEG/PNG/... file to RGBA8. Metal expects the first row at the
+// bottom, so textures pass flipVertically = true.
+DecodedImage decodeImageFile(const char *filepath, bool flipVertically,
+                             ThreadPool *pool = nullptr);
+DecodedImage decodeImageMemory(const uint8_t *data, size_t size,
+                               bool flipVertically, ThreadPool *pool = nullptr);
+
+// Decodes each file as its own pool task; the conversion rows of each image
+// are split across the pool as well.
+std::vector<std::future<DecodedImage>>
+decodeImageFilesAsync(const std::vector<std::string> &filepaths,
+                      bool flipVertically, ThreadPool &pool);
+
+// RGB8 to RGBA8 with alpha = 255, vectorised with NEON, SSSE3 or, on any
+// x86-64, SSE2
+void expandRGBToRGBA(const uint8_t *src, uint8_t *dst, size_t pixelCount);
+
+// Every mip of an RGBA8 image down to 1x1, mip 0 being a copy of `pixels`.
+// Each mip is a 2x2 box filter of the one above, clamping at the edges of
+// odd sizes.
+std::vector<std::vector<uint8_t>> buildMipChain(const uint8_t *pixels,
+                                                int width, int height);
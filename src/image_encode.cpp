@@ -0,0 +1,403 @@
+#include "image_encode.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+uint32_t crc32Update(const uint8_t *data, size_t size, uint32_t crc) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> table;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t value = i;
+      for (int bit = 0; bit < 8; bit++) {
+        value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+      }
+      table[i] = value;
+    }
+    return table;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+uint32_t adler32Update(const uint8_t *data, size_t size, uint32_t adler) {
+  constexpr uint32_t modulus = 65521;
+  // The most bytes that can be summed before b could overflow 32 bits
+  constexpr size_t blockSize = 5552;
+  uint32_t a = adler & 0xFFFF;
+  uint32_t b = adler >> 16;
+  while (size) {
+    size_t block = std::min(size, blockSize);
+    for (size_t i = 0; i < block; i++) {
+      a += data[i];
+      b += a;
+    }
+    a %= modulus;
+    b %= modulus;
+    data += block;
+    size -= block;
+  }
+  return (b << 16) | a;
+}
+
+namespace {
+
+// Deflate's bits go into bytes least significant first
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<uint8_t> &out) : out(out) {}
+
+  void write(uint32_t value, uint32_t length) {
+    bits |= (uint64_t)value << count;
+    count += length;
+    if (count >= 32) {
+      for (int i = 0; i < 4; i++) {
+        out.push_back((uint8_t)(bits >> (i * 8)));
+      }
+      bits >>= 32;
+      count -= 32;
+    }
+  }
+  // Pads the last byte with zeros
+  void flush() {
+    for (; count > 0; count = count > 8 ? count - 8 : 0) {
+      out.push_back((uint8_t)bits);
+      bits >>= 8;
+    }
+  }
+
+private:
+  std::vector<uint8_t> &out;
+  uint64_t bits = 0;
+  uint32_t count = 0;
+};
+
+struct HuffmanCode {
+  // Bit reversed, ready to be written least significant bit first
+  uint16_t bits;
+  uint8_t length;
+};
+
+constexpr uint32_t minMatch = 3;
+constexpr uint32_t maxMatch = 258;
+constexpr uint32_t windowSize = 32768;
+constexpr uint32_t hashBits = 15;
+// Longer matches only hash their first position. Filtered images are mostly
+// long runs, where hashing every position costs more than it finds.
+constexpr uint32_t maxInsertLength = 16;
+
+constexpr uint16_t lengthBase[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11, 13,
+                                     15, 17, 19, 23, 27, 31, 35, 43,  51, 59,
+                                     67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t lengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t distanceBase[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+constexpr uint8_t distanceExtraBits[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+uint16_t reverseBits(uint32_t code, uint32_t length) {
+  uint32_t reversed = 0;
+  for (uint32_t i = 0; i < length; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  return (uint16_t)reversed;
+}
+
+// The fixed Huffman codes of RFC 1951 section 3.2.6, and which length and
+// distance code each match length and distance uses
+struct FixedCodes {
+  HuffmanCode literals[288];
+  HuffmanCode distances[30];
+  uint8_t lengthSymbols[maxMatch + 1];
+  uint8_t distanceSymbols[windowSize + 1];
+
+  FixedCodes() {
+    for (uint32_t symbol = 0; symbol < 288; symbol++) {
+      uint32_t code, length;
+      if (symbol < 144) {
+        code = 0x30 + symbol;
+        length = 8;
+      } else if (symbol < 256) {
+        code = 0x190 + symbol - 144;
+        length = 9;
+      } else if (symbol < 280) {
+        code = symbol - 256;
+        length = 7;
+      } else {
+        code = 0xC0 + symbol - 280;
+        length = 8;
+      }
+      literals[symbol] = {reverseBits(code, length), (uint8_t)length};
+    }
+    for (uint32_t symbol = 0; symbol < 30; symbol++) {
+      distances[symbol] = {reverseBits(symbol, 5), 5};
+    }
+    for (uint32_t symbol = 0; symbol < 29; symbol++) {
+      uint32_t last = symbol == 28 ? maxMatch
+                                   : lengthBase[symbol + 1] - 1u;
+      for (uint32_t length = lengthBase[symbol]; length <= last; length++) {
+        lengthSymbols[length] = (uint8_t)symbol;
+      }
+    }
+    for (uint32_t symbol = 0; symbol < 30; symbol++) {
+      uint32_t last = symbol == 29 ? windowSize
+                                   : distanceBase[symbol + 1] - 1u;
+      for (uint32_t distance = distanceBase[symbol]; distance <= last;
+           distance++) {
+        distanceSymbols[distance] = (uint8_t)symbol;
+      }
+    }
+  }
+};
+
+const FixedCodes &fixedCodes() {
+  static const FixedCodes codes;
+  return codes;
+}
+
+uint32_t hashBytes(const uint8_t *bytes) {
+  uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+  return (value * 2654435761u) >> (32 - hashBits);
+}
+
+// Length of the common prefix of `a` and `b`, up to `limit`, eight bytes at
+// a time
+uint32_t matchLength(const uint8_t *a, const uint8_t *b, uint32_t limit) {
+  uint32_t length = 0;
+  while (length + 8 <= limit) {
+    uint64_t x, y;
+    memcpy(&x, a + length, 8);
+    memcpy(&y, b + length, 8);
+    if (x != y) {
+      // Little endian: the first differing byte holds the lowest set bit
+      return length + (uint32_t)__builtin_ctzll(x ^ y) / 8;
+    }
+    length += 8;
+  }
+  while (length < limit && a[length] == b[length]) {
+    length++;
+  }
+  return length;
+}
+
+} // namespace
+
+std::vector<uint8_t> zlibCompress(const uint8_t *data, size_t size) {
+  const FixedCodes &codes = fixedCodes();
+  std::vector<uint8_t> out;
+  out.reserve(size / 2 + 64);
+  // Deflate with a 32K window, and the fastest compression level flagged
+  out.push_back(0x78);
+  out.push_back(0x01);
+
+  BitWriter writer(out);
+  // Final block, fixed Huffman codes
+  writer.write(1, 1);
+  writer.write(1, 2);
+  auto writeLiteral = [&](uint32_t symbol) {
+    writer.write(codes.literals[symbol].bits, codes.literals[symbol].length);
+  };
+
+  // Positions are kept + 1, so zero means none
+  std::vector<uint32_t> head(1u << hashBits, 0);
+  size_t i = 0;
+  while (i + minMatch <= size) {
+    uint32_t hash = hashBytes(data + i);
+    size_t candidate = head[hash];
+    head[hash] = (uint32_t)i + 1;
+    uint32_t length = 0;
+    if (candidate && i - (candidate - 1) <= windowSize) {
+      uint32_t limit = (uint32_t)std::min<size_t>(maxMatch, size - i);
+      length = matchLength(data + candidate - 1, data + i, limit);
+    }
+    if (length < minMatch) {
+      writeLiteral(data[i]);
+      i++;
+      continue;
+    }
+
+    uint32_t distance = (uint32_t)(i - (candidate - 1));
+    uint32_t lengthSymbol = codes.lengthSymbols[length];
+    writeLiteral(257 + lengthSymbol);
+    writer.write(length - lengthBase[lengthSymbol],
+                 lengthExtraBits[lengthSymbol]);
+    uint32_t distanceSymbol = codes.distanceSymbols[distance];
+    writer.write(codes.distances[distanceSymbol].bits,
+                 codes.distances[distanceSymbol].length);
+    writer.write(distance - distanceBase[distanceSymbol],
+                 distanceExtraBits[distanceSymbol]);
+    // The positions a short match covers can start later matches too
+    size_t end = i + length;
+    if (length <= maxInsertLength) {
+      for (i++; i < end && i + minMatch <= size; i++) {
+        head[hashBytes(data + i)] = (uint32_t)i + 1;
+      }
+    }
+    i = end;
+  }
+  for (; i < size; i++) {
+    writeLiteral(data[i]);
+  }
+  // End of block
+  writeLiteral(256);
+  writer.flush();
+
+  uint32_t adler = adler32Update(data, size);
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back((uint8_t)(adler >> shift));
+  }
+  return out;
+}
+
+static void appendBigEndian(std::vector<uint8_t> &out, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back((uint8_t)(value >> shift));
+  }
+}
+
+static void appendChunk(std::vector<uint8_t> &png, const char type[4],
+                        const uint8_t *data, size_t size) {
+  appendBigEndian(png, (uint32_t)size);
+  size_t typeStart = png.size();
+  png.insert(png.end(), type, type + 4);
+  png.insert(png.end(), data, data + size);
+  // Over the type and the data
+  appendBigEndian(png, crc32Update(png.data() + typeStart, size + 4));
+}
+
+enum PngFilter : uint8_t {
+  PngFilterNone,
+  PngFilterSub,
+  PngFilterUp,
+  PngFilterAverage,
+  PngFilterPaeth,
+  PngFilterCount,
+};
+
+// Filters a row with `filter`. Both rows are preceded by `channels` zeros,
+// the left neighbours of the first pixel. Each filter is a loop of its own,
+// without branches, so the compiler can vectorise it.
+static void filterRow(PngFilter filter, const uint8_t *row,
+                      const uint8_t *previous, size_t rowSize,
+                      uint8_t *filtered) {
+  constexpr ptrdiff_t channels = 4;
+  switch (filter) {
+  case PngFilterNone:
+    memcpy(filtered, row, rowSize);
+    break;
+  case PngFilterSub:
+    for (size_t x = 0; x < rowSize; x++) {
+      filtered[x] = row[x] - row[x - channels];
+    }
+    break;
+  case PngFilterUp:
+    for (size_t x = 0; x < rowSize; x++) {
+      filtered[x] = row[x] - previous[x];
+    }
+    break;
+  case PngFilterAverage:
+    for (size_t x = 0; x < rowSize; x++) {
+      filtered[x] = row[x] - (uint8_t)((row[x - channels] + previous[x]) >> 1);
+    }
+    break;
+  case PngFilterPaeth:
+    // Predicts with whichever of left, up and up-left is nearest to
+    // left + up - up-left
+    for (size_t x = 0; x < rowSize; x++) {
+      int left = row[x - channels];
+      int up = previous[x];
+      int upLeft = previous[x - channels];
+      int toLeft = std::abs(up - upLeft);
+      int toUp = std::abs(left - upLeft);
+      int toUpLeft = std::abs(left + up - 2 * upLeft);
+      int predictor = toLeft <= toUp && toLeft <= toUpLeft ? left
+                      : toUp <= toUpLeft                  ? up
+                                                          : upLeft;
+      filtered[x] = row[x] - (uint8_t)predictor;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// The sum of the bytes as signed differences, the usual guess at how well a
+// filtered row compresses
+static uint64_t filteredRowCost(const uint8_t *filtered, size_t rowSize) {
+  uint64_t cost = 0;
+  for (size_t x = 0; x < rowSize; x++) {
+    cost += (uint32_t)std::abs((int)(int8_t)filtered[x]);
+  }
+  return cost;
+}
+
+std::vector<uint8_t> encodePng(const uint8_t *pixels, uint32_t width,
+                               uint32_t height, uint32_t bytesPerRow,
+                               PixelOrder order) {
+  constexpr uint32_t channels = 4;
+  size_t rowSize = (size_t)width * channels;
+  // Each row is its filter type followed by the filtered bytes
+  std::vector<uint8_t> filtered((rowSize + 1) * height);
+  std::vector<uint8_t> previousRow(channels + rowSize, 0);
+  std::vector<uint8_t> currentRow(channels + rowSize, 0);
+  std::vector<uint8_t> candidate(rowSize);
+
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t *row = pixels + (size_t)y * bytesPerRow;
+    uint8_t *current = currentRow.data() + channels;
+    const uint8_t *previous = previousRow.data() + channels;
+    if (order == PixelOrder::Bgra) {
+      for (size_t x = 0; x < rowSize; x += channels) {
+        current[x] = row[x + 2];
+        current[x + 1] = row[x + 1];
+        current[x + 2] = row[x];
+        current[x + 3] = row[x + 3];
+      }
+    } else {
+      memcpy(current, row, rowSize);
+    }
+
+    // Each row gets whichever filter costs least, written straight into
+    // place when it beats the ones before it
+    uint8_t *out = filtered.data() + (rowSize + 1) * y;
+    uint64_t bestCost = UINT64_MAX;
+    for (uint32_t filter = 0; filter < PngFilterCount; filter++) {
+      filterRow((PngFilter)filter, current, previous, rowSize,
+                candidate.data());
+      uint64_t cost = filteredRowCost(candidate.data(), rowSize);
+      if (cost < bestCost) {
+        bestCost = cost;
+        out[0] = (uint8_t)filter;
+        memcpy(out + 1, candidate.data(), rowSize);
+      }
+    }
+    std::swap(previousRow, currentRow);
+  }
+
+  std::vector<uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  uint8_t header[13];
+  for (int i = 0; i < 4; i++) {
+    header[i] = (uint8_t)(width >> (24 - 8 * i));
+    header[4 + i] = (uint8_t)(height >> (24 - 8 * i));
+  }
+  header[8] = 8;  // Bits per channel
+  header[9] = 6;  // RGBA
+  header[10] = 0; // Deflate
+  header[11] = 0; // Adaptive filtering
+  header[12] = 0; // Not interlaced
+  appendChunk(png, "IHDR", header, sizeof(header));
+  std::vector<uint8_t> compressed =
+      zlibCompress(filtered.data(), filtered.size());
+  appendChunk(png, "IDAT", compressed.data(), compressed.size());
+  appendChunk(png, "IEND", nullptr, 0);
+  return png;
+}
@@ -0,0 +1,33 @@
+#pragma once
+// Image encoding for frames read back from the GPU.
+//
+// A PNG writer with a deflate of its own, so writing frames needs neither
+// zlib nor stb_image_write. Rows are filtered the usual way, each with
+// whichever of the PNG filters leaves the smallest differences, and then
+// compressed as a single fixed Huffman block with LZ77 matches found through
+// a one entry hash table. Files come out larger than zlib's default level
+// would make them, but encoding stays fast enough to keep up with an
+// offscreen renderer, which is what the encoder is for.
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class PixelOrder : uint8_t {
+  Rgba,
+  // Metal's BGRA8Unorm, swizzled to RGBA on the way
+  Bgra,
+};
+
+// PNG file of an 8-bit, 4 channel image with its rows top to bottom,
+// `bytesPerRow` apart
+std::vector<uint8_t> encodePng(const uint8_t *pixels, uint32_t width,
+                               uint32_t height, uint32_t bytesPerRow,
+                               PixelOrder order = PixelOrder::Rgba);
+
+// zlib stream (RFC 1950) of `data`
+std::vector<uint8_t> zlibCompress(const uint8_t *data, size_t size);
+
+// Running checksums, start from the default and pass the previous result to
+// continue over more data
+uint32_t crc32Update(const uint8_t *data, size_t size, uint32_t crc = 0);
+uint32_t adler32Update(const uint8_t *data, size_t size, uint32_t adler = 1);
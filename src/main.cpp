@@ -5,11 +5,72 @@
 #include "mtl_engine.hpp"
 #include "mtl_implementation.cpp"
 
-int main() {
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+static void printUsage() {
+  std::cerr << "Usage: minimal-metal-cpp [--replay frame_capture.txt]\n"
+               "       minimal-metal-cpp --offscreen WxH [--frames n] "
+               "[--out dir] [--format png|raw]"
+            << std::endl;
+}
+
+// minimal-metal-cpp [--replay frame_capture.txt]
+// minimal-metal-cpp --offscreen WxH [--frames n] [--out dir] [--format png|raw]
+int main(int argc, char **argv) {
+  const char *replayPath = nullptr;
+  bool offscreen = false;
+  OffscreenOptions offscreenOptions;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--replay") == 0 && hasValue) {
+      replayPath = argv[++i];
+    } else if (strcmp(argv[i], "--offscreen") == 0 && hasValue) {
+      unsigned width, height;
+      if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 ||
+          height == 0) {
+        printUsage();
+        return 1;
+      }
+      offscreen = true;
+      offscreenOptions.width = width;
+      offscreenOptions.height = height;
+    } else if (strcmp(argv[i], "--frames") == 0 && hasValue) {
+      offscreenOptions.frames = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--out") == 0 && hasValue) {
+      offscreenOptions.directory = argv[++i];
+    } else if (strcmp(argv[i], "--format") == 0 && hasValue) {
+      const char *format = argv[++i];
+      if (strcmp(format, "png") == 0) {
+        offscreenOptions.format = FrameFileFormat::Png;
+      } else if (strcmp(format, "raw") == 0) {
+        offscreenOptions.format = FrameFileFormat::Raw;
+      } else {
+        printUsage();
+        return 1;
+      }
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
   MTLEngine engine;
+  if (offscreen) {
+    engine.setOffscreen(offscreenOptions);
+  }
   engine.init();
-  engine.run();
+  int status = 0;
+  if (replayPath) {
+    status = engine.replay(replayPath);
+  } else if (offscreen) {
+    status = engine.runOffscreen();
+  } else {
+    engine.run();
+  }
   engine.cleanup();
 
-  return 0;
+  return status;
 }
@@ -0,0 +1,62 @@
+#pragma once
+// RenderCommandSink forwarding to an MTL::RenderCommandEncoder, either a
+// plain one or a sub-encoder of an MTL::ParallelRenderCommandEncoder.
+#include "command_encoding.hpp"
+#include <Metal/Metal.hpp>
+
+class MetalCommandSink : public RenderCommandSink {
+public:
+  explicit MetalCommandSink(MTL::RenderCommandEncoder *encoder)
+      : encoder(encoder) {}
+
+  void setRenderPipelineState(const void *pipeline) override {
+    encoder->setRenderPipelineState(
+        static_cast<const MTL::RenderPipelineState *>(pipeline));
+  }
+  void setDepthStencilState(const void *depthStencil) override {
+    encoder->setDepthStencilState(
+        static_cast<const MTL::DepthStencilState *>(depthStencil));
+  }
+  void setFrontFacingWinding(uint32_t winding) override {
+    encoder->setFrontFacingWinding((MTL::Winding)winding);
+  }
+  void setCullMode(uint32_t cullMode) override {
+    encoder->setCullMode((MTL::CullMode)cullMode);
+  }
+  void setVertexBuffer(const void *buffer, uint64_t offset,
+                       uint32_t index) override {
+    encoder->setVertexBuffer(static_cast<const MTL::Buffer *>(buffer), offset,
+                             index);
+  }
+  void setFragmentBuffer(const void *buffer, uint64_t offset,
+                         uint32_t index) override {
+    encoder->setFragmentBuffer(static_cast<const MTL::Buffer *>(buffer),
+                               offset, index);
+  }
+  void setFragmentTexture(const void *texture, uint32_t index) override {
+    encoder->setFragmentTexture(static_cast<const MTL::Texture *>(texture),
+                                index);
+  }
+  void drawPrimitives(uint32_t primitiveType, uint64_t vertexStart,
+                      uint64_t vertexCount, uint64_t instanceCount) override {
+    encoder->drawPrimitives((MTL::PrimitiveType)primitiveType, vertexStart,
+                            vertexCount, instanceCount);
+  }
+  void drawIndexedPrimitives(uint32_t primitiveType, uint64_t indexCount,
+                             const void *indexBuffer, uint64_t indexOffset,
+                             uint64_t instanceCount) override {
+    encoder->drawIndexedPrimitives(
+        (MTL::PrimitiveType)primitiveType, indexCount, MTL::IndexTypeUInt32,
+        static_cast<const MTL::Buffer *>(indexBuffer), indexOffset,
+        instanceCount);
+  }
+  void drawPrimitivesIndirect(uint32_t primitiveType,
+                              const void *indirectBuffer,
+                              uint64_t indirectOffset) override {
+    encoder->drawPrimitives((MTL::PrimitiveType)primitiveType,
+                            static_cast<const MTL::Buffer *>(indirectBuffer),
+                            indirectOffset);
+  }
+
+  MTL::RenderCommandEncoder *encoder;
+};
@@ -1,4 +1,5 @@
 #include "mtl_engine.hpp"
+#include "metal_command_sink.hpp"
 #include "Foundation/NSAutoreleasePool.hpp"
 #include "Foundation/NSString.hpp"
 #include "GLFW/glfw3.h"
@@ -10,51 +11,288 @@
 #include "Metal/MTLRenderPipeline.hpp"
 #include "Metal/MTLResource.hpp"
 #include "vertex_data.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <mach/mach_time.h>
 #include <simd/matrix_types.h>
 #include <simd/simd.h>
 
+// Pipelines used this run, prewarmed on the next one
+static constexpr const char *pipelineManifestPath = "pipeline_manifest.txt";
+// Watched for changes, see setupHotReload
+static constexpr const char *shaderLibraryPath = "shaders.metallib";
+static constexpr const char *objModelPath = "assets/dragon.obj";
+static constexpr const char *marsTexturePath = "assets/mars_texture.jpg";
+// Uber-shader permutations used this run
+static constexpr const char *permutationManifestPath =
+    "shader_permutations.txt";
+// Written by the T key, for chrome://tracing or ui.perfetto.dev
+static constexpr const char *traceCapturePath = "frame_trace.json";
+// Written by the C key, replayed with --replay
+static constexpr const char *frameCapturePath = "frame_capture.txt";
+// Bump when a change to the frame makes old captures meaningless
+static constexpr const char *frameCaptureScene = "MTLEngine 1";
+
+void MTLEngine::setOffscreen(const OffscreenOptions &options) {
+  offscreen = true;
+  offscreenOptions = options;
+}
+
 void MTLEngine::init() {
   initDevice();
-  initWindow();
+  if (offscreen) {
+    initOffscreenTarget();
+  } else {
+    initWindow();
+  }
 
   // createTriangle();
   // createSquare();
   // createCube();
+  // Also the only streamed texture, see textureStreamer
   // createSphere();
-  loadObjModel("assets/dragon.obj");
+  loadObjModel(objModelPath);
   createLight();
+  createScene();
   createBuffers();
+  createCullBuffers();
+  createClusterBuffers();
+  createShadowResources();
   createDefaultLibrary();
+  createPipelineCache();
+  // All are requested up front so they compile in parallel
+  pipelineCache->request(objPipelineDesc());
+  pipelineCache->request(lightPipelineDesc());
+  pipelineCache->request(shadowPipelineDesc());
+  pipelineCache->request(depthPrepassPipelineDesc());
   createCommandQueue();
+  createGpuProfiling();
   createRenderPipeline();
   createLightSourceRenderPipeline();
-  createDepthAndMSAATextures();
+  createShadowPipeline();
+  createDepthPrepassPipeline();
+  computePipelines = newComputePipelines(metalDefaultLibrary);
+  if (!computePipelines.valid()) {
+    std::exit(0);
+  }
+  createHiZPyramid();
   createRenderPassDescriptor();
+  // Nothing to reload into without a window to watch it in
+  if (!offscreen) {
+    setupHotReload();
+  }
 };
 
 void MTLEngine::run() {
   while (!glfwWindowShouldClose(window)) {
     NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
-    metalDrawable = metalLayer->nextDrawable();
+    ProfileScope frameZone("Frame");
+    applyPendingResize();
+    // Reloaded assets are only swapped in here, between frames
+    hotReloader->update(glfwGetTime());
+    frameTime = glfwGetTime();
+    {
+      ProfileScope zone("Next drawable");
+      metalDrawable = metalLayer->nextDrawable();
+    }
     draw();
     pool->release();
     glfwPollEvents();
   }
 };
 
+int MTLEngine::runOffscreen() {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now();
+  // Every frame is a fixed step on from the last, so the output is the same
+  // however fast it renders
+  for (offscreenFrame = 0; offscreenOptions.frames == 0 ||
+                           offscreenFrame < offscreenOptions.frames;
+       offscreenFrame++) {
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    ProfileScope frameZone("Frame");
+    frameTime = offscreenFrame * offscreenOptions.frameStep;
+    draw();
+    pool->release();
+  }
+
+  // The last frames' readbacks complete as the GPU finishes them
+  for (uint32_t i = 0; i < maxFramesInFlight; i++) {
+    frameSemaphore.acquire();
+  }
+  for (uint32_t i = 0; i < maxFramesInFlight; i++) {
+    frameSemaphore.release();
+  }
+  readbackQueue->close();
+  frameWriter->finish();
+
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  FrameWriterStats written = frameWriter->stats();
+  ReadbackStats readback = readbackQueue->stats();
+  std::cout << "Wrote " << written.frames << " frames to "
+            << offscreenOptions.directory << " in " << seconds << " s ("
+            << written.frames / seconds << " fps), waited on the writer "
+            << readback.stalls << " times" << std::endl;
+  return written.failed || written.frames != offscreenFrame ? 1 : 0;
+}
+
 void MTLEngine::cleanup() {
-  glfwTerminate();
-  sphereTransformationBuffer->release();
-  lightTransformationBuffer->release();
-  objTransformationBuffer->release();
-  msaaRenderTargetTexture->release();
-  depthTexture->release();
+  if (!offscreen) {
+    glfwTerminate();
+  }
+  // Let any frames still in flight finish before freeing their memory
+  for (uint32_t i = 0; i < maxFramesInFlight; i++) {
+    frameSemaphore.acquire();
+  }
+  if (offscreen) {
+    // Closed already if runOffscreen ran, and then a no-op
+    readbackQueue->close();
+    delete frameWriter;
+    delete readbackQueue;
+    for (MTL::Buffer *buffer : readbackBuffers) {
+      buffer->release();
+    }
+    offscreenTarget->release();
+  }
+  // Reloads still running read the pipeline cache and buffer allocator
+  delete hotReloader;
+  delete fileWatcher;
+  retireQueue.flush();
+  delete uniformRing;
+  bufferAllocator->release(uniformBuffer);
+  bufferAllocator->release(cullBuffer);
+  bufferAllocator->release(clusterBuffer);
+  bufferAllocator->release(shadowBuffer);
+  bufferAllocator->release(sphereVertexBuffer);
+  bufferAllocator->release(sphereIndexBuffer);
+  bufferAllocator->release(objVertexBuffer);
+  bufferAllocator->release(objPositionBuffer);
+  bufferAllocator->release(lightVertexBuffer);
+  bufferAllocator->release(lightIndexBuffer);
+  delete bufferAllocator;
+  shadowMap->release();
+  equalDepthState->release();
+  releaseHiZPyramid();
+  delete renderGraph;
+  delete attachmentPool;
+  if (transientHeap) {
+    transientHeap->release();
+  }
+  pipelineCache->saveManifest(pipelineManifestPath);
+  forwardPermutations.writeManifest(permutationManifestPath);
+  delete pipelineCache;
+  computePipelines.release();
+  if (counterSampleBuffer) {
+    counterSampleBuffer->release();
+  }
   renderPassDescriptor->release();
+  lateRenderPassDescriptor->release();
   metalDevice->release();
 };
 
-void MTLEngine::initDevice() { metalDevice = MTL::CreateSystemDefaultDevice(); }
+void MTLEngine::initDevice() {
+  metalDevice = MTL::CreateSystemDefaultDevice();
+  bufferAllocator = new GpuBufferAllocator(metalDevice);
+
+  useMemorylessAttachments = metalDevice->supportsFamily(MTL::GPUFamilyApple1);
+  attachmentPool = new AttachmentPool(
+      [this](const AttachmentKey &key) -> AttachmentPool::Handle {
+        MTL::TextureDescriptor *descriptor =
+            MTL::TextureDescriptor::alloc()->init();
+        descriptor->setTextureType(key.sampleCount > 1
+                                       ? MTL::TextureType2DMultisample
+                                       : MTL::TextureType2D);
+        descriptor->setPixelFormat((MTL::PixelFormat)key.pixelFormat);
+        descriptor->setWidth(key.width);
+        descriptor->setHeight(key.height);
+        descriptor->setSampleCount(key.sampleCount);
+        descriptor->setUsage((MTL::TextureUsage)key.usage);
+        descriptor->setStorageMode((MTL::StorageMode)key.storageMode);
+        MTL::Texture *texture = metalDevice->newTexture(descriptor);
+        descriptor->release();
+        return texture;
+      },
+      [](AttachmentPool::Handle handle) {
+        static_cast<MTL::Texture *>(handle)->release();
+      });
+
+  // Transient render graph textures are placed in one heap so that textures
+  // with disjoint lifetimes share memory
+  RenderGraph::Backend graphBackend;
+  graphBackend.textureSizeAndAlign = [this](const RGTextureDesc &desc,
+                                            uint64_t &size,
+                                            uint64_t &alignment) {
+    MTL::TextureDescriptor *descriptor = newTransientTextureDescriptor(desc);
+    MTL::SizeAndAlign sizeAndAlign =
+        metalDevice->heapTextureSizeAndAlign(descriptor);
+    descriptor->release();
+    size = sizeAndAlign.size;
+    alignment = sizeAndAlign.align;
+  };
+  graphBackend.reserveHeap = [this](uint64_t heapSize) {
+    if (transientHeap && transientHeap->size() >= heapSize) {
+      return;
+    }
+    if (transientHeap) {
+      transientHeap->release();
+    }
+    MTL::HeapDescriptor *heapDescriptor = MTL::HeapDescriptor::alloc()->init();
+    heapDescriptor->setType(MTL::HeapTypePlacement);
+    heapDescriptor->setStorageMode(MTL::StorageModePrivate);
+    heapDescriptor->setHazardTrackingMode(MTL::HazardTrackingModeTracked);
+    heapDescriptor->setSize(heapSize);
+    transientHeap = metalDevice->newHeap(heapDescriptor);
+    heapDescriptor->release();
+  };
+  // Memoryless attachments can't be placed in a heap. They come from the
+  // attachment pool instead, which keeps them from one frame to the next.
+  graphBackend.createTransient = [this](const RGTextureDesc &desc,
+                                        uint64_t offset) -> void * {
+    if (desc.memoryless) {
+      return attachmentPool->acquire(memorylessAttachmentKey(desc));
+    }
+    MTL::TextureDescriptor *descriptor = newTransientTextureDescriptor(desc);
+    MTL::Texture *texture = transientHeap->newTexture(descriptor, offset);
+    descriptor->release();
+    return texture;
+  };
+  graphBackend.destroy = [this](const RGTextureDesc &desc, void *texture) {
+    if (desc.memoryless) {
+      attachmentPool->release(texture);
+    } else {
+      static_cast<MTL::Texture *>(texture)->release();
+    }
+  };
+  renderGraph = new RenderGraph(graphBackend);
+}
+
+AttachmentKey MTLEngine::memorylessAttachmentKey(const RGTextureDesc &desc) {
+  AttachmentKey key;
+  key.width = desc.width;
+  key.height = desc.height;
+  key.pixelFormat = desc.pixelFormat;
+  key.sampleCount = desc.sampleCount;
+  key.usage = desc.usage;
+  key.storageMode = MTL::StorageModeMemoryless;
+  return key;
+}
+
+MTL::TextureDescriptor *
+MTLEngine::newTransientTextureDescriptor(const RGTextureDesc &desc) {
+  MTL::TextureDescriptor *descriptor = MTL::TextureDescriptor::alloc()->init();
+  descriptor->setTextureType(desc.sampleCount > 1
+                                 ? MTL::TextureType2DMultisample
+                                 : MTL::TextureType2D);
+  descriptor->setPixelFormat((MTL::PixelFormat)desc.pixelFormat);
+  descriptor->setWidth(desc.width);
+  descriptor->setHeight(desc.height);
+  descriptor->setSampleCount(desc.sampleCount);
+  descriptor->setUsage((MTL::TextureUsage)desc.usage);
+  descriptor->setStorageMode(MTL::StorageModePrivate);
+  return descriptor;
+}
 
 void MTLEngine::frameBufferSizeCallback(GLFWwindow *window, int width,
                                         int height) {
@@ -62,21 +300,167 @@ void MTLEngine::frameBufferSizeCallback(GLFWwindow *window, int width,
   engine->resizeFrameBuffer(width, height);
 };
 
+void MTLEngine::keyCallback(GLFWwindow *window, int key, int, int action,
+                            int) {
+  if (action != GLFW_PRESS) {
+    return;
+  }
+  MTLEngine *engine = (MTLEngine *)glfwGetWindowUserPointer(window);
+  if (key == GLFW_KEY_P) {
+    engine->setSetting(DepthPrepassSetting,
+                       !engine->setting(DepthPrepassSetting));
+  } else if (key == GLFW_KEY_O) {
+    engine->setSetting(OcclusionCullingSetting,
+                       !engine->setting(OcclusionCullingSetting));
+  } else if (key == GLFW_KEY_H) {
+    engine->setSetting(HiZCullingSetting, !engine->setting(HiZCullingSetting));
+  } else if (key == GLFW_KEY_T && !engine->traceFramesLeft) {
+    engine->traceFramesLeft = traceCaptureFrames;
+    std::cout << "Capturing " << traceCaptureFrames << " frames" << std::endl;
+  } else if (key == GLFW_KEY_C && !engine->frameCapturer.active()) {
+    engine->startFrameCapture();
+  }
+}
+
+bool MTLEngine::setting(EngineSetting setting) const {
+  switch (setting) {
+  case DepthPrepassSetting:
+    return depthPrepass;
+  case OcclusionCullingSetting:
+    return occlusionCulling;
+  case HiZCullingSetting:
+    return hizCulling;
+  }
+  return false;
+}
+
+void MTLEngine::setSetting(EngineSetting setting, bool on) {
+  SceneChange change;
+  change.type = SceneChangeType::Setting;
+  change.target = setting;
+  change.value = on;
+  frameCapturer.addChange(change);
+  if (this->setting(setting) == on) {
+    return;
+  }
+  if (setting == DepthPrepassSetting) {
+    depthPrepass = on;
+    std::cout << "Depth pre-pass " << (on ? "on" : "off") << std::endl;
+  } else if (setting == OcclusionCullingSetting) {
+    occlusionCulling = on;
+    std::cout << "Occlusion culling " << (on ? "on" : "off") << std::endl;
+  } else if (setting == HiZCullingSetting) {
+    // Whether the attachments may be memoryless depends on it, which the
+    // next frame's graph picks up
+    hizCulling = on;
+    std::cout << "Hi-Z occlusion culling " << (on ? "on" : "off")
+              << std::endl;
+  }
+}
+
+void MTLEngine::applySceneChange(const SceneChange &change) {
+  if (change.type == SceneChangeType::Setting) {
+    if (change.target <= HiZCullingSetting) {
+      setSetting((EngineSetting)change.target, change.value != 0);
+    }
+  } else if (scene.alive(change.target)) {
+    scene.setLocalTransform(change.target, change.transform);
+  }
+}
+
+void MTLEngine::startFrameCapture() {
+  frameCapturer.start(frameCaptureScene, frameCaptureFrames);
+  // The settings the capture starts with, so a replay doesn't depend on
+  // what they were when it started
+  for (EngineSetting each :
+       {DepthPrepassSetting, OcclusionCullingSetting, HiZCullingSetting}) {
+    setSetting(each, setting(each));
+  }
+  std::cout << "Capturing the inputs and commands of " << frameCaptureFrames
+            << " frames" << std::endl;
+}
+
+void MTLEngine::captureFrame() {
+  if (!frameCapturer.active()) {
+    return;
+  }
+  CommandRecorder recorder;
+  encodeFrameCommands(recorder);
+  if (frameCapturer.endFrame(recorder) &&
+      saveFrameCapture(frameCapturePath, frameCapturer.capture())) {
+    std::cout << "Wrote " << frameCapturer.capture().frames.size()
+              << " frames to " << frameCapturePath << std::endl;
+  }
+}
+
+int MTLEngine::replay(const char *path) {
+  FrameCapture capture;
+  if (!loadFrameCapture(path, capture)) {
+    return 1;
+  }
+  if (capture.scene != frameCaptureScene) {
+    std::cerr << "ERROR: " << path << " was captured from \"" << capture.scene
+              << "\", not " << frameCaptureScene << std::endl;
+    return 1;
+  }
+
+  // Nothing is submitted, but the uniform, culling and shadow regions the
+  // replay writes may still be read by frames in flight until they finish
+  for (uint32_t i = 0; i < maxFramesInFlight; i++) {
+    frameSemaphore.acquire();
+  }
+  ReplayReport report = replayFrameCapture(
+      capture, [this](const CapturedFrame &frame, RenderCommandSink &sink) {
+        NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+        for (const SceneChange &change : frame.changes) {
+          applySceneChange(change);
+        }
+        // Uniform offsets depend on the region, so land on the captured one
+        do {
+          uniformRing->beginFrame();
+        } while (uniformRing->frameIndex() !=
+                 frame.frameInFlight % maxFramesInFlight);
+        frameTime = frame.time;
+        camera = frame.camera;
+        buildDrawList();
+        encodeFrameCommands(sink);
+        pool->release();
+      });
+  for (uint32_t i = 0; i < maxFramesInFlight; i++) {
+    frameSemaphore.release();
+  }
+
+  const FrameTimeSummary &times = report.frameTimes;
+  std::cout << "Replayed " << report.frames << " frames in "
+            << report.totalMilliseconds << " ms, " << report.mismatchedFrames
+            << " differ from the capture" << std::endl;
+  std::cout << "CPU frame ms: mean " << times.mean << ", p50 " << times.p50
+            << ", p95 " << times.p95 << ", p99 " << times.p99 << ", max "
+            << times.max << std::endl;
+  return report.matches() ? 0 : 1;
+}
+
 void MTLEngine::resizeFrameBuffer(int width, int height) {
-  metalLayer->setDrawableSize(CGSizeMake(width, height));
+  // Dragging a window edge fires this for every intermediate size, only
+  // record it here and resize once it settles (see applyPendingResize)
+  resizeDebouncer.request(width, height, glfwGetTime());
+};
 
-  // Deallocate created textures
-  if (msaaRenderTargetTexture) {
-    msaaRenderTargetTexture->release();
-    msaaRenderTargetTexture = nullptr;
+void MTLEngine::applyPendingResize() {
+  int width, height;
+  if (!resizeDebouncer.poll(glfwGetTime(), width, height)) {
+    return;
   }
-  if (depthTexture) {
-    depthTexture->release();
-    depthTexture = nullptr;
+  CGSize drawableSize = targetSize();
+  if (drawableSize.width == width && drawableSize.height == height) {
+    return;
   }
-  createDepthAndMSAATextures();
-  metalDrawable = metalLayer->nextDrawable();
-  updateRenderPassDescriptor();
+  metalLayer->setDrawableSize(CGSizeMake(width, height));
+
+  // The attachments follow from the next frame's graph, only the pyramid,
+  // which outlives frames, is recreated here
+  releaseHiZPyramid();
+  createHiZPyramid();
 };
 
 void MTLEngine::initWindow() {
@@ -90,6 +474,7 @@ void MTLEngine::initWindow() {
 
   glfwSetWindowUserPointer(window, this);
   glfwSetFramebufferSizeCallback(window, frameBufferSizeCallback);
+  glfwSetKeyCallback(window, keyCallback);
   int width, height;
   glfwGetFramebufferSize(window, &width, &height);
 
@@ -104,188 +489,141 @@ void MTLEngine::initWindow() {
   metalDrawable = metalLayer->nextDrawable();
 };
 
-void MTLEngine::createSphere(int numLat, int numLong) {
-  // To create a sphere, we need to compose it of squares
-  std::vector<VertexData> vertices;
-  const float PI = 3.14159265359f;
-
-  // For each lat/lon we need to create a square
-  for (int lat = 0; lat < numLat; lat++) {
-    for (int lon = 0; lon < numLong; lon++) {
-      // Corners of square
-      std::array<simd::float4, 4> squareVertices;
-      std::array<simd::float4, 4> normals;
-      std::array<simd::float2, 4> texCoords;
-
-      for (int i = 0; i < 4; i++) {
-        float theta = (lat + (i / 2)) * PI / numLat;    // 0 to Pi
-        float phi = (lon + (i % 2)) * 2 * PI / numLong; // 0 to 2 Pi
-        float sinTheta = sinf(theta);
-        float cosTheta = cosf(theta);
-        float sinPhi = sinf(phi);
-        float cosPhi = cosf(phi);
-
-        squareVertices[i] = {cosPhi * sinTheta, cosTheta, sinPhi * sinTheta,
-                             1.0f};
-        // Normal of the vertex is same as its position on a unit sphere.
-        normals[i] = simd::normalize(squareVertices[i]);
-
-        // Texture coordinate in spherical coordinates
-        float u = phi / (2 * PI);
-        float v = theta / PI;
-        texCoords[i] = {u, v};
-      }
+void MTLEngine::initOffscreenTarget() {
+  uint32_t width = offscreenOptions.width;
+  uint32_t height = offscreenOptions.height;
+  // Same format as the drawable, so every pipeline works unchanged
+  MTL::TextureDescriptor *descriptor = MTL::TextureDescriptor::alloc()->init();
+  descriptor->setTextureType(MTL::TextureType2D);
+  descriptor->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
+  descriptor->setWidth(width);
+  descriptor->setHeight(height);
+  descriptor->setUsage(MTL::TextureUsageRenderTarget |
+                       MTL::TextureUsageShaderRead);
+  descriptor->setStorageMode(MTL::StorageModePrivate);
+  offscreenTarget = metalDevice->newTexture(descriptor);
+  offscreenTarget->setLabel(
+      NS::String::string("Offscreen Target", NS::UTF8StringEncoding));
+  descriptor->release();
+
+  // Shared, so the CPU reads what the blit wrote without another copy
+  NS::UInteger bufferLength = (NS::UInteger)readbackBytesPerRow(width) * height;
+  std::vector<uint8_t *> slots;
+  for (MTL::Buffer *&buffer : readbackBuffers) {
+    buffer = metalDevice->newBuffer(bufferLength,
+                                    MTL::ResourceStorageModeShared);
+    buffer->setLabel(NS::String::string("Readback", NS::UTF8StringEncoding));
+    slots.push_back(static_cast<uint8_t *>(buffer->contents()));
+  }
+  readbackQueue = new ReadbackQueue(slots);
+  FrameWriterOptions writerOptions;
+  writerOptions.directory = offscreenOptions.directory;
+  writerOptions.format = offscreenOptions.format;
+  frameWriter = new FrameWriter(*readbackQueue, writerOptions);
+}
 
-      // Create two triangles to form the square in counter clockwise winding
-      // order
-      // First Triangle
-      vertices.push_back(
-          VertexData{squareVertices[0], texCoords[0], normals[0]});
-      vertices.push_back(
-          VertexData{squareVertices[1], texCoords[1], normals[1]});
-      vertices.push_back(
-          VertexData{squareVertices[2], texCoords[2], normals[2]});
-      // Second Triangle
-      vertices.push_back(
-          VertexData{squareVertices[1], texCoords[1], normals[1]});
-      vertices.push_back(
-          VertexData{squareVertices[3], texCoords[3], normals[3]});
-      vertices.push_back(
-          VertexData{squareVertices[2], texCoords[2], normals[2]});
-    }
-  }
-  sphereVertexBuffer = metalDevice->newBuffer(
-      vertices.data(), sizeof(VertexData) * vertices.size(),
-      MTL::ResourceStorageModeShared);
+MTL::Texture *MTLEngine::targetTexture() const {
+  return offscreen ? offscreenTarget : metalDrawable->texture();
+}
 
-  vertexCount = vertices.size();
-  marsTexture = new Texture("assets/mars_texture.jpg", metalDevice);
+CGSize MTLEngine::targetSize() const {
+  if (offscreen) {
+    return CGSizeMake(offscreenOptions.width, offscreenOptions.height);
+  }
+  return metalLayer->drawableSize();
+}
+
+void MTLEngine::encodeReadback(MTL::CommandBuffer *commandBuffer) {
+  uint32_t width = offscreenOptions.width;
+  uint32_t height = offscreenOptions.height;
+  uint32_t bytesPerRow = readbackBytesPerRow(width);
+  MTL::BlitCommandEncoder *encoder = commandBuffer->blitCommandEncoder();
+  encoder->setLabel(NS::String::string("Readback", NS::UTF8StringEncoding));
+  encoder->copyFromTexture(offscreenTarget, 0, 0, MTL::Origin(0, 0, 0),
+                           MTL::Size(width, height, 1),
+                           readbackBuffers[readbackSlot], 0, bytesPerRow,
+                           (NS::UInteger)bytesPerRow * height);
+  encoder->endEncoding();
+}
+
+void MTLEngine::createSphere(int numLat, int numLong) {
+  // Indexed, so each vertex is shared by the up to six triangles around it
+  Mesh sphere = generateUVSphere(numLat, numLong);
+  uploadMesh(sphere, sphereVertexBuffer, sphereIndexBuffer);
+  sphereIndexCount = sphere.indices.size();
+
+  // Only the smallest mips of the planet texture are uploaded to begin with,
+  // the streamer brings in more detail as the sphere covers more of the screen
+  marsTexture = new Texture(marsTexturePath, metalDevice, true);
+  marsTextureId =
+      textureStreamer.registerTexture(marsTexture->width, marsTexture->height, 4);
+  // Same placement as the model matrix in encodeRenderCommand
+  textureStreamer.setBounds(marsTextureId, {0.0f, 0.0f, -1.5f}, 1.2f);
+  marsTexture->setResidentMip(textureStreamer.residentMip(marsTextureId));
+  streamedTextures.push_back(marsTexture);
 }
 
 void MTLEngine::createLight() {
   // Cube for use in right-handed coord system with triangle faces
   // specified with counter-clockwise winding order
-  VertexData lightSource[] = {
-      // Front face (normal: 0, 0, 1)
-      {{-0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-      {{0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-      {{0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-      {{-0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-      {{0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-      {{-0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, 1.0, 1.0}},
-
-      // Back face (normal: 0, 0, -1)
-      {{0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-      {{-0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-      {{-0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-      {{-0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-      {{0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-      {{0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 0.0, -1.0, 1.0}},
-
-      // Top face (normal: 0, 1, 0)
-      {{-0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-      {{0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-      {{0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-      {{0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-      {{-0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-      {{-0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, 1.0, 0.0, 1.0}},
-
-      // Bottom face (normal: 0, -1, 0)
-      {{-0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-      {{0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-      {{0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-      {{0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-      {{-0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-      {{-0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {0.0, -1.0, 0.0, 1.0}},
-
-      // Left face (normal: -1, 0, 0)
-      {{-0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-      {{-0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-      {{-0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-      {{-0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-      {{-0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-      {{-0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {-1.0, 0.0, 0.0, 1.0}},
-
-      // Right face (normal: 1, 0, 0)
-      {{0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-      {{0.5, -0.5, -0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-      {{0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-      {{0.5, 0.5, -0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-      {{0.5, 0.5, 0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-      {{0.5, -0.5, 0.5, 1.0}, {0.0, 0.0}, {1.0, 0.0, 0.0, 1.0}},
-  };
-
-  lightVertexBuffer = metalDevice->newBuffer(lightSource, sizeof(lightSource),
-                                             MTL::ResourceStorageModeShared);
+  Mesh cube = generateCube(1.0f);
+  uploadMesh(cube, lightVertexBuffer, lightIndexBuffer);
+  lightIndexCount = cube.indices.size();
 }
 
-void MTLEngine::loadObjModel(const char *filename) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
-  std::string warn, err;
-
-  // Load the OBJ
-  bool ret =
-      tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename);
+void MTLEngine::uploadMesh(const Mesh &mesh, BufferSlice &vertices,
+                           BufferSlice &indices) {
+  static_assert(sizeof(MeshVertex) == sizeof(VertexData) &&
+                    offsetof(MeshVertex, textureCoordinate) ==
+                        offsetof(VertexData, textureCoordinate) &&
+                    offsetof(MeshVertex, normal) == offsetof(VertexData, normal),
+                "MeshVertex must match VertexData");
+  vertices = bufferAllocator->allocate(
+      mesh.vertices.data(), sizeof(MeshVertex) * mesh.vertices.size());
+  indices = bufferAllocator->allocate(mesh.indices.data(),
+                                      sizeof(uint32_t) * mesh.indices.size());
+}
 
-  if (!warn.empty()) {
-    std::cout << "Tiny Obj Warning: " << warn << std::endl;
+bool MTLEngine::parseObjModel(const char *filename,
+                              std::vector<VertexData> &vertices) {
+  static_assert(sizeof(MeshVertex) == sizeof(VertexData),
+                "MeshVertex must match VertexData");
+  std::vector<MeshVertex> meshVertices;
+  if (!loadObjVertices(filename, meshVertices)) {
+    return false;
   }
+  vertices.resize(meshVertices.size());
+  memcpy(vertices.data(), meshVertices.data(),
+         sizeof(MeshVertex) * meshVertices.size());
+  std::cout << "Obj Loaded " << vertices.size() << " vertices from " << filename
+            << std::endl;
+  return true;
+}
 
-  if (!err.empty()) {
-    std::cerr << "Tiny Obj Error: " << err << std::endl;
+simd::float4 MTLEngine::boundingSphere(const std::vector<VertexData> &vertices) {
+  if (vertices.empty()) {
+    return {0, 0, 0, 0};
   }
-
-  if (!ret) {
-    std::cerr << "Failed to load OBJ file: " << filename << std::endl;
-    return;
+  simd::float3 minimum = vertices[0].position.xyz;
+  simd::float3 maximum = minimum;
+  for (const VertexData &vertex : vertices) {
+    minimum = simd::min(minimum, vertex.position.xyz);
+    maximum = simd::max(maximum, vertex.position.xyz);
   }
-
-  std::vector<VertexData> vertices;
-
-  // Loop through all shapes in the obj
-  for (const auto &shape : shapes) {
-    // Loop through all indices
-    for (const auto &index : shape.mesh.indices) {
-      VertexData vertex;
-
-      // Position
-      vertex.position = {attrib.vertices[3 * index.vertex_index + 0],
-                         attrib.vertices[3 * index.vertex_index + 1],
-                         attrib.vertices[3 * index.vertex_index + 2], 1.0f};
-
-      // Texture (if there)
-      if (index.texcoord_index >= 0) {
-        vertex.textureCoordinate = {
-            attrib.texcoords[2 * index.texcoord_index + 0],
-            1.0f - attrib.texcoords[2 * index.texcoord_index +
-                                    1] // Flip V coordinate
-        };
-      } else {
-        vertex.textureCoordinate = {0.0f, 0.0f};
-      }
-
-      // Normal
-      if (index.normal_index >= 0) {
-        vertex.normal = {
-            attrib.normals[3 * index.normal_index + 0],
-            attrib.normals[3 * index.normal_index + 1],
-            attrib.normals[3 * index.normal_index + 2],
-            0.0f // w=0 for directions
-        };
-      } else {
-        vertex.normal = {0.0f, 0.0f, 0.0f, 0.0f};
-      }
-
-      vertices.push_back(vertex);
-    }
+  // Centred on the box, which is close enough to the tightest sphere for
+  // culling
+  simd::float3 center = (minimum + maximum) * 0.5f;
+  float radiusSquared = 0.0f;
+  for (const VertexData &vertex : vertices) {
+    radiusSquared =
+        std::max(radiusSquared, simd::length_squared(vertex.position.xyz - center));
   }
-  std::cout << "Obj Loaded " << vertices.size() << " vertices from " << filename
-            << std::endl;
+  return simd_make_float4(center, std::sqrt(radiusSquared));
+}
 
-  if (vertices.empty()) {
-    std::cerr << "No vertices loaded!" << std::endl;
+void MTLEngine::loadObjModel(const char *filename) {
+  std::vector<VertexData> vertices;
+  if (!parseObjModel(filename, vertices)) {
     return;
   }
 
@@ -305,28 +643,34 @@ void MTLEngine::loadObjModel(const char *filename) {
 
   std::cout << "metalDevice appears valid" << std::endl;
 
-  if (objVertexBuffer) {
+  if (objVertexBuffer.valid()) {
     std::cout << "releasing old buffer" << std::endl;
-    objVertexBuffer->release();
+    bufferAllocator->release(objVertexBuffer);
   }
 
-  std::cout << "About to call newBuffer..." << std::endl;
-
   std::cout << "Creating buffer..." << std::endl;
 
   // Create obj vertex buffer
-  objVertexBuffer =
-      metalDevice->newBuffer(bufferSize, MTL::ResourceStorageModeShared);
+  objVertexBuffer = bufferAllocator->allocate(bufferSize);
 
-  if (!objVertexBuffer) {
+  if (!objVertexBuffer.valid()) {
     std::cerr << "Failed to create obj vertex buffer!" << std::endl;
     return;
   }
 
   std::cout << "Buffer created... allocating data..." << std::endl;
 
-  memcpy(objVertexBuffer->contents(), vertices.data(), bufferSize);
+  memcpy(objVertexBuffer.contents(), vertices.data(), bufferSize);
   vertexCount = vertices.size();
+  objBoundingSphere = boundingSphere(vertices);
+
+  if (objPositionBuffer.valid()) {
+    bufferAllocator->release(objPositionBuffer);
+  }
+  std::vector<float> positions =
+      extractPositions(vertices.data(), vertices.size(), sizeof(VertexData));
+  objPositionBuffer = bufferAllocator->allocate(
+      positions.data(), positions.size() * sizeof(float));
   std::cout << "Buffer created with " << vertexCount << " vertices"
             << std::endl;
 };
@@ -426,22 +770,31 @@ void MTLEngine::loadObjModel(const char *filename) {
 // }
 
 void MTLEngine::createBuffers() {
-  // transformationBuffer = metalDevice->newBuffer(sizeof(TransformationData),
-  // MTL::ResourceStorageModeShared);
-  sphereTransformationBuffer = metalDevice->newBuffer(
-      sizeof(TransformationData), MTL::ResourceStorageModeShared);
-
-  objTransformationBuffer = metalDevice->newBuffer(
-      sizeof(TransformationData), MTL::ResourceStorageModeShared);
+  // One persistently mapped block split into a region per frame in flight
+  uniformBuffer = bufferAllocator->allocate(
+      uniformBytesPerFrame * maxFramesInFlight,
+      GpuBufferAllocator::uniformAlignment);
+  uniformRing =
+      new UniformRingAllocator(uniformBuffer.size, maxFramesInFlight,
+                               GpuBufferAllocator::uniformAlignment);
+}
 
-  lightTransformationBuffer = metalDevice->newBuffer(
-      sizeof(TransformationData), MTL::ResourceStorageModeShared);
+template <typename T> NS::UInteger MTLEngine::pushUniform(const T &value) {
+  uint64_t offset = uniformRing->allocate(sizeof(T));
+  if (offset == UniformRingAllocator::invalidOffset) {
+    std::cerr << "ERROR: uniform ring is full, increase uniformBytesPerFrame"
+              << std::endl;
+    std::exit(-1);
+  }
+  memcpy(static_cast<char *>(uniformBuffer.contents()) + offset, &value,
+         sizeof(T));
+  return uniformBuffer.offset + offset;
 }
 
 void MTLEngine::createDefaultLibrary() {
   // Load the precompiled metallib file
   NS::String *libraryPath =
-      NS::String::string("shaders.metallib", NS::UTF8StringEncoding);
+      NS::String::string(shaderLibraryPath, NS::UTF8StringEncoding);
   NS::Error *error = nullptr;
 
   // Try to load from the current working directory (where CMake copies it)
@@ -465,120 +818,422 @@ void MTLEngine::createCommandQueue() {
   metalCommandQueue = metalDevice->newCommandQueue();
 };
 
-void MTLEngine::createRenderPipeline() {
-  MTL::Function *vertexShader = metalDefaultLibrary->newFunction(
-      NS::String::string("objVertexShader", NS::ASCIIStringEncoding));
-  assert(vertexShader);
-  MTL::Function *fragmentShader = metalDefaultLibrary->newFunction(
-      NS::String::string("objFragmentShader", NS::ASCIIStringEncoding));
-  assert(fragmentShader);
+void MTLEngine::createGpuProfiling() {
+  Profiler::shared().setThreadName("Main");
+
+  // Apple GPUs sample at pass boundaries, others only between draws and
+  // dispatches, which would need a zone per draw
+  if (!metalDevice->supportsCounterSampling(
+          MTL::CounterSamplingPointAtStageBoundary)) {
+    std::cout << "GPU pass timing unavailable, timing whole frames only"
+              << std::endl;
+    return;
+  }
+  MTL::CounterSet *timestampCounters = nullptr;
+  NS::Array *counterSets = metalDevice->counterSets();
+  for (NS::UInteger i = 0; counterSets && i < counterSets->count(); i++) {
+    MTL::CounterSet *counterSet = counterSets->object<MTL::CounterSet>(i);
+    if (counterSet->name()->isEqualToString(MTL::CommonCounterSetTimestamp)) {
+      timestampCounters = counterSet;
+      break;
+    }
+  }
+  if (!timestampCounters) {
+    std::cout << "GPU has no timestamp counters, timing whole frames only"
+              << std::endl;
+    return;
+  }
+
+  MTL::CounterSampleBufferDescriptor *descriptor =
+      MTL::CounterSampleBufferDescriptor::alloc()->init();
+  descriptor->setCounterSet(timestampCounters);
+  // Resolved on the CPU in the completion handler
+  descriptor->setStorageMode(MTL::StorageModeShared);
+  descriptor->setSampleCount(gpuZones.sampleCount());
+  NS::Error *error = nullptr;
+  counterSampleBuffer = metalDevice->newCounterSampleBuffer(descriptor, &error);
+  descriptor->release();
+  if (!counterSampleBuffer) {
+    std::cerr << "Failed to create the GPU zone sample buffer" << std::endl;
+    if (error) {
+      std::cerr << "Error: " << error->localizedDescription()->utf8String()
+                << std::endl;
+    }
+  }
+}
+
+PipelineDesc MTLEngine::mainPassPipelineDesc(const char *label) {
+  PipelineDesc desc;
+  desc.label = label;
+  // The drawable's format, and offscreenTarget's
+  desc.colorFormats[0] = MTL::PixelFormatBGRA8Unorm;
+  desc.sampleCount = sampleCount;
+  desc.depthFormat = MTL::PixelFormatDepth32Float;
+  desc.depthCompare = MTL::CompareFunctionLessEqual;
+  desc.depthWrite = true;
+  return desc;
+}
+
+CompiledPipeline MTLEngine::compilePipeline(const PipelineDesc &desc,
+                                            MTL::Library *library) {
+  // Runs on a pool thread, which has no autorelease pool of its own
+  NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+  CompiledPipeline compiled;
+
+  // Uber-shader permutations get one bool function constant per feature
+  MTL::FunctionConstantValues *constantValues = nullptr;
+  if (desc.specialized) {
+    constantValues = MTL::FunctionConstantValues::alloc()->init();
+    for (uint32_t bit = 0; bit < ShaderFeatureCount; bit++) {
+      bool enabled = desc.shaderFeatures & (1u << bit);
+      constantValues->setConstantValue(&enabled, MTL::DataTypeBool, bit);
+    }
+  }
+  auto newFunction = [&](const std::string &name) -> MTL::Function * {
+    NS::String *functionName =
+        NS::String::string(name.c_str(), NS::UTF8StringEncoding);
+    if (!constantValues) {
+      return library->newFunction(functionName);
+    }
+    NS::Error *error = nullptr;
+    MTL::Function *function =
+        library->newFunction(functionName, constantValues, &error);
+    if (!function && error) {
+      std::cerr << "Error specializing " << name << ": "
+                << error->localizedDescription()->utf8String() << std::endl;
+    }
+    return function;
+  };
+  // Depth only pipelines have no fragment function
+  bool depthOnly = desc.fragmentFunction.empty();
+  MTL::Function *vertexShader = newFunction(desc.vertexFunction);
+  MTL::Function *fragmentShader =
+      depthOnly ? nullptr : newFunction(desc.fragmentFunction);
+  if (constantValues) {
+    constantValues->release();
+  }
+  if (!vertexShader || (!fragmentShader && !depthOnly)) {
+    std::cerr << "Missing shader function for " << desc.label << std::endl;
+    if (vertexShader) {
+      vertexShader->release();
+    }
+    if (fragmentShader) {
+      fragmentShader->release();
+    }
+    pool->release();
+    return compiled;
+  }
 
   MTL::RenderPipelineDescriptor *renderPipelineDescriptor =
       MTL::RenderPipelineDescriptor::alloc()->init();
   renderPipelineDescriptor->setLabel(
-      NS::String::string("Obj Rendering Pipeline", NS::ASCIIStringEncoding));
+      NS::String::string(desc.label.c_str(), NS::UTF8StringEncoding));
   renderPipelineDescriptor->setVertexFunction(vertexShader);
   renderPipelineDescriptor->setFragmentFunction(fragmentShader);
-  assert(renderPipelineDescriptor);
 
-  MTL::PixelFormat pixelFormat = metalLayer->pixelFormat();
-  renderPipelineDescriptor->colorAttachments()->object(0)->setPixelFormat(
-      pixelFormat);
-  renderPipelineDescriptor->setSampleCount(sampleCount);
+  for (uint32_t i = 0; i < PipelineDesc::maxColorAttachments; i++) {
+    if (desc.colorFormats[i] == MTL::PixelFormatInvalid) {
+      continue;
+    }
+    const PipelineBlendState &blend = desc.blend[i];
+    MTL::RenderPipelineColorAttachmentDescriptor *attachment =
+        renderPipelineDescriptor->colorAttachments()->object(i);
+    attachment->setPixelFormat((MTL::PixelFormat)desc.colorFormats[i]);
+    attachment->setBlendingEnabled(blend.enabled);
+    attachment->setRgbBlendOperation((MTL::BlendOperation)blend.rgbOperation);
+    attachment->setAlphaBlendOperation(
+        (MTL::BlendOperation)blend.alphaOperation);
+    attachment->setSourceRGBBlendFactor(
+        (MTL::BlendFactor)blend.sourceRGBFactor);
+    attachment->setDestinationRGBBlendFactor(
+        (MTL::BlendFactor)blend.destinationRGBFactor);
+    attachment->setSourceAlphaBlendFactor(
+        (MTL::BlendFactor)blend.sourceAlphaFactor);
+    attachment->setDestinationAlphaBlendFactor(
+        (MTL::BlendFactor)blend.destinationAlphaFactor);
+    attachment->setWriteMask((MTL::ColorWriteMask)blend.writeMask);
+  }
+  renderPipelineDescriptor->setSampleCount(desc.sampleCount);
   renderPipelineDescriptor->setDepthAttachmentPixelFormat(
-      MTL::PixelFormatDepth32Float);
+      (MTL::PixelFormat)desc.depthFormat);
+  renderPipelineDescriptor->setStencilAttachmentPixelFormat(
+      (MTL::PixelFormat)desc.stencilFormat);
   renderPipelineDescriptor->setTessellationOutputWindingOrder(
       MTL::WindingClockwise);
 
-  NS::Error *error;
-  metalRenderPS0 =
+  NS::Error *error = nullptr;
+  MTL::RenderPipelineState *pipelineState =
       metalDevice->newRenderPipelineState(renderPipelineDescriptor, &error);
-
-  if (metalRenderPS0 == nil) {
-    std::cout << "Error creating render pipeline state: " << error << std::endl;
-    std::exit(0);
+  if (!pipelineState) {
+    std::cerr << "Error creating render pipeline state " << desc.label << ": "
+              << (error ? error->localizedDescription()->utf8String() : "")
+              << std::endl;
+  } else {
+    MTL::DepthStencilDescriptor *depthStencilDescriptor =
+        MTL::DepthStencilDescriptor::alloc()->init();
+    depthStencilDescriptor->setDepthCompareFunction(
+        (MTL::CompareFunction)desc.depthCompare);
+    depthStencilDescriptor->setDepthWriteEnabled(desc.depthWrite);
+    compiled.pipeline = pipelineState;
+    compiled.depthStencil =
+        metalDevice->newDepthStencilState(depthStencilDescriptor);
+    depthStencilDescriptor->release();
   }
 
-  MTL::DepthStencilDescriptor *depthStencilDescriptor =
-      MTL::DepthStencilDescriptor::alloc()->init();
-  depthStencilDescriptor->setDepthCompareFunction(
-      MTL::CompareFunctionLessEqual);
-  depthStencilDescriptor->setDepthWriteEnabled(true);
-  depthStencilState = metalDevice->newDepthStencilState(depthStencilDescriptor);
-
   renderPipelineDescriptor->release();
-  depthStencilDescriptor->release();
   vertexShader->release();
-  fragmentShader->release();
-};
+  if (fragmentShader) {
+    fragmentShader->release();
+  }
+  pool->release();
+  return compiled;
+}
 
-void MTLEngine::createLightSourceRenderPipeline() {
-  MTL::Function *vertexShader = metalDefaultLibrary->newFunction(
-      NS::String::string("lightVertexShader", NS::ASCIIStringEncoding));
-  assert(vertexShader);
-  MTL::Function *fragmentShader = metalDefaultLibrary->newFunction(
-      NS::String::string("lightFragmentShader", NS::ASCIIStringEncoding));
-  assert(fragmentShader);
+PipelineCache *MTLEngine::newPipelineCache(MTL::Library *library) {
+  PipelineCache::Backend backend;
+  backend.compile = [this, library](const PipelineDesc &desc) {
+    return compilePipeline(desc, library);
+  };
+  backend.destroy = [](const CompiledPipeline &compiled) {
+    static_cast<MTL::RenderPipelineState *>(compiled.pipeline)->release();
+    static_cast<MTL::DepthStencilState *>(compiled.depthStencil)->release();
+  };
+  return new PipelineCache(backend);
+}
 
-  MTL::RenderPipelineDescriptor *renderPipelineDescriptor =
-      MTL::RenderPipelineDescriptor::alloc()->init();
-  renderPipelineDescriptor->setLabel(
-      NS::String::string("Light Rendering Pipeline", NS::ASCIIStringEncoding));
-  renderPipelineDescriptor->setVertexFunction(vertexShader);
-  renderPipelineDescriptor->setFragmentFunction(fragmentShader);
-  assert(renderPipelineDescriptor);
+void MTLEngine::createPipelineCache() {
+  pipelineCache = newPipelineCache(metalDefaultLibrary);
 
-  MTL::PixelFormat pixelFormat = metalLayer->pixelFormat();
-  renderPipelineDescriptor->colorAttachments()->object(0)->setPixelFormat(
-      pixelFormat);
-  renderPipelineDescriptor->setSampleCount(sampleCount);
-  renderPipelineDescriptor->setDepthAttachmentPixelFormat(
-      MTL::PixelFormatDepth32Float);
-  renderPipelineDescriptor->setTessellationOutputWindingOrder(
-      MTL::WindingClockwise);
+  // Start compiling last run's pipelines while the rest of the engine is set
+  // up. A manifest from a different layer format or sample count is harmless,
+  // those pipelines just never get used.
+  std::vector<PipelineDesc> manifest =
+      PipelineCache::loadManifest(pipelineManifestPath);
+  pipelineCache->prewarm(manifest);
+  std::cout << "Prewarming " << manifest.size() << " pipelines" << std::endl;
+}
 
-  NS::Error *error;
-  metalLightSourceRenderPSO =
-      metalDevice->newRenderPipelineState(renderPipelineDescriptor, &error);
+PipelineDesc MTLEngine::objPipelineDesc() {
+  return forwardPermutations.describe(
+      objShaderFeatures, mainPassPipelineDesc("Obj Rendering Pipeline"));
+}
 
-  if (metalLightSourceRenderPSO == nil) {
-    std::cout << "Error creating light render pipeline state: " << error
-              << std::endl;
+PipelineDesc MTLEngine::lightPipelineDesc() {
+  PipelineDesc desc = mainPassPipelineDesc("Light Rendering Pipeline");
+  desc.vertexFunction = "lightVertexShader";
+  desc.fragmentFunction = "lightFragmentShader";
+  return desc;
+}
+
+PipelineDesc MTLEngine::shadowPipelineDesc() {
+  PipelineDesc desc;
+  desc.label = "Shadow Pipeline";
+  desc.vertexFunction = "shadowVertexShader";
+  desc.depthFormat = MTL::PixelFormatDepth32Float;
+  desc.sampleCount = 1;
+  desc.depthCompare = MTL::CompareFunctionLessEqual;
+  desc.depthWrite = true;
+  return desc;
+}
+
+PipelineDesc MTLEngine::depthPrepassPipelineDesc() {
+  // Same attachments as the forward pass it runs in, with colour writes off
+  PipelineDesc desc = mainPassPipelineDesc("Depth Pre-pass Pipeline");
+  desc.vertexFunction = "depthPrepassVertexShader";
+  desc.blend[0].writeMask = MTL::ColorWriteMaskNone;
+  return desc;
+}
+
+void MTLEngine::createRenderPipeline() {
+  CompiledPipeline compiled = pipelineCache->acquire(objPipelineDesc());
+  if (!compiled.valid()) {
     std::exit(0);
   }
+  metalRenderPS0 = static_cast<MTL::RenderPipelineState *>(compiled.pipeline);
+  depthStencilState =
+      static_cast<MTL::DepthStencilState *>(compiled.depthStencil);
+};
 
-  renderPipelineDescriptor->release();
-  vertexShader->release();
-  fragmentShader->release();
+void MTLEngine::createLightSourceRenderPipeline() {
+  CompiledPipeline compiled = pipelineCache->acquire(lightPipelineDesc());
+  if (!compiled.valid()) {
+    std::exit(0);
+  }
+  metalLightSourceRenderPSO =
+      static_cast<MTL::RenderPipelineState *>(compiled.pipeline);
 };
 
-void MTLEngine::createDepthAndMSAATextures() {
-  MTL::TextureDescriptor *msaaTextureDescriptor =
-      MTL::TextureDescriptor::alloc()->init();
-  CGSize drawableSize = metalLayer->drawableSize();
+void MTLEngine::createShadowPipeline() {
+  CompiledPipeline compiled = pipelineCache->acquire(shadowPipelineDesc());
+  if (!compiled.valid()) {
+    std::exit(0);
+  }
+  shadowPipeline = static_cast<MTL::RenderPipelineState *>(compiled.pipeline);
+  shadowDepthState =
+      static_cast<MTL::DepthStencilState *>(compiled.depthStencil);
+}
 
-  msaaTextureDescriptor->setTextureType(MTL::TextureType2DMultisample);
-  msaaTextureDescriptor->setPixelFormat(MTL::PixelFormatBGRA8Unorm);
-  msaaTextureDescriptor->setWidth(drawableSize.width);
-  msaaTextureDescriptor->setHeight(drawableSize.height);
-  msaaTextureDescriptor->setSampleCount(sampleCount);
-  msaaTextureDescriptor->setUsage(MTL::TextureUsageRenderTarget);
+void MTLEngine::createDepthPrepassPipeline() {
+  CompiledPipeline compiled =
+      pipelineCache->acquire(depthPrepassPipelineDesc());
+  if (!compiled.valid()) {
+    std::exit(0);
+  }
+  depthPrepassPipeline =
+      static_cast<MTL::RenderPipelineState *>(compiled.pipeline);
+  depthPrepassDepthState =
+      static_cast<MTL::DepthStencilState *>(compiled.depthStencil);
+
+  if (!equalDepthState) {
+    MTL::DepthStencilDescriptor *descriptor =
+        MTL::DepthStencilDescriptor::alloc()->init();
+    descriptor->setDepthCompareFunction(MTL::CompareFunctionEqual);
+    descriptor->setDepthWriteEnabled(false);
+    equalDepthState = metalDevice->newDepthStencilState(descriptor);
+    descriptor->release();
+  }
+}
 
-  msaaRenderTargetTexture = metalDevice->newTexture(msaaTextureDescriptor);
+void ComputePipelines::release() {
+  for (MTL::ComputePipelineState *pipeline :
+       {cull, cullLate, hizCopy, hizDownsample}) {
+    if (pipeline) {
+      pipeline->release();
+    }
+  }
+  *this = {};
+}
 
-  MTL::TextureDescriptor *depthTextureDescriptor =
-      MTL::TextureDescriptor::alloc()->init();
-  depthTextureDescriptor->setTextureType(MTL::TextureType2DMultisample);
-  depthTextureDescriptor->setPixelFormat(MTL::PixelFormatDepth32Float);
-  depthTextureDescriptor->setWidth(drawableSize.width);
-  depthTextureDescriptor->setHeight(drawableSize.height);
-  depthTextureDescriptor->setUsage(MTL::TextureUsageRenderTarget);
-  depthTextureDescriptor->setSampleCount(sampleCount);
+MTL::ComputePipelineState *
+MTLEngine::newComputePipeline(MTL::Library *library,
+                              const char *functionName) {
+  MTL::Function *function = library->newFunction(
+      NS::String::string(functionName, NS::UTF8StringEncoding));
+  if (!function) {
+    std::cerr << "Failed to find the " << functionName << " kernel"
+              << std::endl;
+    return nullptr;
+  }
+  NS::Error *error = nullptr;
+  MTL::ComputePipelineState *pipeline =
+      metalDevice->newComputePipelineState(function, &error);
+  function->release();
+  if (!pipeline) {
+    std::cerr << "Error creating " << functionName << " pipeline state: "
+              << (error ? error->localizedDescription()->utf8String() : "")
+              << std::endl;
+  }
+  return pipeline;
+}
 
-  depthTexture = metalDevice->newTexture(depthTextureDescriptor);
+ComputePipelines MTLEngine::newComputePipelines(MTL::Library *library) {
+  ComputePipelines pipelines;
+  pipelines.cull = newComputePipeline(library, "cullInstances");
+  pipelines.cullLate = newComputePipeline(library, "cullOccludedInstances");
+  pipelines.hizCopy = newComputePipeline(library, "copyDepthToHiZ");
+  pipelines.hizDownsample = newComputePipeline(library, "downsampleHiZ");
+  if (!pipelines.valid()) {
+    pipelines.release();
+  }
+  return pipelines;
+}
 
-  msaaTextureDescriptor->release();
-  depthTextureDescriptor->release();
+void MTLEngine::createCullBuffers() {
+  cullLayout = makeCullFrameLayout(maxCullObjects);
+  cullBuffer = bufferAllocator->allocate(
+      cullLayout.size * maxFramesInFlight,
+      GpuBufferAllocator::uniformAlignment);
+  cullObjects.reserve(maxCullObjects);
+}
+
+void MTLEngine::createClusterBuffers() {
+  clusterLayout =
+      makeClusterFrameLayout(maxPointLights, maxClusterLightIndices);
+  clusterBuffer = bufferAllocator->allocate(
+      clusterLayout.size * maxFramesInFlight,
+      GpuBufferAllocator::uniformAlignment);
+
+  // The white key light, where the light source cube is drawn
+  pointLights.push_back(
+      {{-1.0f, 0.75f, 1.0f}, 10.0f, {1.0f, 1.0f, 1.0f, 1.0f}});
+  // And a ring of small coloured lights around the obj
+  constexpr uint32_t ringLights = 32;
+  for (uint32_t i = 0; i < ringLights; i++) {
+    float angle = 2.0f * M_PI * i / ringLights;
+    float hue = (float)i / ringLights;
+    PointLight light;
+    light.position[0] = 1.5f * std::cos(angle);
+    light.position[1] = -0.5f;
+    light.position[2] = -1.5f + 1.5f * std::sin(angle);
+    light.radius = 1.0f;
+    light.color[0] = 0.5f + 0.5f * std::cos(2.0f * M_PI * hue);
+    light.color[1] = 0.5f + 0.5f * std::cos(2.0f * M_PI * (hue - 1.0f / 3));
+    light.color[2] = 0.5f + 0.5f * std::cos(2.0f * M_PI * (hue - 2.0f / 3));
+    light.color[3] = 1.0f;
+    pointLights.push_back(light);
+  }
+}
+
+void MTLEngine::createShadowResources() {
+  // Casters are the culled obj instances
+  shadowLayout = makeShadowFrameLayout(maxCullObjects);
+  shadowBuffer = bufferAllocator->allocate(
+      shadowLayout.size * maxFramesInFlight,
+      GpuBufferAllocator::uniformAlignment);
+
+  // Rendered and sampled within the frame, so one is enough for every frame
+  // in flight: the GPU runs their command buffers in order
+  MTL::TextureDescriptor *descriptor = MTL::TextureDescriptor::alloc()->init();
+  descriptor->setTextureType(MTL::TextureType2DArray);
+  descriptor->setPixelFormat(MTL::PixelFormatDepth32Float);
+  descriptor->setWidth(ShadowMapResolution);
+  descriptor->setHeight(ShadowMapResolution);
+  descriptor->setArrayLength(ShadowCascadeCount);
+  descriptor->setUsage(MTL::TextureUsageRenderTarget |
+                       MTL::TextureUsageShaderRead);
+  descriptor->setStorageMode(MTL::StorageModePrivate);
+  shadowMap = metalDevice->newTexture(descriptor);
+  shadowMap->setLabel(
+      NS::String::string("Shadow Map", NS::UTF8StringEncoding));
+  descriptor->release();
+}
+
+void MTLEngine::createHiZPyramid() {
+  CGSize drawableSize = targetSize();
+  // Like the shadow map, one pyramid serves every frame in flight: each
+  // frame's early pass reads it before the frame rebuilds it, and the GPU
+  // runs the frames in order
+  uint32_t width = drawableSize.width;
+  uint32_t height = drawableSize.height;
+  uint32_t mipCount = hizMipCount(width, height);
+  MTL::TextureDescriptor *descriptor = MTL::TextureDescriptor::alloc()->init();
+  descriptor->setTextureType(MTL::TextureType2D);
+  descriptor->setPixelFormat(MTL::PixelFormatR32Float);
+  descriptor->setWidth(width);
+  descriptor->setHeight(height);
+  descriptor->setMipmapLevelCount(mipCount);
+  descriptor->setUsage(MTL::TextureUsageShaderRead |
+                       MTL::TextureUsageShaderWrite);
+  descriptor->setStorageMode(MTL::StorageModePrivate);
+  hizPyramid = metalDevice->newTexture(descriptor);
+  hizPyramid->setLabel(NS::String::string("Hi-Z", NS::UTF8StringEncoding));
+  descriptor->release();
+  for (uint32_t level = 0; level < mipCount; level++) {
+    hizPyramidLevels.push_back(hizPyramid->newTextureView(
+        MTL::PixelFormatR32Float, MTL::TextureType2D, NS::Range(level, 1),
+        NS::Range(0, 1)));
+  }
+  hizPyramidValid = false;
+}
+
+void MTLEngine::releaseHiZPyramid() {
+  // Frames still in flight keep their own references
+  for (MTL::Texture *level : hizPyramidLevels) {
+    level->release();
+  }
+  hizPyramidLevels.clear();
+  hizPyramid->release();
+  hizPyramid = nullptr;
 }
 
 void MTLEngine::createRenderPassDescriptor() {
@@ -589,201 +1244,1384 @@ void MTLEngine::createRenderPassDescriptor() {
   MTL::RenderPassDepthAttachmentDescriptor *depthAttachment =
       renderPassDescriptor->depthAttachment();
 
-  colorAttachment->setTexture(msaaRenderTargetTexture);
-  colorAttachment->setResolveTexture(metalDrawable->texture());
   colorAttachment->setLoadAction(MTL::LoadActionClear);
   colorAttachment->setClearColor(
       MTL::ClearColor(41.0f / 255.0f, 42.0f / 255.0f, 48.0f / 255.0f, 1.0));
   colorAttachment->setStoreAction(MTL::StoreActionMultisampleResolve);
 
-  depthAttachment->setTexture(depthTexture);
   depthAttachment->setLoadAction(MTL::LoadActionClear);
   depthAttachment->setStoreAction(MTL::StoreActionDontCare);
   depthAttachment->setClearDepth(1.0);
+
+  // Hi-Z culling's late draws, on top of what the forward pass left
+  lateRenderPassDescriptor = MTL::RenderPassDescriptor::alloc()->init();
+  colorAttachment = lateRenderPassDescriptor->colorAttachments()->object(0);
+  colorAttachment->setLoadAction(MTL::LoadActionLoad);
+  colorAttachment->setStoreAction(MTL::StoreActionMultisampleResolve);
+  depthAttachment = lateRenderPassDescriptor->depthAttachment();
+  depthAttachment->setLoadAction(MTL::LoadActionLoad);
+  depthAttachment->setStoreAction(MTL::StoreActionDontCare);
+}
+
+void MTLEngine::updateRenderPassDescriptor(MTL::Texture *msaaColor,
+                                           MTL::Texture *depth,
+                                           MTL::Texture *hizDepth) {
+  MTL::RenderPassColorAttachmentDescriptor *colorAttachment =
+      renderPassDescriptor->colorAttachments()->object(0);
+  MTL::RenderPassDepthAttachmentDescriptor *depthAttachment =
+      renderPassDescriptor->depthAttachment();
+  colorAttachment->setTexture(msaaColor);
+  colorAttachment->setResolveTexture(targetTexture());
+  depthAttachment->setTexture(depth);
+  if (hizCulling) {
+    // Resolved by the late pass instead. The depth's farthest sample is kept
+    // for the pyramid, so nothing is hidden behind a partly covered pixel.
+    colorAttachment->setStoreAction(MTL::StoreActionStore);
+    depthAttachment->setStoreAction(
+        MTL::StoreActionStoreAndMultisampleResolve);
+    depthAttachment->setResolveTexture(hizDepth);
+    depthAttachment->setDepthResolveFilter(
+        MTL::MultisampleDepthResolveFilterMax);
+  } else {
+    colorAttachment->setStoreAction(MTL::StoreActionMultisampleResolve);
+    depthAttachment->setStoreAction(MTL::StoreActionDontCare);
+    depthAttachment->setResolveTexture(nullptr);
+  }
+
+  colorAttachment = lateRenderPassDescriptor->colorAttachments()->object(0);
+  colorAttachment->setTexture(msaaColor);
+  colorAttachment->setResolveTexture(targetTexture());
+  lateRenderPassDescriptor->depthAttachment()->setTexture(depth);
 }
 
-void MTLEngine::updateRenderPassDescriptor() {
-  renderPassDescriptor->colorAttachments()->object(0)->setTexture(
-      msaaRenderTargetTexture);
-  renderPassDescriptor->colorAttachments()->object(0)->setResolveTexture(
-      metalDrawable->texture());
-  renderPassDescriptor->depthAttachment()->setTexture(depthTexture);
+void MTLEngine::updateTextureStreaming(simd::float3 cameraPosition,
+                                       simd::float3 cameraForward, float fov,
+                                       float viewportHeight) {
+  if (streamedTextures.empty()) {
+    return;
+  }
+  StreamingView view;
+  view.cameraPosition = {cameraPosition.x, cameraPosition.y, cameraPosition.z};
+  view.cameraForward = {cameraForward.x, cameraForward.y, cameraForward.z};
+  view.fovY = fov;
+  view.viewportHeight = viewportHeight;
+
+  for (const StreamingChange &change : textureStreamer.update(view)) {
+    streamedTextures[change.textureId]->setResidentMip(change.residentMip);
+  }
 }
 
-void MTLEngine::draw() { sendRenderCommand(); };
+// The texture behind one of frameTargets, or null for an unused one
+static MTL::Texture *frameTexture(const RenderGraphPassContext &context,
+                                  RGResource resource) {
+  if (resource == invalidRGResource) {
+    return nullptr;
+  }
+  return static_cast<MTL::Texture *>(context.texture(resource));
+}
 
-void MTLEngine::sendRenderCommand() {
-  std::cout << "=== sendRenderCommand ===" << std::endl;
+void MTLEngine::buildFrameGraph() {
+  CGSize drawableSize = targetSize();
+  // The MSAA samples are resolved into the drawable and depth is DontCare, so
+  // on Apple GPUs neither needs to be backed by memory at all. Hi-Z culling
+  // draws on top of both in a second pass, so they have to be stored.
+  RGTextureDesc colorDesc;
+  colorDesc.width = drawableSize.width;
+  colorDesc.height = drawableSize.height;
+  colorDesc.pixelFormat = MTL::PixelFormatBGRA8Unorm;
+  colorDesc.sampleCount = sampleCount;
+  colorDesc.usage = MTL::TextureUsageRenderTarget;
+  colorDesc.memoryless = useMemorylessAttachments && !hizCulling;
+  RGTextureDesc depthDesc = colorDesc;
+  depthDesc.pixelFormat = MTL::PixelFormatDepth32Float;
+  RGTextureDesc drawableDesc = colorDesc;
+  drawableDesc.sampleCount = 1;
+  drawableDesc.memoryless = false;
+
+  RGResource drawable = renderGraph->importTexture(
+      "Drawable", targetTexture(), drawableDesc);
+  RGTextureDesc shadowDesc;
+  shadowDesc.width = ShadowMapResolution;
+  shadowDesc.height = ShadowMapResolution;
+  shadowDesc.pixelFormat = MTL::PixelFormatDepth32Float;
+  shadowDesc.usage =
+      MTL::TextureUsageRenderTarget | MTL::TextureUsageShaderRead;
+  RGResource shadows =
+      renderGraph->importTexture("Shadow Map", shadowMap, shadowDesc);
+  RGTextureDesc hizDesc = drawableDesc;
+  hizDesc.pixelFormat = MTL::PixelFormatR32Float;
+  hizDesc.usage = MTL::TextureUsageShaderRead | MTL::TextureUsageShaderWrite;
+  // Read by the next frame's culling, so it can't be transient
+  RGResource hiz = renderGraph->importTexture("Hi-Z", hizPyramid, hizDesc);
+  renderGraph->markOutput(drawable);
+
+  // Fills in the obj's indirect draw. It only writes buffers, which the
+  // graph doesn't track, so it's kept alive as a side effect and runs first
+  // by being declared first. It reads last frame's Hi-Z pyramid.
+  renderGraph->addPass(
+      "Cull",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(hiz);
+        builder.sideEffect();
+      },
+      [this](RenderGraphPassContext &context) {
+        encodeCulling(static_cast<MTL::CommandBuffer *>(context.userData));
+      });
+
+  // Every cascade of the key light's shadow map
+  renderGraph->addPass(
+      "Shadows", [&](RenderGraphBuilder &builder) { builder.write(shadows); },
+      [this](RenderGraphPassContext &context) {
+        encodeShadows(static_cast<MTL::CommandBuffer *>(context.userData));
+      });
+
+  // Obj and light draws, resolved into the drawable. The MSAA colour and
+  // depth, and with Hi-Z culling the resolved depth, are the graph's own.
+  // The execute functions run after this returns, so the handles are kept
+  // in frameTargets rather than captured.
+  frameTargets = {};
+  renderGraph->addPass(
+      "Forward",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(shadows);
+        frameTargets.msaaColor = builder.create("MSAA Color", colorDesc);
+        frameTargets.depth = builder.create("Depth", depthDesc);
+        builder.write(drawable);
+        if (hizCulling) {
+          RGTextureDesc hizDepthDesc = drawableDesc;
+          hizDepthDesc.pixelFormat = MTL::PixelFormatDepth32Float;
+          hizDepthDesc.usage =
+              MTL::TextureUsageRenderTarget | MTL::TextureUsageShaderRead;
+          frameTargets.hizDepth = builder.create("Hi-Z Depth", hizDepthDesc);
+        }
+      },
+      [this](RenderGraphPassContext &context) {
+        updateRenderPassDescriptor(
+            frameTexture(context, frameTargets.msaaColor),
+            frameTexture(context, frameTargets.depth),
+            frameTexture(context, frameTargets.hizDepth));
+        encodeDrawList(static_cast<MTL::CommandBuffer *>(context.userData));
+      });
+  if (!hizCulling) {
+    return;
+  }
+
+  // This frame's pyramid, from what the early draws left in the depth buffer
+  renderGraph->addPass(
+      "Hi-Z",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(frameTargets.hizDepth);
+        builder.write(hiz);
+      },
+      [this](RenderGraphPassContext &context) {
+        encodeHiZPyramid(static_cast<MTL::CommandBuffer *>(context.userData),
+                         frameTexture(context, frameTargets.hizDepth));
+      });
+
+  // The instances the early pass held back, tested against it
+  renderGraph->addPass(
+      "Cull Late",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(hiz);
+        builder.sideEffect();
+      },
+      [this](RenderGraphPassContext &context) {
+        encodeLateCulling(static_cast<MTL::CommandBuffer *>(context.userData));
+      });
+
+  // Draws the ones found visible and resolves into the drawable
+  renderGraph->addPass(
+      "Forward Late",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(shadows);
+        builder.write(frameTargets.msaaColor);
+        builder.write(frameTargets.depth);
+        builder.write(drawable);
+      },
+      [this](RenderGraphPassContext &context) {
+        encodeLateDraws(static_cast<MTL::CommandBuffer *>(context.userData));
+      });
+}
+
+namespace {
+// Library and pipelines built by a shader reload. Released again if the
+// reload is dropped before it's swapped in.
+struct ReloadedShaders {
+  MTL::Library *library = nullptr;
+  PipelineCache *cache = nullptr;
+  ComputePipelines computePipelines;
+
+  ~ReloadedShaders() {
+    delete cache;
+    computePipelines.release();
+    if (library) {
+      library->release();
+    }
+  }
+};
+} // namespace
+
+void MTLEngine::setupHotReload() {
+  fileWatcher = new FileWatcher();
+  hotReloader = new HotReloader(*fileWatcher);
+
+  // Rebuilding the shaders target replaces shaders.metallib. The new library
+  // and every pipeline used so far are compiled in the background and only
+  // swapped in if all of them compiled, so a shader error keeps the old ones.
+  hotReloader->add(shaderLibraryPath, [this]() -> std::function<void()> {
+    NS::AutoreleasePool *pool = NS::AutoreleasePool::alloc()->init();
+    auto shaders = std::make_shared<ReloadedShaders>();
+    NS::Error *error = nullptr;
+    shaders->library = metalDevice->newLibrary(
+        NS::String::string(shaderLibraryPath, NS::UTF8StringEncoding), &error);
+    if (!shaders->library) {
+      std::cerr << "Failed to reload metal library: "
+                << (error ? error->localizedDescription()->utf8String() : "")
+                << std::endl;
+      pool->release();
+      return {};
+    }
+    shaders->cache = newPipelineCache(shaders->library);
+    for (const PipelineDesc &desc : pipelineCache->descs()) {
+      if (!shaders->cache->compileNow(desc).valid()) {
+        pool->release();
+        return {};
+      }
+    }
+    shaders->computePipelines = newComputePipelines(shaders->library);
+    pool->release();
+    if (!shaders->computePipelines.valid()) {
+      return {};
+    }
+
+    return [this, shaders]() {
+      PipelineCache *oldCache = pipelineCache;
+      MTL::Library *oldLibrary = metalDefaultLibrary;
+      ComputePipelines oldComputePipelines = computePipelines;
+      retireQueue.retire(
+          [oldCache, oldLibrary, oldComputePipelines]() mutable {
+            delete oldCache;
+            oldLibrary->release();
+            oldComputePipelines.release();
+          });
+      pipelineCache = shaders->cache;
+      metalDefaultLibrary = shaders->library;
+      computePipelines = shaders->computePipelines;
+      shaders->cache = nullptr;
+      shaders->library = nullptr;
+      shaders->computePipelines = {};
+      // Already compiled, these only look the pipelines up
+      createRenderPipeline();
+      createLightSourceRenderPipeline();
+      createShadowPipeline();
+      createDepthPrepassPipeline();
+    };
+  });
+
+  // The model is parsed in the background, only the copy into the vertex
+  // buffer happens between frames
+  hotReloader->add(objModelPath, [this]() -> std::function<void()> {
+    auto vertices = std::make_shared<std::vector<VertexData>>();
+    if (!parseObjModel(objModelPath, *vertices)) {
+      return {};
+    }
+    auto positions = std::make_shared<std::vector<float>>(extractPositions(
+        vertices->data(), vertices->size(), sizeof(VertexData)));
+    return [this, vertices, positions]() {
+      BufferSlice slice = bufferAllocator->allocate(
+          vertices->data(), sizeof(VertexData) * vertices->size());
+      BufferSlice positionSlice = bufferAllocator->allocate(
+          positions->data(), sizeof(float) * positions->size());
+      if (!slice.valid() || !positionSlice.valid()) {
+        std::cerr << "Failed to allocate the reloaded obj vertex buffer"
+                  << std::endl;
+        bufferAllocator->release(slice);
+        bufferAllocator->release(positionSlice);
+        return;
+      }
+      BufferSlice oldSlice = objVertexBuffer;
+      BufferSlice oldPositionSlice = objPositionBuffer;
+      retireQueue.retire([this, oldSlice, oldPositionSlice]() mutable {
+        bufferAllocator->release(oldSlice);
+        bufferAllocator->release(oldPositionSlice);
+      });
+      objVertexBuffer = slice;
+      objPositionBuffer = positionSlice;
+      vertexCount = vertices->size();
+      objBoundingSphere = boundingSphere(*vertices);
+      Float4 sphere = {objBoundingSphere.x, objBoundingSphere.y,
+                       objBoundingSphere.z, objBoundingSphere.w};
+      entities.forEach<MeshComponent, BoundsComponent>(
+          [&](Entity, MeshComponent &mesh, BoundsComponent &bounds) {
+            if (mesh.mesh == ObjMesh) {
+              bounds.sphere = sphere;
+            }
+          });
+    };
+  });
+
+  if (marsTexture) {
+    hotReloader->add(marsTexturePath, [this]() -> std::function<void()> {
+      DecodedImage decoded =
+          decodeImageFile(marsTexturePath, true, &ThreadPool::shared());
+      if (!decoded.valid()) {
+        std::cerr << "Failed to reload " << marsTexturePath << ": "
+                  << decoded.error << std::endl;
+        return {};
+      }
+      // The streamer's bookkeeping is sized for the original mip chain
+      if (TextureStreamer::mipCountFor(decoded.width, decoded.height) !=
+          textureStreamer.mipCount(marsTextureId)) {
+        std::cerr << marsTexturePath
+                  << " changed size, restart to pick it up" << std::endl;
+        return {};
+      }
+      auto texture = std::make_shared<std::unique_ptr<Texture>>(
+          std::make_unique<Texture>(decoded, metalDevice, true));
+
+      return [this, texture]() {
+        Texture *oldTexture = marsTexture;
+        marsTexture = texture->release();
+        marsTexture->setResidentMip(textureStreamer.residentMip(marsTextureId));
+        streamedTextures[marsTextureId] = marsTexture;
+        retireQueue.retire([oldTexture]() { delete oldTexture; });
+      };
+    });
+  }
+  std::cout << "Watching assets for changes (" << fileWatcher->backendName()
+            << ")" << std::endl;
+}
 
-  if (!metalDrawable) {
+void MTLEngine::draw() {
+  sendRenderCommand();
+  attachmentPool->endFrame();
+  retireQueue.endFrame();
+  collectProfile();
+  reportPassStats();
+};
+
+void MTLEngine::sendRenderCommand() {
+  if (!offscreen && !metalDrawable) {
     std::cerr << "ERROR: metalDrawable is NULL!" << std::endl;
     return;
   }
-  std::cout << "metalDrawable OK" << std::endl;
 
   if (!metalCommandQueue) {
     std::cerr << "ERROR: metalCommandQueue is NULL!" << std::endl;
     return;
   }
-  std::cout << "metalCommandQueue OK" << std::endl;
+
+  // Wait until the GPU has finished with the oldest frame in flight, its
+  // uniform region is the one we are about to reuse
+  {
+    ProfileScope zone("Wait for GPU");
+    frameSemaphore.acquire();
+  }
+  uniformRing->beginFrame();
+  // The frame's samples in counterSampleBuffer are free again too
+  GpuClockSample clock;
+  if (counterSampleBuffer) {
+    MTL::Timestamp cpuTicks = 0;
+    metalDevice->sampleTimestamps(&cpuTicks, &clock.gpuTicks);
+    clock.nanoseconds = Profiler::now();
+  }
+  gpuZones.beginFrame(uniformRing->frameIndex(), clock);
+
   metalCommandBuffer = metalCommandQueue->commandBuffer();
   if (!metalCommandBuffer) {
     std::cerr << "ERROR: metalCommandBuffer is NULL!" << std::endl;
+    frameSemaphore.release();
     return;
   }
-  std::cout << "metalCommandBuffer OK" << std::endl;
-  updateRenderPassDescriptor();
   if (!renderPassDescriptor) {
     std::cerr << "ERROR: renderPassDescriptor is NULL!" << std::endl;
+    frameSemaphore.release();
     return;
   }
-  std::cout << "renderPassDescriptor OK" << std::endl;
-  MTL::RenderCommandEncoder *renderCommandEncoder =
-      metalCommandBuffer->renderCommandEncoder(renderPassDescriptor);
-  if (!renderCommandEncoder) {
-    std::cerr << "ERROR: renderCommandEncoder is NULL!" << std::endl;
-    return;
+
+  updateCamera();
+  frameCapturer.beginFrame(frameTime, uniformRing->frameIndex(), camera);
+  buildDrawList();
+  captureFrame();
+  {
+    ProfileScope zone("Compile frame graph");
+    buildFrameGraph();
+    if (!renderGraph->compile()) {
+      std::cerr << "ERROR: failed to compile the frame graph!" << std::endl;
+      renderGraph->reset();
+      frameSemaphore.release();
+      return;
+    }
+  }
+  if (offscreen) {
+    // Waits for frameWriter when it's a whole readbackQueue behind
+    ProfileScope zone("Wait for readback");
+    readbackSlot = readbackQueue->acquire();
+  }
+  {
+    ProfileScope zone("Encode frame graph");
+    renderGraph->execute(metalCommandBuffer);
+  }
+  if (offscreen) {
+    encodeReadback(metalCommandBuffer);
+  }
+  // Transient textures are released here, the command buffer keeps them
+  // alive until the GPU is done with them
+  renderGraph->reset();
+
+  if (offscreen) {
+    // Hands the frame to frameWriter once it's been copied back
+    metalCommandBuffer->addCompletedHandler(
+        [this, slot = readbackSlot,
+         frame = offscreenFrame](MTL::CommandBuffer *) {
+          readbackQueue->complete(slot, frame, offscreenOptions.width,
+                                  offscreenOptions.height,
+                                  readbackBytesPerRow(offscreenOptions.width));
+        });
+  } else {
+    metalCommandBuffer->presentDrawable(metalDrawable);
   }
-  std::cout << "renderCommandEncoder OK" << std::endl;
-  encodeRenderCommand(renderCommandEncoder);
-  std::cout << "About to end encoding..." << std::endl;
-  renderCommandEncoder->endEncoding();
-  std::cout << "Encoding ended" << std::endl;
 
-  std::cout << "About to present drawable..." << std::endl;
-  metalCommandBuffer->presentDrawable(metalDrawable);
-  std::cout << "Drawable presented" << std::endl;
+  // Hand the frame's uniform region back once the GPU is done with it
+  metalCommandBuffer->addCompletedHandler(
+      [this, zones = gpuZones.frame()](MTL::CommandBuffer *commandBuffer) {
+        recordGpuZones(commandBuffer, zones);
+        frameSemaphore.release();
+      });
 
-  std::cout << "About to commit..." << std::endl;
+  ProfileScope zone("Commit");
   metalCommandBuffer->commit();
-  std::cout << "Committed" << std::endl;
-
-  std::cout << "Waiting for completion..." << std::endl;
-  metalCommandBuffer->waitUntilCompleted();
-  std::cout << "Completed!" << std::endl;
 };
 
-// Define the modal, view, perspective projection's here in the render command
-void MTLEngine::encodeRenderCommand(
-    MTL::RenderCommandEncoder *renderCommandEncoder) {
-  std::cout << "=== START encodeRenderCommand ===" << std::endl;
-  std::cout << "drawing " << vertexCount << " vertices " << std::endl;
+// Host time in seconds, the clock of a command buffer's GPUStartTime and
+// GPUEndTime
+static double hostSeconds() {
+  static const double secondsPerTick = [] {
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    return timebase.numer / (timebase.denom * 1e9);
+  }();
+  return mach_absolute_time() * secondsPerTick;
+}
 
-  if (!objVertexBuffer) {
-    std::cerr << "ERROR: objVertexBuffer is NULL" << std::endl;
+void MTLEngine::recordGpuZones(MTL::CommandBuffer *commandBuffer,
+                               const GpuZoneRecorder::Frame &zones) {
+  Profiler &profiler = Profiler::shared();
+  uint64_t now = Profiler::now();
+  double hostNow = hostSeconds();
+  auto toProfilerClock = [&](double seconds) {
+    return (uint64_t)((int64_t)now + std::llround((seconds - hostNow) * 1e9));
+  };
+  profiler.record("GPU Frame", toProfilerClock(commandBuffer->GPUStartTime()),
+                  toProfilerClock(commandBuffer->GPUEndTime()),
+                  ProfileTrack::GpuCommandBuffer);
+
+  if (!counterSampleBuffer || zones.names.empty()) {
+    return;
+  }
+  NS::Data *samples = counterSampleBuffer->resolveCounterRange(
+      NS::Range(zones.firstSample, zones.names.size() * 2));
+  if (!samples) {
     return;
   }
-  std::cout << "objVertexBuffer OK" << std::endl;
+  GpuClockSample clock;
+  MTL::Timestamp cpuTicks = 0;
+  metalDevice->sampleTimestamps(&cpuTicks, &clock.gpuTicks);
+  clock.nanoseconds = Profiler::now();
+  // An array of MTL::CounterResultTimestamp, a single uint64_t each
+  GpuZoneRecorder::resolve(
+      zones, clock, static_cast<const uint64_t *>(samples->mutableBytes()),
+      profiler);
+}
 
-  if (!objTransformationBuffer) {
-    std::cerr << "ERROR: objTransformationBuffer is NULL" << std::endl;
+void MTLEngine::timeRenderPass(MTL::RenderPassDescriptor *descriptor,
+                               const char *name) {
+  MTL::RenderPassSampleBufferAttachmentDescriptor *attachment =
+      descriptor->sampleBufferAttachments()->object(0);
+  uint32_t sample = counterSampleBuffer ? gpuZones.addZone(name)
+                                        : GpuZoneRecorder::noSample;
+  if (sample == GpuZoneRecorder::noSample) {
+    attachment->setSampleBuffer(nullptr);
+    return;
+  }
+  attachment->setSampleBuffer(counterSampleBuffer);
+  attachment->setStartOfVertexSampleIndex(sample);
+  attachment->setEndOfVertexSampleIndex(MTL::CounterDontSample);
+  attachment->setStartOfFragmentSampleIndex(MTL::CounterDontSample);
+  attachment->setEndOfFragmentSampleIndex(sample + 1);
+}
+
+MTL::ComputeCommandEncoder *
+MTLEngine::newComputeEncoder(MTL::CommandBuffer *commandBuffer,
+                             const char *name) {
+  uint32_t sample = counterSampleBuffer ? gpuZones.addZone(name)
+                                        : GpuZoneRecorder::noSample;
+  if (sample == GpuZoneRecorder::noSample) {
+    return commandBuffer->computeCommandEncoder();
+  }
+  MTL::ComputePassDescriptor *descriptor =
+      MTL::ComputePassDescriptor::computePassDescriptor();
+  MTL::ComputePassSampleBufferAttachmentDescriptor *attachment =
+      descriptor->sampleBufferAttachments()->object(0);
+  attachment->setSampleBuffer(counterSampleBuffer);
+  attachment->setStartOfEncoderSampleIndex(sample);
+  attachment->setEndOfEncoderSampleIndex(sample + 1);
+  return commandBuffer->computeCommandEncoder(descriptor);
+}
+
+void MTLEngine::collectProfile() {
+  uint64_t now = Profiler::now();
+  if (lastFrameStart) {
+    cpuFrameTimes.add((now - lastFrameStart) / 1e6);
+  }
+  lastFrameStart = now;
+
+  frameEvents.clear();
+  Profiler::shared().collect(frameEvents);
+  for (const ProfileEvent &event : frameEvents) {
+    if (event.track == ProfileTrack::GpuCommandBuffer) {
+      gpuFrameTimes.add((event.endNanoseconds - event.startNanoseconds) / 1e6);
+    }
+  }
+
+  if (!traceFramesLeft) {
+    return;
+  }
+  traceEvents.insert(traceEvents.end(), frameEvents.begin(),
+                     frameEvents.end());
+  if (--traceFramesLeft == 0) {
+    if (writeChromeTrace(traceCapturePath, traceEvents,
+                         Profiler::shared().threadNames())) {
+      std::cout << "Wrote " << traceEvents.size() << " zones to "
+                << traceCapturePath << std::endl;
+    }
+    traceEvents.clear();
+  }
+}
+
+// SceneGraph works in engine_math types, which share simd's column-major
+// layout
+static Float4x4 toFloat4x4(const matrix_float4x4 &matrix) {
+  Float4x4 result;
+  memcpy(&result, &matrix, sizeof(result));
+  return result;
+}
+
+static matrix_float4x4 toSimdMatrix(const Float4x4 &matrix) {
+  matrix_float4x4 result;
+  memcpy(&result, &matrix, sizeof(result));
+  return result;
+}
+
+void MTLEngine::createOccluderMeshes() {
+  // A unit cube, scaled by the entity's transform into walls and floors
+  Mesh box = generateCube(1.0f);
+  OccluderMesh boxOccluder;
+  boxOccluder.positions = extractPositions(
+      box.vertices.data(), box.vertices.size(), sizeof(MeshVertex));
+  boxOccluder.indices = box.indices;
+  occluderMeshes.push_back(std::move(boxOccluder));
+}
+
+void MTLEngine::createScene() {
+  createOccluderMeshes();
+  objNode = scene.createNode();
+  // Same position as the key light, see createClusterBuffers
+  simd_float4 lightPosition = simd_make_float4(-1.0, 0.75, 1.0, 1.0);
+  lightNode = scene.createNode(
+      invalidSceneNode,
+      toFloat4x4(simd_mul(matrix4x4_translation(lightPosition.xyz),
+                          matrix4x4_scale(0.25f, 0.25f, 0.25f))));
+
+  MaterialComponent objMaterial;
+  objMaterial.color = {0.0f, 0.48f, 0.65f, 1.0f};
+  objMaterial.pipeline = LitPipeline;
+  objMaterial.texture = marsTexture ? marsTextureId : noMaterialTexture;
+  entities.create(TransformComponent{}, MeshComponent{ObjMesh}, objMaterial,
+                  BoundsComponent{{objBoundingSphere.x, objBoundingSphere.y,
+                                   objBoundingSphere.z, objBoundingSphere.w}},
+                  SceneNodeComponent{objNode});
+
+  MaterialComponent lightMaterial;
+  lightMaterial.pipeline = LightSourcePipeline;
+  entities.create(TransformComponent{}, MeshComponent{LightMesh},
+                  lightMaterial, SceneNodeComponent{lightNode});
+}
+
+void MTLEngine::bindMesh(DrawItem &draw, uint32_t mesh) const {
+  switch (mesh) {
+  case ObjMesh:
+    draw.vertices = objVertexBuffer;
+    draw.positions = objPositionBuffer;
+    draw.vertexCount = vertexCount;
+    break;
+  case LightMesh:
+    draw.vertices = lightVertexBuffer;
+    draw.indexBuffer = lightIndexBuffer;
+    draw.indexCount = lightIndexCount;
+    break;
+  case SphereMesh:
+    draw.vertices = sphereVertexBuffer;
+    draw.indexBuffer = sphereIndexBuffer;
+    draw.indexCount = sphereIndexCount;
+    break;
+  }
+}
+
+// Define the modal, view, perspective projection's here in the render command
+void MTLEngine::updateCamera() {
+  CGSize drawableSize = targetSize();
+  camera = FrameCamera();
+  camera.fov = 90 * (M_PI / 180.0f);
+  camera.nearZ = 0.1f;
+  camera.farZ = 100.0f;
+  camera.viewportWidth = drawableSize.width;
+  camera.viewportHeight = drawableSize.height;
+}
+
+void MTLEngine::buildDrawList() {
+  drawList.clear();
+  lateDrawList.clear();
+  cullObjects.clear();
+  // Ids only have to be consistent within the frame. Starting over keeps
+  // them dense and forgets pipelines and textures released since, whose
+  // addresses may come back as different objects.
+  pipelineKeyIds.clear();
+  materialKeyIds.clear();
+  ProfileScope zone("Build draw list");
+
+  if (!objVertexBuffer.valid()) {
+    std::cerr << "ERROR: objVertexBuffer is NULL" << std::endl;
     return;
   }
-  std::cout << "objTransformationBuffer OK" << std::endl;
 
   // Moves 1.5  units down the negative z-axis
   matrix_float4x4 translationMatrix = matrix4x4_translation(0, 0, -1.5);
   matrix_float4x4 scaleMatrix = matrix4x4_scale(1.2, 1.2, 1.2);
 
   matrix_float4x4 sizeMatrix = matrix_multiply(translationMatrix, scaleMatrix);
-  std::cout << "Matrices created" << std::endl;
 
   // Rotate the sphere by 90 degrees
-  float angleInDegrees = glfwGetTime() / 4.0 * 45;
+  float angleInDegrees = frameTime / 4.0 * 45;
   float angleInRadians = angleInDegrees * M_PI / 180.0f;
   matrix_float4x4 rotationMatrix =
       matrix4x4_rotation(angleInRadians, 0.0, 1.0, 0.0);
 
-  matrix_float4x4 modelMatrix = simd_mul(sizeMatrix, rotationMatrix);
-  std::cout << "Model matrix calculated" << std::endl;
-
-  simd::float3 R = simd::float3{1, 0, 0};  // Unit-Right
-  simd::float3 U = simd::float3{0, 1, 0};  // Unit-Up
-  simd::float3 F = simd::float3{0, 0, -1}; // Unit-Forward
-  simd::float3 P = simd::float3{0, 0, 0};  // Camera Position in World Space
+  scene.setLocalTransform(objNode,
+                          toFloat4x4(simd_mul(sizeMatrix, rotationMatrix)));
+  // Only the obj is dirty, so the light keeps last frame's world matrix
+  scene.updateWorldTransforms();
+  entities.forEachChunk<SceneNodeComponent, TransformComponent>(
+      [this](size_t count, const Entity *, SceneNodeComponent *nodes,
+             TransformComponent *transforms) {
+        for (size_t i = 0; i < count; i++) {
+          transforms[i].model = scene.worldTransform(nodes[i].node);
+        }
+      });
+
+  // Camera Position in World Space, and its Unit-Forward, Unit-Right and
+  // Unit-Up vectors
+  simd::float3 P = {camera.position.x, camera.position.y, camera.position.z};
+  simd::float3 F = simd_normalize(simd::float3{
+      camera.forward.x, camera.forward.y, camera.forward.z});
+  simd::float3 R = simd_normalize(
+      simd_cross(F, simd::float3{camera.up.x, camera.up.y, camera.up.z}));
+  simd::float3 U = simd_cross(R, F);
 
   matrix_float4x4 viewMatrix = matrix_make_rows(
       R.x, R.y, R.z, simd::dot(-R, P), U.x, U.y, U.z, simd::dot(-U, P), -F.x,
       -F.y, -F.z, simd::dot(F, P), 0, 0, 0, 1);
-  std::cout << "View matrix created" << std::endl;
 
-  // Get the aspect ratio
-  // In the future, we could probably do this in the init and store it such that
-  // we can control when it's resized ahead of time
-  CGSize drawableSize = metalLayer->drawableSize();
-  float aspectRatio = (drawableSize.width / drawableSize.height);
-  float fov = 90 * (M_PI / 180.0f);
-  float nearZ = 0.1f;
-  float farZ = 100.0f;
+  CGSize drawableSize = {camera.viewportWidth, camera.viewportHeight};
+  float aspectRatio = camera.aspectRatio();
+  float fov = camera.fov;
+  float nearZ = camera.nearZ;
+  float farZ = camera.farZ;
 
   matrix_float4x4 perspectiveMatrix =
       matrix_perspective_right_hand(fov, aspectRatio, nearZ, farZ);
-  std::cout << "Perspective matrix created" << std::endl;
-  TransformationData transformationData = {modelMatrix, viewMatrix,
-                                           perspectiveMatrix};
-
-  std::cout << "About to memcpy transformation data" << std::endl;
-  memcpy(objTransformationBuffer->contents(), &transformationData,
-         sizeof(transformationData));
-  std::cout << "memcpy complete" << std::endl;
+  updateTextureStreaming(P, F, fov, drawableSize.height);
+  prepareClustering(viewMatrix, fov, aspectRatio, nearZ, farZ, drawableSize);
 
   // Sphere Vertex Shader Data
   simd_float4 lightColor = simd_make_float4(1.0, 1.0, 1.0, 1.0);
-  simd_float4 lightPosition = simd_make_float4(-1.0, 0.75, 1.0, 1.0);
   simd_float4 cameraPosition = simd_make_float4(P.xyz, 1.0);
-  simd_float4 objColor = simd_make_float4(0.0f, 0.48f, 0.65f, 1.0f);
 
-  std::cout << "Setting fragment bytes" << std::endl;
-  renderCommandEncoder->setFragmentBytes(&lightColor, sizeof(lightColor), 0);
-  renderCommandEncoder->setFragmentBytes(&lightPosition, sizeof(lightPosition),
-                                         1);
-  renderCommandEncoder->setFragmentBytes(&cameraPosition,
-                                         sizeof(cameraPosition), 2);
-  renderCommandEncoder->setFragmentBytes(&objColor, sizeof(objColor), 3);
-  std::cout << "FragmentBytes  set" << std::endl;
+  // Uniforms are written here, on the main thread which owns the uniform
+  // ring. Draws only carry offsets into it, and are bound by offset rather
+  // than copied into the command stream with setFragmentBytes.
+  NS::UInteger lightColorOffset = pushUniform(lightColor);
+  NS::UInteger cameraPositionOffset = pushUniform(cameraPosition);
+  NS::UInteger clusterOffset = clusterFrameOffset();
+  NS::UInteger shadowOffset = shadowFrameOffset();
+
+  // Mesh and material state of a draw, everything but its transforms
+  auto makeDraw = [&](uint32_t mesh, const MaterialComponent &material) {
+    DrawItem draw;
+    draw.depthStencil = depthStencilState;
+    bindMesh(draw, mesh);
+    if (material.pipeline == LightSourcePipeline) {
+      draw.pipeline = metalLightSourceRenderPSO;
+      draw.fragmentBuffers[0] = {uniformBuffer.buffer, lightColorOffset};
+      draw.fragmentBufferCount = 1;
+    } else {
+      // Laid out as forwardFragmentShader expects
+      draw.pipeline = metalRenderPS0;
+      draw.fragmentBuffers[0] = {clusterBuffer.buffer,
+                                 clusterOffset + clusterLayout.uniformsOffset};
+      draw.fragmentBuffers[1] = {clusterBuffer.buffer,
+                                 clusterOffset + clusterLayout.lightsOffset};
+      draw.fragmentBuffers[2] = {uniformBuffer.buffer, cameraPositionOffset};
+      draw.fragmentBuffers[3] = {uniformBuffer.buffer,
+                                 pushUniform(material.color)};
+      draw.fragmentBuffers[4] = {clusterBuffer.buffer,
+                                 clusterOffset + clusterLayout.rangesOffset};
+      draw.fragmentBuffers[5] = {clusterBuffer.buffer,
+                                 clusterOffset + clusterLayout.indicesOffset};
+      draw.fragmentBuffers[6] = {shadowBuffer.buffer,
+                                 shadowOffset + shadowLayout.uniformsOffset};
+      draw.fragmentBufferCount = 7;
+      draw.shadowMap = shadowMap;
+      // The pre-pass shader is the lit one's position transform alone
+      if (depthPrepass && draw.positions.valid()) {
+        draw.depthPrepassed = true;
+        draw.depthStencil = equalDepthState;
+      }
+    }
+    if (material.texture < streamedTextures.size() &&
+        streamedTextures[material.texture]->texture) {
+      draw.texture = streamedTextures[material.texture]->texture;
+    }
+    return draw;
+  };
+
+  // Entities with bounds showing the obj go through GPU culling as a list
+  // of instances, drawn with one indirect draw per LOD however long the list
+  // gets. The obj is the only mesh with LODs set up for it, and the instances
+  // share the first one's material.
+  const MaterialComponent *culledMaterial = nullptr;
+  matrix_float4x4 culledModel = matrix_identity_float4x4;
+  entities.forEach<TransformComponent, MeshComponent, MaterialComponent,
+                   BoundsComponent>([&](Entity, TransformComponent &transform,
+                                        MeshComponent &mesh,
+                                        MaterialComponent &material,
+                                        BoundsComponent &bounds) {
+    if (mesh.mesh != ObjMesh) {
+      return;
+    }
+    matrix_float4x4 model = toSimdMatrix(transform.model);
+    CullObject object;
+    simd::float4 worldCenter = simd_mul(
+        model, simd_make_float4(bounds.sphere.x, bounds.sphere.y,
+                                bounds.sphere.z, 1.0f));
+    object.center[0] = worldCenter.x;
+    object.center[1] = worldCenter.y;
+    object.center[2] = worldCenter.z;
+    // The largest axis scale keeps the sphere around a non-uniformly scaled
+    // mesh
+    float scale = std::max({simd_length(model.columns[0].xyz),
+                            simd_length(model.columns[1].xyz),
+                            simd_length(model.columns[2].xyz)});
+    object.radius = bounds.sphere.w * scale;
+    memcpy(object.model, &model, sizeof(object.model));
+    cullObjects.push_back(object);
+    if (!culledMaterial) {
+      culledMaterial = &material;
+      culledModel = model;
+    }
+  });
+  // Shadows go first, hidden objects still cast them
+  prepareShadows(viewMatrix, fov, aspectRatio, nearZ);
+  cullOccludedObjects(simd_mul(perspectiveMatrix, viewMatrix));
+  // The obj has a single LOD, visible as far as the far plane
+  CullLod objLod{0, (uint32_t)vertexCount, farZ};
+  prepareCulling(simd_mul(perspectiveMatrix, viewMatrix), P, &objLod, 1);
+
+  if (culledMaterial) {
+    DrawItem obj = makeDraw(ObjMesh, *culledMaterial);
+    // Instances bring their own model matrices
+    obj.transformationOffset = pushUniform(TransformationData{
+        matrix_identity_float4x4, viewMatrix, perspectiveMatrix});
+    obj.instanceBuffer = cullBuffer.buffer;
+    obj.instanceOffset = cullFrameOffset() + cullLayout.instancesOffset;
+    obj.indirectBuffer = cullBuffer.buffer;
+    obj.indirectOffset = cullFrameOffset() + cullLayout.argumentsOffset;
+    obj.sortKey = forwardSortKey(obj, simd_mul(viewMatrix, culledModel));
+    drawList.push_back(obj);
+
+    if (hizCulling) {
+      // The late pass's instances missed the pre-pass, so they test and
+      // write depth as usual
+      DrawItem late = obj;
+      late.depthPrepassed = false;
+      late.depthStencil = depthStencilState;
+      late.instanceOffset = cullFrameOffset() + cullLayout.lateInstancesOffset;
+      late.indirectOffset = cullFrameOffset() + cullLayout.lateArgumentsOffset;
+      lateDrawList.push_back(late);
+    }
+  }
+
+  // Everything else is drawn directly, one draw per entity
+  entities.forEach<TransformComponent, MeshComponent, MaterialComponent>(
+      [&](Entity entity, TransformComponent &transform, MeshComponent &mesh,
+          MaterialComponent &material) {
+        if (mesh.mesh == ObjMesh && entities.has<BoundsComponent>(entity)) {
+          return;
+        }
+        DrawItem draw = makeDraw(mesh.mesh, material);
+        if (!draw.vertices.valid()) {
+          return;
+        }
+        matrix_float4x4 model = toSimdMatrix(transform.model);
+        draw.transformationOffset = pushUniform(
+            TransformationData{model, viewMatrix, perspectiveMatrix});
+        // The lit pipeline is built for instancing, so give it a single
+        // instance
+        if (draw.pipeline == metalRenderPS0) {
+          draw.instanceBuffer = uniformBuffer.buffer;
+          draw.instanceOffset = pushUniform(model);
+        }
+        draw.sortKey = forwardSortKey(draw, simd_mul(viewMatrix, model));
+        drawList.push_back(draw);
+      });
+
+  sortDrawList();
+}
+
+NS::UInteger MTLEngine::cullFrameOffset() const {
+  return cullBuffer.offset + uniformRing->frameIndex() * cullLayout.size;
+}
+
+NS::UInteger MTLEngine::clusterFrameOffset() const {
+  return clusterBuffer.offset + uniformRing->frameIndex() * clusterLayout.size;
+}
+
+void MTLEngine::cullOccludedObjects(
+    const matrix_float4x4 &viewProjectionMatrix) {
+  if (!occlusionCulling || cullObjects.empty()) {
+    return;
+  }
+  ProfileScope zone("Occlusion culling");
+  occlusionCuller.beginFrame(toFloat4x4(viewProjectionMatrix));
+  entities.forEach<TransformComponent, OccluderComponent>(
+      [this](Entity, TransformComponent &transform,
+             OccluderComponent &occluder) {
+        if (occluder.mesh >= occluderMeshes.size()) {
+          return;
+        }
+        const OccluderMesh &mesh = occluderMeshes[occluder.mesh];
+        occlusionCuller.addOccluder(
+            mesh.positions.data(),
+            (uint32_t)(mesh.positions.size() / positionStreamComponents),
+            mesh.indices.data(), (uint32_t)mesh.indices.size(),
+            transform.model);
+      });
+  if (!occlusionCuller.stats().occluders) {
+    return;
+  }
+  occlusionCuller.rasterize();
+
+  // The box around each bounding sphere
+  size_t before = cullObjects.size();
+  std::erase_if(cullObjects, [this](const CullObject &object) {
+    Float3 center = {object.center[0], object.center[1], object.center[2]};
+    Float3 extent = {object.radius, object.radius, object.radius};
+    return occlusionCuller.isOccluded(center - extent, center + extent);
+  });
+  occlusionTested += before;
+  occlusionCulled += before - cullObjects.size();
+}
+
+NS::UInteger MTLEngine::shadowFrameOffset() const {
+  return shadowBuffer.offset + uniformRing->frameIndex() * shadowLayout.size;
+}
+
+void MTLEngine::prepareShadows(const matrix_float4x4 &viewMatrix, float fov,
+                               float aspectRatio, float nearZ) {
+  ProfileScope zone("Fit shadow cascades");
+  ShadowCamera camera;
+  memcpy(&camera.view, &viewMatrix, sizeof(camera.view));
+  camera.fovyRadians = fov;
+  camera.aspect = aspectRatio;
+  camera.nearZ = nearZ;
+  camera.farZ = shadowDistance;
+
+  // From the key light towards the first obj, or straight down without one
+  const PointLight &light = pointLights[shadowedLight];
+  Float3 lightDirection = {0.0f, -1.0f, 0.0f};
+  if (!cullObjects.empty()) {
+    const CullObject &target = cullObjects.front();
+    lightDirection = {target.center[0] - light.position[0],
+                      target.center[1] - light.position[1],
+                      target.center[2] - light.position[2]};
+  }
+  fitShadowCascades(camera, lightDirection, shadowSplitLambda,
+                    shadowCasterDistance, shadowCascades);
+
+  char *region = static_cast<char *>(shadowBuffer.buffer->contents()) +
+                 shadowFrameOffset();
+  ShadowUniforms uniforms = makeShadowUniforms(
+      shadowCascades, ShadowCascadeCount, shadowedLight, shadowDepthBias);
+  memcpy(region + shadowLayout.uniformsOffset, &uniforms, sizeof(uniforms));
+  auto *instances =
+      reinterpret_cast<Float4x4 *>(region + shadowLayout.instancesOffset);
+  uint32_t objectCount =
+      std::min<uint32_t>((uint32_t)cullObjects.size(), maxCullObjects);
+  for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+    memcpy(region + shadowLayout.cascadeOffsets[i],
+           &shadowCascades[i].viewProjection, sizeof(Float4x4));
+    shadowCasterCounts[i] = cullShadowCasters(
+        shadowCascades[i], cullObjects.data(), objectCount,
+        instances + i * maxCullObjects, maxCullObjects);
+  }
+}
+
+void MTLEngine::encodeShadows(MTL::CommandBuffer *commandBuffer) {
+  NS::UInteger base = shadowFrameOffset();
+  for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+    // Even an empty cascade is cleared, or it would keep old shadows
+    MTL::RenderPassDescriptor *passDescriptor =
+        MTL::RenderPassDescriptor::alloc()->init();
+    MTL::RenderPassDepthAttachmentDescriptor *depthAttachment =
+        passDescriptor->depthAttachment();
+    depthAttachment->setTexture(shadowMap);
+    depthAttachment->setSlice(i);
+    depthAttachment->setLoadAction(MTL::LoadActionClear);
+    depthAttachment->setClearDepth(1.0);
+    depthAttachment->setStoreAction(MTL::StoreActionStore);
+    timeRenderPass(passDescriptor, "Shadow cascade");
+    MTL::RenderCommandEncoder *encoder =
+        commandBuffer->renderCommandEncoder(passDescriptor);
+    passDescriptor->release();
+    if (!encoder) {
+      std::cerr << "ERROR: shadow renderCommandEncoder is NULL!" << std::endl;
+      return;
+    }
+    if (shadowCasterCounts[i]) {
+      encoder->setRenderPipelineState(shadowPipeline);
+      encoder->setDepthStencilState(shadowDepthState);
+      encoder->setFrontFacingWinding(MTL::WindingCounterClockwise);
+      encoder->setCullMode(MTL::CullModeBack);
+      // Slope scaled, so surfaces at a steep angle to the light get more
+      encoder->setDepthBias(0.0f, 2.0f, 0.0f);
+      encoder->setVertexBuffer(objVertexBuffer.buffer, objVertexBuffer.offset,
+                               0);
+      encoder->setVertexBuffer(shadowBuffer.buffer,
+                               base + shadowLayout.cascadeOffsets[i], 1);
+      encoder->setVertexBuffer(
+          shadowBuffer.buffer,
+          base + shadowLayout.instancesOffset +
+              i * maxCullObjects * sizeof(Float4x4),
+          2);
+      encoder->drawPrimitives(MTL::PrimitiveTypeTriangle, NS::UInteger(0),
+                              vertexCount, shadowCasterCounts[i]);
+    }
+    encoder->endEncoding();
+  }
+}
+
+void MTLEngine::prepareClustering(const matrix_float4x4 &viewMatrix, float fov,
+                                  float aspectRatio, float nearZ, float farZ,
+                                  CGSize drawableSize) {
+  ProfileScope zone("Light clustering");
+  uint32_t lightCount = (uint32_t)pointLights.size();
+  if (lightCount > maxPointLights) {
+    std::cerr << "Clustering " << lightCount << " lights, only the first "
+              << maxPointLights << " are used" << std::endl;
+    lightCount = maxPointLights;
+  }
+
+  ClusterGridParams params;
+  memcpy(&params.view, &viewMatrix, sizeof(params.view));
+  params.fovyRadians = fov;
+  params.aspect = aspectRatio;
+  params.nearZ = nearZ;
+  params.farZ = farZ;
+  params.screenWidth = drawableSize.width;
+  params.screenHeight = drawableSize.height;
+  lightClusterer.assign(params, pointLights.data(), lightCount);
+  if (lightClusterer.stats().droppedIndices) {
+    std::cerr << "Cluster light lists are full, "
+              << lightClusterer.stats().droppedIndices << " entries dropped"
+              << std::endl;
+  }
+
+  char *region = static_cast<char *>(clusterBuffer.buffer->contents()) +
+                 clusterFrameOffset();
+  memcpy(region + clusterLayout.uniformsOffset, &lightClusterer.uniforms(),
+         sizeof(ClusterUniforms));
+  memcpy(region + clusterLayout.lightsOffset, pointLights.data(),
+         lightCount * sizeof(PointLight));
+  memcpy(region + clusterLayout.rangesOffset, lightClusterer.ranges().data(),
+         ClusterCount * sizeof(ClusterRange));
+  memcpy(region + clusterLayout.indicesOffset,
+         lightClusterer.lightIndices().data(),
+         lightClusterer.lightIndices().size() * sizeof(uint32_t));
+}
+
+void MTLEngine::prepareCulling(const matrix_float4x4 &viewProjectionMatrix,
+                               simd::float3 cameraPosition,
+                               const CullLod *lods, uint32_t lodCount) {
+  ProfileScope zone("Prepare culling");
+  char *region =
+      static_cast<char *>(cullBuffer.buffer->contents()) + cullFrameOffset();
+  auto *uniforms = reinterpret_cast<CullUniforms *>(region + cullLayout.uniformsOffset);
+  auto *objects = reinterpret_cast<CullObject *>(region + cullLayout.objectsOffset);
+  auto *arguments = reinterpret_cast<IndirectDrawArguments *>(
+      region + cullLayout.argumentsOffset);
+  auto *lateArguments = reinterpret_cast<IndirectDrawArguments *>(
+      region + cullLayout.lateArgumentsOffset);
+  auto *earlyHiZ =
+      reinterpret_cast<HiZUniforms *>(region + cullLayout.earlyHiZOffset);
+  auto *lateHiZ =
+      reinterpret_cast<HiZUniforms *>(region + cullLayout.lateHiZOffset);
+  uint32_t frame = uniformRing->frameIndex();
+
+  // The GPU finished with this region before frameSemaphore let us in, so
+  // what the kernel wrote into it last time can be checked now
+  if (validateGpuCulling && cullFrameWritten[frame] && !lateHiZ->enabled &&
+      !validateCullOutput(
+          *uniforms, objects, arguments,
+          reinterpret_cast<const Float4x4 *>(region + cullLayout.instancesOffset),
+          reinterpret_cast<const uint32_t *>(region + cullLayout.visibilityOffset))) {
+    std::cerr << "ERROR: GPU culling doesn't match the CPU reference"
+              << std::endl;
+  }
+
+  // simd and engine_math matrices share a layout
+  Float4x4 viewProjection;
+  memcpy(&viewProjection, &viewProjectionMatrix, sizeof(viewProjection));
+  uint32_t objectCount = (uint32_t)cullObjects.size();
+  if (objectCount > maxCullObjects) {
+    std::cerr << "Culling " << objectCount << " objects, only the first "
+              << maxCullObjects << " are drawn" << std::endl;
+  }
+  *uniforms = makeCullUniforms(
+      makeFrustum(viewProjection),
+      {cameraPosition.x, cameraPosition.y, cameraPosition.z}, lods, lodCount,
+      objectCount, maxCullObjects);
+  memcpy(objects, cullObjects.data(),
+         uniforms->objectCount * sizeof(CullObject));
+  resetCullArguments(arguments, lods, lodCount, maxCullObjects);
+  resetCullArguments(lateArguments, lods, lodCount, maxCullObjects);
+
+  // The early pass reprojects last frame's pyramid with last frame's
+  // matrix, the late pass tests against the one this frame builds
+  uint32_t width = hizPyramid->width();
+  uint32_t height = hizPyramid->height();
+  *earlyHiZ = makeHiZUniforms(hizViewProjection, width, height,
+                              hizCulling && hizPyramidValid);
+  *lateHiZ = makeHiZUniforms(viewProjection, width, height, hizCulling);
+  hizViewProjection = viewProjection;
+  hizPyramidValid = hizCulling;
+  cullFrameWritten[frame] = true;
+}
+
+void MTLEngine::encodeCulling(MTL::CommandBuffer *commandBuffer) {
+  // Nothing was prepared this frame
+  if (cullObjects.empty()) {
+    return;
+  }
+  NS::UInteger base = cullFrameOffset();
+  const auto *uniforms = reinterpret_cast<const CullUniforms *>(
+      static_cast<char *>(cullBuffer.buffer->contents()) + base +
+      cullLayout.uniformsOffset);
+  MTL::ComputeCommandEncoder *computeEncoder =
+      newComputeEncoder(commandBuffer, "Cull");
+  computeEncoder->setComputePipelineState(computePipelines.cull);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.uniformsOffset, 0);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.objectsOffset, 1);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.argumentsOffset, 2);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.instancesOffset, 3);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.visibilityOffset, 4);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.earlyHiZOffset, 5);
+  computeEncoder->setTexture(hizPyramid, 0);
+  computeEncoder->dispatchThreads(MTL::Size(uniforms->objectCount, 1, 1),
+                                  MTL::Size(CullThreadgroupSize, 1, 1));
+  computeEncoder->endEncoding();
+}
+
+void MTLEngine::encodeHiZPyramid(MTL::CommandBuffer *commandBuffer,
+                                 MTL::Texture *hizDepth) {
+  MTL::ComputeCommandEncoder *computeEncoder =
+      newComputeEncoder(commandBuffer, "Hi-Z");
+  MTL::Size threadgroup(HiZThreadgroupSize, HiZThreadgroupSize, 1);
+  computeEncoder->setComputePipelineState(computePipelines.hizCopy);
+  computeEncoder->setTexture(hizDepth, 0);
+  computeEncoder->setTexture(hizPyramidLevels[0], 1);
+  computeEncoder->dispatchThreads(
+      MTL::Size(hizPyramid->width(), hizPyramid->height(), 1), threadgroup);
+  // Dispatches in one encoder run one after the other, so each mip is
+  // complete before the next one reads it
+  computeEncoder->setComputePipelineState(computePipelines.hizDownsample);
+  for (size_t level = 1; level < hizPyramidLevels.size(); level++) {
+    MTL::Texture *destination = hizPyramidLevels[level];
+    computeEncoder->setTexture(hizPyramidLevels[level - 1], 0);
+    computeEncoder->setTexture(destination, 1);
+    computeEncoder->dispatchThreads(
+        MTL::Size(destination->width(), destination->height(), 1),
+        threadgroup);
+  }
+  computeEncoder->endEncoding();
+}
+
+void MTLEngine::encodeLateCulling(MTL::CommandBuffer *commandBuffer) {
+  if (cullObjects.empty()) {
+    return;
+  }
+  NS::UInteger base = cullFrameOffset();
+  const auto *uniforms = reinterpret_cast<const CullUniforms *>(
+      static_cast<char *>(cullBuffer.buffer->contents()) + base +
+      cullLayout.uniformsOffset);
+  MTL::ComputeCommandEncoder *computeEncoder =
+      newComputeEncoder(commandBuffer, "Cull Late");
+  computeEncoder->setComputePipelineState(computePipelines.cullLate);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.uniformsOffset, 0);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.objectsOffset, 1);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.lateArgumentsOffset, 2);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.lateInstancesOffset, 3);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.visibilityOffset, 4);
+  computeEncoder->setBuffer(cullBuffer.buffer, base + cullLayout.lateHiZOffset, 5);
+  computeEncoder->setTexture(hizPyramid, 0);
+  computeEncoder->dispatchThreads(MTL::Size(uniforms->objectCount, 1, 1),
+                                  MTL::Size(CullThreadgroupSize, 1, 1));
+  computeEncoder->endEncoding();
+}
+
+uint64_t MTLEngine::forwardSortKey(const DrawItem &draw,
+                                   const matrix_float4x4 &modelViewMatrix) {
+  // The forward pass is opaque, so front to back. The view looks down -z.
+  float depth = -modelViewMatrix.columns[3].z;
+  return makeDrawSortKey(0, pipelineKeyIds.id(draw.pipeline),
+                         materialKeyIds.id(draw.texture), drawKeyDepth(depth));
+}
 
+void MTLEngine::sortDrawList() {
+  ProfileScope zone("Sort draw list");
+  drawPackets.clear();
+  for (size_t i = 0; i < drawList.size(); i++) {
+    drawPackets.push_back({drawList[i].sortKey, (uint32_t)i});
+  }
+  radixSortDrawPackets(drawPackets, drawPacketScratch);
+
+  // Front to back like the forward pass, so the pre-pass rejects early too
+  depthPrepassDraws.clear();
+  for (const DrawPacket &packet : drawPackets) {
+    if (drawList[packet.index].depthPrepassed) {
+      depthPrepassDraws.push_back(packet.index);
+    }
+  }
+}
+
+void MTLEngine::encodeDraws(RenderCommandSink &encoder, size_t begin,
+                            size_t end) {
+  // Every draw binds all of its state, the tracker drops what is already
+  // bound. Sorted neighbours mostly share pipeline and material.
+  StateTrackingSink sink(encoder);
   // Tell what winding mode we are using and instruct metal to cull faces we
   // can't see
-  std::cout << "Setting render states" << std::endl;
-  renderCommandEncoder->setFrontFacingWinding(MTL::WindingCounterClockwise);
-  renderCommandEncoder->setCullMode(MTL::CullModeBack);
+  sink.setFrontFacingWinding(MTL::WindingCounterClockwise);
+  sink.setCullMode(MTL::CullModeBack);
   // Uncomment to show the wireframe of the object we are rendering
   // renderCommandEncoder->setTriangleFillMode(MTL::TriangleFillModeLines);
-  renderCommandEncoder->setRenderPipelineState(metalRenderPS0);
-  renderCommandEncoder->setDepthStencilState(depthStencilState);
-  std::cout << "Render states set" << std::endl;
-
-  std::cout << "Setting vertex buffers" << std::endl;
-  renderCommandEncoder->setVertexBuffer(objVertexBuffer, 0, 0);
-  renderCommandEncoder->setVertexBuffer(objTransformationBuffer, 0, 1);
-  std::cout << "Vertex buffers set" << std::endl;
-  MTL::PrimitiveType typeTriangle = MTL::PrimitiveTypeTriangle;
-  if (marsTexture && marsTexture->texture) {
-    std::cout << "Setting fragment texture..." << std::endl;
-    renderCommandEncoder->setFragmentTexture(marsTexture->texture, 0);
-  }
-  std::cout << "About to draw primitives (vertexCount=" << vertexCount << ")"
-            << std::endl;
-  renderCommandEncoder->drawPrimitives(typeTriangle, (NS::UInteger)0,
-                                       vertexCount);
-  std::cout << "Draw primitives completed" << std::endl;
-
-  // Light matrix
-  std::cout << "Drawing light source..." << std::endl;
-  scaleMatrix = matrix4x4_scale(0.25f, 0.25f, 0.25f);
-  translationMatrix = matrix4x4_translation(lightPosition.xyz);
-  modelMatrix = simd_mul(translationMatrix, scaleMatrix);
-
-  renderCommandEncoder->setRenderPipelineState(metalLightSourceRenderPSO);
-  transformationData = {modelMatrix, viewMatrix, perspectiveMatrix};
-  memcpy(lightTransformationBuffer->contents(), &transformationData,
-         sizeof(transformationData));
-  renderCommandEncoder->setDepthStencilState(depthStencilState);
-  renderCommandEncoder->setVertexBuffer(lightVertexBuffer, 0, 0);
-  renderCommandEncoder->setVertexBuffer(lightTransformationBuffer, 0, 1);
-  renderCommandEncoder->setFragmentBytes(&lightColor, sizeof(lightColor), 0);
-  renderCommandEncoder->drawPrimitives(typeTriangle, (NS::UInteger)0,
-                                       (NS::UInteger)36);
-
-  std::cout << "=== END encodeRenderCommand ===" << std::endl;
-};
+
+  for (size_t i = begin; i < end; i++) {
+    encodeDraw(sink, drawList[drawPackets[i].index]);
+  }
+}
+
+void MTLEngine::encodeDraw(RenderCommandSink &sink, const DrawItem &draw) {
+  sink.setRenderPipelineState(draw.pipeline);
+  sink.setDepthStencilState(draw.depthStencil);
+  sink.setVertexBuffer(draw.vertices.buffer, draw.vertices.offset, 0);
+  sink.setVertexBuffer(uniformBuffer.buffer, draw.transformationOffset, 1);
+  for (uint32_t index = 0; index < draw.fragmentBufferCount; index++) {
+    sink.setFragmentBuffer(draw.fragmentBuffers[index].buffer,
+                           draw.fragmentBuffers[index].offset, index);
+  }
+  if (draw.texture) {
+    sink.setFragmentTexture(draw.texture, 0);
+  }
+  if (draw.shadowMap) {
+    sink.setFragmentTexture(draw.shadowMap, 1);
+  }
+  if (draw.instanceBuffer) {
+    sink.setVertexBuffer(draw.instanceBuffer, draw.instanceOffset, 2);
+  }
+  encodeDrawCall(sink, draw);
+}
+
+void MTLEngine::encodeLateDraws(MTL::CommandBuffer *commandBuffer) {
+  // Runs even with nothing to draw, it's what resolves the frame
+  timeRenderPass(lateRenderPassDescriptor, "Forward Late");
+  MTL::RenderCommandEncoder *renderCommandEncoder =
+      commandBuffer->renderCommandEncoder(lateRenderPassDescriptor);
+  if (!renderCommandEncoder) {
+    std::cerr << "ERROR: late renderCommandEncoder is NULL!" << std::endl;
+    return;
+  }
+  MetalCommandSink sink(renderCommandEncoder);
+  encodeLateDraws(sink);
+  renderCommandEncoder->endEncoding();
+}
+
+void MTLEngine::encodeLateDraws(RenderCommandSink &encoder) {
+  StateTrackingSink sink(encoder);
+  sink.setFrontFacingWinding(MTL::WindingCounterClockwise);
+  sink.setCullMode(MTL::CullModeBack);
+  for (const DrawItem &draw : lateDrawList) {
+    encodeDraw(sink, draw);
+  }
+}
+
+void MTLEngine::encodeFrameCommands(RenderCommandSink &sink) {
+  encodeDepthPrepass(sink);
+  encodeDraws(sink, 0, drawPackets.size());
+  encodeLateDraws(sink);
+}
+
+void MTLEngine::encodeDrawCall(RenderCommandSink &sink, const DrawItem &draw) {
+  if (draw.indirectBuffer) {
+    sink.drawPrimitivesIndirect(MTL::PrimitiveTypeTriangle,
+                                draw.indirectBuffer, draw.indirectOffset);
+  } else if (draw.indexBuffer.valid()) {
+    sink.drawIndexedPrimitives(MTL::PrimitiveTypeTriangle, draw.indexCount,
+                               draw.indexBuffer.buffer, draw.indexBuffer.offset,
+                               1);
+  } else {
+    sink.drawPrimitives(MTL::PrimitiveTypeTriangle, 0, draw.vertexCount, 1);
+  }
+}
+
+void MTLEngine::encodeDepthPrepass(RenderCommandSink &encoder) {
+  StateTrackingSink sink(encoder);
+  sink.setFrontFacingWinding(MTL::WindingCounterClockwise);
+  sink.setCullMode(MTL::CullModeBack);
+  sink.setRenderPipelineState(depthPrepassPipeline);
+  sink.setDepthStencilState(depthPrepassDepthState);
+  // Pre-passed draws are all instanced lit draws, with the same vertex
+  // ranges, indices and indirect arguments on the position stream
+  for (uint32_t index : depthPrepassDraws) {
+    const DrawItem &draw = drawList[index];
+    sink.setVertexBuffer(draw.positions.buffer, draw.positions.offset, 0);
+    sink.setVertexBuffer(uniformBuffer.buffer, draw.transformationOffset, 1);
+    sink.setVertexBuffer(draw.instanceBuffer, draw.instanceOffset, 2);
+    encodeDrawCall(sink, draw);
+  }
+}
+
+static void printFrameTimes(const char *label,
+                            const FrameTimeHistory &history) {
+  FrameTimeSummary summary = history.summary();
+  if (!summary.frames) {
+    return;
+  }
+  std::cout << label << " frame ms over " << summary.frames
+            << " frames: mean " << summary.mean << ", p50 " << summary.p50
+            << ", p95 " << summary.p95 << ", p99 " << summary.p99 << ", max "
+            << summary.max << std::endl;
+}
+
+void MTLEngine::reportPassStats() {
+  if (++statsFrames < statsReportInterval) {
+    return;
+  }
+  double frames = statsFrames;
+  std::cout << "Depth pre-pass " << (depthPrepass ? "on" : "off")
+            << ", per frame: pre-pass " << depthPrepassStats.draws / frames
+            << " draws in " << depthPrepassStats.encodeMilliseconds / frames
+            << " ms, forward " << forwardStats.draws / frames << " draws in "
+            << forwardStats.encodeMilliseconds / frames << " ms" << std::endl;
+  printFrameTimes("CPU", cpuFrameTimes);
+  printFrameTimes("GPU", gpuFrameTimes);
+  // Of the last frame, the graph's stats outlive its reset
+  const RenderGraphStats &graphStats = renderGraph->stats();
+  std::cout << "Frame graph: " << graphStats.transientTextures
+            << " transient textures (" << graphStats.memorylessTextures
+            << " memoryless) in " << graphStats.aliasedBytes / (1024 * 1024)
+            << " MB of heap, " << graphStats.unaliasedBytes / (1024 * 1024)
+            << " MB without aliasing" << std::endl;
+  if (occlusionTested) {
+    std::cout << "Occlusion culling " << (occlusionCulling ? "on" : "off")
+              << ": " << occlusionCulled << " of " << occlusionTested
+              << " objects hidden" << std::endl;
+  }
+  occlusionTested = 0;
+  occlusionCulled = 0;
+  depthPrepassStats = {};
+  forwardStats = {};
+  statsFrames = 0;
+}
+
+void MTLEngine::encodeDrawList(MTL::CommandBuffer *commandBuffer) {
+  using Clock = std::chrono::steady_clock;
+  auto milliseconds = [](Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start)
+        .count();
+  };
+  std::vector<EncodeRange> ranges =
+      partitionDraws(drawPackets.size(), ThreadPool::shared().threadCount() + 1,
+                     minDrawsPerEncoder);
+  depthPrepassStats.draws += depthPrepassDraws.size();
+  forwardStats.draws += drawPackets.size();
+  timeRenderPass(renderPassDescriptor, "Forward");
+
+  // The pre-pass shares the forward pass's render pass, so its depth stays
+  // in tile memory rather than being stored and loaded again
+  if (ranges.size() <= 1) {
+    MTL::RenderCommandEncoder *renderCommandEncoder =
+        commandBuffer->renderCommandEncoder(renderPassDescriptor);
+    if (!renderCommandEncoder) {
+      std::cerr << "ERROR: renderCommandEncoder is NULL!" << std::endl;
+      return;
+    }
+    MetalCommandSink sink(renderCommandEncoder);
+    ProfileScope zone("Encode draws");
+    Clock::time_point start = Clock::now();
+    encodeDepthPrepass(sink);
+    depthPrepassStats.encodeMilliseconds += milliseconds(start);
+    start = Clock::now();
+    encodeDraws(sink, 0, drawPackets.size());
+    renderCommandEncoder->endEncoding();
+    forwardStats.encodeMilliseconds += milliseconds(start);
+    return;
+  }
+
+  MTL::ParallelRenderCommandEncoder *parallelEncoder =
+      commandBuffer->parallelRenderCommandEncoder(renderPassDescriptor);
+  if (!parallelEncoder) {
+    std::cerr << "ERROR: parallelRenderCommandEncoder is NULL!" << std::endl;
+    return;
+  }
+  // Sub-encoders execute in the order they are created, whichever thread
+  // finishes first, so creating them here in range order keeps the frame
+  // identical to encoding the list serially
+  Clock::time_point start = Clock::now();
+  if (!depthPrepassDraws.empty()) {
+    MetalCommandSink prepassSink(parallelEncoder->renderCommandEncoder());
+    encodeDepthPrepass(prepassSink);
+    prepassSink.encoder->endEncoding();
+  }
+  depthPrepassStats.encodeMilliseconds += milliseconds(start);
+
+  start = Clock::now();
+  std::vector<MetalCommandSink> sinks;
+  std::vector<RenderCommandSink *> sinkPointers;
+  sinks.reserve(ranges.size());
+  for (size_t i = 0; i < ranges.size(); i++) {
+    sinks.emplace_back(parallelEncoder->renderCommandEncoder());
+    sinkPointers.push_back(&sinks.back());
+  }
+  encodeParallel(ranges, sinkPointers,
+                 [this](RenderCommandSink &sink, size_t begin, size_t end) {
+                   // Pool threads have no autorelease pool of their own
+                   NS::AutoreleasePool *pool =
+                       NS::AutoreleasePool::alloc()->init();
+                   ProfileScope zone("Encode draws");
+                   encodeDraws(sink, begin, end);
+                   static_cast<MetalCommandSink &>(sink).encoder->endEncoding();
+                   pool->release();
+                 });
+  parallelEncoder->endEncoding();
+  forwardStats.encodeMilliseconds += milliseconds(start);
+}
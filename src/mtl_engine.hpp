@@ -6,8 +6,30 @@
 #define GLFW_EXPOSE_NATIVE_COCOA
 #include <GLFW/glfw3native.h>
 
+#include "attachment_pool.hpp"
+#include "cluster_lighting.hpp"
+#include "command_encoding.hpp"
+#include "draw_sorting.hpp"
+#include "entity_store.hpp"
+#include "frame_capture.hpp"
+#include "frame_readback.hpp"
+#include "gpu_buffer_allocator.hpp"
+#include "gpu_culling.hpp"
+#include "hiz_culling.hpp"
+#include "hot_reload.hpp"
+#include "obj_loading.hpp"
+#include "occlusion_culling.hpp"
+#include "pipeline_cache.hpp"
+#include "position_stream.hpp"
+#include "procedural_geometry.hpp"
+#include "profiler.hpp"
+#include "render_graph.hpp"
+#include "scene_graph.hpp"
+#include "shader_permutations.hpp"
+#include "shadow_cascades.hpp"
 #include "texture.hpp"
-#include "tiny_obj_loader.h"
+#include "texture_streaming.hpp"
+#include "uniform_ring.hpp"
 #include "vertex_data.hpp"
 #include <stb/stb_image.h>
 
@@ -17,40 +39,294 @@
 #include <QuartzCore/CAMetalLayer.hpp>
 #include <QuartzCore/QuartzCore.hpp>
 
+#include <atomic>
 #include <filesystem>
+#include <semaphore>
+#include <string>
+
+// Every compute kernel, created and hot reloaded together
+struct ComputePipelines {
+  MTL::ComputePipelineState *cull = nullptr;
+  // Hi-Z occlusion culling's late pass
+  MTL::ComputePipelineState *cullLate = nullptr;
+  // Hi-Z pyramid, mip 0 from the depth buffer and every other mip from the
+  // one above it
+  MTL::ComputePipelineState *hizCopy = nullptr;
+  MTL::ComputePipelineState *hizDownsample = nullptr;
+
+  bool valid() const { return cull && cullLate && hizCopy && hizDownsample; }
+  void release();
+};
+
+// Rendering without a window, into a texture of the engine's own that every
+// frame is read back from and written to files
+struct OffscreenOptions {
+  uint32_t width = 1280;
+  uint32_t height = 720;
+  // 0 renders until the process is stopped
+  uint64_t frames = 0;
+  std::string directory = "frames";
+  FrameFileFormat format = FrameFileFormat::Png;
+  // Seconds of frameTime between frames, however long they took to render
+  double frameStep = 1.0 / 60.0;
+};
 
 class MTLEngine {
 public:
+  // Renders offscreen rather than to a window. Call before init().
+  void setOffscreen(const OffscreenOptions &options);
   void init();
   void run();
+  // Renders the offscreen frames as fast as they can be read back and
+  // written. Returns the exit status: 0 if every frame was written.
+  int runOffscreen();
+  // Re-runs the frames of a capture made with C, at full speed and without
+  // submitting them, and compares their forward passes with the captured
+  // ones. Returns the exit status: 0 if every frame matched.
+  int replay(const char *path);
   void cleanup();
 
 private:
+  struct BufferBinding {
+    MTL::Buffer *buffer = nullptr;
+    NS::UInteger offset = 0;
+  };
+
+  // One draw of the forward pass, with everything it binds
+  struct DrawItem {
+    MTL::RenderPipelineState *pipeline = nullptr;
+    MTL::DepthStencilState *depthStencil = nullptr;
+    BufferSlice vertices;
+    NS::UInteger vertexCount = 0;
+    // The mesh's position stream, if it has one
+    BufferSlice positions;
+    // Drawn in the depth pre-pass too, then shaded with an equal depth test
+    bool depthPrepassed = false;
+    // Drawn indexed when set
+    BufferSlice indexBuffer;
+    NS::UInteger indexCount = 0;
+    // Offset into uniformBuffer
+    NS::UInteger transformationOffset = 0;
+    // Fragment buffers are bound at their index
+    BufferBinding fragmentBuffers[7];
+    uint32_t fragmentBufferCount = 0;
+    MTL::Texture *texture = nullptr;
+    // Cascaded shadow map of lit draws, fragment texture 1
+    MTL::Texture *shadowMap = nullptr;
+    // Set for GPU culled draws: per-instance model matrices go to vertex
+    // buffer 2, and the draw reads its arguments from indirectBuffer
+    MTL::Buffer *instanceBuffer = nullptr;
+    NS::UInteger instanceOffset = 0;
+    MTL::Buffer *indirectBuffer = nullptr;
+    NS::UInteger indirectOffset = 0;
+    uint64_t sortKey = 0;
+  };
+
+  // What MeshComponent::mesh and MaterialComponent::pipeline refer to
+  enum MeshId : uint32_t { ObjMesh, LightMesh, SphereMesh };
+  enum PipelineId : uint32_t { LitPipeline, LightSourcePipeline };
+  // What OccluderComponent::mesh refers to
+  enum OccluderMeshId : uint32_t { BoxOccluder };
+
+  // CPU only geometry of an occluder, as OcclusionCuller reads it
+  struct OccluderMesh {
+    std::vector<float> positions;
+    std::vector<uint32_t> indices;
+  };
+
   void initDevice();
   void initWindow();
+  // The texture frames resolve into and the buffers they're read back
+  // through, in place of the window's
+  void initOffscreenTarget();
   static void frameBufferSizeCallback(GLFWwindow *window, int width,
                                       int height);
+  // P toggles the depth pre-pass, O occlusion culling, H Hi-Z occlusion
+  // culling. T captures a trace of the next traceCaptureFrames frames, C the
+  // inputs and command streams of the next frameCaptureFrames frames.
+  static void keyCallback(GLFWwindow *window, int key, int scancode,
+                          int action, int mods);
   void resizeFrameBuffer(int width, int height);
+
+  // What a capture's setting changes refer to
+  enum EngineSetting : uint32_t {
+    DepthPrepassSetting,
+    OcclusionCullingSetting,
+    HiZCullingSetting,
+  };
+  bool setting(EngineSetting setting) const;
+  // Also records the change into the capture being made
+  void setSetting(EngineSetting setting, bool on);
+  void applySceneChange(const SceneChange &change);
+  // Starts capturing the next frameCaptureFrames frames
+  void startFrameCapture();
+  // Records the frame's forward pass into the capture being made, and
+  // writes the capture out after its last frame
+  void captureFrame();
   std::string readFile(const std::string &filename);
 
   void createSquare();
   void createSphere(int numLat = 34, int numLon = 34);
+  // CPU only, safe to call from any thread
+  static bool parseObjModel(const char *filename,
+                            std::vector<VertexData> &vertices);
+  // Model space bounding sphere, centre in xyz and radius in w
+  static simd::float4 boundingSphere(const std::vector<VertexData> &vertices);
   void loadObjModel(const char *filename);
   void createLight();
+  // Scene graph nodes and entities for the obj and the light
+  void createScene();
+  // Fills occluderMeshes, indexed by OccluderMeshId
+  void createOccluderMeshes();
+  // Sets the draw's vertex and index buffers to a MeshId's
+  void bindMesh(DrawItem &draw, uint32_t mesh) const;
+  // Copies a generated mesh into new vertex and index slices
+  void uploadMesh(const Mesh &mesh, BufferSlice &vertices, BufferSlice &indices);
   void createTriangle();
   void createCube();
   void createBuffers();
   void createDefaultLibrary();
   void createCommandQueue();
+  // Names the main thread for the profiler and creates counterSampleBuffer
+  // where the GPU can time passes
+  void createGpuProfiling();
+  // Creates the pipeline cache and starts compiling last run's pipelines
+  void createPipelineCache();
+  // Single MSAA colour target plus depth, as used by every current pipeline
+  PipelineDesc mainPassPipelineDesc(const char *label);
+  PipelineDesc objPipelineDesc();
+  PipelineDesc lightPipelineDesc();
+  // Depth only, into one slice of the shadow map
+  PipelineDesc shadowPipelineDesc();
+  // Depth only, in the main pass ahead of the forward draws
+  PipelineDesc depthPrepassPipelineDesc();
+  // A cache compiling against `library`
+  PipelineCache *newPipelineCache(MTL::Library *library);
+  // PipelineCache backend, called on pool threads
+  CompiledPipeline compilePipeline(const PipelineDesc &desc,
+                                   MTL::Library *library);
   void createRenderPipeline();
   void createLightSourceRenderPipeline();
-  void createDepthAndMSAATextures();
+  void createShadowPipeline();
+  void createDepthPrepassPipeline();
+  MTL::ComputePipelineState *newComputePipeline(MTL::Library *library,
+                                                const char *functionName);
+  // All null if any kernel failed to build
+  ComputePipelines newComputePipelines(MTL::Library *library);
+  void createCullBuffers();
+  // Cluster buffers and the scene's point lights
+  void createClusterBuffers();
+  // Shadow map array texture and the per-frame cascade buffer
+  void createShadowResources();
+  // Follows the drawable's size. The MSAA colour and depth attachments are
+  // transient textures of the frame graph instead.
+  void createHiZPyramid();
+  void releaseHiZPyramid();
+  // Applies a window resize once the size has stopped changing
+  void applyPendingResize();
   void createRenderPassDescriptor();
+  // Watches the shader library, model and textures and reloads them when
+  // they change on disk
+  void setupHotReload();
+
+  // Points the forward passes at this frame's MSAA colour and depth (and
+  // the resolved depth for Hi-Z culling, if on). Also sets what the forward
+  // pass stores, which depends on hizCulling.
+  void updateRenderPassDescriptor(MTL::Texture *msaaColor,
+                                  MTL::Texture *depth,
+                                  MTL::Texture *hizDepth);
+
+  // Re-prioritises streamed textures for the current camera and uploads or
+  // evicts mips accordingly
+  void updateTextureStreaming(simd::float3 cameraPosition,
+                              simd::float3 cameraForward, float fov,
+                              float viewportHeight);
+
+  // Copies `value` into this frame's region of the uniform ring and returns
+  // its offset in uniformBuffer.buffer
+  template <typename T> NS::UInteger pushUniform(const T &value);
 
-  // Upon resizing, update depth and MSAA
-  void updateRenderPassDescriptor();
+  // Declares this frame's passes and the textures they touch
+  void buildFrameGraph();
+  MTL::TextureDescriptor *newTransientTextureDescriptor(const RGTextureDesc &desc);
+  static AttachmentKey memorylessAttachmentKey(const RGTextureDesc &desc);
 
-  void encodeRenderCommand(MTL::RenderCommandEncoder *renderEncoder);
+  // What the forward pass resolves into: the drawable, or offscreenTarget
+  MTL::Texture *targetTexture() const;
+  CGSize targetSize() const;
+  // Copies offscreenTarget into the readback slot acquired for the frame
+  void encodeReadback(MTL::CommandBuffer *commandBuffer);
+
+  // Sets camera for a frame looking at the drawable
+  void updateCamera();
+  // Pushes this frame's uniforms, fills drawList and sorts it into
+  // drawPackets, on the main thread. Everything that changes from frame to
+  // frame comes from frameTime, camera and the scene.
+  void buildDrawList();
+  // Offset of this frame's culling data in cullBuffer.buffer
+  NS::UInteger cullFrameOffset() const;
+  // Writes this frame's culling inputs and resets its indirect arguments
+  void prepareCulling(const matrix_float4x4 &viewProjectionMatrix,
+                      simd::float3 cameraPosition, const CullLod *lods,
+                      uint32_t lodCount);
+  void encodeCulling(MTL::CommandBuffer *commandBuffer);
+  // Reduces hizDepth into every mip of hizPyramid
+  void encodeHiZPyramid(MTL::CommandBuffer *commandBuffer,
+                        MTL::Texture *hizDepth);
+  // Hi-Z occlusion culling's late pass, and the draws of what it found
+  void encodeLateCulling(MTL::CommandBuffer *commandBuffer);
+  void encodeLateDraws(MTL::CommandBuffer *commandBuffer);
+  void encodeLateDraws(RenderCommandSink &encoder);
+  // Offset of this frame's clustering data in clusterBuffer.buffer
+  NS::UInteger clusterFrameOffset() const;
+  // Assigns pointLights to clusters and writes the lists to this frame's
+  // region of clusterBuffer
+  void prepareClustering(const matrix_float4x4 &viewMatrix, float fov,
+                         float aspectRatio, float nearZ, float farZ,
+                         CGSize drawableSize);
+  // Rasterizes the occluder entities and drops the cullObjects hidden
+  // behind them, before anything is submitted
+  void cullOccludedObjects(const matrix_float4x4 &viewProjectionMatrix);
+  // Offset of this frame's shadow data in shadowBuffer.buffer
+  NS::UInteger shadowFrameOffset() const;
+  // Fits the cascades to the camera and writes their matrices and culled
+  // casters, from cullObjects, to this frame's region of shadowBuffer
+  void prepareShadows(const matrix_float4x4 &viewMatrix, float fov,
+                      float aspectRatio, float nearZ);
+  // Renders the casters into every cascade's slice of shadowMap
+  void encodeShadows(MTL::CommandBuffer *commandBuffer);
+  uint64_t forwardSortKey(const DrawItem &draw,
+                          const matrix_float4x4 &modelViewMatrix);
+  void sortDrawList();
+  // Encodes drawPackets[begin, end), safe to call from several threads at
+  // once on different sinks
+  void encodeDraws(RenderCommandSink &sink, size_t begin, size_t end);
+  // Binds everything the draw reads and encodes it
+  void encodeDraw(RenderCommandSink &sink, const DrawItem &draw);
+  // The draw call itself, with everything it reads already bound
+  void encodeDrawCall(RenderCommandSink &sink, const DrawItem &draw);
+  // Lays down the depth of every depthPrepassed draw, front to back
+  void encodeDepthPrepass(RenderCommandSink &sink);
+  // Encodes the forward pass, across worker threads once drawList is long
+  // enough to be worth splitting
+  void encodeDrawList(MTL::CommandBuffer *commandBuffer);
+  // The forward and late passes' commands as if encoded serially, the
+  // stream frame captures record and replays compare
+  void encodeFrameCommands(RenderCommandSink &sink);
+  // Makes the pass a GPU zone of this frame, or stops it from being one if
+  // the frame has no zones left or there's no counterSampleBuffer
+  void timeRenderPass(MTL::RenderPassDescriptor *descriptor, const char *name);
+  // A compute encoder timed as a GPU zone, like timeRenderPass
+  MTL::ComputeCommandEncoder *
+  newComputeEncoder(MTL::CommandBuffer *commandBuffer, const char *name);
+  // Records a finished frame's GPU zones, from its completion handler
+  void recordGpuZones(MTL::CommandBuffer *commandBuffer,
+                      const GpuZoneRecorder::Frame &zones);
+  // Collects the frame's zones into the frame time histories, and the trace
+  // being captured
+  void collectProfile();
+  // Prints the per-pass statistics every statsReportInterval frames
+  void reportPassStats();
   void sendRenderCommand();
   void draw();
 
@@ -65,26 +341,231 @@ private:
   MTL::CommandBuffer *metalCommandBuffer;
   MTL::RenderPipelineState *metalRenderPS0;
   MTL::RenderPipelineState *metalLightSourceRenderPSO;
+  MTL::RenderPipelineState *shadowPipeline = nullptr;
+  MTL::DepthStencilState *shadowDepthState = nullptr;
+  MTL::RenderPipelineState *depthPrepassPipeline = nullptr;
+  MTL::DepthStencilState *depthPrepassDepthState = nullptr;
+  // Equal test, no writes, for draws whose depth the pre-pass wrote. Not a
+  // pipeline of its own, so created here rather than by the cache.
+  MTL::DepthStencilState *equalDepthState = nullptr;
+  // Owns every pipeline and depth stencil state above
+  PipelineCache *pipelineCache = nullptr;
+  // Lit draws all use shaders/forward.metal, specialized per material
+  ShaderPermutationManager forwardPermutations{"forwardVertexShader",
+                                               "forwardFragmentShader"};
+  // Instanced, the obj is drawn from the instance lists the culling kernel
+  // writes
+  static constexpr uint32_t objShaderFeatures =
+      ShaderFeatureSpecular | ShaderFeatureInstancing | ShaderFeatureShadows;
 
   MTL::DepthStencilState *depthStencilState;
   MTL::RenderPassDescriptor *renderPassDescriptor;
-  MTL::Texture *msaaRenderTargetTexture = nullptr;
   int sampleCount = 4;
-  MTL::Texture *depthTexture;
+
+  // Memoryless MSAA colour and depth come from here so that they're reused
+  // from frame to frame and when resizing back and forth, and the resize
+  // itself is debounced while dragging
+  AttachmentPool *attachmentPool = nullptr;
+  ResizeDebouncer resizeDebouncer;
+  // Apple GPUs can keep the MSAA colour and depth in tile memory only, as
+  // neither is stored at the end of the pass
+  bool useMemorylessAttachments = false;
+
+  // Rebuilt every frame in sendRenderCommand
+  RenderGraph *renderGraph = nullptr;
+  MTL::Heap *transientHeap = nullptr;
+  // The forward passes' transient attachments in this frame's graph.
+  // hizDepth, the MSAA depth resolved to its farthest sample for the Hi-Z
+  // pyramid, only while hizCulling is on.
+  struct FrameTargets {
+    RGResource msaaColor = invalidRGResource;
+    RGResource depth = invalidRGResource;
+    RGResource hizDepth = invalidRGResource;
+  } frameTargets;
 
   NS::UInteger vertexCount = 0;
 
+  // Vertex and uniform data is carved out of a few large buffers
+  GpuBufferAllocator *bufferAllocator = nullptr;
+
   MTL::Buffer *squareVertexBuffer;
-  MTL::Buffer *sphereVertexBuffer;
-  MTL::Buffer *sphereTransformationBuffer;
-  MTL::Buffer *objVertexBuffer = nullptr;
-  MTL::Buffer *objTransformationBuffer = nullptr;
-  MTL::Buffer *lightVertexBuffer;
-  MTL::Buffer *lightTransformationBuffer;
+  BufferSlice sphereVertexBuffer;
+  BufferSlice sphereIndexBuffer;
+  NS::UInteger sphereIndexCount = 0;
+  BufferSlice objVertexBuffer;
+  // objVertexBuffer's positions alone, for depth only passes
+  BufferSlice objPositionBuffer;
+  BufferSlice lightVertexBuffer;
+  BufferSlice lightIndexBuffer;
+  NS::UInteger lightIndexCount = 0;
+
+  // Per-frame uniforms (transforms, light and material constants) are bump
+  // allocated from here. Up to maxFramesInFlight frames are queued on the GPU
+  // at once, frameSemaphore stops us from reusing a region still in use.
+  static constexpr uint32_t maxFramesInFlight = 3;
+  static constexpr NS::UInteger uniformBytesPerFrame = 64 * 1024;
+  BufferSlice uniformBuffer;
+  UniformRingAllocator *uniformRing = nullptr;
+  std::counting_semaphore<maxFramesInFlight> frameSemaphore{
+      maxFramesInFlight};
+
+  // Without a window, see OffscreenOptions. Each frame resolves into
+  // offscreenTarget, which is copied into the frame's slot of readbackQueue
+  // (one shared buffer per frame in flight) for frameWriter to write out.
+  bool offscreen = false;
+  OffscreenOptions offscreenOptions;
+  MTL::Texture *offscreenTarget = nullptr;
+  MTL::Buffer *readbackBuffers[maxFramesInFlight] = {};
+  ReadbackQueue *readbackQueue = nullptr;
+  FrameWriter *frameWriter = nullptr;
+  uint32_t readbackSlot = 0;
+  uint64_t offscreenFrame = 0;
+
+  FileWatcher *fileWatcher = nullptr;
+  HotReloader *hotReloader = nullptr;
+  // Whatever a reload replaces is released once no queued frame can use it
+  RetireQueue retireQueue{maxFramesInFlight};
+
+  // Frustum culling and LOD selection of obj instances on the GPU
+  ComputePipelines computePipelines;
+  static constexpr uint32_t maxCullObjects = 1024;
+  CullFrameLayout cullLayout;
+  // One cullLayout region per frame in flight
+  BufferSlice cullBuffer;
+  std::vector<CullObject> cullObjects;
+  // Regions the GPU has written culling output to at least once
+  bool cullFrameWritten[maxFramesInFlight] = {};
+  // Checks every frame's culling output against cullObjectsReference before
+  // its region is reused. Slow, for debugging the kernel. Frames using Hi-Z
+  // occlusion culling aren't checked, their pyramid only exists on the GPU.
+  static constexpr bool validateGpuCulling = false;
+  simd::float4 objBoundingSphere = {0, 0, 0, 0};
+
+  // Clustered forward lighting of the lit pipeline
+  static constexpr uint32_t maxPointLights = 1024;
+  static constexpr uint32_t maxClusterLightIndices = 64 * 1024;
+  std::vector<PointLight> pointLights;
+  LightClusterer lightClusterer{maxClusterLightIndices};
+  ClusterFrameLayout clusterLayout;
+  // One clusterLayout region per frame in flight
+  BufferSlice clusterBuffer;
+
+  // Cascaded shadows of the key light, pointLights[0]. It's treated as a
+  // directional light shining at the obj, which is where its shadows land.
+  static constexpr uint32_t shadowedLight = 0;
+  // Shadows are cast up to this view depth, well short of farZ, so the
+  // cascades stay small enough to be sharp
+  static constexpr float shadowDistance = 20.0f;
+  // Between uniform (0) and logarithmic (1) cascade splits
+  static constexpr float shadowSplitLambda = 0.75f;
+  // How far towards the light a caster may be and still cast into a cascade
+  static constexpr float shadowCasterDistance = 20.0f;
+  // Shadow map depth, subtracted from receivers on top of the normal offset
+  static constexpr float shadowDepthBias = 0.0005f;
+  // Depth32Float 2D array, one slice per cascade
+  MTL::Texture *shadowMap = nullptr;
+  ShadowFrameLayout shadowLayout;
+  // One shadowLayout region per frame in flight
+  BufferSlice shadowBuffer;
+  ShadowCascade shadowCascades[ShadowCascadeCount];
+  uint32_t shadowCasterCounts[ShadowCascadeCount] = {};
+
   MTL::Buffer *triangleVertexBuffer;
   MTL::Buffer *cubeVertexBuffer;
   MTL::Buffer *transformationBuffer;
 
   Texture *grassTexture;
   Texture *marsTexture = nullptr;
+  uint32_t marsTextureId = 0;
+
+  // Lit draws with a position stream first write depth alone, so the
+  // forward pass shades each pixel once however much the dense obj overlaps
+  // itself. Toggled with P to measure the difference.
+  bool depthPrepass = true;
+  // drawList indices of the pre-passed draws, in drawPackets order
+  std::vector<uint32_t> depthPrepassDraws;
+
+  // Entities with an OccluderComponent hide the cullObjects behind them,
+  // tested on the CPU at low resolution. Toggled with O.
+  bool occlusionCulling = true;
+  std::vector<OccluderMesh> occluderMeshes;
+  OcclusionCuller occlusionCuller{256, 144};
+  // Since the last report
+  uint64_t occlusionTested = 0;
+  uint64_t occlusionCulled = 0;
+
+  // GPU culled instances are also tested against a Hi-Z pyramid of the
+  // previous frame's depth, see hiz_culling.hpp. The depth buffer is then
+  // stored rather than discarded, so the attachments can't be memoryless
+  // while it's on. Toggled with H.
+  bool hizCulling = false;
+  // R32Float, full mip chain. Bound to the culling kernel even while
+  // hizCulling is off, which then doesn't read it.
+  MTL::Texture *hizPyramid = nullptr;
+  // A view of each of hizPyramid's mips, for the kernels to write
+  std::vector<MTL::Texture *> hizPyramidLevels;
+  // World to clip space of the frame hizPyramid holds the depth of, and
+  // whether it holds any at its current size
+  Float4x4 hizViewProjection;
+  bool hizPyramidValid = false;
+  // Loads the forward pass's attachments, draws lateDrawList and resolves
+  MTL::RenderPassDescriptor *lateRenderPassDescriptor = nullptr;
+  // Draws of the instances the late pass found
+  std::vector<DrawItem> lateDrawList;
+
+  // Per-pass totals since the last report
+  struct PassStats {
+    uint64_t draws = 0;
+    double encodeMilliseconds = 0.0;
+  };
+  static constexpr uint32_t statsReportInterval = 120;
+  PassStats depthPrepassStats;
+  PassStats forwardStats;
+  uint32_t statsFrames = 0;
+
+  // Zones of the frame profiler, see profiler.hpp. Each pass is a GPU zone
+  // where the GPU can sample timestamps at pass boundaries.
+  static constexpr uint32_t maxGpuZonesPerFrame = 16;
+  GpuZoneRecorder gpuZones{maxFramesInFlight, maxGpuZonesPerFrame};
+  // Null without pass timing, leaving only whole command buffers as zones
+  MTL::CounterSampleBuffer *counterSampleBuffer = nullptr;
+  std::vector<ProfileEvent> frameEvents;
+  // Milliseconds. CPU frames are from one frame's start to the next, so
+  // they include waiting for the GPU and the drawable.
+  FrameTimeHistory cpuFrameTimes;
+  FrameTimeHistory gpuFrameTimes;
+  uint64_t lastFrameStart = 0;
+  static constexpr uint32_t traceCaptureFrames = 300;
+  uint32_t traceFramesLeft = 0;
+  std::vector<ProfileEvent> traceEvents;
+
+  // Inputs of the frame being built, captured and replayed as they are.
+  // frameTime is in seconds, from glfwGetTime() while running.
+  double frameTime = 0.0;
+  FrameCamera camera;
+  static constexpr uint32_t frameCaptureFrames = 300;
+  FrameCapturer frameCapturer;
+
+  std::vector<DrawItem> drawList;
+  // drawList in submission order, sorted by DrawItem::sortKey
+  std::vector<DrawPacket> drawPackets;
+  std::vector<DrawPacket> drawPacketScratch;
+  DrawKeyIds pipelineKeyIds{drawKeyPipelineBits};
+  DrawKeyIds materialKeyIds{drawKeyMaterialBits};
+  // Fewer draws than this per thread aren't worth a parallel encoder
+  static constexpr size_t minDrawsPerEncoder = 64;
+
+  // Model transforms. The obj spins each frame, the light hangs still.
+  SceneGraph scene;
+  SceneNodeId objNode = invalidSceneNode;
+  SceneNodeId lightNode = invalidSceneNode;
+  // Everything drawn in the forward pass
+  EntityStore entities;
+
+  // Only the mars texture of createSphere is streamed, so with the sphere
+  // left out of init the streamer stays empty. streaming_sim and the
+  // streaming tests exercise it on their own.
+  TextureStreamer textureStreamer;
+  // Indexed by the id returned from TextureStreamer::registerTexture
+  std::vector<Texture *> streamedTextures;
 };
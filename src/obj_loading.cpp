@@ -0,0 +1,73 @@
+#include "obj_loading.hpp"
+#include "tiny_obj_loader.h"
+
+#include <iostream>
+
+static bool convertObj(bool loaded, const std::string &warn,
+                       const std::string &err, const char *name,
+                       const tinyobj::attrib_t &attrib,
+                       const std::vector<tinyobj::shape_t> &shapes,
+                       std::vector<MeshVertex> &vertices) {
+  if (!warn.empty()) {
+    std::cout << "Tiny Obj Warning: " << warn << std::endl;
+  }
+  if (!err.empty()) {
+    std::cerr << "Tiny Obj Error: " << err << std::endl;
+  }
+  if (!loaded) {
+    std::cerr << "Failed to load OBJ file: " << name << std::endl;
+    return false;
+  }
+
+  size_t cornerCount = 0;
+  for (const auto &shape : shapes) {
+    cornerCount += shape.mesh.indices.size();
+  }
+  if (!cornerCount) {
+    std::cerr << "No vertices in OBJ file: " << name << std::endl;
+    return false;
+  }
+
+  vertices.reserve(vertices.size() + cornerCount);
+  for (const auto &shape : shapes) {
+    for (const auto &index : shape.mesh.indices) {
+      MeshVertex vertex;
+      const float *position = &attrib.vertices[3 * index.vertex_index];
+      vertex.position = {position[0], position[1], position[2], 1.0f};
+      if (index.texcoord_index >= 0) {
+        const float *uv = &attrib.texcoords[2 * index.texcoord_index];
+        vertex.textureCoordinate = {uv[0], 1.0f - uv[1]};
+      } else {
+        vertex.textureCoordinate = {0.0f, 0.0f};
+      }
+      if (index.normal_index >= 0) {
+        const float *normal = &attrib.normals[3 * index.normal_index];
+        vertex.normal = {normal[0], normal[1], normal[2], 0.0f};
+      } else {
+        vertex.normal = {0.0f, 0.0f, 0.0f, 0.0f};
+      }
+      vertices.push_back(vertex);
+    }
+  }
+  return true;
+}
+
+bool loadObjVertices(const char *filename, std::vector<MeshVertex> &vertices) {
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+  bool loaded =
+      tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, filename);
+  return convertObj(loaded, warn, err, filename, attrib, shapes, vertices);
+}
+
+bool parseObjVertices(std::istream &stream, std::vector<MeshVertex> &vertices) {
+  tinyobj::attrib_t attrib;
+  std::vector<tinyobj::shape_t> shapes;
+  std::vector<tinyobj::material_t> materials;
+  std::string warn, err;
+  bool loaded =
+      tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, &stream);
+  return convertObj(loaded, warn, err, "<stream>", attrib, shapes, vertices);
+}
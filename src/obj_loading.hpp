@@ -0,0 +1,18 @@
+#pragma once
+// Wavefront obj loading, parsed by tinyobjloader.
+//
+// The engine draws objs unindexed, so every face corner becomes a vertex of
+// its own. Parsing and that conversion are kept out of MTLEngine so they run
+// on any thread and any platform, the benchmarks included.
+#include "procedural_geometry.hpp"
+
+#include <istream>
+#include <vector>
+
+// Appends one vertex per face corner: positions with w = 1, texture
+// coordinates with v flipped for Metal, normals with w = 0. Corners without
+// a texture coordinate or normal get zeros. Returns false, and says why on
+// std::cerr, if the obj can't be parsed or has no faces.
+bool loadObjVertices(const char *filename, std::vector<MeshVertex> &vertices);
+// From obj text already in memory. Material libraries aren't read.
+bool parseObjVertices(std::istream &stream, std::vector<MeshVertex> &vertices);
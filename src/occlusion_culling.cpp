@@ -0,0 +1,368 @@
+#include "occlusion_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Vertices this close to the eye or behind it drop their triangle
+static constexpr float minClipW = 1e-5f;
+// Vertices and triangles are set up in chunks of this many per task
+static constexpr size_t setupGrainSize = 1024;
+
+OcclusionCuller::OcclusionCuller(uint32_t width, uint32_t height) {
+  tilesX = std::max(1u, (width + tileWidth - 1) / tileWidth);
+  tilesY = std::max(1u, (height + tileHeight - 1) / tileHeight);
+  bufferWidth = tilesX * tileWidth;
+  bufferHeight = tilesY * tileHeight;
+  depthBuffer.assign((size_t)bufferWidth * bufferHeight, 1.0f);
+  tileMaxDepth.assign((size_t)tilesX * tilesY, 1.0f);
+}
+
+void OcclusionCuller::beginFrame(const Float4x4 &frameViewProjection) {
+  viewProjection = frameViewProjection;
+  occluders.clear();
+  occlusionStats = {};
+  // Nothing is occluded until rasterize()
+  std::fill(depthBuffer.begin(), depthBuffer.end(), 1.0f);
+  std::fill(tileMaxDepth.begin(), tileMaxDepth.end(), 1.0f);
+}
+
+void OcclusionCuller::addOccluder(const float *positions, uint32_t vertexCount,
+                                  const uint32_t *indices, uint32_t indexCount,
+                                  const Float4x4 &model) {
+  Occluder occluder;
+  occluder.positions = positions;
+  occluder.vertexCount = vertexCount;
+  occluder.indices = indices;
+  occluder.indexCount = indexCount - indexCount % 3;
+  occluder.modelViewProjection = mul(viewProjection, model);
+  occluder.firstVertex = 0;
+  occluder.firstTriangle = 0;
+  if (!occluders.empty()) {
+    const Occluder &last = occluders.back();
+    occluder.firstVertex = last.firstVertex + last.vertexCount;
+    occluder.firstTriangle = last.firstTriangle + last.indexCount / 3;
+  }
+  occluders.push_back(occluder);
+  occlusionStats.occluders++;
+  occlusionStats.occluderTriangles += occluder.indexCount / 3;
+}
+
+void OcclusionCuller::transformVertices(const Occluder &occluder, size_t begin,
+                                        size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    const float *p = occluder.positions + i * 3;
+    clipVertices[occluder.firstVertex + i] =
+        mul(occluder.modelViewProjection, Float4{p[0], p[1], p[2], 1.0f});
+  }
+}
+
+void OcclusionCuller::setupTriangles(const Occluder &occluder, size_t begin,
+                                     size_t end) {
+  float width = (float)bufferWidth;
+  float height = (float)bufferHeight;
+  for (size_t t = begin; t < end; t++) {
+    Triangle &triangle = triangles[occluder.firstTriangle + t];
+    triangle.minY = 1;
+    triangle.maxY = 0;
+
+    float x[3], y[3], z[3];
+    bool dropped = false;
+    for (int corner = 0; corner < 3; corner++) {
+      uint32_t index = occluder.indices[t * 3 + corner];
+      if (index >= occluder.vertexCount) {
+        dropped = true;
+        break;
+      }
+      const Float4 &clip = clipVertices[occluder.firstVertex + index];
+      // Clipping would keep the part in front, dropping is simpler and
+      // still conservative
+      if (clip.w < minClipW || clip.z < 0.0f) {
+        dropped = true;
+        break;
+      }
+      float inverseW = 1.0f / clip.w;
+      // Pixel coordinates, y down
+      x[corner] = (clip.x * inverseW * 0.5f + 0.5f) * width;
+      y[corner] = (0.5f - clip.y * inverseW * 0.5f) * height;
+      z[corner] = clip.z * inverseW;
+    }
+    if (dropped) {
+      continue;
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (std::fabs(area) < 1e-6f) {
+      continue;
+    }
+    // Occluders block light from both sides, so either winding is filled.
+    // Swapping two corners makes the area positive.
+    if (area < 0.0f) {
+      std::swap(x[1], x[2]);
+      std::swap(y[1], y[2]);
+      std::swap(z[1], z[2]);
+      area = -area;
+    }
+
+    float minX = std::min({x[0], x[1], x[2]});
+    float maxX = std::max({x[0], x[1], x[2]});
+    float minY = std::min({y[0], y[1], y[2]});
+    float maxY = std::max({y[0], y[1], y[2]});
+    // Pixels whose centre may be inside, clamped to the buffer
+    triangle.minX = (int32_t)std::max(0.0f, std::floor(minX - 0.5f));
+    triangle.maxX = (int32_t)std::min(width - 1.0f, std::ceil(maxX - 0.5f));
+    triangle.minY = (int32_t)std::max(0.0f, std::floor(minY - 0.5f));
+    triangle.maxY = (int32_t)std::min(height - 1.0f, std::ceil(maxY - 0.5f));
+    if (triangle.minX > triangle.maxX) {
+      triangle.minY = 1;
+      triangle.maxY = 0;
+      continue;
+    }
+
+    // Edge i runs from corner i to corner i + 1 and is >= 0 inside
+    for (int i = 0; i < 3; i++) {
+      int j = (i + 1) % 3;
+      triangle.edgeA[i] = y[i] - y[j];
+      triangle.edgeB[i] = x[j] - x[i];
+      triangle.edgeC[i] =
+          -(triangle.edgeA[i] * x[i] + triangle.edgeB[i] * y[i]);
+    }
+
+    float inverseArea = 1.0f / area;
+    triangle.depthA =
+        ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) *
+        inverseArea;
+    triangle.depthB =
+        ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) *
+        inverseArea;
+    triangle.depthC = z[0] - triangle.depthA * x[0] - triangle.depthB * y[0];
+    // Half a pixel along each axis reaches any point of the pixel
+    triangle.depthSlack =
+        0.5f * (std::fabs(triangle.depthA) + std::fabs(triangle.depthB));
+    triangle.depthMax = std::max({z[0], z[1], z[2]});
+  }
+}
+
+void OcclusionCuller::fillTriangle(const Triangle &triangle, int32_t minY,
+                                   int32_t maxY) {
+  for (int32_t y = minY; y <= maxY; y++) {
+    float pixelY = (float)y + 0.5f;
+    float rowEdge[3];
+    // Each edge bounds the row's span from one side. Widened by a pixel so
+    // rounding here can't lose pixels, the edge tests below are exact.
+    float spanMin = (float)triangle.minX;
+    float spanMax = (float)triangle.maxX;
+    for (int i = 0; i < 3; i++) {
+      rowEdge[i] = triangle.edgeB[i] * pixelY + triangle.edgeC[i];
+      float a = triangle.edgeA[i];
+      if (a > 0.0f) {
+        spanMin = std::max(spanMin, -rowEdge[i] / a - 1.5f);
+      } else if (a < 0.0f) {
+        spanMax = std::min(spanMax, -rowEdge[i] / a + 0.5f);
+      }
+    }
+    if (spanMin > spanMax) {
+      continue;
+    }
+    // Whole groups of four, the buffer width is a multiple of the tile width
+    int32_t x = (int32_t)spanMin & ~3;
+    int32_t lastX = (int32_t)spanMax;
+    float rowDepth =
+        triangle.depthB * pixelY + triangle.depthC + triangle.depthSlack;
+    float *row = depthBuffer.data() + (size_t)y * bufferWidth;
+
+#if defined(__ARM_NEON)
+    const float laneOffsets[4] = {0.5f, 1.5f, 2.5f, 3.5f};
+    float32x4_t lanes = vld1q_f32(laneOffsets);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    float32x4_t depthMax = vdupq_n_f32(triangle.depthMax);
+    for (; x <= lastX; x += 4) {
+      float32x4_t pixelX = vaddq_f32(vdupq_n_f32((float)x), lanes);
+      uint32x4_t inside = vdupq_n_u32(~0u);
+      for (int i = 0; i < 3; i++) {
+        float32x4_t edge =
+            vaddq_f32(vmulq_f32(vdupq_n_f32(triangle.edgeA[i]), pixelX),
+                      vdupq_n_f32(rowEdge[i]));
+        inside = vandq_u32(inside, vcgeq_f32(edge, zero));
+      }
+      float32x4_t depth =
+          vaddq_f32(vmulq_f32(vdupq_n_f32(triangle.depthA), pixelX),
+                    vdupq_n_f32(rowDepth));
+      depth = vminq_f32(depth, depthMax);
+      float32x4_t old = vld1q_f32(row + x);
+      vst1q_f32(row + x, vbslq_f32(inside, vminq_f32(old, depth), old));
+    }
+#elif defined(__SSE2__)
+    __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 depthMax = _mm_set1_ps(triangle.depthMax);
+    for (; x <= lastX; x += 4) {
+      __m128 pixelX = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+      __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+      for (int i = 0; i < 3; i++) {
+        __m128 edge =
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edgeA[i]), pixelX),
+                       _mm_set1_ps(rowEdge[i]));
+        inside = _mm_and_ps(inside, _mm_cmpge_ps(edge, zero));
+      }
+      __m128 depth = _mm_add_ps(
+          _mm_mul_ps(_mm_set1_ps(triangle.depthA), pixelX),
+          _mm_set1_ps(rowDepth));
+      depth = _mm_min_ps(depth, depthMax);
+      __m128 old = _mm_loadu_ps(row + x);
+      __m128 nearer = _mm_min_ps(old, depth);
+      _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer),
+                                       _mm_andnot_ps(inside, old)));
+    }
+#else
+    for (; x <= lastX; x++) {
+      float pixelX = (float)x + 0.5f;
+      bool inside = true;
+      for (int i = 0; i < 3; i++) {
+        inside &= triangle.edgeA[i] * pixelX + rowEdge[i] >= 0.0f;
+      }
+      if (inside) {
+        float depth = std::min(triangle.depthA * pixelX + rowDepth,
+                               triangle.depthMax);
+        row[x] = std::min(row[x], depth);
+      }
+    }
+#endif
+  }
+}
+
+void OcclusionCuller::rasterizeBand(uint32_t firstTileRow,
+                                    uint32_t lastTileRow) {
+  int32_t bandMinY = (int32_t)(firstTileRow * tileHeight);
+  int32_t bandMaxY = (int32_t)(lastTileRow * tileHeight) - 1;
+
+  for (const Triangle &triangle : triangles) {
+    int32_t minY = std::max(triangle.minY, bandMinY);
+    int32_t maxY = std::min(triangle.maxY, bandMaxY);
+    if (minY <= maxY) {
+      fillTriangle(triangle, minY, maxY);
+    }
+  }
+
+  for (uint32_t tileY = firstTileRow; tileY < lastTileRow; tileY++) {
+    for (uint32_t tileX = 0; tileX < tilesX; tileX++) {
+      float farthest = 0.0f;
+      for (uint32_t y = 0; y < tileHeight; y++) {
+        const float *row = depthBuffer.data() +
+                           (size_t)(tileY * tileHeight + y) * bufferWidth +
+                           tileX * tileWidth;
+        for (uint32_t x = 0; x < tileWidth; x++) {
+          farthest = std::max(farthest, row[x]);
+        }
+      }
+      tileMaxDepth[tileY * tilesX + tileX] = farthest;
+    }
+  }
+}
+
+void OcclusionCuller::rasterize(ThreadPool *pool) {
+  uint32_t vertexCount = 0;
+  uint32_t triangleCount = 0;
+  if (!occluders.empty()) {
+    const Occluder &last = occluders.back();
+    vertexCount = last.firstVertex + last.vertexCount;
+    triangleCount = last.firstTriangle + last.indexCount / 3;
+  }
+  clipVertices.resize(vertexCount);
+  triangles.resize(triangleCount);
+
+  for (const Occluder &occluder : occluders) {
+    if (pool && occluder.vertexCount > setupGrainSize) {
+      pool->parallelFor(occluder.vertexCount, setupGrainSize,
+                        [&](size_t begin, size_t end) {
+                          transformVertices(occluder, begin, end);
+                        });
+    } else {
+      transformVertices(occluder, 0, occluder.vertexCount);
+    }
+  }
+  for (const Occluder &occluder : occluders) {
+    size_t count = occluder.indexCount / 3;
+    if (pool && count > setupGrainSize) {
+      pool->parallelFor(count, setupGrainSize, [&](size_t begin, size_t end) {
+        setupTriangles(occluder, begin, end);
+      });
+    } else {
+      setupTriangles(occluder, 0, count);
+    }
+  }
+  for (const Triangle &triangle : triangles) {
+    occlusionStats.rasterizedTriangles += triangle.minY <= triangle.maxY;
+  }
+
+  if (pool) {
+    pool->parallelFor(tilesY, 1, [&](size_t begin, size_t end) {
+      rasterizeBand((uint32_t)begin, (uint32_t)end);
+    });
+  } else {
+    rasterizeBand(0, tilesY);
+  }
+}
+
+bool OcclusionCuller::isOccluded(Float3 boxMin, Float3 boxMax) const {
+  float minX = INFINITY, maxX = -INFINITY;
+  float minY = INFINITY, maxY = -INFINITY;
+  float nearest = INFINITY;
+  for (int corner = 0; corner < 8; corner++) {
+    Float4 point = {corner & 1 ? boxMax.x : boxMin.x,
+                    corner & 2 ? boxMax.y : boxMin.y,
+                    corner & 4 ? boxMax.z : boxMin.z, 1.0f};
+    Float4 clip = mul(viewProjection, point);
+    if (clip.w < minClipW || clip.z < 0.0f) {
+      return false;
+    }
+    float inverseW = 1.0f / clip.w;
+    float x = (clip.x * inverseW * 0.5f + 0.5f) * bufferWidth;
+    float y = (0.5f - clip.y * inverseW * 0.5f) * bufferHeight;
+    minX = std::min(minX, x);
+    maxX = std::max(maxX, x);
+    minY = std::min(minY, y);
+    maxY = std::max(maxY, y);
+    nearest = std::min(nearest, clip.z * inverseW);
+  }
+
+  // Every pixel the box's outline touches, not just those whose centre it
+  // covers
+  int32_t firstX = (int32_t)std::max(0.0f, std::floor(minX));
+  int32_t lastX = (int32_t)std::min(bufferWidth - 1.0f, std::floor(maxX));
+  int32_t firstY = (int32_t)std::max(0.0f, std::floor(minY));
+  int32_t lastY = (int32_t)std::min(bufferHeight - 1.0f, std::floor(maxY));
+  if (firstX > lastX || firstY > lastY) {
+    // Off screen, which is for frustum culling to decide
+    return false;
+  }
+
+  for (int32_t tileY = firstY / (int32_t)tileHeight;
+       tileY <= lastY / (int32_t)tileHeight; tileY++) {
+    for (int32_t tileX = firstX / (int32_t)tileWidth;
+         tileX <= lastX / (int32_t)tileWidth; tileX++) {
+      // The whole tile is nearer than the box
+      if (tileMaxDepth[tileY * tilesX + tileX] < nearest) {
+        continue;
+      }
+      int32_t startX = std::max(firstX, tileX * (int32_t)tileWidth);
+      int32_t endX = std::min(lastX, (tileX + 1) * (int32_t)tileWidth - 1);
+      int32_t startY = std::max(firstY, tileY * (int32_t)tileHeight);
+      int32_t endY = std::min(lastY, (tileY + 1) * (int32_t)tileHeight - 1);
+      for (int32_t y = startY; y <= endY; y++) {
+        const float *row = depthBuffer.data() + (size_t)y * bufferWidth;
+        for (int32_t x = startX; x <= endX; x++) {
+          if (row[x] >= nearest) {
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,121 @@
+#pragma once
+// Software occlusion culling: a low resolution CPU depth rasterizer.
+//
+// Designated occluders (walls, floors, big props, as simple meshes) are
+// rasterized into a small depth buffer on the CPU before anything is
+// submitted, and the bounding box of every other object is then tested
+// against it. An object whose box is behind the occluders wherever it
+// covers the screen isn't drawn at all. This follows the approach of
+// Intel's Masked Occlusion Culling, simplified: the buffer stores a depth
+// per pixel rather than a coverage mask and two depths per tile, and a
+// second level keeps the farthest depth of every tileWidth x tileHeight
+// tile, so most boxes are decided from a handful of tiles.
+//
+// The buffer only ever errs towards keeping objects:
+//  - occluder triangles crossing the near plane are dropped rather than
+//    clipped, which only removes occlusion
+//  - a covered pixel stores the farthest depth its triangle can have inside
+//    the pixel, not the depth at its centre
+//  - boxes crossing the near plane are always visible
+// so everything that's culled is hidden by the occluders, up to pixel
+// centre coverage at the occluders' edges.
+//
+// Rasterization runs in parallel over bands of tile rows, which own their
+// pixels outright. Within a band, triangles are filled four pixels at a time
+// with NEON or SSE.
+#include "engine_math.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct OcclusionStats {
+  uint32_t occluders = 0;
+  uint32_t occluderTriangles = 0;
+  // Triangles that weren't dropped, back facing ones included
+  uint32_t rasterizedTriangles = 0;
+};
+
+class OcclusionCuller {
+public:
+  static constexpr uint32_t tileWidth = 8;
+  static constexpr uint32_t tileHeight = 8;
+
+  // Size of the depth buffer, rounded up to whole tiles
+  OcclusionCuller(uint32_t width, uint32_t height);
+
+  // Clears the buffer and forgets last frame's occluders. Depths are those
+  // of `viewProjection`, 0 near and 1 far.
+  void beginFrame(const Float4x4 &viewProjection);
+
+  // Queues an occluder mesh. `positions` holds packed float3s (see
+  // position_stream.hpp), `indices` a triangle list of either winding. Both
+  // are read in rasterize(), so must stay alive until then.
+  void addOccluder(const float *positions, uint32_t vertexCount,
+                   const uint32_t *indices, uint32_t indexCount,
+                   const Float4x4 &model);
+
+  // Renders every queued occluder. `pool` may be null to run on the calling
+  // thread.
+  void rasterize(ThreadPool *pool = &ThreadPool::shared());
+
+  // True if the world space box is hidden behind the rasterized occluders.
+  // Safe to call from several threads at once after rasterize().
+  bool isOccluded(Float3 boxMin, Float3 boxMax) const;
+
+  uint32_t width() const { return bufferWidth; }
+  uint32_t height() const { return bufferHeight; }
+  // Row major, width() x height(), 1 where no occluder was drawn
+  const float *depth() const { return depthBuffer.data(); }
+  // Farthest depth of each tile, row major
+  const float *tileDepth() const { return tileMaxDepth.data(); }
+  const OcclusionStats &stats() const { return occlusionStats; }
+
+private:
+  struct Occluder {
+    const float *positions;
+    uint32_t vertexCount;
+    const uint32_t *indices;
+    uint32_t indexCount;
+    Float4x4 modelViewProjection;
+    // Of its clip space vertices and triangles in the frame's arrays
+    uint32_t firstVertex;
+    uint32_t firstTriangle;
+  };
+
+  // Screen space edge functions and depth plane of one triangle, evaluated
+  // at pixel centres
+  struct Triangle {
+    float edgeA[3];
+    float edgeB[3];
+    float edgeC[3];
+    // depth = depthC + depthA * x + depthB * y, plus depthSlack to reach
+    // the farthest point in the pixel, but never past depthMax
+    float depthA;
+    float depthB;
+    float depthC;
+    float depthSlack;
+    float depthMax;
+    // Pixel bounds, inclusive. Dropped triangles have minY > maxY.
+    int32_t minX, maxX, minY, maxY;
+  };
+
+  void transformVertices(const Occluder &occluder, size_t begin, size_t end);
+  void setupTriangles(const Occluder &occluder, size_t begin, size_t end);
+  // Fills tile rows [firstTileRow, lastTileRow) and rebuilds their tiles
+  void rasterizeBand(uint32_t firstTileRow, uint32_t lastTileRow);
+  void fillTriangle(const Triangle &triangle, int32_t minY, int32_t maxY);
+
+  uint32_t bufferWidth;
+  uint32_t bufferHeight;
+  uint32_t tilesX;
+  uint32_t tilesY;
+  Float4x4 viewProjection;
+  std::vector<float> depthBuffer;
+  std::vector<float> tileMaxDepth;
+
+  std::vector<Occluder> occluders;
+  std::vector<Float4> clipVertices;
+  std::vector<Triangle> triangles;
+  OcclusionStats occlusionStats;
+};
@@ -0,0 +1,289 @@
+// offscreen_stub: the engine's offscreen readback path with the GPU stubbed
+// out.
+//
+//   offscreen_stub [--size WxH] [--frames n] [--out dir] [--format png|raw]
+//                  [--latency ms] [--threads n] [--verify]
+//
+// The renderer loop runs as fast as the readback queue lets it, like
+// MTLEngine::runOffscreen. Every frame it acquires a slot and submits a
+// stand-in command buffer to a thread playing the GPU, which works through
+// them in order, waits --latency to simulate the render and the copy, fills
+// the slot with a pattern made from the frame's number and completes it.
+// FrameWriter saves the frames as the engine's would. --verify reads the
+// files back and checks every pixel against the pattern, and exits with 1
+// if any differ. Runs anywhere engine_core builds.
+#include "frame_readback.hpp"
+
+#include "stb/stb_image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// BGRA of pixel (x, y) of `frame`: gradients that shift with the frame and
+// a bar sweeping across, so frames written out of order or mixed up differ
+static void patternPixel(uint64_t frame, uint32_t x, uint32_t y,
+                         uint8_t bgra[4]) {
+  uint32_t bar = (uint32_t)(frame * 7) % 256;
+  bgra[0] = (uint8_t)(x + frame);
+  bgra[1] = (uint8_t)(y * 2 + frame * 3);
+  bgra[2] = (x % 256) / 16 == bar / 16 ? 255 : (uint8_t)(x ^ y);
+  bgra[3] = 255;
+}
+
+static void fillPattern(uint64_t frame, uint32_t width, uint32_t height,
+                        uint32_t bytesPerRow, uint8_t *pixels) {
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t *row = pixels + (size_t)y * bytesPerRow;
+    for (uint32_t x = 0; x < width; x++) {
+      patternPixel(frame, x, y, row + x * 4);
+    }
+  }
+}
+
+// Runs submitted work in order on a thread of its own, like a command queue
+class StubGpu {
+public:
+  StubGpu() : thread([this]() { run(); }) {}
+  ~StubGpu() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    condition.notify_one();
+    thread.join();
+  }
+
+  void submit(std::function<void()> commandBuffer) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      commandBuffers.push_back(std::move(commandBuffer));
+    }
+    condition.notify_one();
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::function<void()> commandBuffer;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock,
+                       [this]() { return stopping || !commandBuffers.empty(); });
+        if (commandBuffers.empty()) {
+          return;
+        }
+        commandBuffer = std::move(commandBuffers.front());
+        commandBuffers.pop_front();
+      }
+      commandBuffer();
+    }
+  }
+
+  std::deque<std::function<void()>> commandBuffers;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+  std::thread thread;
+};
+
+struct StubOptions {
+  uint32_t width = 640;
+  uint32_t height = 360;
+  uint32_t frames = 120;
+  std::string directory = "offscreen_frames";
+  FrameFileFormat format = FrameFileFormat::Png;
+  double latencyMilliseconds = 2.0;
+  uint32_t threads = 0;
+  bool verify = false;
+};
+
+// Whether `rgba` (or BGRA, `bgra`), tightly packed, is `frame`'s pattern
+static bool matchesPattern(uint64_t frame, uint32_t width, uint32_t height,
+                           const uint8_t *pixels, bool bgra) {
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      uint8_t expected[4];
+      patternPixel(frame, x, y, expected);
+      if (!bgra) {
+        std::swap(expected[0], expected[2]);
+      }
+      if (memcmp(expected, pixels + ((size_t)y * width + x) * 4, 4) != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool verifyFrames(const StubOptions &options) {
+  uint32_t mismatches = 0;
+  if (options.format == FrameFileFormat::Raw) {
+    std::string path =
+        FrameWriter::framePath(options.directory, options.format, 0);
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> pixels((size_t)options.width * options.height * 4);
+    for (uint32_t frame = 0; frame < options.frames; frame++) {
+      if (!file.read((char *)pixels.data(), (std::streamsize)pixels.size())) {
+        std::cerr << path << " ends before frame " << frame << std::endl;
+        return false;
+      }
+      if (!matchesPattern(frame, options.width, options.height, pixels.data(),
+                          true)) {
+        std::cerr << "Frame " << frame << " of " << path << " differs"
+                  << std::endl;
+        mismatches++;
+      }
+    }
+    if (file.peek() != EOF) {
+      std::cerr << path << " has more than " << options.frames << " frames"
+                << std::endl;
+      return false;
+    }
+    return mismatches == 0;
+  }
+
+  for (uint32_t frame = 0; frame < options.frames; frame++) {
+    std::string path =
+        FrameWriter::framePath(options.directory, options.format, frame);
+    int width, height, channels;
+    stbi_uc *pixels = stbi_load(path.c_str(), &width, &height, &channels, 4);
+    if (!pixels) {
+      std::cerr << "Can't decode " << path << ": " << stbi_failure_reason()
+                << std::endl;
+      mismatches++;
+      continue;
+    }
+    if ((uint32_t)width != options.width ||
+        (uint32_t)height != options.height ||
+        !matchesPattern(frame, options.width, options.height, pixels, false)) {
+      std::cerr << path << " differs from frame " << frame << std::endl;
+      mismatches++;
+    }
+    stbi_image_free(pixels);
+  }
+  return mismatches == 0;
+}
+
+static int run(const StubOptions &options) {
+  uint32_t bytesPerRow = readbackBytesPerRow(options.width);
+  size_t slotSize = (size_t)bytesPerRow * options.height;
+  std::vector<std::vector<uint8_t>> slotStorage(3,
+                                                std::vector<uint8_t>(slotSize));
+  std::vector<uint8_t *> slotMemory;
+  for (std::vector<uint8_t> &storage : slotStorage) {
+    slotMemory.push_back(storage.data());
+  }
+  ReadbackQueue queue(slotMemory);
+  FrameWriterOptions writerOptions;
+  writerOptions.directory = options.directory;
+  writerOptions.format = options.format;
+  writerOptions.threads = options.threads;
+
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point start = Clock::now();
+  FrameWriterStats written;
+  {
+    FrameWriter writer(queue, writerOptions);
+    {
+      StubGpu gpu;
+      auto latency =
+          std::chrono::duration<double, std::milli>(options.latencyMilliseconds);
+      for (uint64_t frame = 0; frame < options.frames; frame++) {
+        uint32_t slot = queue.acquire();
+        uint8_t *pixels = queue.slotMemory(slot);
+        uint32_t width = options.width;
+        uint32_t height = options.height;
+        gpu.submit([&queue, latency, slot, frame, width, height, bytesPerRow,
+                    pixels]() {
+          std::this_thread::sleep_for(latency);
+          fillPattern(frame, width, height, bytesPerRow, pixels);
+          queue.complete(slot, frame, width, height, bytesPerRow);
+        });
+      }
+      // Leaving the scope waits for the GPU to finish
+    }
+    queue.close();
+    writer.finish();
+    written = writer.stats();
+  }
+  double seconds =
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  ReadbackStats readback = queue.stats();
+  char line[160];
+  snprintf(line, sizeof(line),
+           "%llu frames, %.1f fps, %.1f MB written, %llu stalls (%.1f ms)",
+           (unsigned long long)written.frames, written.frames / seconds,
+           written.bytes / (1024.0 * 1024.0),
+           (unsigned long long)readback.stalls, readback.stallMilliseconds);
+  std::cout << line << std::endl;
+  if (written.failed || written.frames != options.frames) {
+    return 1;
+  }
+  if (options.verify) {
+    if (!verifyFrames(options)) {
+      return 1;
+    }
+    std::cout << "Every frame matches" << std::endl;
+  }
+  return 0;
+}
+
+static void printUsage() {
+  std::cerr << "Usage: offscreen_stub [--size WxH] [--frames n] [--out dir]\n"
+               "                      [--format png|raw] [--latency ms]\n"
+               "                      [--threads n] [--verify]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  StubOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (argument == "--size" && hasValue) {
+      unsigned width, height;
+      if (sscanf(argv[++i], "%ux%u", &width, &height) != 2 || width == 0 ||
+          height == 0) {
+        printUsage();
+        return 1;
+      }
+      options.width = width;
+      options.height = height;
+    } else if (argument == "--frames" && hasValue) {
+      options.frames = std::max(1, atoi(argv[++i]));
+    } else if (argument == "--out" && hasValue) {
+      options.directory = argv[++i];
+    } else if (argument == "--format" && hasValue) {
+      std::string format = argv[++i];
+      if (format != "png" && format != "raw") {
+        printUsage();
+        return 1;
+      }
+      options.format =
+          format == "png" ? FrameFileFormat::Png : FrameFileFormat::Raw;
+    } else if (argument == "--latency" && hasValue) {
+      options.latencyMilliseconds = std::max(0.0, atof(argv[++i]));
+    } else if (argument == "--threads" && hasValue) {
+      options.threads = std::max(0, atoi(argv[++i]));
+    } else if (argument == "--verify") {
+      options.verify = true;
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+  return run(options);
+}
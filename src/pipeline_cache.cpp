@@ -0,0 +1,306 @@
+#include "pipeline_cache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static constexpr const char *manifestHeader = "pipeline-manifest 2";
+
+bool PipelineDesc::operator==(const PipelineDesc &other) const {
+  if (vertexFunction != other.vertexFunction ||
+      fragmentFunction != other.fragmentFunction ||
+      depthFormat != other.depthFormat ||
+      stencilFormat != other.stencilFormat ||
+      sampleCount != other.sampleCount ||
+      depthCompare != other.depthCompare || depthWrite != other.depthWrite ||
+      specialized != other.specialized ||
+      shaderFeatures != other.shaderFeatures) {
+    return false;
+  }
+  for (uint32_t i = 0; i < maxColorAttachments; i++) {
+    if (colorFormats[i] != other.colorFormats[i] ||
+        !(blend[i] == other.blend[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+namespace {
+struct Fnv1a {
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  void bytes(const void *data, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+      hash ^= p[i];
+      hash *= 0x100000001b3ull;
+    }
+  }
+  void u32(uint32_t value) {
+    // Little endian regardless of the host, so keys match across platforms
+    uint8_t le[4] = {(uint8_t)value, (uint8_t)(value >> 8),
+                     (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    bytes(le, 4);
+  }
+  void string(const std::string &value) {
+    // Length prefixed so ("ab", "c") and ("a", "bc") differ
+    u32((uint32_t)value.size());
+    bytes(value.data(), value.size());
+  }
+};
+} // namespace
+
+uint64_t hashPipelineDesc(const PipelineDesc &desc) {
+  Fnv1a fnv;
+  fnv.string(desc.vertexFunction);
+  fnv.string(desc.fragmentFunction);
+  for (uint32_t i = 0; i < PipelineDesc::maxColorAttachments; i++) {
+    const PipelineBlendState &blend = desc.blend[i];
+    fnv.u32(desc.colorFormats[i]);
+    fnv.u32(blend.enabled);
+    fnv.u32(blend.rgbOperation);
+    fnv.u32(blend.alphaOperation);
+    fnv.u32(blend.sourceRGBFactor);
+    fnv.u32(blend.destinationRGBFactor);
+    fnv.u32(blend.sourceAlphaFactor);
+    fnv.u32(blend.destinationAlphaFactor);
+    fnv.u32(blend.writeMask);
+  }
+  fnv.u32(desc.depthFormat);
+  fnv.u32(desc.stencilFormat);
+  fnv.u32(desc.sampleCount);
+  fnv.u32(desc.depthCompare);
+  fnv.u32(desc.depthWrite);
+  fnv.u32(desc.specialized);
+  fnv.u32(desc.shaderFeatures);
+  return fnv.hash;
+}
+
+PipelineCache::PipelineCache(Backend backend, ThreadPool &pool)
+    : backend(std::move(backend)), pool(pool) {}
+
+PipelineCache::~PipelineCache() {
+  // No lock here: compile tasks take the mutex themselves, and nothing else
+  // may use the cache while it's being destroyed
+  for (auto &[desc, entry] : entries) {
+    CompiledPipeline pipeline = entry.future.get();
+    if (pipeline.valid() && backend.destroy) {
+      backend.destroy(pipeline);
+    }
+  }
+}
+
+CompiledPipeline PipelineCache::compileAndRecord(const PipelineDesc &desc) {
+  auto start = std::chrono::steady_clock::now();
+  CompiledPipeline pipeline = backend.compile(desc);
+  double milliseconds = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  cacheStats.compileMilliseconds += milliseconds;
+  if (!pipeline.valid()) {
+    cacheStats.failures++;
+    std::cerr << "PipelineCache: failed to compile '" << desc.label << "'"
+              << std::endl;
+  }
+  return pipeline;
+}
+
+PipelineCache::Entry &PipelineCache::findOrCompile(const PipelineDesc &desc,
+                                                   bool prewarming) {
+  // Called with the mutex held
+  auto found = entries.find(desc);
+  if (found != entries.end()) {
+    if (!prewarming) {
+      bool ready = found->second.future.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready;
+      (ready ? cacheStats.hits : cacheStats.joined)++;
+    }
+    return found->second;
+  }
+
+  cacheStats.compiles++;
+  if (prewarming) {
+    cacheStats.prewarmed++;
+  }
+  Entry entry;
+  entry.order = (uint32_t)entries.size();
+  entry.future =
+      pool.submit([this, desc]() { return compileAndRecord(desc); }).share();
+  return entries.emplace(desc, std::move(entry)).first->second;
+}
+
+uint64_t PipelineCache::request(const PipelineDesc &desc) {
+  std::lock_guard<std::mutex> lock(mutex);
+  cacheStats.requests++;
+  findOrCompile(desc, false);
+  return hashPipelineDesc(desc);
+}
+
+CompiledPipeline PipelineCache::acquire(const PipelineDesc &desc) {
+  std::shared_future<CompiledPipeline> future;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cacheStats.requests++;
+    future = findOrCompile(desc, false).future;
+  }
+  // The compile task takes the mutex to update the stats, so wait without it
+  return future.get();
+}
+
+bool PipelineCache::tryAcquire(const PipelineDesc &desc,
+                               CompiledPipeline &pipeline) {
+  std::lock_guard<std::mutex> lock(mutex);
+  cacheStats.requests++;
+  const Entry &entry = findOrCompile(desc, false);
+  if (entry.future.wait_for(std::chrono::seconds(0)) !=
+      std::future_status::ready) {
+    return false;
+  }
+  pipeline = entry.future.get();
+  return true;
+}
+
+CompiledPipeline PipelineCache::compileNow(const PipelineDesc &desc) {
+  std::promise<CompiledPipeline> promise;
+  std::shared_future<CompiledPipeline> future;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    cacheStats.requests++;
+    auto found = entries.find(desc);
+    if (found != entries.end()) {
+      future = found->second.future;
+    } else {
+      cacheStats.compiles++;
+      Entry entry;
+      entry.order = (uint32_t)entries.size();
+      entry.future = promise.get_future().share();
+      entries.emplace(desc, std::move(entry));
+    }
+  }
+  if (future.valid()) {
+    return future.get();
+  }
+  CompiledPipeline pipeline = compileAndRecord(desc);
+  promise.set_value(pipeline);
+  return pipeline;
+}
+
+std::vector<PipelineDesc> PipelineCache::descs() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<PipelineDesc> result(entries.size());
+  for (const auto &[desc, entry] : entries) {
+    result[entry.order] = desc;
+  }
+  return result;
+}
+
+void PipelineCache::prewarm(const std::vector<PipelineDesc> &descs) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const PipelineDesc &desc : descs) {
+    findOrCompile(desc, true);
+  }
+}
+
+// Manifest format, after a header line:
+//   <key> <vertex> <fragment> <sampleCount> <depthFormat> <stencilFormat>
+//   <depthCompare> <depthWrite> <specialized> <shaderFeatures>, then per
+//   colour attachment <format> <blend enabled> <rgbOp> <alphaOp> <srcRGB>
+//   <dstRGB> <srcAlpha> <dstAlpha> <writeMask>, and finally the label, which
+//   runs to the end of the line.
+bool PipelineCache::saveManifest(const char *path) const {
+  std::vector<const std::pair<const PipelineDesc, Entry> *> ordered;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &item : entries) {
+      ordered.push_back(&item);
+    }
+  }
+  std::sort(ordered.begin(), ordered.end(), [](auto *a, auto *b) {
+    return a->second.order < b->second.order;
+  });
+
+  std::ofstream file(path, std::ios::trunc);
+  if (!file) {
+    std::cerr << "PipelineCache: can't write " << path << std::endl;
+    return false;
+  }
+  file << manifestHeader << "\n";
+  for (const auto *item : ordered) {
+    const PipelineDesc &desc = item->first;
+    // Pipelines that failed to compile would fail again
+    if (!item->second.future.get().valid()) {
+      continue;
+    }
+    // Depth only pipelines have no fragment function, written as "-" to
+    // keep the fields apart
+    file << std::hex << hashPipelineDesc(desc) << std::dec << " "
+         << desc.vertexFunction << " "
+         << (desc.fragmentFunction.empty() ? "-" : desc.fragmentFunction)
+         << " "
+         << desc.sampleCount << " " << desc.depthFormat << " "
+         << desc.stencilFormat << " " << desc.depthCompare << " "
+         << desc.depthWrite << " " << desc.specialized << " "
+         << desc.shaderFeatures;
+    for (uint32_t i = 0; i < PipelineDesc::maxColorAttachments; i++) {
+      const PipelineBlendState &blend = desc.blend[i];
+      file << " " << desc.colorFormats[i] << " " << blend.enabled << " "
+           << blend.rgbOperation << " " << blend.alphaOperation << " "
+           << blend.sourceRGBFactor << " " << blend.destinationRGBFactor << " "
+           << blend.sourceAlphaFactor << " " << blend.destinationAlphaFactor
+           << " " << blend.writeMask;
+    }
+    file << " " << desc.label << "\n";
+  }
+  return (bool)file;
+}
+
+std::vector<PipelineDesc> PipelineCache::loadManifest(const char *path) {
+  std::vector<PipelineDesc> descs;
+  std::ifstream file(path);
+  if (!file) {
+    return descs;
+  }
+  std::string line;
+  if (!std::getline(file, line) || line != manifestHeader) {
+    std::cerr << "PipelineCache: ignoring " << path
+              << ", unknown manifest version" << std::endl;
+    return descs;
+  }
+
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    PipelineDesc desc;
+    uint64_t key;
+    fields >> std::hex >> key >> std::dec >> desc.vertexFunction >>
+        desc.fragmentFunction >> desc.sampleCount >> desc.depthFormat >>
+        desc.stencilFormat >> desc.depthCompare >> desc.depthWrite >>
+        desc.specialized >> desc.shaderFeatures;
+    for (uint32_t i = 0; i < PipelineDesc::maxColorAttachments; i++) {
+      PipelineBlendState &blend = desc.blend[i];
+      fields >> desc.colorFormats[i] >> blend.enabled >> blend.rgbOperation >>
+          blend.alphaOperation >> blend.sourceRGBFactor >>
+          blend.destinationRGBFactor >> blend.sourceAlphaFactor >>
+          blend.destinationAlphaFactor >> blend.writeMask;
+    }
+    if (desc.fragmentFunction == "-") {
+      desc.fragmentFunction.clear();
+    }
+    if (!fields || key != hashPipelineDesc(desc)) {
+      continue;
+    }
+    fields >> std::ws;
+    std::getline(fields, desc.label);
+    descs.push_back(std::move(desc));
+  }
+  return descs;
+}
+
+PipelineCacheStats PipelineCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return cacheStats;
+}
@@ -0,0 +1,152 @@
+#pragma once
+// Render pipeline state cache.
+//
+// Pipelines are keyed by a hash of everything that goes into the
+// descriptor: shader functions and their function constants, attachment
+// formats, sample count, blend and depth state. The first request for a key starts compiling it on the thread
+// pool; later requests for the same key, even while it's still compiling,
+// share that one compile. The keys that were used are written to a manifest
+// on shutdown, so the next run can start compiling them all in the
+// background before the engine asks for them.
+//
+// Compiling goes through a backend callback, the cache itself has no Metal
+// dependency.
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct PipelineBlendState {
+  bool enabled = false;
+  // MTL::BlendOperation, MTL::BlendFactor and MTL::ColorWriteMask values
+  uint32_t rgbOperation = 0;
+  uint32_t alphaOperation = 0;
+  uint32_t sourceRGBFactor = 1;
+  uint32_t destinationRGBFactor = 0;
+  uint32_t sourceAlphaFactor = 1;
+  uint32_t destinationAlphaFactor = 0;
+  uint32_t writeMask = 0xF;
+
+  bool operator==(const PipelineBlendState &other) const = default;
+};
+
+struct PipelineDesc {
+  static constexpr uint32_t maxColorAttachments = 4;
+
+  // Only used for debugging, not part of the key
+  std::string label;
+  std::string vertexFunction;
+  std::string fragmentFunction;
+  // MTL::PixelFormat values, 0 (Invalid) for unused attachments
+  uint32_t colorFormats[maxColorAttachments] = {};
+  PipelineBlendState blend[maxColorAttachments];
+  uint32_t depthFormat = 0;
+  uint32_t stencilFormat = 0;
+  uint32_t sampleCount = 1;
+  // MTL::CompareFunction value
+  uint32_t depthCompare = 7; // Always
+  bool depthWrite = false;
+  // Specialized functions get one bool function constant per shader feature
+  // bit (see shader_features.hpp)
+  bool specialized = false;
+  uint32_t shaderFeatures = 0;
+
+  // Compares every field that is part of the key
+  bool operator==(const PipelineDesc &other) const;
+};
+
+// 64 bit FNV-1a over the key fields, stable across runs and platforms
+uint64_t hashPipelineDesc(const PipelineDesc &desc);
+
+// Opaque render pipeline and depth stencil state handles
+struct CompiledPipeline {
+  void *pipeline = nullptr;
+  void *depthStencil = nullptr;
+
+  bool valid() const { return pipeline != nullptr; }
+};
+
+struct PipelineCacheStats {
+  uint32_t requests = 0;
+  // Requests answered by a finished pipeline
+  uint32_t hits = 0;
+  // Requests that joined a compile already in flight
+  uint32_t joined = 0;
+  uint32_t compiles = 0;
+  uint32_t failures = 0;
+  uint32_t prewarmed = 0;
+  double compileMilliseconds = 0.0;
+};
+
+class PipelineCache {
+public:
+  struct Backend {
+    // Called on a pool thread. Returns an invalid pipeline on failure.
+    std::function<CompiledPipeline(const PipelineDesc &)> compile;
+    std::function<void(const CompiledPipeline &)> destroy;
+  };
+
+  explicit PipelineCache(Backend backend,
+                         ThreadPool &pool = ThreadPool::shared());
+  // Waits for compiles still in flight and destroys every pipeline
+  ~PipelineCache();
+
+  PipelineCache(const PipelineCache &) = delete;
+  PipelineCache &operator=(const PipelineCache &) = delete;
+
+  // Starts compiling `desc` in the background unless it's already cached or
+  // compiling. Returns the key.
+  uint64_t request(const PipelineDesc &desc);
+  // Returns the pipeline, waiting for its compile if needed. Don't call this
+  // from a pool thread, it blocks on pool work.
+  CompiledPipeline acquire(const PipelineDesc &desc);
+  // Returns false if `desc` hasn't finished compiling yet (starting the
+  // compile if nobody asked for it before)
+  bool tryAcquire(const PipelineDesc &desc, CompiledPipeline &pipeline);
+
+  // Compiles `desc` on the calling thread if it isn't cached yet. Meant for
+  // pool tasks, where waiting on another pool task could deadlock.
+  CompiledPipeline compileNow(const PipelineDesc &desc);
+
+  // Every descriptor requested so far, in first request order
+  std::vector<PipelineDesc> descs() const;
+
+  // Requests every pipeline of a previous run's manifest
+  void prewarm(const std::vector<PipelineDesc> &descs);
+
+  // One pipeline per line, see pipeline_cache.cpp for the format
+  bool saveManifest(const char *path) const;
+  // Returns nothing if the file is missing. Lines that don't parse or whose
+  // key doesn't match the one recomputed from their fields are skipped.
+  static std::vector<PipelineDesc> loadManifest(const char *path);
+
+  PipelineCacheStats stats() const;
+
+private:
+  struct DescHash {
+    size_t operator()(const PipelineDesc &desc) const {
+      return (size_t)hashPipelineDesc(desc);
+    }
+  };
+
+  struct Entry {
+    std::shared_future<CompiledPipeline> future;
+    // Manifest order, so the next run prewarms in first-use order
+    uint32_t order = 0;
+  };
+
+  Entry &findOrCompile(const PipelineDesc &desc, bool prewarming);
+  // Runs the backend compile and updates the stats
+  CompiledPipeline compileAndRecord(const PipelineDesc &desc);
+
+  Backend backend;
+  ThreadPool &pool;
+  mutable std::mutex mutex;
+  std::unordered_map<PipelineDesc, Entry, DescHash> entries;
+  PipelineCacheStats cacheStats;
+};
@@ -0,0 +1,74 @@
+#include "position_stream.hpp"
+
+#include <cassert>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void extractPositions(const void *vertices, size_t vertexCount, size_t stride,
+                      float *positions) {
+  assert(stride >= 3 * sizeof(float) && stride % sizeof(float) == 0);
+  const char *source = static_cast<const char *>(vertices);
+  size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__SSE2__)
+  // Four whole floats are loaded per vertex, so vertices need room for a
+  // fourth (VertexData has w)
+  if (stride >= 4 * sizeof(float)) {
+    for (; i + 4 <= vertexCount; i += 4) {
+      const char *vertex = source + i * stride;
+      const float *v0 = reinterpret_cast<const float *>(vertex);
+      const float *v1 = reinterpret_cast<const float *>(vertex + stride);
+      const float *v2 = reinterpret_cast<const float *>(vertex + 2 * stride);
+      const float *v3 = reinterpret_cast<const float *>(vertex + 3 * stride);
+      float *out = positions + i * positionStreamComponents;
+      // (x0 y0 z0 x1) (y1 z1 x2 y2) (z2 x3 y3 z3)
+#if defined(__ARM_NEON)
+      float32x4_t p0 = vld1q_f32(v0);
+      float32x4_t p1 = vld1q_f32(v1);
+      float32x4_t p2 = vld1q_f32(v2);
+      float32x4_t p3 = vld1q_f32(v3);
+      float32x4_t out0 = vsetq_lane_f32(vgetq_lane_f32(p1, 0), p0, 3);
+      float32x4_t out1 = vcombine_f32(vget_low_f32(vextq_f32(p1, p1, 1)),
+                                      vget_low_f32(p2));
+      float32x4_t out2 =
+          vsetq_lane_f32(vgetq_lane_f32(p2, 2), vextq_f32(p3, p3, 3), 0);
+      vst1q_f32(out, out0);
+      vst1q_f32(out + 4, out1);
+      vst1q_f32(out + 8, out2);
+#else
+      __m128 p0 = _mm_loadu_ps(v0);
+      __m128 p1 = _mm_loadu_ps(v1);
+      __m128 p2 = _mm_loadu_ps(v2);
+      __m128 p3 = _mm_loadu_ps(v3);
+      // (z0 z0 x1 x1), then x0 y0 from p0 and z0 x1 from that
+      __m128 z0x1 = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(0, 0, 2, 2));
+      __m128 out0 = _mm_shuffle_ps(p0, z0x1, _MM_SHUFFLE(2, 0, 1, 0));
+      __m128 out1 = _mm_shuffle_ps(p1, p2, _MM_SHUFFLE(1, 0, 2, 1));
+      // (z2 z2 x3 x3), then z2 x3 from that and y3 z3 from p3
+      __m128 z2x3 = _mm_shuffle_ps(p2, p3, _MM_SHUFFLE(0, 0, 2, 2));
+      __m128 out2 = _mm_shuffle_ps(z2x3, p3, _MM_SHUFFLE(2, 1, 2, 0));
+      _mm_storeu_ps(out, out0);
+      _mm_storeu_ps(out + 4, out1);
+      _mm_storeu_ps(out + 8, out2);
+#endif
+    }
+  }
+#endif
+
+  for (; i < vertexCount; i++) {
+    memcpy(positions + i * positionStreamComponents, source + i * stride,
+           positionStreamComponents * sizeof(float));
+  }
+}
+
+std::vector<float> extractPositions(const void *vertices, size_t vertexCount,
+                                    size_t stride) {
+  std::vector<float> positions(vertexCount * positionStreamComponents);
+  extractPositions(vertices, vertexCount, stride, positions.data());
+  return positions;
+}
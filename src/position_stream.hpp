@@ -0,0 +1,27 @@
+#pragma once
+// Position-only vertex streams for depth-only passes.
+//
+// A depth pre-pass or shadow pass only needs where each vertex is, yet
+// reading it from the full VertexData fetches the normal and texture
+// coordinate too: 48 bytes per vertex for the 12 it uses. Drawing those
+// passes from a packed copy of just the positions cuts their vertex
+// bandwidth by four. The copy keeps the vertex order, so the same vertex
+// ranges, indices and indirect arguments work on both streams.
+//
+// Extraction gathers four vertices' positions at a time with NEON or SSE
+// and stores them as three packed vectors.
+#include <cstddef>
+#include <vector>
+
+// Floats per vertex of a position stream
+constexpr size_t positionStreamComponents = 3;
+
+// Copies the x, y and z of `vertexCount` vertices, the first three floats of
+// each, `stride` bytes apart, into `positions` as packed float3s. `stride`
+// must be a multiple of 4 and at least 12. w is dropped, so positions must
+// be points (w = 1), which is what the pre-pass shader assumes.
+void extractPositions(const void *vertices, size_t vertexCount, size_t stride,
+                      float *positions);
+
+std::vector<float> extractPositions(const void *vertices, size_t vertexCount,
+                                    size_t stride);
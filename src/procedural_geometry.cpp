@@ -0,0 +1,343 @@
+#include "procedural_geometry.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+
+namespace {
+
+constexpr float pi = 3.14159265358979323846f;
+
+// sin and cos of i * range / steps for i in [0, steps]
+struct AngleTable {
+  std::vector<float> sines;
+  std::vector<float> cosines;
+
+  AngleTable(uint32_t steps, float range) : sines(steps + 1), cosines(steps + 1) {
+    for (uint32_t i = 0; i <= steps; i++) {
+      float angle = range * (float)i / (float)steps;
+      sines[i] = std::sin(angle);
+      cosines[i] = std::cos(angle);
+    }
+  }
+
+  // The last entry is the first one again, so seam vertices match exactly
+  void closeLoop() {
+    sines.back() = sines.front();
+    cosines.back() = cosines.front();
+  }
+};
+
+// (rows + 1) x (columns + 1) vertices, rows x columns quads. Quads have
+// corners v0 = (row, column), v1 = (row, column + 1), v2 = (row + 1, column)
+// and v3 = (row + 1, column + 1), split as (v0, v1, v2) and (v1, v3, v2):
+// counter-clockwise when the column direction crossed with the row
+// direction points outwards. flipWinding reverses that.
+struct Grid {
+  uint32_t rows;
+  uint32_t columns;
+  // All vertices of the first or last row are the same point (a pole), so
+  // only the triangle of each quad that isn't degenerate is kept
+  bool firstRowIsPole = false;
+  bool lastRowIsPole = false;
+  bool flipWinding = false;
+
+  size_t vertexCount() const { return size_t(rows + 1) * (columns + 1); }
+
+  size_t indexCount() const {
+    size_t count = size_t(rows) * columns * 6;
+    count -= firstRowIsPole ? columns * 3 : 0;
+    count -= lastRowIsPole ? columns * 3 : 0;
+    return count;
+  }
+
+  size_t rowIndexOffset(uint32_t row) const {
+    size_t offset = size_t(row) * columns * 6;
+    return offset - (firstRowIsPole && row > 0 ? columns * 3 : 0);
+  }
+};
+
+// Fills the grid's vertices and indices into `mesh` at the given offsets.
+// vertex(row, column) returns the vertex at that grid position.
+template <typename VertexFunction>
+void fillGrid(Mesh &mesh, size_t vertexBase, size_t indexBase, const Grid &grid,
+              const VertexFunction &vertex, ThreadPool *pool) {
+  uint32_t stride = grid.columns + 1;
+
+  auto fillRows = [&](size_t first, size_t last) {
+    for (size_t row = first; row < last; row++) {
+      MeshVertex *out = &mesh.vertices[vertexBase + row * stride];
+      for (uint32_t column = 0; column <= grid.columns; column++) {
+        out[column] = vertex((uint32_t)row, column);
+      }
+      if (row == grid.rows) {
+        continue;
+      }
+
+      // On a pole row v0 and v1 (first row) or v2 and v3 (last row) are the
+      // same point, making one of the two triangles degenerate
+      bool keepFirst = !(row == 0 && grid.firstRowIsPole);
+      bool keepSecond = !(row + 1 == grid.rows && grid.lastRowIsPole);
+      uint32_t *index = &mesh.indices[indexBase + grid.rowIndexOffset((uint32_t)row)];
+      for (uint32_t column = 0; column < grid.columns; column++) {
+        uint32_t v0 = uint32_t(vertexBase + row * stride + column);
+        uint32_t v1 = v0 + 1;
+        uint32_t v2 = v0 + stride;
+        uint32_t v3 = v2 + 1;
+        if (keepFirst) {
+          *index++ = v0;
+          *index++ = grid.flipWinding ? v2 : v1;
+          *index++ = grid.flipWinding ? v1 : v2;
+        }
+        if (keepSecond) {
+          *index++ = v1;
+          *index++ = grid.flipWinding ? v2 : v3;
+          *index++ = grid.flipWinding ? v3 : v2;
+        }
+      }
+    }
+  };
+
+  size_t vertexRows = grid.rows + 1;
+  if (pool && grid.vertexCount() >= parallelGeometryThreshold) {
+    size_t grain = std::max<size_t>(1, vertexRows / ((pool->threadCount() + 1) * 4));
+    pool->parallelFor(vertexRows, grain, fillRows);
+  } else {
+    fillRows(0, vertexRows);
+  }
+}
+
+MeshVertex makeVertex(Float3 position, Float3 normal, float u, float v) {
+  return {{position.x, position.y, position.z, 1.0f},
+          {u, v},
+          {normal.x, normal.y, normal.z, 0.0f}};
+}
+
+} // namespace
+
+Mesh generateUVSphere(uint32_t rings, uint32_t segments, float radius,
+                      ThreadPool *pool) {
+  rings = std::max(rings, 2u);
+  segments = std::max(segments, 3u);
+
+  AngleTable theta(rings, pi);
+  // Exactly on the poles, so the pole rows collapse to one point
+  theta.sines.front() = theta.sines.back() = 0.0f;
+  theta.cosines.front() = 1.0f;
+  theta.cosines.back() = -1.0f;
+  AngleTable phi(segments, 2 * pi);
+  phi.closeLoop();
+
+  Grid grid{rings, segments, true, true};
+  Mesh mesh;
+  mesh.vertices.resize(grid.vertexCount());
+  mesh.indices.resize(grid.indexCount());
+  fillGrid(
+      mesh, 0, 0, grid,
+      [&](uint32_t ring, uint32_t segment) {
+        Float3 normal = {phi.cosines[segment] * theta.sines[ring],
+                         theta.cosines[ring],
+                         phi.sines[segment] * theta.sines[ring]};
+        return makeVertex(normal * radius, normal, (float)segment / segments,
+                          (float)ring / rings);
+      },
+      pool);
+  return mesh;
+}
+
+Mesh generateIcosphere(uint32_t subdivisions, float radius, ThreadPool *pool) {
+  const float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
+  std::vector<Float3> positions = {
+      {-1, t, 0}, {1, t, 0}, {-1, -t, 0}, {1, -t, 0}, {0, -1, t}, {0, 1, t},
+      {0, -1, -t}, {0, 1, -t}, {t, 0, -1}, {t, 0, 1}, {-t, 0, -1}, {-t, 0, 1},
+  };
+  for (Float3 &position : positions) {
+    position = normalize(position);
+  }
+  std::vector<uint32_t> indices = {
+      0, 11, 5,  0, 5,  1, 0, 1, 7, 0, 7,  10, 0, 10, 11, 1, 5, 9, 5, 11,
+      4, 11, 10, 2, 10, 7, 6, 7, 1, 8, 3,  9,  4, 3,  4,  2, 3, 2, 6, 3,
+      6, 8,  3,  8, 9,  4, 9, 5, 2, 4, 11, 6,  2, 10, 8,  6, 7, 9, 8, 1,
+  };
+
+  // Each edge is shared by two triangles, its midpoint is made once
+  std::unordered_map<uint64_t, uint32_t> midpoints;
+  auto midpoint = [&](uint32_t a, uint32_t b) {
+    uint64_t key = (uint64_t)std::min(a, b) << 32 | std::max(a, b);
+    auto [it, inserted] = midpoints.try_emplace(key, (uint32_t)positions.size());
+    if (inserted) {
+      positions.push_back(normalize((positions[a] + positions[b]) * 0.5f));
+    }
+    return it->second;
+  };
+
+  for (uint32_t level = 0; level < subdivisions; level++) {
+    // Euler: every level adds one vertex per edge, and there are 1.5 edges
+    // per triangle
+    positions.reserve(positions.size() + indices.size() / 2);
+    midpoints.clear();
+    midpoints.reserve(indices.size() / 2);
+    std::vector<uint32_t> next;
+    next.reserve(indices.size() * 4);
+    for (size_t i = 0; i < indices.size(); i += 3) {
+      uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+      uint32_t ab = midpoint(a, b), bc = midpoint(b, c), ca = midpoint(c, a);
+      uint32_t split[] = {a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca};
+      next.insert(next.end(), std::begin(split), std::end(split));
+    }
+    indices.swap(next);
+  }
+
+  Mesh mesh;
+  mesh.indices = std::move(indices);
+  mesh.vertices.resize(positions.size());
+  auto fillVertices = [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      Float3 normal = positions[i];
+      float u = std::atan2(normal.z, normal.x) / (2 * pi) + 0.5f;
+      float v = std::acos(std::clamp(normal.y, -1.0f, 1.0f)) / pi;
+      mesh.vertices[i] = makeVertex(normal * radius, normal, u, v);
+    }
+  };
+  if (pool && positions.size() >= parallelGeometryThreshold) {
+    pool->parallelFor(positions.size(), 4096, fillVertices);
+  } else {
+    fillVertices(0, positions.size());
+  }
+  return mesh;
+}
+
+Mesh generateCube(float size) {
+  struct Face {
+    Float3 normal, u, v;
+  };
+  // u x v == normal, so (-u -v), (+u -v), (+u +v), (-u +v) runs
+  // counter-clockwise seen from outside
+  const Face faces[6] = {
+      {{1, 0, 0}, {0, 0, -1}, {0, 1, 0}},  {{-1, 0, 0}, {0, 0, 1}, {0, 1, 0}},
+      {{0, 1, 0}, {1, 0, 0}, {0, 0, -1}},  {{0, -1, 0}, {1, 0, 0}, {0, 0, 1}},
+      {{0, 0, 1}, {1, 0, 0}, {0, 1, 0}},   {{0, 0, -1}, {-1, 0, 0}, {0, 1, 0}},
+  };
+  const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+  float half = size * 0.5f;
+
+  Mesh mesh;
+  mesh.vertices.reserve(24);
+  mesh.indices.reserve(36);
+  for (const Face &face : faces) {
+    uint32_t base = (uint32_t)mesh.vertices.size();
+    for (const auto &corner : corners) {
+      Float3 position =
+          (face.normal + face.u * corner[0] + face.v * corner[1]) * half;
+      // V runs down the texture, like the obj loader's
+      mesh.vertices.push_back(makeVertex(position, face.normal,
+                                         (corner[0] + 1) * 0.5f,
+                                         (1 - corner[1]) * 0.5f));
+    }
+    uint32_t quad[] = {base, base + 1, base + 2, base, base + 2, base + 3};
+    mesh.indices.insert(mesh.indices.end(), std::begin(quad), std::end(quad));
+  }
+  return mesh;
+}
+
+Mesh generatePlane(float width, float depth, uint32_t xSegments,
+                   uint32_t zSegments, ThreadPool *pool) {
+  xSegments = std::max(xSegments, 1u);
+  zSegments = std::max(zSegments, 1u);
+  // Columns run along +x and rows along +z, which crossed point down
+  Grid grid{zSegments, xSegments};
+  grid.flipWinding = true;
+  Mesh mesh;
+  mesh.vertices.resize(grid.vertexCount());
+  mesh.indices.resize(grid.indexCount());
+  fillGrid(
+      mesh, 0, 0, grid,
+      [&](uint32_t row, uint32_t column) {
+        float u = (float)column / xSegments;
+        float v = (float)row / zSegments;
+        return makeVertex({(u - 0.5f) * width, 0.0f, (v - 0.5f) * depth},
+                          {0, 1, 0}, u, v);
+      },
+      pool);
+  return mesh;
+}
+
+Mesh generateCylinder(float radius, float height, uint32_t segments,
+                      uint32_t heightSegments, bool caps, ThreadPool *pool) {
+  segments = std::max(segments, 3u);
+  heightSegments = std::max(heightSegments, 1u);
+  AngleTable phi(segments, 2 * pi);
+  phi.closeLoop();
+
+  // Side rows run from the top down
+  Grid side{heightSegments, segments};
+  size_t capVertices = caps ? 2 * (segments + 2) : 0;
+  size_t capIndices = caps ? 2 * segments * 3 : 0;
+  Mesh mesh;
+  mesh.vertices.resize(side.vertexCount() + capVertices);
+  mesh.indices.resize(side.indexCount() + capIndices);
+  float half = height * 0.5f;
+  fillGrid(
+      mesh, 0, 0, side,
+      [&](uint32_t row, uint32_t segment) {
+        float v = (float)row / heightSegments;
+        Float3 normal = {phi.cosines[segment], 0.0f, phi.sines[segment]};
+        return makeVertex({normal.x * radius, half - v * height,
+                           normal.z * radius},
+                          normal, (float)segment / segments, v);
+      },
+      pool);
+
+  if (caps) {
+    size_t vertex = side.vertexCount();
+    size_t index = side.indexCount();
+    for (float y : {half, -half}) {
+      Float3 normal = {0, y > 0 ? 1.0f : -1.0f, 0};
+      uint32_t center = (uint32_t)vertex;
+      mesh.vertices[vertex++] = makeVertex({0, y, 0}, normal, 0.5f, 0.5f);
+      // A ring of its own, the cap's normals differ from the side's
+      for (uint32_t segment = 0; segment <= segments; segment++) {
+        float c = phi.cosines[segment], s = phi.sines[segment];
+        mesh.vertices[vertex++] = makeVertex({c * radius, y, s * radius},
+                                             normal, 0.5f + c * 0.5f,
+                                             0.5f + s * 0.5f);
+      }
+      for (uint32_t segment = 0; segment < segments; segment++) {
+        uint32_t a = center + 1 + segment, b = a + 1;
+        // Counter-clockwise seen from above for the top, below for the bottom
+        mesh.indices[index++] = center;
+        mesh.indices[index++] = y > 0 ? b : a;
+        mesh.indices[index++] = y > 0 ? a : b;
+      }
+    }
+  }
+  return mesh;
+}
+
+Mesh generateTorus(float majorRadius, float minorRadius, uint32_t majorSegments,
+                   uint32_t minorSegments, ThreadPool *pool) {
+  majorSegments = std::max(majorSegments, 3u);
+  minorSegments = std::max(minorSegments, 3u);
+  AngleTable major(majorSegments, 2 * pi);
+  major.closeLoop();
+  AngleTable minor(minorSegments, 2 * pi);
+  minor.closeLoop();
+
+  // Rows go around the ring, columns around the tube
+  Grid grid{majorSegments, minorSegments};
+  Mesh mesh;
+  mesh.vertices.resize(grid.vertexCount());
+  mesh.indices.resize(grid.indexCount());
+  fillGrid(
+      mesh, 0, 0, grid,
+      [&](uint32_t row, uint32_t column) {
+        float cu = major.cosines[row], su = major.sines[row];
+        float cv = minor.cosines[column], sv = minor.sines[column];
+        float distance = majorRadius + minorRadius * cv;
+        return makeVertex({distance * cu, minorRadius * sv, distance * su},
+                          {cv * cu, sv, cv * su}, (float)row / majorSegments,
+                          (float)column / minorSegments);
+      },
+      pool);
+  return mesh;
+}
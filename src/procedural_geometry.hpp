@@ -0,0 +1,66 @@
+#pragma once
+// Procedural meshes: UV sphere, icosphere, cube, plane, cylinder and torus.
+//
+// Every generator produces an indexed mesh, so a vertex shared by several
+// triangles is computed and stored once. Vertices are only duplicated where
+// an attribute really changes: along a UV seam, or at a hard edge where the
+// normal changes.
+//
+// Curved shapes are laid out as grids of rings. The sines and cosines for
+// each ring and each segment are computed once into small tables, and a
+// vertex is then a few multiplies of table entries. Grids that are large
+// enough are filled with ThreadPool::parallelFor, one band of rows per task.
+// Rows are written to offsets known up front, so the result doesn't depend
+// on how the work was split.
+#include "engine_math.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Same layout as VertexData in vertex_data.hpp, which needs <simd/simd.h>
+struct MeshVertex {
+  Float4 position;
+  Float2 textureCoordinate;
+  Float4 normal;
+};
+
+struct Mesh {
+  std::vector<MeshVertex> vertices;
+  // Triangle list, counter-clockwise when seen from outside
+  std::vector<uint32_t> indices;
+
+  size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// Grids with at least this many vertices are filled in parallel
+constexpr size_t parallelGeometryThreshold = 16 * 1024;
+
+// `rings` bands from pole to pole, `segments` around. The pole rows only get
+// one triangle per segment, with no degenerate triangles.
+Mesh generateUVSphere(uint32_t rings, uint32_t segments, float radius = 1.0f,
+                      ThreadPool *pool = &ThreadPool::shared());
+
+// Icosahedron with every triangle split into four `subdivisions` times:
+// 20 * 4^n triangles of near equal area. UVs are spherical and wrap across
+// the seam rather than duplicating vertices along it.
+Mesh generateIcosphere(uint32_t subdivisions, float radius = 1.0f,
+                       ThreadPool *pool = &ThreadPool::shared());
+
+// 24 vertices, four per face so each face has its own normal
+Mesh generateCube(float size = 1.0f);
+
+// In the xz plane facing +y, centred on the origin
+Mesh generatePlane(float width, float depth, uint32_t xSegments,
+                   uint32_t zSegments, ThreadPool *pool = &ThreadPool::shared());
+
+// Along the y axis, centred on the origin
+Mesh generateCylinder(float radius, float height, uint32_t segments,
+                      uint32_t heightSegments = 1, bool caps = true,
+                      ThreadPool *pool = &ThreadPool::shared());
+
+// Around the y axis. `majorSegments` around the ring, `minorSegments` around
+// the tube.
+Mesh generateTorus(float majorRadius, float minorRadius, uint32_t majorSegments,
+                   uint32_t minorSegments,
+                   ThreadPool *pool = &ThreadPool::shared());
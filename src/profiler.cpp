@@ -0,0 +1,338 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+ProfileEventRing::ProfileEventRing(uint32_t capacity) {
+  uint32_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  slots.resize(size);
+  mask = size - 1;
+}
+
+bool ProfileEventRing::push(const ProfileEvent &event) {
+  uint64_t position = head.load(std::memory_order_relaxed);
+  if (position - tail.load(std::memory_order_acquire) >= slots.size()) {
+    droppedEvents.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  slots[position & mask] = event;
+  // Publishes the slot to drain()
+  head.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+size_t ProfileEventRing::drain(std::vector<ProfileEvent> &events) {
+  uint64_t first = tail.load(std::memory_order_relaxed);
+  uint64_t last = head.load(std::memory_order_acquire);
+  for (uint64_t position = first; position < last; position++) {
+    events.push_back(slots[position & mask]);
+  }
+  // Hands the slots back to push()
+  tail.store(last, std::memory_order_release);
+  return last - first;
+}
+
+namespace {
+
+std::atomic<uint64_t> nextProfilerId{1};
+
+// The last ring the thread recorded to, so record() only looks it up again
+// when the thread switches profilers
+struct ThreadRingCache {
+  uint64_t profilerId = 0;
+  void *ring = nullptr;
+};
+thread_local ThreadRingCache threadRingCache;
+
+} // namespace
+
+Profiler::Profiler(uint32_t eventsPerThread)
+    : id(nextProfilerId.fetch_add(1, std::memory_order_relaxed)),
+      eventsPerThread(eventsPerThread) {}
+
+Profiler &Profiler::shared() {
+  static Profiler profiler;
+  return profiler;
+}
+
+uint64_t Profiler::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Profiler::ThreadRing &Profiler::threadRing() {
+  ThreadRingCache &cache = threadRingCache;
+  if (cache.profilerId == id) {
+    return *static_cast<ThreadRing *>(cache.ring);
+  }
+
+  std::thread::id self = std::this_thread::get_id();
+  std::lock_guard<std::mutex> lock(mutex);
+  ThreadRing *ring = nullptr;
+  for (const auto &existing : threadRings) {
+    if (existing->owner == self) {
+      ring = existing.get();
+      break;
+    }
+  }
+  if (!ring) {
+    threadRings.push_back(std::make_unique<ThreadRing>(
+        eventsPerThread, (uint32_t)threadRings.size(), self));
+    ring = threadRings.back().get();
+  }
+  cache.profilerId = id;
+  cache.ring = ring;
+  return *ring;
+}
+
+void Profiler::record(const char *name, uint64_t startNanoseconds,
+                      uint64_t endNanoseconds, ProfileTrack track) {
+  if (!enabled()) {
+    return;
+  }
+  ThreadRing &ring = threadRing();
+  ProfileEvent event;
+  event.name = name;
+  event.startNanoseconds = startNanoseconds;
+  event.endNanoseconds = endNanoseconds;
+  event.thread = ring.index;
+  event.track = track;
+  ring.ring.push(event);
+}
+
+void Profiler::setThreadName(const char *name) {
+  ThreadRing &ring = threadRing();
+  std::lock_guard<std::mutex> lock(mutex);
+  ring.name = name;
+}
+
+void Profiler::collect(std::vector<ProfileEvent> &events) {
+  // Rings are never removed, so they can be drained outside the lock while
+  // other threads register theirs
+  std::vector<ThreadRing *> rings;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    rings.reserve(threadRings.size());
+    for (const auto &ring : threadRings) {
+      rings.push_back(ring.get());
+    }
+  }
+  for (ThreadRing *ring : rings) {
+    ring->ring.drain(events);
+  }
+}
+
+std::vector<std::string> Profiler::threadNames() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> names;
+  names.reserve(threadRings.size());
+  for (const auto &ring : threadRings) {
+    names.push_back(ring->name);
+  }
+  return names;
+}
+
+uint64_t Profiler::droppedEvents() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t dropped = 0;
+  for (const auto &ring : threadRings) {
+    dropped += ring->ring.dropped();
+  }
+  return dropped;
+}
+
+uint64_t gpuTicksToNanoseconds(const GpuClockSample &first,
+                               const GpuClockSample &second, uint64_t ticks) {
+  // Ticks may come before the first sample, so work with signed offsets
+  double offset = (double)(int64_t)(ticks - first.gpuTicks);
+  double scale = 1.0;
+  if (second.gpuTicks != first.gpuTicks) {
+    scale = (double)(int64_t)(second.nanoseconds - first.nanoseconds) /
+            (double)(int64_t)(second.gpuTicks - first.gpuTicks);
+  }
+  return first.nanoseconds + (int64_t)std::llround(offset * scale);
+}
+
+GpuZoneRecorder::GpuZoneRecorder(uint32_t framesInFlight,
+                                 uint32_t zonesPerFrame)
+    : framesInFlight(framesInFlight), zonesPerFrame(zonesPerFrame) {
+  current.names.reserve(zonesPerFrame);
+}
+
+void GpuZoneRecorder::beginFrame(uint32_t frame, const GpuClockSample &clock) {
+  current.firstSample = (frame % framesInFlight) * zonesPerFrame * 2;
+  current.names.clear();
+  current.clock = clock;
+}
+
+uint32_t GpuZoneRecorder::addZone(const char *name) {
+  if (current.names.size() >= zonesPerFrame) {
+    return noSample;
+  }
+  uint32_t sample = current.firstSample + (uint32_t)current.names.size() * 2;
+  current.names.push_back(name);
+  return sample;
+}
+
+void GpuZoneRecorder::resolve(const Frame &frame, const GpuClockSample &clock,
+                              const uint64_t *timestamps, Profiler &profiler) {
+  for (size_t zone = 0; zone < frame.names.size(); zone++) {
+    uint64_t start = timestamps[zone * 2];
+    uint64_t end = timestamps[zone * 2 + 1];
+    // Passes that were skipped, or that the GPU couldn't sample, leave their
+    // samples invalid or zero
+    if (start == invalidTimestamp || end == invalidTimestamp || !start ||
+        end < start) {
+      continue;
+    }
+    profiler.record(frame.names[zone],
+                    gpuTicksToNanoseconds(frame.clock, clock, start),
+                    gpuTicksToNanoseconds(frame.clock, clock, end),
+                    ProfileTrack::GpuPass);
+  }
+}
+
+FrameTimeHistory::FrameTimeHistory(uint32_t window) : window(window) {
+  samples.reserve(window);
+}
+
+void FrameTimeHistory::add(double frameTime) {
+  if (samples.size() < window) {
+    samples.push_back(frameTime);
+  } else {
+    samples[next] = frameTime;
+  }
+  next = (next + 1) % window;
+}
+
+FrameTimeSummary FrameTimeHistory::summary() const {
+  FrameTimeSummary summary;
+  if (samples.empty()) {
+    return summary;
+  }
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  size_t count = sorted.size();
+  auto percentile = [&](double p) {
+    size_t rank = (size_t)std::ceil(p / 100.0 * count);
+    return sorted[std::clamp<size_t>(rank, 1, count) - 1];
+  };
+  double total = 0.0;
+  for (double sample : sorted) {
+    total += sample;
+  }
+  summary.frames = (uint32_t)count;
+  summary.mean = total / count;
+  summary.p50 = percentile(50.0);
+  summary.p95 = percentile(95.0);
+  summary.p99 = percentile(99.0);
+  summary.max = sorted.back();
+  return summary;
+}
+
+void FrameTimeHistory::clear() {
+  samples.clear();
+  next = 0;
+}
+
+static void appendJsonString(std::string &json, const char *text) {
+  json += '"';
+  for (const char *c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      json += '\\';
+      json += *c;
+    } else if ((unsigned char)*c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+      json += escaped;
+    } else {
+      json += *c;
+    }
+  }
+  json += '"';
+}
+
+// The CPU threads are one process in the trace, the GPU another with a
+// track for command buffers and one for passes
+static constexpr int cpuProcess = 1;
+static constexpr int gpuProcess = 2;
+
+static void appendMetadata(std::string &json, const char *kind, int process,
+                           int thread, const char *name) {
+  char prefix[96];
+  snprintf(prefix, sizeof(prefix),
+           "{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+           "\"args\":{\"name\":",
+           kind, process, thread);
+  json += prefix;
+  appendJsonString(json, name);
+  json += "}},\n";
+}
+
+std::string chromeTraceJson(const std::vector<ProfileEvent> &events,
+                            const std::vector<std::string> &threadNames) {
+  uint64_t origin = UINT64_MAX;
+  for (const ProfileEvent &event : events) {
+    origin = std::min(origin, event.startNanoseconds);
+  }
+
+  std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  appendMetadata(json, "process_name", cpuProcess, 0, "CPU");
+  appendMetadata(json, "process_name", gpuProcess, 0, "GPU");
+  appendMetadata(json, "thread_name", gpuProcess, 0, "Command buffers");
+  appendMetadata(json, "thread_name", gpuProcess, 1, "Passes");
+  for (size_t thread = 0; thread < threadNames.size(); thread++) {
+    std::string name = threadNames[thread].empty()
+                           ? "Thread " + std::to_string(thread)
+                           : threadNames[thread];
+    appendMetadata(json, "thread_name", cpuProcess, (int)thread, name.c_str());
+  }
+
+  for (const ProfileEvent &event : events) {
+    int process = cpuProcess;
+    int thread = (int)event.thread;
+    if (event.track != ProfileTrack::Cpu) {
+      process = gpuProcess;
+      thread = event.track == ProfileTrack::GpuCommandBuffer ? 0 : 1;
+    }
+    uint64_t duration = event.endNanoseconds > event.startNanoseconds
+                            ? event.endNanoseconds - event.startNanoseconds
+                            : 0;
+    json += "{\"ph\":\"X\",\"name\":";
+    appendJsonString(json, event.name ? event.name : "");
+    // Microseconds, to the nanosecond
+    char fields[128];
+    snprintf(fields, sizeof(fields),
+             ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n", process,
+             thread, (event.startNanoseconds - origin) / 1000.0,
+             duration / 1000.0);
+    json += fields;
+  }
+  // Drop the last separator, there's always at least the metadata before it
+  json.erase(json.size() - 2);
+  json += "\n]}\n";
+  return json;
+}
+
+bool writeChromeTrace(const char *path, const std::vector<ProfileEvent> &events,
+                      const std::vector<std::string> &threadNames) {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file) {
+    std::cerr << "Profiler: can't write " << path << std::endl;
+    return false;
+  }
+  file << chromeTraceJson(events, threadNames);
+  if (!file) {
+    std::cerr << "Profiler: failed writing " << path << std::endl;
+    return false;
+  }
+  return true;
+}
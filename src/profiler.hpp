@@ -0,0 +1,240 @@
+#pragma once
+// Frame profiler: scoped CPU zones, GPU zones and frame time percentiles.
+//
+// A zone is a named span of time on one thread, or on the GPU. Zones are
+// recorded into a ring buffer owned by the recording thread, single producer
+// and single consumer, so recording never takes a lock or allocates once a
+// thread has recorded its first zone. Once a frame the main thread collects
+// every ring into one list, which can be kept and written out in Chrome's
+// trace format (chrome://tracing, ui.perfetto.dev) to look at frame by frame.
+//
+// GPU zones come from two places, both converted to the profiler's clock:
+//  - a command buffer's GPUStartTime and GPUEndTime, the whole frame
+//  - timestamps sampled into a counter sample buffer at the start and end of
+//    each pass, which GpuZoneRecorder hands out indices for and turns back
+//    into zones
+//
+// Zone names are stored as pointers and only read when exporting, so they
+// have to outlive the profiler: use string literals.
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class ProfileTrack : uint8_t {
+  Cpu,
+  // Whole command buffers, from GPUStartTime to GPUEndTime
+  GpuCommandBuffer,
+  // Passes, from counter sample buffer timestamps
+  GpuPass,
+};
+
+struct ProfileEvent {
+  const char *name = nullptr;
+  // On the Profiler::now() clock
+  uint64_t startNanoseconds = 0;
+  uint64_t endNanoseconds = 0;
+  // Index of the recording thread, in the order threads first recorded.
+  // GPU zones are recorded from whichever thread completes the command
+  // buffer.
+  uint32_t thread = 0;
+  ProfileTrack track = ProfileTrack::Cpu;
+};
+
+// Fixed size single producer, single consumer queue of events
+class ProfileEventRing {
+public:
+  // Rounded up to a power of two
+  explicit ProfileEventRing(uint32_t capacity);
+
+  // Producer side. Returns false, dropping the event, if the ring is full.
+  bool push(const ProfileEvent &event);
+  // Consumer side. Appends everything pushed so far to `events` and returns
+  // how many that was.
+  size_t drain(std::vector<ProfileEvent> &events);
+
+  uint32_t capacity() const { return (uint32_t)slots.size(); }
+  uint64_t dropped() const {
+    return droppedEvents.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::vector<ProfileEvent> slots;
+  uint64_t mask;
+  // Each written by one side only, on lines of their own
+  alignas(64) std::atomic<uint64_t> head{0};
+  alignas(64) std::atomic<uint64_t> tail{0};
+  std::atomic<uint64_t> droppedEvents{0};
+};
+
+class Profiler {
+public:
+  // Every thread that records gets a ring of `eventsPerThread` events, which
+  // has to hold whatever it records between two collect() calls
+  explicit Profiler(uint32_t eventsPerThread = 4096);
+
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  // Process wide profiler, created on first use
+  static Profiler &shared();
+  // Nanoseconds on the profiler's clock, a steady clock
+  static uint64_t now();
+
+  // Zones are only recorded while enabled, which is the default
+  void setEnabled(bool enabled) {
+    isEnabled.store(enabled, std::memory_order_relaxed);
+  }
+  bool enabled() const { return isEnabled.load(std::memory_order_relaxed); }
+
+  // Records a finished zone on the calling thread's ring
+  void record(const char *name, uint64_t startNanoseconds,
+              uint64_t endNanoseconds, ProfileTrack track = ProfileTrack::Cpu);
+  // Names the calling thread in exported traces
+  void setThreadName(const char *name);
+
+  // Appends every zone recorded since the last call to `events`, oldest
+  // first per thread. Call from one thread at a time.
+  void collect(std::vector<ProfileEvent> &events);
+
+  // Indexed by ProfileEvent::thread, empty for unnamed threads
+  std::vector<std::string> threadNames() const;
+  // Events lost to full rings, over every thread
+  uint64_t droppedEvents() const;
+
+private:
+  struct ThreadRing {
+    ThreadRing(uint32_t capacity, uint32_t index, std::thread::id owner)
+        : ring(capacity), index(index), owner(owner) {}
+    ProfileEventRing ring;
+    uint32_t index;
+    std::thread::id owner;
+    std::string name;
+  };
+
+  // The calling thread's ring, registered on its first use
+  ThreadRing &threadRing();
+
+  // Distinguishes profilers in the per-thread lookup cache, even one created
+  // where a destroyed one used to be
+  const uint64_t id;
+  const uint32_t eventsPerThread;
+  std::atomic<bool> isEnabled{true};
+  // Guards threadRings itself, not the rings in it
+  mutable std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadRing>> threadRings;
+};
+
+// Records the time from construction to destruction as a CPU zone
+class ProfileScope {
+public:
+  explicit ProfileScope(const char *name,
+                        Profiler &profiler = Profiler::shared())
+      : profiler(profiler.enabled() ? &profiler : nullptr), name(name),
+        startNanoseconds(this->profiler ? Profiler::now() : 0) {}
+  ~ProfileScope() {
+    if (profiler) {
+      profiler->record(name, startNanoseconds, Profiler::now());
+    }
+  }
+
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+  Profiler *profiler;
+  const char *name;
+  uint64_t startNanoseconds;
+};
+
+// A moment as seen by both the GPU's timestamp counter and the profiler's
+// clock, e.g. from MTLDevice::sampleTimestamps followed by Profiler::now()
+struct GpuClockSample {
+  uint64_t gpuTicks = 0;
+  uint64_t nanoseconds = 0;
+};
+
+// Converts a GPU timestamp to the profiler's clock, interpolating between
+// (or extrapolating past) two samples of both clocks
+uint64_t gpuTicksToNanoseconds(const GpuClockSample &first,
+                               const GpuClockSample &second, uint64_t ticks);
+
+// Counter sample buffer bookkeeping for per-pass GPU zones. Each frame in
+// flight has its own range of samples, and each zone in it a start and an
+// end sample, so a frame's samples are only reused once the frame is done.
+class GpuZoneRecorder {
+public:
+  static constexpr uint32_t noSample = UINT32_MAX;
+  // What a resolved sample holds when the GPU didn't write it
+  static constexpr uint64_t invalidTimestamp = UINT64_MAX;
+
+  // One frame's zones, copied out for the command buffer's completion
+  // handler
+  struct Frame {
+    uint32_t firstSample = 0;
+    std::vector<const char *> names;
+    GpuClockSample clock;
+  };
+
+  GpuZoneRecorder(uint32_t framesInFlight, uint32_t zonesPerFrame);
+
+  // Samples the counter sample buffer needs to hold
+  uint32_t sampleCount() const { return framesInFlight * zonesPerFrame * 2; }
+
+  // Starts frame `frame` of the frames in flight, forgetting its old zones.
+  // `clock` is sampled as the frame is encoded.
+  void beginFrame(uint32_t frame, const GpuClockSample &clock);
+  // Index of the new zone's start sample, its end is the next one. Returns
+  // noSample once the frame's zones run out.
+  uint32_t addZone(const char *name);
+  const Frame &frame() const { return current; }
+
+  // Records the frame's zones on `profiler`. `timestamps` holds the frame's
+  // resolved samples, two per zone from frame.firstSample, and `clock` is
+  // sampled after the frame completed. Zones whose samples weren't written
+  // are skipped.
+  static void resolve(const Frame &frame, const GpuClockSample &clock,
+                      const uint64_t *timestamps, Profiler &profiler);
+
+private:
+  uint32_t framesInFlight;
+  uint32_t zonesPerFrame;
+  Frame current;
+};
+
+struct FrameTimeSummary {
+  uint32_t frames = 0;
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p95 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+// Percentiles of the last `window` frame times, in whatever unit they're
+// added in
+class FrameTimeHistory {
+public:
+  explicit FrameTimeHistory(uint32_t window = 240);
+
+  void add(double frameTime);
+  // Nearest rank percentiles
+  FrameTimeSummary summary() const;
+  void clear();
+
+private:
+  std::vector<double> samples;
+  uint32_t window;
+  uint32_t next = 0;
+};
+
+// Chrome trace event JSON of `events`, CPU zones under their threads and GPU
+// zones on a track of their own. Times are relative to the earliest event.
+std::string chromeTraceJson(const std::vector<ProfileEvent> &events,
+                            const std::vector<std::string> &threadNames);
+// Returns false, and says why on std::cerr, if the file can't be written
+bool writeChromeTrace(const char *path, const std::vector<ProfileEvent> &events,
+                      const std::vector<std::string> &threadNames);
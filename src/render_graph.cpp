@@ -0,0 +1,325 @@
+#include "render_graph.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+
+RGResource RenderGraphBuilder::create(const char *name,
+                                      const RGTextureDesc &desc) {
+  RenderGraph::Resource resource;
+  resource.name = name;
+  resource.desc = desc;
+  graph.resources.push_back(resource);
+  RGResource id = (RGResource)graph.resources.size() - 1;
+  graph.passes[pass].creates.push_back(id);
+  graph.passes[pass].writes.push_back(id);
+  return id;
+}
+
+void RenderGraphBuilder::read(RGResource resource) {
+  assert(resource < graph.resources.size());
+  graph.passes[pass].reads.push_back(resource);
+}
+
+void RenderGraphBuilder::write(RGResource resource) {
+  assert(resource < graph.resources.size());
+  graph.passes[pass].writes.push_back(resource);
+}
+
+void RenderGraphBuilder::sideEffect() { graph.passes[pass].sideEffect = true; }
+
+void *RenderGraphPassContext::texture(RGResource resource) const {
+  return graph.texture(resource);
+}
+
+RenderGraph::RenderGraph(Backend backend) : backend(std::move(backend)) {}
+
+RenderGraph::~RenderGraph() { reset(); }
+
+RGResource RenderGraph::importTexture(const char *name, void *texture,
+                                      const RGTextureDesc &desc) {
+  Resource resource;
+  resource.name = name;
+  resource.desc = desc;
+  resource.imported = true;
+  resource.texture = texture;
+  resources.push_back(resource);
+  return (RGResource)resources.size() - 1;
+}
+
+void RenderGraph::markOutput(RGResource resource) {
+  resources[resource].output = true;
+}
+
+void RenderGraph::addPass(const char *name, const SetupFunction &setup,
+                          ExecuteFunction execute) {
+  Pass pass;
+  pass.name = name;
+  pass.execute = std::move(execute);
+  passes.push_back(std::move(pass));
+  RenderGraphBuilder builder(*this, (uint32_t)passes.size() - 1);
+  setup(builder);
+}
+
+void RenderGraph::cullPasses() {
+  // Reference counting flood fill: a pass is referenced by the resources it
+  // writes, a resource by the passes reading it (or by being an output).
+  // Passes and resources whose count drops to zero are unused.
+  for (Resource &resource : resources) {
+    resource.refCount = resource.output ? 1 : 0;
+  }
+  for (Pass &pass : passes) {
+    pass.culled = false;
+    pass.refCount = (uint32_t)pass.writes.size() + (pass.sideEffect ? 1 : 0);
+    for (RGResource read : pass.reads) {
+      resources[read].refCount++;
+    }
+  }
+
+  // A pass that writes nothing and has no side effects is unused from the
+  // start, and so may be what it reads
+  for (Pass &pass : passes) {
+    if (pass.refCount == 0) {
+      pass.culled = true;
+      for (RGResource read : pass.reads) {
+        resources[read].refCount--;
+      }
+    }
+  }
+  std::vector<RGResource> unreferenced;
+  for (RGResource id = 0; id < resources.size(); id++) {
+    if (resources[id].refCount == 0) {
+      unreferenced.push_back(id);
+    }
+  }
+  while (!unreferenced.empty()) {
+    RGResource id = unreferenced.back();
+    unreferenced.pop_back();
+    // Every pass writing an unused resource loses a reference
+    for (Pass &pass : passes) {
+      if (pass.culled ||
+          std::find(pass.writes.begin(), pass.writes.end(), id) ==
+              pass.writes.end()) {
+        continue;
+      }
+      if (--pass.refCount == 0) {
+        pass.culled = true;
+        for (RGResource read : pass.reads) {
+          if (--resources[read].refCount == 0) {
+            unreferenced.push_back(read);
+          }
+        }
+      }
+    }
+  }
+}
+
+bool RenderGraph::schedulePasses() {
+  // Dependencies: a pass must run after the last earlier pass writing what it
+  // reads (read after write), and a pass writing a resource must run after
+  // earlier passes that read or wrote it (write after read/write). Kahn's
+  // algorithm, always picking the earliest declared ready pass, gives a
+  // stable order that respects all of them.
+  uint32_t passCount = (uint32_t)passes.size();
+  std::vector<std::vector<uint32_t>> dependents(passCount);
+  std::vector<uint32_t> inDegree(passCount, 0);
+  std::vector<uint32_t> lastWriter(resources.size(), UINT32_MAX);
+  std::vector<std::vector<uint32_t>> readersSinceWrite(resources.size());
+
+  auto addEdge = [&](uint32_t from, uint32_t to) {
+    if (from == UINT32_MAX || from == to) {
+      return;
+    }
+    dependents[from].push_back(to);
+    inDegree[to]++;
+  };
+
+  for (uint32_t p = 0; p < passCount; p++) {
+    const Pass &pass = passes[p];
+    if (pass.culled) {
+      continue;
+    }
+    for (RGResource read : pass.reads) {
+      const Resource &resource = resources[read];
+      if (!resource.imported && lastWriter[read] == UINT32_MAX) {
+        std::cerr << "RenderGraph: pass '" << pass.name << "' reads '"
+                  << resource.name << "' before anything writes it"
+                  << std::endl;
+        return false;
+      }
+      addEdge(lastWriter[read], p);
+      readersSinceWrite[read].push_back(p);
+    }
+    for (RGResource write : pass.writes) {
+      addEdge(lastWriter[write], p);
+      for (uint32_t reader : readersSinceWrite[write]) {
+        addEdge(reader, p);
+      }
+      readersSinceWrite[write].clear();
+      lastWriter[write] = p;
+      resources[write].producer = p;
+    }
+  }
+
+  order.clear();
+  std::vector<uint32_t> ready;
+  for (uint32_t p = 0; p < passCount; p++) {
+    if (!passes[p].culled && inDegree[p] == 0) {
+      ready.push_back(p);
+    }
+  }
+  while (!ready.empty()) {
+    auto earliest = std::min_element(ready.begin(), ready.end());
+    uint32_t p = *earliest;
+    ready.erase(earliest);
+    order.push_back(p);
+    for (uint32_t dependent : dependents[p]) {
+      if (--inDegree[dependent] == 0) {
+        ready.push_back(dependent);
+      }
+    }
+  }
+  return true;
+}
+
+void RenderGraph::computeLifetimes() {
+  for (uint32_t i = 0; i < order.size(); i++) {
+    const Pass &pass = passes[order[i]];
+    auto touch = [&](RGResource id) {
+      Resource &resource = resources[id];
+      resource.firstUse = std::min(resource.firstUse, i);
+      resource.lastUse = std::max(resource.lastUse, i);
+    };
+    for (RGResource id : pass.creates) {
+      touch(id);
+    }
+    for (RGResource id : pass.reads) {
+      touch(id);
+    }
+    for (RGResource id : pass.writes) {
+      touch(id);
+    }
+  }
+}
+
+void RenderGraph::aliasTransients() {
+  std::vector<RGResource> transients;
+  for (RGResource id = 0; id < resources.size(); id++) {
+    Resource &resource = resources[id];
+    if (resource.imported || resource.firstUse == UINT32_MAX) {
+      continue;
+    }
+    graphStats.transientTextures++;
+    if (resource.desc.memoryless) {
+      graphStats.memorylessTextures++;
+      continue;
+    }
+    if (backend.textureSizeAndAlign) {
+      backend.textureSizeAndAlign(resource.desc, resource.size,
+                                  resource.alignment);
+    } else {
+      // 4 bytes per sample is good enough for planning without a device
+      resource.size = (uint64_t)resource.desc.width * resource.desc.height *
+                      resource.desc.sampleCount * 4;
+      resource.alignment = 256;
+    }
+    transients.push_back(id);
+  }
+
+  // Place the biggest textures first, each at the lowest offset that doesn't
+  // overlap a placed texture whose lifetime overlaps its own
+  std::sort(transients.begin(), transients.end(), [&](RGResource a, RGResource b) {
+    return resources[a].size > resources[b].size;
+  });
+  std::vector<RGResource> placed;
+  uint64_t heapSize = 0;
+  graphStats.unaliasedBytes = 0;
+  for (RGResource id : transients) {
+    Resource &resource = resources[id];
+    graphStats.unaliasedBytes += resource.size;
+
+    std::vector<std::pair<uint64_t, uint64_t>> busy;
+    for (RGResource other : placed) {
+      const Resource &o = resources[other];
+      if (o.firstUse <= resource.lastUse && resource.firstUse <= o.lastUse) {
+        busy.push_back({o.offset, o.offset + o.size});
+      }
+    }
+    std::sort(busy.begin(), busy.end());
+    uint64_t offset = 0;
+    for (const auto &range : busy) {
+      uint64_t aligned =
+          (offset + resource.alignment - 1) / resource.alignment *
+          resource.alignment;
+      if (aligned + resource.size <= range.first) {
+        break;
+      }
+      offset = std::max(offset, range.second);
+    }
+    resource.offset = (offset + resource.alignment - 1) / resource.alignment *
+                      resource.alignment;
+    heapSize = std::max(heapSize, resource.offset + resource.size);
+    placed.push_back(id);
+  }
+  graphStats.aliasedBytes = heapSize;
+}
+
+bool RenderGraph::compile() {
+  graphStats = {};
+  graphStats.declaredPasses = (uint32_t)passes.size();
+  cullPasses();
+  if (!schedulePasses()) {
+    return false;
+  }
+  graphStats.culledPasses = (uint32_t)(passes.size() - order.size());
+  computeLifetimes();
+  aliasTransients();
+  return true;
+}
+
+void RenderGraph::execute(void *userData) {
+  if (backend.reserveHeap && graphStats.aliasedBytes > 0) {
+    backend.reserveHeap(graphStats.aliasedBytes);
+  }
+  for (Resource &resource : resources) {
+    if (!resource.imported && resource.firstUse != UINT32_MAX &&
+        backend.createTransient) {
+      resource.texture =
+          backend.createTransient(resource.desc, resource.offset);
+    }
+  }
+
+  RenderGraphPassContext context{*this, userData};
+  for (uint32_t p : order) {
+    if (passes[p].execute) {
+      passes[p].execute(context);
+    }
+  }
+}
+
+void RenderGraph::reset() {
+  for (Resource &resource : resources) {
+    if (!resource.imported && resource.texture && backend.destroy) {
+      backend.destroy(resource.desc, resource.texture);
+    }
+  }
+  resources.clear();
+  passes.clear();
+  order.clear();
+}
+
+std::vector<std::string> RenderGraph::executionOrder() const {
+  std::vector<std::string> names;
+  for (uint32_t p : order) {
+    names.push_back(passes[p].name);
+  }
+  return names;
+}
+
+uint64_t RenderGraph::heapOffset(RGResource resource) const {
+  return resources[resource].offset;
+}
+
+void *RenderGraph::texture(RGResource resource) const {
+  return resources[resource].texture;
+}
@@ -0,0 +1,164 @@
+#pragma once
+// Frame render graph.
+//
+// Each frame, passes are added together with the textures they create, read
+// and write. compile() then:
+//  - culls passes whose results never reach an output (or have no side
+//    effects),
+//  - orders the remaining passes so every pass runs after the passes that
+//    produce what it reads,
+//  - works out the first and last pass that uses every transient texture,
+//  - and places transient textures at offsets in one heap so that textures
+//    whose lifetimes don't overlap share memory. Memoryless textures take no
+//    memory and are left out.
+// execute() creates the transient textures through the backend callbacks and
+// runs the passes in order.
+//
+// The graph only deals in opaque texture handles, the Metal specific parts
+// (sizes, heap placement, encoders) live in the backend and pass callbacks.
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+using RGResource = uint32_t;
+static constexpr RGResource invalidRGResource = UINT32_MAX;
+
+struct RGTextureDesc {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // MTL::PixelFormat / MTL::TextureUsage values, passed through to the backend
+  uint32_t pixelFormat = 0;
+  uint32_t sampleCount = 1;
+  uint32_t usage = 0;
+  // Kept in tile memory only (Apple GPUs), so it never gets a place in the
+  // heap. Only for textures no later pass loads.
+  bool memoryless = false;
+};
+
+class RenderGraph;
+
+class RenderGraphBuilder {
+public:
+  // Declares a new transient texture, written by this pass
+  RGResource create(const char *name, const RGTextureDesc &desc);
+  void read(RGResource resource);
+  void write(RGResource resource);
+  // Keeps the pass alive even if nothing reads its outputs
+  void sideEffect();
+
+private:
+  friend class RenderGraph;
+  RenderGraphBuilder(RenderGraph &graph, uint32_t pass)
+      : graph(graph), pass(pass) {}
+
+  RenderGraph &graph;
+  uint32_t pass;
+};
+
+struct RenderGraphPassContext {
+  const RenderGraph &graph;
+  // Whatever was passed to RenderGraph::execute, e.g. the command buffer
+  void *userData;
+
+  void *texture(RGResource resource) const;
+};
+
+struct RenderGraphStats {
+  uint32_t declaredPasses = 0;
+  uint32_t culledPasses = 0;
+  uint32_t transientTextures = 0;
+  // Of the transient textures, those that take no memory at all
+  uint32_t memorylessTextures = 0;
+  // Heap size needed with and without aliasing transient textures
+  uint64_t unaliasedBytes = 0;
+  uint64_t aliasedBytes = 0;
+};
+
+class RenderGraph {
+public:
+  struct Backend {
+    // Size and alignment of a texture placed in a heap
+    std::function<void(const RGTextureDesc &, uint64_t &size,
+                       uint64_t &alignment)>
+        textureSizeAndAlign;
+    // Makes sure the transient heap is at least this big
+    std::function<void(uint64_t heapSize)> reserveHeap;
+    // Creates a transient texture at `offset` in the heap, or a memoryless
+    // one outside of it (offset 0)
+    std::function<void *(const RGTextureDesc &, uint64_t offset)>
+        createTransient;
+    std::function<void(const RGTextureDesc &, void *)> destroy;
+  };
+
+  using SetupFunction = std::function<void(RenderGraphBuilder &)>;
+  using ExecuteFunction = std::function<void(RenderGraphPassContext &)>;
+
+  explicit RenderGraph(Backend backend);
+  ~RenderGraph();
+
+  // Textures owned outside of the graph (drawable, persistent targets).
+  // They are never aliased.
+  RGResource importTexture(const char *name, void *texture,
+                           const RGTextureDesc &desc);
+  // The graph's results: passes contributing to outputs are never culled
+  void markOutput(RGResource resource);
+
+  void addPass(const char *name, const SetupFunction &setup,
+               ExecuteFunction execute);
+
+  // Returns false (and prints why) if the graph is malformed, e.g. a pass
+  // reads a transient texture nothing writes
+  bool compile();
+  void execute(void *userData);
+  // Destroys this frame's transient textures and clears all passes
+  void reset();
+
+  const RenderGraphStats &stats() const { return graphStats; }
+  // Names of the passes that will run, in execution order
+  std::vector<std::string> executionOrder() const;
+  // Offset of a transient texture in the heap, valid after compile()
+  uint64_t heapOffset(RGResource resource) const;
+  void *texture(RGResource resource) const;
+
+private:
+  friend class RenderGraphBuilder;
+
+  struct Resource {
+    std::string name;
+    RGTextureDesc desc;
+    bool imported = false;
+    bool output = false;
+    void *texture = nullptr;
+    uint32_t producer = UINT32_MAX; // Last pass writing it
+    uint32_t refCount = 0;
+    // Lifetime in execution order indices
+    uint32_t firstUse = UINT32_MAX;
+    uint32_t lastUse = 0;
+    uint64_t size = 0;
+    uint64_t alignment = 1;
+    uint64_t offset = 0;
+  };
+
+  struct Pass {
+    std::string name;
+    ExecuteFunction execute;
+    std::vector<RGResource> creates;
+    std::vector<RGResource> reads;
+    std::vector<RGResource> writes;
+    bool sideEffect = false;
+    uint32_t refCount = 0;
+    bool culled = false;
+  };
+
+  void cullPasses();
+  bool schedulePasses();
+  void computeLifetimes();
+  void aliasTransients();
+
+  Backend backend;
+  std::vector<Resource> resources;
+  std::vector<Pass> passes;
+  std::vector<uint32_t> order;
+  RenderGraphStats graphStats;
+};
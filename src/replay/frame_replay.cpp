@@ -0,0 +1,147 @@
+// frame_replay: records and replays frame captures of HeadlessScene.
+//
+//   frame_replay --record capture.txt [--frames n]
+//   frame_replay capture.txt [--repeat n]
+//
+// Recording drives the scene with scripted inputs: a fixed 60 Hz clock, a
+// camera panning across the grid, an instance moved and both settings
+// switched off and on again along the way. Replaying re-runs the capture at
+// full speed, reports the CPU time per frame on stdout and any frames whose
+// command stream differs on stderr, and exits with 1 if any did. Record a
+// capture on one commit and replay it on another to check that a change
+// leaves the frame alone, and what it did to its cost.
+#include "frame_capture.hpp"
+#include "headless_scene.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+static SceneChange settingChange(HeadlessScene::Setting setting, bool on) {
+  SceneChange change;
+  change.type = SceneChangeType::Setting;
+  change.target = setting;
+  change.value = on;
+  return change;
+}
+
+// The scripted inputs of frame `index` out of `frameCount`
+static void addScriptedChanges(const HeadlessScene &scene, uint32_t index,
+                               uint32_t frameCount, FrameCapturer &capturer) {
+  // Settings as they start, so a replay doesn't depend on the defaults
+  if (index == 0) {
+    capturer.addChange(settingChange(HeadlessScene::SortDrawsSetting, true));
+    capturer.addChange(settingChange(HeadlessScene::LodSetting, true));
+  }
+  if (index == frameCount / 4) {
+    capturer.addChange(settingChange(HeadlessScene::LodSetting, false));
+  } else if (index == frameCount / 2) {
+    capturer.addChange(settingChange(HeadlessScene::LodSetting, true));
+    capturer.addChange(settingChange(HeadlessScene::SortDrawsSetting, false));
+  } else if (index == frameCount * 3 / 4) {
+    capturer.addChange(settingChange(HeadlessScene::SortDrawsSetting, true));
+    // Lifts the middle instance out of the grid
+    SceneChange lift;
+    lift.type = SceneChangeType::LocalTransform;
+    lift.target = scene.instanceNode(scene.instanceCount() / 2);
+    lift.transform = makeTranslation({0, 6, 0});
+    capturer.addChange(lift);
+  }
+}
+
+static bool record(const char *path, uint32_t frameCount) {
+  HeadlessScene scene;
+  FrameCapturer capturer;
+  capturer.start(HeadlessScene::sceneName, frameCount);
+  CommandRecorder recorder;
+  for (uint32_t i = 0; i < frameCount; i++) {
+    double time = i / 60.0;
+    FrameCamera camera = HeadlessScene::defaultCamera();
+    camera.position = {(float)std::sin(time * 0.5) * 8.0f, 2.0f, 0.0f};
+    addScriptedChanges(scene, i, frameCount, capturer);
+    capturer.beginFrame(time, i % HeadlessScene::framesInFlight, camera);
+    recorder.clear();
+    scene.frame(capturer.capture().frames.back(), recorder);
+    capturer.endFrame(recorder);
+  }
+  if (!saveFrameCapture(path, capturer.capture())) {
+    return false;
+  }
+  std::cout << "Recorded " << frameCount << " frames to " << path
+            << std::endl;
+  return true;
+}
+
+static int replay(const char *path, uint32_t repeat) {
+  FrameCapture capture;
+  if (!loadFrameCapture(path, capture)) {
+    return 1;
+  }
+  if (capture.scene != HeadlessScene::sceneName) {
+    std::cerr << "frame_replay: " << path << " was captured from \""
+              << capture.scene << "\", which only it can replay" << std::endl;
+    return 1;
+  }
+
+  std::unique_ptr<HeadlessScene> scene;
+  ReplayOptions options;
+  options.repeat = repeat;
+  options.beginPass = [&scene] { scene = std::make_unique<HeadlessScene>(); };
+  ReplayReport report = replayFrameCapture(
+      capture,
+      [&scene](const CapturedFrame &frame, RenderCommandSink &sink) {
+        scene->frame(frame, sink);
+      },
+      options);
+
+  const FrameTimeSummary &times = report.frameTimes;
+  char line[160];
+  snprintf(line, sizeof(line),
+           "CPU frame ms: mean %.4f, p50 %.4f, p95 %.4f, p99 %.4f, max %.4f",
+           times.mean, times.p50, times.p95, times.p99, times.max);
+  std::cout << "Replayed " << report.frames << " frames in "
+            << report.totalMilliseconds << " ms, " << report.mismatchedFrames
+            << " differ from the capture" << std::endl;
+  std::cout << line << std::endl;
+  return report.matches() ? 0 : 1;
+}
+
+static void printUsage() {
+  std::cerr << "Usage: frame_replay --record capture.txt [--frames n]\n"
+               "       frame_replay capture.txt [--repeat n]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  const char *recordPath = nullptr;
+  const char *replayPath = nullptr;
+  uint32_t frameCount = 600;
+  uint32_t repeat = 1;
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (argument == "--record" && hasValue) {
+      recordPath = argv[++i];
+    } else if (argument == "--frames" && hasValue) {
+      frameCount = std::max(1, atoi(argv[++i]));
+    } else if (argument == "--repeat" && hasValue) {
+      repeat = std::max(1, atoi(argv[++i]));
+    } else if (argument[0] != '-' && !replayPath) {
+      replayPath = argv[i];
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+  if (recordPath && !replayPath) {
+    return record(recordPath, frameCount) ? 0 : 1;
+  }
+  if (replayPath && !recordPath) {
+    return replay(replayPath, repeat);
+  }
+  printUsage();
+  return 1;
+}
@@ -0,0 +1,170 @@
+#include "headless_scene.hpp"
+
+#include <cmath>
+#include <cstring>
+
+// The MTL::PrimitiveType, MTL::Winding and MTL::CullMode values the engine
+// encodes
+static constexpr uint32_t primitiveTypeTriangle = 3;
+static constexpr uint32_t windingCounterClockwise = 1;
+static constexpr uint32_t cullModeBack = 2;
+
+// Per draw: model-view-projection and model matrices
+static constexpr uint64_t drawUniformSize = 2 * sizeof(Float4x4);
+static constexpr uint64_t materialStride = 256;
+
+HeadlessScene::HeadlessScene()
+    : uniforms(4 * 1024 * 1024, framesInFlight) {
+  // Pushed back to where the engine's obj sits
+  root = scene.createNode(invalidSceneNode, makeTranslation({0, 0, -30}));
+  for (uint32_t z = 0; z < gridSize; z++) {
+    for (uint32_t x = 0; x < gridSize; x++) {
+      Float3 position = {(x - (gridSize - 1) * 0.5f) * 2.5f, 0.0f,
+                         (z - (gridSize - 1) * 0.5f) * 2.5f};
+      instanceNodes.push_back(
+          scene.createNode(root, makeTranslation(position)));
+    }
+  }
+  for (uint32_t i = 0; i < lightCount; i++) {
+    float angle = i * 6.2831853f / lightCount;
+    lightNodes.push_back(scene.createNode(
+        invalidSceneNode,
+        mul(makeTranslation({std::cos(angle) * 12.0f, 4.0f,
+                             std::sin(angle) * 12.0f - 30.0f}),
+            makeScale({0.3f, 0.3f, 0.3f}))));
+  }
+  lods[0] = {0, 30000, 15.0f};
+  lods[1] = {30000, 8000, 40.0f};
+  lods[2] = {38000, 2000, 1000.0f};
+
+  uint32_t instanceCount = (uint32_t)instanceNodes.size();
+  cullObjects.resize(instanceCount);
+  cullArguments.resize(CullMaxLods);
+  cullInstances.resize(CullMaxLods * instanceCount);
+  visibility.resize(instanceCount);
+}
+
+FrameCamera HeadlessScene::defaultCamera() {
+  FrameCamera camera;
+  camera.viewportWidth = 1280.0f;
+  camera.viewportHeight = 720.0f;
+  return camera;
+}
+
+void HeadlessScene::applyChange(const SceneChange &change) {
+  if (change.type == SceneChangeType::LocalTransform) {
+    if (scene.alive(change.target)) {
+      scene.setLocalTransform(change.target, change.transform);
+    }
+  } else if (change.target == SortDrawsSetting) {
+    sortDraws = change.value != 0;
+  } else if (change.target == LodSetting) {
+    useLods = change.value != 0;
+  }
+}
+
+void HeadlessScene::frame(const CapturedFrame &frame,
+                          RenderCommandSink &sink) {
+  for (const SceneChange &change : frame.changes) {
+    applyChange(change);
+  }
+  // Uniform offsets depend on the region, so land on the captured one
+  uint32_t frameInFlight = frame.frameInFlight % framesInFlight;
+  do {
+    uniforms.beginFrame();
+  } while (uniforms.frameIndex() != frameInFlight);
+
+  // Spun by the frame's time, as the engine spins its obj
+  float angleInRadians = (float)(frame.time / 4.0 * 45.0 * M_PI / 180.0);
+  scene.setLocalTransform(root, mul(makeTranslation({0, 0, -30}),
+                                    makeRotation(angleInRadians, {0, 1, 0})));
+  // Single threaded, so frame times don't depend on the machine's cores
+  scene.updateWorldTransforms(nullptr);
+
+  const FrameCamera &camera = frame.camera;
+  Float4x4 view = makeLookAt(camera.position, camera.position + camera.forward,
+                             camera.up);
+  Float4x4 projection = makePerspectiveRightHand(
+      camera.fov, camera.aspectRatio(), camera.nearZ, camera.farZ);
+  Float4x4 viewProjection = mul(projection, view);
+
+  uint32_t instanceCount = (uint32_t)instanceNodes.size();
+  for (uint32_t i = 0; i < instanceCount; i++) {
+    const Float4x4 &model = scene.worldTransform(instanceNodes[i]);
+    Float3 center = transformPoint(model, {0, 0, 0});
+    CullObject &object = cullObjects[i];
+    object.center[0] = center.x;
+    object.center[1] = center.y;
+    object.center[2] = center.z;
+    object.radius = 1.0f;
+    memcpy(object.model, &model, sizeof(object.model));
+  }
+  uint32_t lodCount = useLods ? 3 : 1;
+  // Without LODs the most detailed one reaches as far as anything does
+  CullLod singleLod = {lods[0].vertexStart, lods[0].vertexCount, camera.farZ};
+  const CullLod *frameLods = useLods ? lods : &singleLod;
+  CullUniforms cullUniforms =
+      makeCullUniforms(makeFrustum(viewProjection), camera.position, frameLods,
+                       lodCount, instanceCount, instanceCount);
+  resetCullArguments(cullArguments.data(), frameLods, lodCount,
+                     instanceCount);
+  cullObjectsReference(cullUniforms, cullObjects.data(), cullArguments.data(),
+                       cullInstances.data(), visibility.data());
+
+  draws.clear();
+  packets.clear();
+  auto addDraw = [&](uint32_t pipeline, uint32_t material,
+                     const Float4x4 &model, const CullLod &lod) {
+    uint64_t offset = uniforms.allocate(drawUniformSize);
+    if (offset == UniformRingAllocator::invalidOffset) {
+      return;
+    }
+    Float4x4 modelView = mul(view, model);
+    Float3 viewPosition = transformPoint(modelView, {0, 0, 0});
+    uint64_t key = makeDrawSortKey(0, pipeline, material,
+                                   drawKeyDepth(-viewPosition.z));
+    packets.push_back({key, (uint32_t)draws.size()});
+    draws.push_back(
+        {pipeline, material, offset, lod.vertexStart, lod.vertexCount});
+  };
+  visibleCount = 0;
+  for (uint32_t i = 0; i < instanceCount; i++) {
+    if (!visibility[i]) {
+      continue;
+    }
+    visibleCount++;
+    addDraw(LitPipelineHandle, i % materialCount,
+            scene.worldTransform(instanceNodes[i]),
+            frameLods[visibility[i] - 1]);
+  }
+  // Lights are small and few, so never culled
+  CullLod lightLod = {38000, 2000, 0.0f};
+  for (SceneNodeId light : lightNodes) {
+    addDraw(LightPipelineHandle, 0, scene.worldTransform(light), lightLod);
+  }
+  if (sortDraws) {
+    radixSortDrawPackets(packets, packetScratch);
+  }
+
+  StateTrackingSink tracker(sink);
+  tracker.setFrontFacingWinding(windingCounterClockwise);
+  tracker.setCullMode(cullModeBack);
+  for (const DrawPacket &packet : packets) {
+    encodeDraw(tracker, draws[packet.index]);
+  }
+}
+
+void HeadlessScene::encodeDraw(RenderCommandSink &sink,
+                               const Draw &draw) const {
+  sink.setRenderPipelineState(handle(draw.pipeline));
+  sink.setDepthStencilState(handle(DepthStencilHandle));
+  sink.setVertexBuffer(handle(MeshBufferHandle), 0, 0);
+  sink.setVertexBuffer(handle(UniformBufferHandle), draw.uniformOffset, 1);
+  sink.setFragmentBuffer(handle(MaterialBufferHandle),
+                         draw.material * materialStride, 0);
+  if (draw.pipeline == LitPipelineHandle) {
+    sink.setFragmentTexture(handle(FirstTextureHandle + draw.material), 0);
+  }
+  sink.drawPrimitives(primitiveTypeTriangle, draw.vertexStart,
+                      draw.vertexCount, 1);
+}
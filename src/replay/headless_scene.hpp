@@ -0,0 +1,103 @@
+#pragma once
+// The engine's frame without Metal, for replaying captures on any platform.
+//
+// MTLEngine builds its frame from Metal objects, so its captures can only
+// be replayed where it runs. HeadlessScene goes through the same steps with
+// engine_core alone: apply the frame's changes, spin the scene by the
+// frame's time, update world transforms, frustum and LOD cull the instances
+// with the culling kernel's reference, bump allocate their uniforms, sort
+// the draws and encode them through a StateTrackingSink. Metal objects are
+// stood in for by addresses the scene owns, which captures turn into ids
+// anyway.
+//
+// The scene is a grid of instances under one root, which spins like the
+// engine's obj, and a few unculled lights on a pipeline of their own.
+#include "draw_sorting.hpp"
+#include "frame_capture.hpp"
+#include "gpu_culling.hpp"
+#include "scene_graph.hpp"
+#include "uniform_ring.hpp"
+
+#include <cstdint>
+#include <vector>
+
+class HeadlessScene {
+public:
+  // Captures of a different scene, or of this one laid out differently,
+  // can't be replayed by it
+  static constexpr const char *sceneName = "headless-grid 1";
+  static constexpr uint32_t framesInFlight = 3;
+
+  // SceneChange::target of settings
+  enum Setting : uint32_t {
+    // Off encodes the draws in the order they were built
+    SortDrawsSetting,
+    // Off draws every instance at its most detailed LOD
+    LodSetting,
+  };
+
+  HeadlessScene();
+
+  // The camera the engine looks through, viewing a 1280x720 viewport
+  static FrameCamera defaultCamera();
+  // The node the grid hangs from, which each frame spins
+  SceneNodeId rootNode() const { return root; }
+  uint32_t instanceCount() const { return (uint32_t)instanceNodes.size(); }
+  SceneNodeId instanceNode(uint32_t index) const {
+    return instanceNodes[index];
+  }
+
+  // Builds and encodes one frame
+  void frame(const CapturedFrame &frame, RenderCommandSink &sink);
+
+  // Of the last frame
+  uint32_t visibleInstances() const { return visibleCount; }
+
+private:
+  // Stand-ins for the Metal objects a frame binds
+  enum Handle : uint32_t {
+    LitPipelineHandle,
+    LightPipelineHandle,
+    DepthStencilHandle,
+    MeshBufferHandle,
+    UniformBufferHandle,
+    MaterialBufferHandle,
+    FirstTextureHandle,
+    HandleCount = FirstTextureHandle + 4,
+  };
+  static constexpr uint32_t materialCount = 4;
+  static constexpr uint32_t gridSize = 24;
+  static constexpr uint32_t lightCount = 8;
+
+  struct Draw {
+    uint32_t pipeline;
+    uint32_t material;
+    uint64_t uniformOffset;
+    uint32_t vertexStart;
+    uint32_t vertexCount;
+  };
+
+  const void *handle(uint32_t index) const { return &handles[index]; }
+  void applyChange(const SceneChange &change);
+  void encodeDraw(RenderCommandSink &sink, const Draw &draw) const;
+
+  SceneGraph scene;
+  SceneNodeId root = invalidSceneNode;
+  std::vector<SceneNodeId> instanceNodes;
+  std::vector<SceneNodeId> lightNodes;
+  UniformRingAllocator uniforms;
+  uint8_t handles[HandleCount] = {};
+  CullLod lods[3];
+  bool sortDraws = true;
+  bool useLods = true;
+
+  // Reused from frame to frame
+  std::vector<CullObject> cullObjects;
+  std::vector<IndirectDrawArguments> cullArguments;
+  std::vector<Float4x4> cullInstances;
+  std::vector<uint32_t> visibility;
+  std::vector<Draw> draws;
+  std::vector<DrawPacket> packets;
+  std::vector<DrawPacket> packetScratch;
+  uint32_t visibleCount = 0;
+};
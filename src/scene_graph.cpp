@@ -0,0 +1,263 @@
+#include "scene_graph.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// out = a * b, column by column: each output column is the columns of `a`
+// weighted by one column of `b`, four lanes at a time
+static inline void multiply(const Float4x4 &a, const Float4x4 &b,
+                            Float4x4 &out) {
+#if defined(__ARM_NEON)
+  float32x4_t a0 = vld1q_f32(&a.columns[0].x);
+  float32x4_t a1 = vld1q_f32(&a.columns[1].x);
+  float32x4_t a2 = vld1q_f32(&a.columns[2].x);
+  float32x4_t a3 = vld1q_f32(&a.columns[3].x);
+  for (int c = 0; c < 4; c++) {
+    const Float4 &column = b.columns[c];
+    float32x4_t result = vmulq_n_f32(a0, column.x);
+    result = vfmaq_n_f32(result, a1, column.y);
+    result = vfmaq_n_f32(result, a2, column.z);
+    result = vfmaq_n_f32(result, a3, column.w);
+    vst1q_f32(&out.columns[c].x, result);
+  }
+#elif defined(__SSE2__)
+  __m128 a0 = _mm_load_ps(&a.columns[0].x);
+  __m128 a1 = _mm_load_ps(&a.columns[1].x);
+  __m128 a2 = _mm_load_ps(&a.columns[2].x);
+  __m128 a3 = _mm_load_ps(&a.columns[3].x);
+  for (int c = 0; c < 4; c++) {
+    const Float4 &column = b.columns[c];
+    __m128 result = _mm_mul_ps(a0, _mm_set1_ps(column.x));
+    result = _mm_add_ps(result, _mm_mul_ps(a1, _mm_set1_ps(column.y)));
+    result = _mm_add_ps(result, _mm_mul_ps(a2, _mm_set1_ps(column.z)));
+    result = _mm_add_ps(result, _mm_mul_ps(a3, _mm_set1_ps(column.w)));
+    _mm_store_ps(&out.columns[c].x, result);
+  }
+#else
+  out = mul(a, b);
+#endif
+}
+
+SceneNodeId SceneGraph::createNode(SceneNodeId parent, const Float4x4 &matrix) {
+  assert(parent == invalidSceneNode || alive(parent));
+  SceneNodeId node;
+  if (!freeIds.empty()) {
+    node = freeIds.back();
+    freeIds.pop_back();
+  } else {
+    node = (SceneNodeId)slotOfNode.size();
+    slotOfNode.push_back(invalidSlot);
+  }
+
+  uint32_t slot = (uint32_t)nodeOfSlot.size();
+  slotOfNode[node] = slot;
+  nodeOfSlot.push_back(node);
+  parentSlot.push_back(parent == invalidSceneNode ? invalidSlot
+                                                  : slotOfNode[parent]);
+  local.push_back(matrix);
+  world.push_back(matrix);
+  dirty.push_back(1);
+  dead.push_back(0);
+  liveNodes++;
+  // Appended after its parent, so only the levels are out of date
+  levelsStale = true;
+  return node;
+}
+
+void SceneGraph::destroyNode(SceneNodeId node) {
+  if (!alive(node)) {
+    return;
+  }
+  // Descendants are found in one forward pass, which needs parents first
+  if (orderStale) {
+    rebuild();
+  }
+  uint32_t first = slotOfNode[node];
+  dead[first] = 1;
+  for (uint32_t slot = first; slot < nodeOfSlot.size(); slot++) {
+    if (slot != first &&
+        (parentSlot[slot] == invalidSlot || !dead[parentSlot[slot]] ||
+         dead[slot])) {
+      continue;
+    }
+    dead[slot] = 1;
+    slotOfNode[nodeOfSlot[slot]] = invalidSlot;
+    freeIds.push_back(nodeOfSlot[slot]);
+    liveNodes--;
+  }
+  // The dead slots are dropped by the next rebuild
+  levelsStale = true;
+}
+
+bool SceneGraph::alive(SceneNodeId node) const {
+  return node < slotOfNode.size() && slotOfNode[node] != invalidSlot;
+}
+
+bool SceneGraph::setParent(SceneNodeId node, SceneNodeId parent) {
+  assert(alive(node) && (parent == invalidSceneNode || alive(parent)));
+  uint32_t slot = slotOfNode[node];
+  uint32_t newParentSlot =
+      parent == invalidSceneNode ? invalidSlot : slotOfNode[parent];
+  for (uint32_t ancestor = newParentSlot; ancestor != invalidSlot;
+       ancestor = parentSlot[ancestor]) {
+    if (ancestor == slot) {
+      return false;
+    }
+  }
+  parentSlot[slot] = newParentSlot;
+  dirty[slot] = 1;
+  orderStale = true;
+  return true;
+}
+
+SceneNodeId SceneGraph::parent(SceneNodeId node) const {
+  uint32_t slot = parentSlot[slotOfNode[node]];
+  return slot == invalidSlot ? invalidSceneNode : nodeOfSlot[slot];
+}
+
+void SceneGraph::setLocalTransform(SceneNodeId node, const Float4x4 &matrix) {
+  uint32_t slot = slotOfNode[node];
+  local[slot] = matrix;
+  dirty[slot] = 1;
+}
+
+const Float4x4 &SceneGraph::localTransform(SceneNodeId node) const {
+  return local[slotOfNode[node]];
+}
+
+const Float4x4 &SceneGraph::worldTransform(SceneNodeId node) const {
+  return world[slotOfNode[node]];
+}
+
+void SceneGraph::rebuild() {
+  uint32_t slotCount = (uint32_t)nodeOfSlot.size();
+
+  // Depth of every live slot. After setParent a parent can sit after its
+  // child, so walk up to the nearest slot whose depth is known.
+  std::vector<uint32_t> depth(slotCount, invalidSlot);
+  std::vector<uint32_t> path;
+  uint32_t maxDepth = 0;
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    if (dead[slot] || depth[slot] != invalidSlot) {
+      continue;
+    }
+    uint32_t current = slot;
+    while (current != invalidSlot && depth[current] == invalidSlot) {
+      path.push_back(current);
+      current = parentSlot[current];
+    }
+    uint32_t d = current == invalidSlot ? 0 : depth[current] + 1;
+    while (!path.empty()) {
+      depth[path.back()] = d++;
+      path.pop_back();
+    }
+    maxDepth = std::max(maxDepth, d - 1);
+  }
+
+  // Counting sort by depth, keeping the current order within a level
+  uint32_t levelCount = liveNodes ? maxDepth + 1 : 0;
+  levelStart.assign(levelCount + 1, 0);
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    if (!dead[slot]) {
+      levelStart[depth[slot] + 1]++;
+    }
+  }
+  for (uint32_t level = 0; level < levelCount; level++) {
+    levelStart[level + 1] += levelStart[level];
+  }
+  std::vector<uint32_t> newSlot(slotCount, invalidSlot);
+  std::vector<uint32_t> next(levelStart.begin(), levelStart.end() - 1);
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    if (!dead[slot]) {
+      newSlot[slot] = next[depth[slot]]++;
+    }
+  }
+
+  uint32_t liveCount = (uint32_t)liveNodes;
+  std::vector<SceneNodeId> sortedNodes(liveCount);
+  std::vector<uint32_t> sortedParents(liveCount);
+  std::vector<Float4x4> sortedLocal(liveCount);
+  std::vector<Float4x4> sortedWorld(liveCount);
+  std::vector<uint8_t> sortedDirty(liveCount);
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    uint32_t target = newSlot[slot];
+    if (target == invalidSlot) {
+      continue;
+    }
+    sortedNodes[target] = nodeOfSlot[slot];
+    sortedParents[target] =
+        parentSlot[slot] == invalidSlot ? invalidSlot : newSlot[parentSlot[slot]];
+    sortedLocal[target] = local[slot];
+    sortedWorld[target] = world[slot];
+    sortedDirty[target] = dirty[slot];
+    slotOfNode[nodeOfSlot[slot]] = target;
+  }
+  nodeOfSlot.swap(sortedNodes);
+  parentSlot.swap(sortedParents);
+  local.swap(sortedLocal);
+  world.swap(sortedWorld);
+  dirty.swap(sortedDirty);
+  dead.assign(liveCount, 0);
+
+  levelsStale = false;
+  orderStale = false;
+  graphStats.rebuilds++;
+}
+
+void SceneGraph::updateWorldTransforms(ThreadPool *pool) {
+  if (levelsStale || orderStale) {
+    rebuild();
+  }
+
+  // Parents come first, so one pass pushes dirty flags all the way down
+  uint32_t slotCount = (uint32_t)nodeOfSlot.size();
+  uint32_t updated = 0;
+  for (uint32_t slot = 0; slot < slotCount; slot++) {
+    uint32_t parent = parentSlot[slot];
+    if (parent != invalidSlot) {
+      dirty[slot] |= dirty[parent];
+    }
+    updated += dirty[slot];
+  }
+
+  auto updateSlots = [this](size_t first, size_t last) {
+    for (size_t slot = first; slot < last; slot++) {
+      if (!dirty[slot]) {
+        continue;
+      }
+      uint32_t parent = parentSlot[slot];
+      if (parent == invalidSlot) {
+        world[slot] = local[slot];
+      } else {
+        multiply(world[parent], local[slot], world[slot]);
+      }
+      dirty[slot] = 0;
+    }
+  };
+
+  // A level only reads the level above it, which is already done
+  uint32_t levelCount =
+      levelStart.empty() ? 0 : (uint32_t)levelStart.size() - 1;
+  for (uint32_t level = 0; level < levelCount; level++) {
+    size_t first = levelStart[level];
+    size_t size = levelStart[level + 1] - first;
+    if (pool && size >= parallelLevelSize) {
+      pool->parallelFor(size, parallelLevelSize / 4,
+                        [&](size_t begin, size_t end) {
+                          updateSlots(first + begin, first + end);
+                        });
+    } else {
+      updateSlots(first, first + size);
+    }
+  }
+
+  graphStats.nodes = slotCount;
+  graphStats.levels = levelCount;
+  graphStats.updatedNodes = updated;
+}
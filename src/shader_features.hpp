@@ -0,0 +1,33 @@
+#pragma once
+// Features of the forward uber-shader (shaders/forward.metal).
+//
+// Included by both the engine and the Metal shaders, so this must stay plain
+// enough for both compilers. Each feature is a bool function constant; a
+// permutation is the bitmask of enabled features, and Metal strips the
+// disabled code paths when the pipeline is specialized.
+
+enum ShaderFeature {
+  // Multiply the base colour by colorTexture [[texture(0)]]
+  ShaderFeatureTextured = 1 << 0,
+  // Multiply the base colour by per-vertex colours in [[buffer(3)]]
+  ShaderFeatureVertexColor = 1 << 1,
+  // Add a Blinn-Phong specular term
+  ShaderFeatureSpecular = 1 << 2,
+  // Read per-instance model matrices from [[buffer(2)]]
+  ShaderFeatureInstancing = 1 << 3,
+  // Shadow the cluster light ShadowUniforms::shadowedLight with the cascaded
+  // shadow map in [[texture(1)]], uniforms in [[buffer(6)]]
+  ShaderFeatureShadows = 1 << 4,
+
+  ShaderFeatureCount = 5,
+  ShaderFeatureAll = (1 << ShaderFeatureCount) - 1,
+};
+
+// Function constant index of each feature is the index of its bit
+enum FunctionConstantIndex {
+  FunctionConstantTextured = 0,
+  FunctionConstantVertexColor = 1,
+  FunctionConstantSpecular = 2,
+  FunctionConstantInstancing = 3,
+  FunctionConstantShadows = 4,
+};
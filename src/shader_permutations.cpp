@@ -0,0 +1,87 @@
+#include "shader_permutations.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Indexed by feature bit
+static const char *const featureNames[ShaderFeatureCount] = {
+    "textured", "vertexcolor", "specular", "instancing", "shadows"};
+
+std::string shaderFeatureName(uint32_t features) {
+  features = canonicalShaderFeatures(features);
+  if (features == 0) {
+    return "base";
+  }
+  std::string name;
+  for (uint32_t bit = 0; bit < ShaderFeatureCount; bit++) {
+    if (features & (1u << bit)) {
+      if (!name.empty()) {
+        name += "+";
+      }
+      name += featureNames[bit];
+    }
+  }
+  return name;
+}
+
+bool parseShaderFeatureName(const std::string &name, uint32_t &features) {
+  features = 0;
+  if (name == "base") {
+    return true;
+  }
+  std::istringstream parts(name);
+  std::string part;
+  while (std::getline(parts, part, '+')) {
+    auto found = std::find(std::begin(featureNames), std::end(featureNames),
+                           part);
+    if (found == std::end(featureNames)) {
+      return false;
+    }
+    features |= 1u << (found - std::begin(featureNames));
+  }
+  return features != 0;
+}
+
+ShaderPermutationManager::ShaderPermutationManager(std::string vertexFunction,
+                                                   std::string fragmentFunction)
+    : vertexFunction(std::move(vertexFunction)),
+      fragmentFunction(std::move(fragmentFunction)) {}
+
+PipelineDesc ShaderPermutationManager::describe(uint32_t features,
+                                                const PipelineDesc &base) {
+  features = canonicalShaderFeatures(features);
+  if (std::find(permutations.begin(), permutations.end(), features) ==
+      permutations.end()) {
+    permutations.push_back(features);
+  }
+
+  PipelineDesc desc = base;
+  desc.label = base.label + " (" + shaderFeatureName(features) + ")";
+  desc.vertexFunction = vertexFunction;
+  desc.fragmentFunction = fragmentFunction;
+  desc.specialized = true;
+  desc.shaderFeatures = features;
+  return desc;
+}
+
+std::string ShaderPermutationManager::manifest() const {
+  std::ostringstream out;
+  for (uint32_t features : permutations) {
+    out << std::hex << features << std::dec << " "
+        << shaderFeatureName(features) << "\n";
+  }
+  return out.str();
+}
+
+bool ShaderPermutationManager::writeManifest(const char *path) const {
+  std::ofstream file(path, std::ios::trunc);
+  if (!file) {
+    std::cerr << "ShaderPermutationManager: can't write " << path
+              << std::endl;
+    return false;
+  }
+  file << manifest();
+  return (bool)file;
+}
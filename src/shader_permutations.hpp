@@ -0,0 +1,46 @@
+#pragma once
+// Permutations of the forward uber-shader.
+//
+// Only the permutations something actually asks for are turned into
+// pipelines: describe() fills in a PipelineDesc for a feature mask and
+// remembers it, the pipeline cache then compiles (and dedups) it like any
+// other pipeline. The requested permutations can be written out as a
+// manifest, to see which variants a scene uses or to build them offline.
+#include "pipeline_cache.hpp"
+#include "shader_features.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Drops bits that aren't features, so equivalent masks give the same key
+inline uint32_t canonicalShaderFeatures(uint32_t features) {
+  return features & ShaderFeatureAll;
+}
+
+// e.g. "textured+specular", or "base" when no feature is enabled
+std::string shaderFeatureName(uint32_t features);
+// Inverse of shaderFeatureName, returns false for unknown feature names
+bool parseShaderFeatureName(const std::string &name, uint32_t &features);
+
+class ShaderPermutationManager {
+public:
+  ShaderPermutationManager(std::string vertexFunction,
+                           std::string fragmentFunction);
+
+  // Returns `base` with the uber-shader functions and `features` filled in,
+  // and records the permutation as requested
+  PipelineDesc describe(uint32_t features, const PipelineDesc &base);
+
+  // Requested feature masks, in first request order, without duplicates
+  const std::vector<uint32_t> &requested() const { return permutations; }
+
+  // One line per permutation: "<features hex> <name>"
+  std::string manifest() const;
+  bool writeManifest(const char *path) const;
+
+private:
+  std::string vertexFunction;
+  std::string fragmentFunction;
+  std::vector<uint32_t> permutations;
+};
@@ -0,0 +1,227 @@
+#include <metal_stdlib>
+using namespace metal;
+
+#include "culling_data.hpp"
+
+// Appends an object's model matrix to its LOD's instance list and bumps the
+// instance count of the LOD's indirect draw
+static void appendInstance(constant CullUniforms &uniforms,
+                           device const CullObject &object, uint lod,
+                           device atomic_uint *drawArguments,
+                           device float4x4 *instances) {
+  uint slot = atomic_fetch_add_explicit(&drawArguments[lod * 4 + 1], 1,
+                                        memory_order_relaxed);
+  device const float *m = object.model;
+  instances[lod * uniforms.instanceCapacity + slot] =
+      float4x4(float4(m[0], m[1], m[2], m[3]), float4(m[4], m[5], m[6], m[7]),
+               float4(m[8], m[9], m[10], m[11]),
+               float4(m[12], m[13], m[14], m[15]));
+}
+
+// Texel of a Hi-Z mip holding mip 0's texel `x`. The last texel of an odd
+// sized mip also covers the leftover one.
+static uint hizMipTexel(uint x, uint level, uint size) {
+  return min(x >> level, max(size >> level, 1u) - 1);
+}
+
+// Mip 0 texel holding a screen coordinate, in texels
+static uint hizTexel(float coordinate, uint size) {
+  return uint(clamp(floor(coordinate), 0.0f, float(size) - 1.0f));
+}
+
+// True if the box around the object's bounding sphere is behind the Hi-Z
+// pyramid wherever it covers the screen. hizOccluded in hiz_culling.cpp is
+// the CPU reference, keep the two in step.
+static bool hizOccluded(constant HiZUniforms &hiz,
+                        texture2d<float, access::read> pyramid,
+                        device const CullObject &object) {
+  if (hiz.enabled == 0) {
+    return false;
+  }
+  constant float *m = hiz.viewProjection;
+  float minX = INFINITY, minY = INFINITY;
+  float maxX = -INFINITY, maxY = -INFINITY;
+  float nearest = INFINITY;
+  float radius = object.radius;
+  for (int corner = 0; corner < 8; corner++) {
+    float x = object.center[0] + ((corner & 1) ? radius : -radius);
+    float y = object.center[1] + ((corner & 2) ? radius : -radius);
+    float z = object.center[2] + ((corner & 4) ? radius : -radius);
+    float clipX = fma(m[0], x, fma(m[4], y, fma(m[8], z, m[12])));
+    float clipY = fma(m[1], x, fma(m[5], y, fma(m[9], z, m[13])));
+    float clipZ = fma(m[2], x, fma(m[6], y, fma(m[10], z, m[14])));
+    float clipW = fma(m[3], x, fma(m[7], y, fma(m[11], z, m[15])));
+    // In front of the near plane, where the pyramid knows nothing
+    if (clipZ < 0.0f || clipW <= 0.0f) {
+      return false;
+    }
+    float inverseW = 1.0f / clipW;
+    minX = min(minX, clipX * inverseW);
+    maxX = max(maxX, clipX * inverseW);
+    minY = min(minY, clipY * inverseW);
+    maxY = max(maxY, clipY * inverseW);
+    nearest = min(nearest, clipZ * inverseW);
+  }
+
+  // Normalized device y points up, texel rows go down
+  uint width = hiz.width;
+  uint height = hiz.height;
+  uint left = hizTexel(fma(minX, 0.5f, 0.5f) * float(width), width);
+  uint right = hizTexel(fma(maxX, 0.5f, 0.5f) * float(width), width);
+  uint top = hizTexel(fma(-maxY, 0.5f, 0.5f) * float(height), height);
+  uint bottom = hizTexel(fma(-minY, 0.5f, 0.5f) * float(height), height);
+
+  // The first mip where the rectangle spans at most 2x2 texels
+  uint level = 0;
+  for (; level + 1 < hiz.mipCount; level++) {
+    uint columns =
+        hizMipTexel(right, level, width) - hizMipTexel(left, level, width);
+    uint rows =
+        hizMipTexel(bottom, level, height) - hizMipTexel(top, level, height);
+    if (columns <= 1 && rows <= 1) {
+      break;
+    }
+  }
+
+  float farthest = 0.0f;
+  for (uint y = hizMipTexel(top, level, height);
+       y <= hizMipTexel(bottom, level, height); y++) {
+    for (uint x = hizMipTexel(left, level, width);
+         x <= hizMipTexel(right, level, width); x++) {
+      farthest = max(farthest, pyramid.read(uint2(x, y), level).r);
+    }
+  }
+  return nearest > farthest;
+}
+
+// Frustum culling and LOD selection for every instance of a mesh, one
+// thread per instance. Visible instances append their model matrix to their
+// LOD's instance list and bump the instance count of its indirect draw, so
+// the CPU never needs to know how many survived.
+//
+// With Hi-Z occlusion culling this is the early pass: instances hidden
+// behind last frame's pyramid are marked CullVisibilityOccluded instead,
+// for cullOccludedInstances to look at again.
+//
+// cullObject in gpu_culling.cpp is the CPU reference of this kernel, and
+// cullObjectsEarlyReference in hiz_culling.cpp with the occlusion test, keep
+// them in step. The explicit fma calls pin down the rounding, so both
+// give the same answer for the same inputs.
+kernel void cullInstances(
+    uint objectIndex [[thread_position_in_grid]],
+    constant CullUniforms &uniforms [[buffer(0)]],
+    device const CullObject *objects [[buffer(1)]],
+    // The IndirectDrawArguments array, as words so instanceCount (word 1 of
+    // each entry) can be incremented atomically
+    device atomic_uint *drawArguments [[buffer(2)]],
+    device float4x4 *instances [[buffer(3)]],
+    device uint *visibility [[buffer(4)]],
+    // Last frame's
+    constant HiZUniforms &hiz [[buffer(5)]],
+    texture2d<float, access::read> pyramid [[texture(0)]]) {
+  if (objectIndex >= uniforms.objectCount) {
+    return;
+  }
+  device const CullObject &object = objects[objectIndex];
+  float x = object.center[0];
+  float y = object.center[1];
+  float z = object.center[2];
+
+  uint result = 0;
+  bool inside = true;
+  for (int i = 0; i < 6; i++) {
+    float distance =
+        fma(uniforms.planes[i][0], x,
+            fma(uniforms.planes[i][1], y,
+                fma(uniforms.planes[i][2], z, uniforms.planes[i][3])));
+    if (distance < -object.radius) {
+      inside = false;
+      break;
+    }
+  }
+  if (inside) {
+    float dx = x - uniforms.cameraPosition[0];
+    float dy = y - uniforms.cameraPosition[1];
+    float dz = z - uniforms.cameraPosition[2];
+    float distanceSquared = fma(dx, dx, fma(dy, dy, dz * dz));
+    for (uint lod = 0; lod < uniforms.lodCount; lod++) {
+      if (distanceSquared < uniforms.lodDistanceSquared[lod]) {
+        result = lod + 1;
+        break;
+      }
+    }
+  }
+  if (result != 0 && hizOccluded(hiz, pyramid, object)) {
+    visibility[objectIndex] = result | CullVisibilityOccluded;
+    return;
+  }
+  visibility[objectIndex] = result;
+  if (result == 0) {
+    return;
+  }
+  appendInstance(uniforms, object, result - 1, drawArguments, instances);
+}
+
+// Hi-Z occlusion culling's late pass, once the pyramid has been rebuilt from
+// the early pass's draws. Instances the early pass marked occluded are tested
+// against it again, and the ones now in view are appended to the late pass's
+// own instance lists and indirect draws.
+kernel void cullOccludedInstances(
+    uint objectIndex [[thread_position_in_grid]],
+    constant CullUniforms &uniforms [[buffer(0)]],
+    device const CullObject *objects [[buffer(1)]],
+    device atomic_uint *drawArguments [[buffer(2)]],
+    device float4x4 *instances [[buffer(3)]],
+    device uint *visibility [[buffer(4)]],
+    // This frame's
+    constant HiZUniforms &hiz [[buffer(5)]],
+    texture2d<float, access::read> pyramid [[texture(0)]]) {
+  if (objectIndex >= uniforms.objectCount) {
+    return;
+  }
+  uint state = visibility[objectIndex];
+  device const CullObject &object = objects[objectIndex];
+  if ((state & CullVisibilityOccluded) == 0 ||
+      hizOccluded(hiz, pyramid, object)) {
+    return;
+  }
+  uint result = state & ~uint(CullVisibilityOccluded);
+  visibility[objectIndex] = result;
+  appendInstance(uniforms, object, result - 1, drawArguments, instances);
+}
+
+// Mip 0 of the Hi-Z pyramid, a copy of the resolved depth buffer
+kernel void copyDepthToHiZ(uint2 position [[thread_position_in_grid]],
+                           depth2d<float, access::read> depth [[texture(0)]],
+                           texture2d<float, access::write> hiz [[texture(1)]]) {
+  if (position.x >= hiz.get_width() || position.y >= hiz.get_height()) {
+    return;
+  }
+  hiz.write(float4(depth.read(position)), position);
+}
+
+// One mip of the Hi-Z pyramid from the one above it. Every texel keeps the
+// farthest of its 2x2 source texels, and the last row and column take in
+// the extra source texel left over by an odd size. downsampleHiZ in
+// hiz_culling.cpp is the CPU reference.
+kernel void downsampleHiZ(uint2 position [[thread_position_in_grid]],
+                          texture2d<float, access::read> source [[texture(0)]],
+                          texture2d<float, access::write> destination
+                          [[texture(1)]]) {
+  uint width = destination.get_width();
+  uint height = destination.get_height();
+  if (position.x >= width || position.y >= height) {
+    return;
+  }
+  uint lastX =
+      position.x == width - 1 ? source.get_width() - 1 : 2 * position.x + 1;
+  uint lastY =
+      position.y == height - 1 ? source.get_height() - 1 : 2 * position.y + 1;
+  float farthest = 0.0f;
+  for (uint y = 2 * position.y; y <= lastY; y++) {
+    for (uint x = 2 * position.x; x <= lastX; x++) {
+      farthest = max(farthest, source.read(uint2(x, y)).r);
+    }
+  }
+  destination.write(float4(farthest), position);
+}
@@ -0,0 +1,220 @@
+#include <metal_stdlib>
+using namespace metal;
+#include <simd/simd.h>
+
+#include "cluster_data.hpp"
+#include "shader_features.hpp"
+#include "shadow_data.hpp"
+#include "vertex_data.hpp"
+
+// One source for every lit forward draw. Rather than a copy of this file per
+// material, features are switched on and off with function constants, which
+// are set when the pipeline is created (see ShaderPermutationManager). Code
+// behind a false constant is removed by the compiler, so each permutation is
+// as fast as a hand written shader.
+constant bool hasTexture [[function_constant(FunctionConstantTextured)]];
+constant bool hasVertexColor [[function_constant(FunctionConstantVertexColor)]];
+constant bool hasSpecular [[function_constant(FunctionConstantSpecular)]];
+constant bool useInstancing [[function_constant(FunctionConstantInstancing)]];
+constant bool hasShadows [[function_constant(FunctionConstantShadows)]];
+
+// This is a new struct we are defining to hold the output of our data from the
+// vertex shader.
+// The position attribute is defined with two square brackets, indicating to
+// Metal that we should apply perspective-division to it.
+struct VertexOut {
+  // Invariant, as the depth pre-pass must compute exactly the same depths
+  float4 position [[position, invariant]];
+  // Since this member does not have a special attribute, the rasterizer
+  // interpolates its value with the values of the other triangle vertices
+  // and then passes the interpolated value to the fragment shader for each
+  // fragment in the triangle.
+  float2 textureCoordinate;
+  float3 normal;
+  float4 fragmentPosition; // Position in worldspace
+  // Only exists in permutations with per-vertex colours
+  float4 color [[function_constant(hasVertexColor)]];
+};
+
+// Shared by both vertex shaders, so the main pass's equal depth test passes
+// wherever the pre-pass wrote. Together with [[invariant]] (and
+// -fpreserve-invariance) this stops the compiler from evaluating it
+// differently in each.
+static float4 clipPosition(constant TransformationData *transformationData,
+                           float4 worldPosition) {
+  return transformationData->perspectiveMatrix *
+         transformationData->viewMatrix * worldPosition;
+}
+
+vertex VertexOut forwardVertexShader(
+    uint vertexID [[vertex_id]], uint instanceID [[instance_id]],
+    constant VertexData *vertexData [[buffer(0)]],
+    constant TransformationData *transformationData [[buffer(1)]],
+    constant float4x4 *instanceModelMatrices
+    [[buffer(2), function_constant(useInstancing)]],
+    constant float4 *vertexColors
+    [[buffer(3), function_constant(hasVertexColor)]]) {
+  VertexOut out;
+  // With instancing each instance brings its own model matrix, otherwise the
+  // one in transformationData is used for the whole draw
+  float4x4 modelMatrix = transformationData->modelMatrix;
+  if (useInstancing) {
+    modelMatrix = instanceModelMatrices[instanceID];
+  }
+  float4 worldPosition = modelMatrix * vertexData[vertexID].position;
+  out.position = clipPosition(transformationData, worldPosition);
+  out.textureCoordinate = vertexData[vertexID].textureCoordinate;
+  out.normal = (modelMatrix * float4(vertexData[vertexID].normal.xyz, 0.0)).xyz;
+  out.fragmentPosition = worldPosition;
+  if (hasVertexColor) {
+    out.color = vertexColors[vertexID];
+  }
+  return out;
+};
+
+struct DepthPrepassVertexOut {
+  float4 position [[position, invariant]];
+};
+
+// Depth pre-pass of instanced lit draws: only the position stream is read
+// (see position_stream.hpp) and there is no fragment function
+vertex DepthPrepassVertexOut depthPrepassVertexShader(
+    uint vertexID [[vertex_id]], uint instanceID [[instance_id]],
+    device const packed_float3 *positions [[buffer(0)]],
+    constant TransformationData *transformationData [[buffer(1)]],
+    constant float4x4 *instanceModelMatrices [[buffer(2)]]) {
+  DepthPrepassVertexOut out;
+  float4 worldPosition =
+      instanceModelMatrices[instanceID] * float4(positions[vertexID], 1.0);
+  out.position = clipPosition(transformationData, worldPosition);
+  return out;
+}
+
+// Fraction of the shadowed light reaching a fragment, see shadow_cascades.hpp
+static float shadowFactor(constant ShadowUniforms &shadows,
+                          depth2d_array<float> shadowMap, float3 position,
+                          float3 normal, float viewDepth) {
+  uint cascade = 0;
+  while (cascade < shadows.cascadeCount &&
+         viewDepth > shadows.cascadeFarDepth[cascade]) {
+    cascade++;
+  }
+  if (cascade == shadows.cascadeCount) {
+    return 1.0;
+  }
+  constant float *m = shadows.cascadeViewProjection[cascade];
+  float4x4 viewProjection(float4(m[0], m[1], m[2], m[3]),
+                          float4(m[4], m[5], m[6], m[7]),
+                          float4(m[8], m[9], m[10], m[11]),
+                          float4(m[12], m[13], m[14], m[15]));
+  // Pushed off the surface by about a texel, so the surface doesn't shadow
+  // itself where it's at an angle to the shadow map
+  float3 offsetPosition =
+      position + normal * shadows.cascadeTexelSize[cascade] * 1.5;
+  float4 shadowPosition = viewProjection * float4(offsetPosition, 1.0);
+  float2 uv = shadowPosition.xy * float2(0.5, -0.5) + 0.5;
+  float depth = shadowPosition.z - shadows.depthBias;
+
+  // Percentage closer filtering: every tap is a bilinear 2x2 comparison,
+  // so 3x3 taps average over a 4x4 texel footprint
+  constexpr sampler shadowSampler(coord::normalized, filter::linear,
+                                  address::clamp_to_edge,
+                                  compare_func::less_equal);
+  float lit = 0.0;
+  for (int y = -1; y <= 1; y++) {
+    for (int x = -1; x <= 1; x++) {
+      lit += shadowMap.sample_compare(shadowSampler, uv, cascade, depth,
+                                      int2(x, y));
+    }
+  }
+  return lit / 9.0;
+}
+
+// Lights come from the fragment's cluster, see cluster_lighting.hpp
+fragment float4 forwardFragmentShader(
+    VertexOut in [[stage_in]],
+    texture2d<float> colorTexture
+    [[texture(0), function_constant(hasTexture)]],
+    constant ClusterUniforms &clusters [[buffer(0)]],
+    device const PointLight *lights [[buffer(1)]],
+    constant float4 &cameraPosition [[buffer(2)]],
+    constant float4 &materialColor [[buffer(3)]],
+    device const ClusterRange *clusterRanges [[buffer(4)]],
+    device const uint *lightIndices [[buffer(5)]],
+    constant ShadowUniforms &shadows
+    [[buffer(6), function_constant(hasShadows)]],
+    depth2d_array<float> shadowMap
+    [[texture(1), function_constant(hasShadows)]]) {
+
+  float4 baseColor = materialColor;
+  if (hasTexture) {
+    // Textures may be streamed, so sample across whichever mips are resident
+    constexpr sampler textureSampler(mag_filter::linear, min_filter::linear,
+                                     mip_filter::linear);
+    baseColor *= colorTexture.sample(textureSampler, in.textureCoordinate);
+  }
+  if (hasVertexColor) {
+    baseColor *= in.color;
+  }
+
+  // Find the cluster: the screen tile from the pixel position, the slice
+  // from the view depth
+  float4 viewDepthRow =
+      float4(clusters.viewDepthRow[0], clusters.viewDepthRow[1],
+             clusters.viewDepthRow[2], clusters.viewDepthRow[3]);
+  float viewDepth = -dot(viewDepthRow, in.fragmentPosition);
+  float slice = floor(log(max(viewDepth, 1e-6)) * clusters.sliceScale +
+                      clusters.sliceBias);
+  uint sliceIndex = uint(clamp(slice, 0.0, float(ClusterSlices - 1)));
+  uint tileX = min(uint(in.position.x / clusters.screenSize[0] * ClusterTilesX),
+                   uint(ClusterTilesX - 1));
+  uint tileY = min(uint(in.position.y / clusters.screenSize[1] * ClusterTilesY),
+                   uint(ClusterTilesY - 1));
+  ClusterRange range =
+      clusterRanges[(sliceIndex * ClusterTilesY + tileY) * ClusterTilesX +
+                    tileX];
+
+  float3 norm = normalize(in.normal.xyz);
+  float3 viewDir = normalize(cameraPosition.xyz - in.fragmentPosition.xyz);
+  float shadow = 1.0;
+  if (hasShadows) {
+    shadow = shadowFactor(shadows, shadowMap, in.fragmentPosition.xyz, norm,
+                          viewDepth);
+  }
+
+  // Ambient
+  float3 lighting = float3(clusters.ambientColor[0], clusters.ambientColor[1],
+                           clusters.ambientColor[2]);
+  for (uint i = 0; i < range.count; i++) {
+    uint lightIndex = lightIndices[range.offset + i];
+    PointLight light = lights[lightIndex];
+    float3 toLight =
+        float3(light.position[0], light.position[1], light.position[2]) -
+        in.fragmentPosition.xyz;
+    float distanceSquared = dot(toLight, toLight);
+    float radiusSquared = light.radius * light.radius;
+    if (distanceSquared >= radiusSquared) {
+      continue;
+    }
+    // Fades smoothly to nothing at the light's radius
+    float falloff = 1.0 - distanceSquared / radiusSquared;
+    float3 lightColor =
+        float3(light.color[0], light.color[1], light.color[2]) * falloff *
+        falloff;
+    if (hasShadows && lightIndex == shadows.shadowedLight) {
+      lightColor *= shadow;
+    }
+    float3 lightDir = toLight * rsqrt(max(distanceSquared, 1e-8));
+
+    // Diffuse
+    lighting += max(dot(norm, lightDir), 0.0) * lightColor;
+    if (hasSpecular) {
+      // For Blinn-Phong, we compute the halfway vector rather than the
+      // reflection vector
+      float3 halfway = normalize(lightDir + viewDir);
+      lighting += pow(max(dot(norm, halfway), 0.0), 32) * lightColor;
+    }
+  }
+
+  return float4(lighting, 1.0) * baseColor;
+};
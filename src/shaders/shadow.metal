@@ -0,0 +1,23 @@
+#include <metal_stdlib>
+using namespace metal;
+#include <simd/simd.h>
+
+#include "vertex_data.hpp"
+
+struct ShadowVertexOut {
+  float4 position [[position]];
+};
+
+// Depth only pass of one shadow cascade (see shadow_cascades.hpp). Casters
+// are drawn instanced, their model matrices in buffer 2, and there is no
+// fragment function: only depth is written.
+vertex ShadowVertexOut shadowVertexShader(
+    uint vertexID [[vertex_id]], uint instanceID [[instance_id]],
+    constant VertexData *vertexData [[buffer(0)]],
+    constant float4x4 &cascadeViewProjection [[buffer(1)]],
+    constant float4x4 *instanceModelMatrices [[buffer(2)]]) {
+  ShadowVertexOut out;
+  out.position = cascadeViewProjection * instanceModelMatrices[instanceID] *
+                 vertexData[vertexID].position;
+  return out;
+}
@@ -0,0 +1,151 @@
+#include "shadow_cascades.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+void computeCascadeSplits(float nearZ, float farZ, uint32_t count,
+                          float lambda, float *farDepths) {
+  for (uint32_t i = 1; i <= count; i++) {
+    float fraction = (float)i / count;
+    float logarithmic = nearZ * std::pow(farZ / nearZ, fraction);
+    float uniform = nearZ + (farZ - nearZ) * fraction;
+    farDepths[i - 1] = lambda * logarithmic + (1.0f - lambda) * uniform;
+  }
+  farDepths[count - 1] = farZ;
+}
+
+Float4x4 makeShadowLightView(Float3 lightDirection) {
+  Float3 direction = normalize(lightDirection);
+  // Any up vector works as long as it isn't parallel to the light
+  Float3 up =
+      std::fabs(direction.y) > 0.99f ? Float3{0, 0, 1} : Float3{0, 1, 0};
+  return makeLookAt({0, 0, 0}, direction, up);
+}
+
+ShadowCascade fitShadowCascade(const ShadowCamera &camera, float nearDepth,
+                               float farDepth, Float3 lightDirection,
+                               uint32_t resolution, float casterDistance) {
+  ShadowCascade cascade;
+  cascade.nearDepth = nearDepth;
+  cascade.farDepth = farDepth;
+
+  // The frustum piece's corners at view depth d are d * (±tanX, ±tanY, -1),
+  // all at the same distance k * d from the view axis. The smallest sphere
+  // through both rings of corners is centred on the axis.
+  float tanY = std::tan(camera.fovyRadians * 0.5f);
+  float tanX = tanY * camera.aspect;
+  float kSquared = tanX * tanX + tanY * tanY;
+  float centerDepth = std::min(
+      (farDepth + nearDepth) * (1.0f + kSquared) * 0.5f, farDepth);
+  float nearOffset = centerDepth - nearDepth;
+  float farOffset = farDepth - centerDepth;
+  float radius = std::sqrt(std::max(nearOffset * nearOffset +
+                                        kSquared * nearDepth * nearDepth,
+                                    farOffset * farOffset +
+                                        kSquared * farDepth * farDepth));
+  // Rounded up so float noise in the above can't change the size
+  radius = std::ceil(radius * 16.0f) / 16.0f;
+  cascade.radius = radius;
+  cascade.texelSize = 2.0f * radius / resolution;
+
+  Float3 center =
+      transformPoint(inverse(camera.view), {0.0f, 0.0f, -centerDepth});
+
+  // Snap the centre, in the light's view, to whole texels
+  cascade.view = makeShadowLightView(lightDirection);
+  Float3 lightCenter = transformPoint(cascade.view, center);
+  lightCenter.x = std::floor(lightCenter.x / cascade.texelSize) *
+                  cascade.texelSize;
+  lightCenter.y = std::floor(lightCenter.y / cascade.texelSize) *
+                  cascade.texelSize;
+
+  // The light looks down -z, depth is -z
+  cascade.projection = makeOrthographicRightHand(
+      lightCenter.x - radius, lightCenter.x + radius, lightCenter.y - radius,
+      lightCenter.y + radius, -lightCenter.z - radius - casterDistance,
+      -lightCenter.z + radius);
+  cascade.viewProjection = mul(cascade.projection, cascade.view);
+  cascade.frustum = makeFrustum(cascade.viewProjection);
+  return cascade;
+}
+
+uint32_t fitShadowCascades(const ShadowCamera &camera, Float3 lightDirection,
+                           float splitLambda, float casterDistance,
+                           ShadowCascade *cascades) {
+  float farDepths[ShadowCascadeCount];
+  computeCascadeSplits(camera.nearZ, camera.farZ, ShadowCascadeCount,
+                       splitLambda, farDepths);
+  float nearDepth = camera.nearZ;
+  for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+    cascades[i] =
+        fitShadowCascade(camera, nearDepth, farDepths[i], lightDirection,
+                         ShadowMapResolution, casterDistance);
+    nearDepth = farDepths[i];
+  }
+  return ShadowCascadeCount;
+}
+
+bool shadowCasterVisible(const ShadowCascade &cascade, Float3 center,
+                         float radius) {
+  // Plane 4 is the near plane, towards the light
+  for (int i = 0; i < 6; i++) {
+    const Plane &plane = cascade.frustum.planes[i];
+    if (i != 4 && dot(plane.normal, center) + plane.d < -radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint32_t cullShadowCasters(const ShadowCascade &cascade,
+                           const CullObject *objects, uint32_t objectCount,
+                           Float4x4 *instances, uint32_t capacity) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < objectCount && count < capacity; i++) {
+    const CullObject &object = objects[i];
+    Float3 center = {object.center[0], object.center[1], object.center[2]};
+    if (shadowCasterVisible(cascade, center, object.radius)) {
+      memcpy(&instances[count++], object.model, sizeof(Float4x4));
+    }
+  }
+  return count;
+}
+
+ShadowUniforms makeShadowUniforms(const ShadowCascade *cascades,
+                                  uint32_t cascadeCount,
+                                  uint32_t shadowedLight, float depthBias) {
+  ShadowUniforms uniforms = {};
+  uniforms.cascadeCount = std::min<uint32_t>(cascadeCount, ShadowCascadeCount);
+  for (uint32_t i = 0; i < uniforms.cascadeCount; i++) {
+    memcpy(uniforms.cascadeViewProjection[i], &cascades[i].viewProjection,
+           sizeof(uniforms.cascadeViewProjection[i]));
+    uniforms.cascadeFarDepth[i] = cascades[i].farDepth;
+    uniforms.cascadeTexelSize[i] = cascades[i].texelSize;
+  }
+  uniforms.shadowedLight = shadowedLight;
+  uniforms.depthBias = depthBias;
+  return uniforms;
+}
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+ShadowFrameLayout makeShadowFrameLayout(uint32_t casterCapacity) {
+  // Metal wants 256 byte aligned offsets for constant buffers
+  constexpr size_t alignment = 256;
+  ShadowFrameLayout layout;
+  layout.uniformsOffset = 0;
+  size_t offset = alignUp(sizeof(ShadowUniforms), alignment);
+  for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+    layout.cascadeOffsets[i] = offset;
+    offset = alignUp(offset + sizeof(Float4x4), alignment);
+  }
+  layout.instancesOffset = offset;
+  layout.size = alignUp(layout.instancesOffset +
+                            (size_t)ShadowCascadeCount * casterCapacity *
+                                sizeof(Float4x4),
+                        alignment);
+  return layout;
+}
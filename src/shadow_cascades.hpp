@@ -0,0 +1,95 @@
+#pragma once
+// Cascaded shadow maps: cascade splits, fitting and caster culling.
+//
+// The camera's view depth range is split into ShadowCascadeCount ranges,
+// near ones short and far ones long, and each gets its own slice of the
+// shadow map rendered with an orthographic projection along the light. Near
+// the camera a texel then covers little of the world, far away a lot, which
+// roughly matches how much of the screen it ends up covering.
+//
+// Cascades are fitted to be stable. Each covers the bounding sphere of its
+// piece of the view frustum, whose radius depends only on the field of view
+// and split depths, so rotating the camera never changes the cascade's size.
+// The light's view has no translation, and the sphere's centre is snapped to
+// whole shadow map texels in it, so moving the camera only ever shifts a
+// cascade by whole texels. Either way the shadow map samples the world at
+// the same points from frame to frame, and shadow edges don't shimmer.
+//
+// Casters are culled per cascade against its box, without the near plane:
+// something between the light and the box still casts into it.
+#include "culling_data.hpp"
+#include "engine_math.hpp"
+#include "shadow_data.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+struct ShadowCamera {
+  Float4x4 view;
+  float fovyRadians = 1.0f;
+  float aspect = 1.0f;
+  float nearZ = 0.1f;
+  float farZ = 100.0f;
+};
+
+// Far view depth of each of `count` cascades, the last one at farZ.
+// `lambda` blends between uniform (0) and logarithmic (1) spacing.
+void computeCascadeSplits(float nearZ, float farZ, uint32_t count,
+                          float lambda, float *farDepths);
+
+struct ShadowCascade {
+  Float4x4 view;
+  Float4x4 projection;
+  Float4x4 viewProjection;
+  // Box of the cascade, for caster culling
+  Frustum frustum;
+  // View depth range covered
+  float nearDepth = 0.0f;
+  float farDepth = 0.0f;
+  // Of the bounding sphere, which is half the width of the box
+  float radius = 0.0f;
+  // World size of one shadow map texel
+  float texelSize = 0.0f;
+};
+
+// Rotation only view of a light shining along `lightDirection`
+Float4x4 makeShadowLightView(Float3 lightDirection);
+
+// Fits one cascade to the camera's view depths [nearDepth, farDepth].
+// Casters up to `casterDistance` towards the light from the box still fall
+// within its depth range.
+ShadowCascade fitShadowCascade(const ShadowCamera &camera, float nearDepth,
+                               float farDepth, Float3 lightDirection,
+                               uint32_t resolution, float casterDistance);
+
+// Fits every cascade, returning how many there are
+uint32_t fitShadowCascades(const ShadowCamera &camera, Float3 lightDirection,
+                           float splitLambda, float casterDistance,
+                           ShadowCascade *cascades);
+
+bool shadowCasterVisible(const ShadowCascade &cascade, Float3 center,
+                         float radius);
+
+// Copies the model matrices of the objects casting into the cascade to
+// `instances`, at most `capacity`. Returns how many were written.
+uint32_t cullShadowCasters(const ShadowCascade &cascade,
+                           const CullObject *objects, uint32_t objectCount,
+                           Float4x4 *instances, uint32_t capacity);
+
+ShadowUniforms makeShadowUniforms(const ShadowCascade *cascades,
+                                  uint32_t cascadeCount,
+                                  uint32_t shadowedLight, float depthBias);
+
+// Offsets of one frame's shadow data inside a buffer, each aligned for
+// binding as a Metal buffer
+struct ShadowFrameLayout {
+  size_t uniformsOffset;
+  // View-projection of each cascade on its own, for the depth pass
+  size_t cascadeOffsets[ShadowCascadeCount];
+  // Caster model matrices of cascade c start at instancesOffset +
+  // c * casterCapacity matrices
+  size_t instancesOffset;
+  size_t size;
+};
+
+ShadowFrameLayout makeShadowFrameLayout(uint32_t casterCapacity);
@@ -0,0 +1,32 @@
+#pragma once
+// Buffer layouts of cascaded shadow maps (see shadow_cascades.hpp).
+//
+// Included by both the engine and the Metal shaders, so like
+// culling_data.hpp this must stay plain enough for both compilers: only
+// scalar members, so the layout is the same on either side without simd.
+#ifndef __METAL_VERSION__
+#include <cstdint>
+#endif
+
+enum ShadowLimits {
+  ShadowCascadeCount = 4,
+  // Width and height of every cascade's slice of the shadow map
+  ShadowMapResolution = 2048,
+};
+
+struct ShadowUniforms {
+  // World to shadow clip space of each cascade, column major
+  float cascadeViewProjection[ShadowCascadeCount][16];
+  // A fragment uses the first cascade whose far view depth it is nearer
+  // than, and is unshadowed past the last one
+  float cascadeFarDepth[ShadowCascadeCount];
+  // World size of one shadow map texel in each cascade. Receivers are moved
+  // this far along their normal before the lookup to stop shadow acne.
+  float cascadeTexelSize[ShadowCascadeCount];
+  uint32_t cascadeCount;
+  // Index, in the cluster lights, of the light casting the shadow
+  uint32_t shadowedLight;
+  // Subtracted from the receiver's shadow map depth
+  float depthBias;
+  float padding;
+};
@@ -0,0 +1,80 @@
+// streaming_sim: TextureStreamer along a simulated camera path, headlessly.
+//
+//   streaming_sim [--planets n] [--steps n] [--budget-mb mb] [--cap-mb mb]
+//
+// Flies the camera of StreamingSimulation down its row of planets in
+// `steps` updates and prints, every few steps and at the end, how many
+// bytes are resident against the budget and against what the view wants,
+// and how many textures were promoted and demoted. Exits with 1 if the
+// resident bytes ever went over the budget.
+#include "streaming_simulation.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+static void printUsage() {
+  std::cerr << "Usage: streaming_sim [--planets n] [--steps n] "
+               "[--budget-mb mb] [--cap-mb mb]"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  uint32_t planetCount = 16;
+  uint32_t steps = 2000;
+  StreamingConfig config;
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (argument == "--planets" && hasValue) {
+      planetCount = std::max(1, atoi(argv[++i]));
+    } else if (argument == "--steps" && hasValue) {
+      steps = std::max(1, atoi(argv[++i]));
+    } else if (argument == "--budget-mb" && hasValue) {
+      config.memoryBudget = (size_t)(atof(argv[++i]) * 1024 * 1024);
+    } else if (argument == "--cap-mb" && hasValue) {
+      config.maxPromotionBytesPerUpdate =
+          (size_t)(atof(argv[++i]) * 1024 * 1024);
+    } else {
+      printUsage();
+      return 1;
+    }
+  }
+
+  StreamingSimulation simulation(config, planetCount);
+  const double megabyte = 1024.0 * 1024.0;
+  std::printf("%u planets, %.1f MB at full residency, budget %.1f MB\n",
+              planetCount, simulation.fullResidencyBytes() / megabyte,
+              config.memoryBudget / megabyte);
+  std::printf("%6s %10s %10s %6s %6s %8s\n", "step", "resident", "wanted",
+              "promo", "demo", "desired");
+
+  uint64_t promotions = 0, demotions = 0;
+  size_t peakResident = 0;
+  bool overBudget = false;
+  uint32_t reportInterval = std::max(1u, steps / 20);
+  for (uint32_t i = 0; i <= steps; i++) {
+    simulation.step((float)i / steps);
+    const StreamingStats &stats = simulation.streamer().stats();
+    promotions += stats.promotions;
+    demotions += stats.demotions;
+    peakResident = std::max(peakResident, stats.residentBytes);
+    overBudget |= stats.residentBytes > config.memoryBudget;
+    if (i % reportInterval == 0 || i == steps) {
+      std::printf("%6u %8.1fMB %8.1fMB %6u %6u %5u/%-3u\n", i,
+                  stats.residentBytes / megabyte, stats.wantedBytes / megabyte,
+                  stats.promotions, stats.demotions,
+                  stats.texturesAtDesiredMip, planetCount);
+    }
+  }
+  std::printf("%llu promotions, %llu demotions, peak %.1f MB resident\n",
+              (unsigned long long)promotions, (unsigned long long)demotions,
+              peakResident / megabyte);
+  if (overBudget) {
+    std::cerr << "streaming_sim: went over the budget" << std::endl;
+    return 1;
+  }
+  return 0;
+}
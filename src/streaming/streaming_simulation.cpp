@@ -0,0 +1,69 @@
+#include "streaming_simulation.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+StreamingSimulation::StreamingSimulation(const StreamingConfig &config,
+                                         uint32_t planetCount, uint64_t seed)
+    : textureStreamer(config) {
+  // xorshift64*, so the scene is the same with every standard library
+  uint64_t state = seed ? seed : 1;
+  auto next = [&state] {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+  };
+  for (uint32_t i = 0; i < planetCount; i++) {
+    SimulatedPlanet planet;
+    planet.textureSize = 256u << (next() % 5);
+    planet.radius = 1.0f + (next() % 1000) * 0.002f;
+    // Alternating sides of the path, so the camera has to turn to them
+    float side = i % 2 == 0 ? -4.5f : 4.5f;
+    planet.center = {side, 0.0f, -planetSpacing * (i + 1)};
+    planet.textureId = textureStreamer.registerTexture(
+        planet.textureSize, planet.textureSize, 4);
+    textureStreamer.setBounds(planet.textureId, planet.center, planet.radius);
+    planetList.push_back(planet);
+  }
+}
+
+StreamingView StreamingSimulation::viewAt(float t) const {
+  t = std::clamp(t, 0.0f, 1.0f);
+  // Eases in and out of a stop beside every planet: the camera lingers next
+  // to each one before moving on, and ends the path next to the last
+  float segments = (float)planetList.size();
+  float segment = std::min(std::floor(t * segments), segments - 1.0f);
+  float within = t * segments - segment;
+  float eased = within * within * (3.0f - 2.0f * within);
+  float z = -(segment + eased) * planetSpacing;
+
+  StreamingView view;
+  view.cameraPosition = {0.0f, 0.5f, z};
+  view.cameraForward = {0.0f, 0.0f, -1.0f};
+  // Turns towards the planet it's closest to, once close
+  for (const SimulatedPlanet &planet : planetList) {
+    Float3 toPlanet = planet.center - view.cameraPosition;
+    if (length(toPlanet) < planetSpacing * 0.5f) {
+      view.cameraForward = normalize(toPlanet);
+      break;
+    }
+  }
+  // A 45 degree lens on a 4K screen, which close up wants whole 4096² mips
+  view.fovY = 0.785f;
+  view.viewportHeight = 2160.0f;
+  return view;
+}
+
+const std::vector<StreamingChange> &StreamingSimulation::step(float t) {
+  return textureStreamer.update(viewAt(t));
+}
+
+size_t StreamingSimulation::fullResidencyBytes() const {
+  size_t bytes = 0;
+  for (const SimulatedPlanet &planet : planetList) {
+    bytes += TextureStreamer::bytesForMips(planet.textureSize,
+                                           planet.textureSize, 4, 0);
+  }
+  return bytes;
+}
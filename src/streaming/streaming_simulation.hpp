@@ -0,0 +1,45 @@
+#pragma once
+// TextureStreamer driven headlessly by a simulated camera.
+//
+// A row of planets, each with a texture of its own (from 256² to 4096²),
+// hangs along the -z axis. The camera flies down the row, slowing to a stop
+// next to every few planets and turning to look at them, the way the engine's
+// camera would approach the mars sphere. Each step places the camera at its
+// point of the path and runs one streamer update, which is what the engine
+// does once a frame. streaming_sim prints what the streamer did along the
+// way, the tests check it.
+#include "texture_streaming.hpp"
+
+#include <cstdint>
+#include <vector>
+
+struct SimulatedPlanet {
+  uint32_t textureId = 0;
+  Float3 center;
+  float radius = 1.0f;
+  uint32_t textureSize = 0;
+};
+
+class StreamingSimulation {
+public:
+  // `planetCount` planets, their sizes and textures picked from `seed`
+  StreamingSimulation(const StreamingConfig &config, uint32_t planetCount,
+                      uint64_t seed = 1);
+
+  // The camera at `t` of the path, 0 at its start and 1 at its end
+  StreamingView viewAt(float t) const;
+  // Moves the camera to `t` and updates the streamer
+  const std::vector<StreamingChange> &step(float t);
+
+  TextureStreamer &streamer() { return textureStreamer; }
+  const TextureStreamer &streamer() const { return textureStreamer; }
+  const std::vector<SimulatedPlanet> &planets() const { return planetList; }
+  // Bytes of every texture at its full chain
+  size_t fullResidencyBytes() const;
+
+  static constexpr float planetSpacing = 12.0f;
+
+private:
+  TextureStreamer textureStreamer;
+  std::vector<SimulatedPlanet> planetList;
+};
@@ -0,0 +1,133 @@
+#include "testing.hpp"
+
+#include "attachment_pool.hpp"
+
+#include <set>
+
+// Stands in for the Metal device: handles are just numbers, and every live
+// one is tracked so leaks and double destroys show up
+struct FakeTextures {
+  uintptr_t nextHandle = 1;
+  std::set<AttachmentPool::Handle> live;
+  uint32_t doubleDestroys = 0;
+
+  AttachmentPool pool(uint32_t maxIdleFrames = 8,
+                      uint32_t maxIdleAttachments = 8) {
+    return AttachmentPool(
+        [this](const AttachmentKey &) {
+          AttachmentPool::Handle handle = (AttachmentPool::Handle)nextHandle++;
+          live.insert(handle);
+          return handle;
+        },
+        [this](AttachmentPool::Handle handle) {
+          if (live.erase(handle) == 0) {
+            doubleDestroys++;
+          }
+        },
+        maxIdleFrames, maxIdleAttachments);
+  }
+};
+
+static AttachmentKey msaaKey(uint32_t width, uint32_t height) {
+  AttachmentKey key;
+  key.width = width;
+  key.height = height;
+  key.pixelFormat = 80; // BGRA8Unorm
+  key.sampleCount = 4;
+  key.usage = 4; // RenderTarget
+  key.storageMode = 3; // Memoryless
+  return key;
+}
+
+ENGINE_TEST("attachments/reuse_matching_key") {
+  FakeTextures textures;
+  {
+    AttachmentPool pool = textures.pool();
+    AttachmentPool::Handle first = pool.acquire(msaaKey(800, 600));
+    pool.release(first);
+    pool.endFrame();
+    CHECK(pool.acquire(msaaKey(800, 600)) == first);
+    CHECK(pool.stats().created == 1 && pool.stats().reused == 1);
+
+    // Any difference in the key is a different texture
+    AttachmentKey depth = msaaKey(800, 600);
+    depth.pixelFormat = 252; // Depth32Float
+    AttachmentPool::Handle other = pool.acquire(depth);
+    CHECK(other != first);
+    CHECK(pool.stats().created == 2 && pool.stats().inUse == 2);
+  }
+  // The pool destroys what it still holds, in use or not
+  CHECK(textures.live.empty());
+  CHECK(textures.doubleDestroys == 0);
+}
+
+// A window going back and forth between two sizes keeps both textures
+ENGINE_TEST("attachments/resize_back_and_forth") {
+  FakeTextures textures;
+  AttachmentPool pool = textures.pool();
+  AttachmentPool::Handle current = pool.acquire(msaaKey(800, 600));
+  for (int frame = 0; frame < 20; frame++) {
+    pool.release(current);
+    current = pool.acquire(frame % 2 ? msaaKey(800, 600) : msaaKey(1024, 768));
+    pool.endFrame();
+  }
+  CHECK(pool.stats().created == 2);
+  CHECK(pool.stats().reused == 19);
+  CHECK(pool.stats().destroyed == 0);
+}
+
+ENGINE_TEST("attachments/idle_ages_out") {
+  FakeTextures textures;
+  AttachmentPool pool = textures.pool(3);
+  AttachmentPool::Handle handle = pool.acquire(msaaKey(640, 480));
+  pool.release(handle);
+  for (int frame = 0; frame < 3; frame++) {
+    pool.endFrame();
+  }
+  CHECK(textures.live.size() == 1);
+  pool.endFrame();
+  CHECK(textures.live.empty());
+  CHECK(pool.stats().destroyed == 1 && pool.stats().idle == 0);
+  CHECK(pool.acquire(msaaKey(640, 480)) != handle);
+}
+
+ENGINE_TEST("attachments/idle_set_bounded") {
+  FakeTextures textures;
+  AttachmentPool pool = textures.pool(8, 2);
+  std::vector<AttachmentPool::Handle> handles;
+  for (uint32_t i = 0; i < 5; i++) {
+    handles.push_back(pool.acquire(msaaKey(100 + i, 100)));
+  }
+  for (AttachmentPool::Handle handle : handles) {
+    pool.release(handle);
+    pool.endFrame();
+  }
+  CHECK(pool.stats().idle == 2);
+  CHECK(textures.live.size() == 2);
+  // The two released last are the ones kept
+  CHECK(textures.live.count(handles[3]) == 1);
+  CHECK(textures.live.count(handles[4]) == 1);
+  pool.trim();
+  CHECK(textures.live.empty());
+  CHECK(textures.doubleDestroys == 0);
+}
+
+// A drag produces a resize event per frame, only the settled size comes out
+ENGINE_TEST("attachments/resize_debounce") {
+  ResizeDebouncer debouncer(0.1);
+  int width = 0, height = 0;
+  CHECK(!debouncer.poll(0.0, width, height));
+  double last = 0.0;
+  for (int i = 0; i < 30; i++) {
+    last = i / 60.0;
+    debouncer.request(800 + i * 10, 600 + i * 5, last);
+    CHECK(!debouncer.poll(last, width, height));
+  }
+  CHECK(debouncer.pending());
+  CHECK(!debouncer.poll(last + 0.09, width, height));
+  CHECK(debouncer.poll(last + 0.11, width, height));
+  CHECK(width == 800 + 29 * 10 && height == 600 + 29 * 5);
+  // Reported once
+  CHECK(!debouncer.pending());
+  CHECK(!debouncer.poll(last + 1.0, width, height));
+}
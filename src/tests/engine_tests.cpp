@@ -0,0 +1,71 @@
+// engine_tests: behaviour checks of engine_core, runnable anywhere it builds.
+//
+//   engine_tests [filter] [--list]
+//
+// Runs every registered test whose name contains `filter`, all of them
+// without one, and exits with 1 if any check failed.
+#include "testing.hpp"
+
+#include <iostream>
+
+static std::string currentTest;
+static uint32_t currentFailures = 0;
+
+std::vector<TestCase> &registeredTests() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+void reportFailure(const char *file, int line, const std::string &message) {
+  std::cerr << file << ":" << line << ": " << currentTest
+            << ": check failed: " << message << std::endl;
+  currentFailures++;
+}
+
+int main(int argc, char **argv) {
+  std::string filter;
+  bool list = false;
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    if (argument == "--list") {
+      list = true;
+    } else if (argument[0] != '-' && filter.empty()) {
+      filter = argument;
+    } else {
+      std::cerr << "Usage: engine_tests [filter] [--list]" << std::endl;
+      return 1;
+    }
+  }
+
+  uint32_t run = 0;
+  uint32_t failed = 0;
+  for (const TestCase &test : registeredTests()) {
+    if (!filter.empty() && test.name.find(filter) == std::string::npos) {
+      continue;
+    }
+    if (list) {
+      std::cout << test.name << std::endl;
+      continue;
+    }
+    currentTest = test.name;
+    currentFailures = 0;
+    test.run();
+    run++;
+    if (currentFailures > 0) {
+      failed++;
+      std::cout << "FAIL " << test.name << std::endl;
+    } else {
+      std::cout << "ok   " << test.name << std::endl;
+    }
+  }
+  if (list) {
+    return 0;
+  }
+  if (run == 0) {
+    std::cerr << "engine_tests: no test matches \"" << filter << "\""
+              << std::endl;
+    return 1;
+  }
+  std::cout << run - failed << " of " << run << " tests passed" << std::endl;
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include "testing.hpp"
+
+#include "frame_readback.hpp"
+#include "image_decode.hpp"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+// BGRA pixel of a frame that differs from frame to frame and pixel to pixel
+static void framePixel(uint64_t frame, uint32_t x, uint32_t y,
+                       uint8_t *bgra) {
+  bgra[0] = (uint8_t)(x * 7 + frame);
+  bgra[1] = (uint8_t)(y * 13 + frame * 3);
+  bgra[2] = (uint8_t)(x ^ y);
+  bgra[3] = (uint8_t)(255 - frame * 16);
+}
+
+// Plays the renderer: `frameCount` frames copied into padded slots, the way
+// a blit fills a readback buffer
+static void renderFrames(ReadbackQueue &queue, uint64_t frameCount,
+                         uint32_t width, uint32_t height) {
+  uint32_t bytesPerRow = readbackBytesPerRow(width);
+  for (uint64_t frame = 0; frame < frameCount; frame++) {
+    uint32_t slot = queue.acquire();
+    uint8_t *pixels = queue.slotMemory(slot);
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        framePixel(frame, x, y, pixels + (size_t)y * bytesPerRow + x * 4);
+      }
+    }
+    queue.complete(slot, frame, width, height, bytesPerRow);
+  }
+  queue.close();
+}
+
+struct ReadbackSlots {
+  std::vector<std::vector<uint8_t>> memory;
+
+  ReadbackSlots(uint32_t count, uint32_t width, uint32_t height)
+      : memory(count, std::vector<uint8_t>(
+                          (size_t)readbackBytesPerRow(width) * height)) {}
+
+  std::vector<uint8_t *> pointers() {
+    std::vector<uint8_t *> slots;
+    for (std::vector<uint8_t> &slot : memory) {
+      slots.push_back(slot.data());
+    }
+    return slots;
+  }
+};
+
+static std::vector<uint8_t> readFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+// Frames saved as PNGs decode back to what was rendered, padding dropped and
+// BGRA swizzled to RGBA
+ENGINE_TEST("readback/png_round_trip") {
+  const uint32_t width = 37, height = 19, frameCount = 9;
+  std::string directory =
+      (std::filesystem::temp_directory_path() / "engine_tests_readback_png")
+          .string();
+  std::filesystem::remove_all(directory);
+  ReadbackSlots slots(3, width, height);
+  ReadbackQueue queue(slots.pointers());
+  FrameWriterOptions options;
+  options.directory = directory;
+  options.threads = 2;
+  FrameWriter writer(queue, options);
+  renderFrames(queue, frameCount, width, height);
+  writer.finish();
+
+  FrameWriterStats stats = writer.stats();
+  CHECK(!stats.failed);
+  CHECK(stats.frames == frameCount);
+  CHECK(queue.stats().acquired == frameCount);
+  uint64_t bytes = 0;
+  for (uint64_t frame = 0; frame < frameCount; frame++) {
+    std::vector<uint8_t> png = readFile(
+        FrameWriter::framePath(directory, FrameFileFormat::Png, frame));
+    bytes += png.size();
+    DecodedImage image = decodeImageMemory(png.data(), png.size(), false);
+    CHECK(image.error.empty());
+    CHECK(image.width == (int)width && image.height == (int)height);
+    CHECK(image.channels == 4);
+    bool same = image.pixels.size() == (size_t)width * height * 4;
+    for (uint32_t y = 0; same && y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint8_t bgra[4];
+        framePixel(frame, x, y, bgra);
+        const uint8_t *rgba = image.pixels.data() + (y * width + x) * 4;
+        same = same && rgba[0] == bgra[2] && rgba[1] == bgra[1] &&
+               rgba[2] == bgra[0] && rgba[3] == bgra[3];
+      }
+    }
+    CHECK(same);
+  }
+  CHECK(stats.bytes == bytes);
+  std::filesystem::remove_all(directory);
+}
+
+// Raw frames go to one file, in order, without the rows' padding
+ENGINE_TEST("readback/raw_frames_in_order") {
+  const uint32_t width = 21, height = 5, frameCount = 6;
+  std::string directory =
+      (std::filesystem::temp_directory_path() / "engine_tests_readback_raw")
+          .string();
+  std::filesystem::remove_all(directory);
+  ReadbackSlots slots(2, width, height);
+  ReadbackQueue queue(slots.pointers());
+  FrameWriterOptions options;
+  options.directory = directory;
+  options.format = FrameFileFormat::Raw;
+  {
+    FrameWriter writer(queue, options);
+    renderFrames(queue, frameCount, width, height);
+    writer.finish();
+    CHECK(writer.stats().frames == frameCount);
+  }
+
+  std::vector<uint8_t> raw =
+      readFile(FrameWriter::framePath(directory, FrameFileFormat::Raw, 0));
+  std::vector<uint8_t> expected;
+  for (uint64_t frame = 0; frame < frameCount; frame++) {
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint8_t bgra[4];
+        framePixel(frame, x, y, bgra);
+        expected.insert(expected.end(), bgra, bgra + 4);
+      }
+    }
+  }
+  CHECK(raw == expected);
+  std::filesystem::remove_all(directory);
+}
+
+// The renderer waits for a slot once it's this far ahead of the writer
+ENGINE_TEST("readback/renderer_waits_for_free_slot") {
+  std::vector<uint8_t> memory(2 * 256);
+  ReadbackQueue queue({memory.data(), memory.data() + 256});
+  uint32_t first = queue.acquire();
+  uint32_t second = queue.acquire();
+  CHECK(first == 0 && second == 1);
+  queue.complete(first, 0, 1, 1, 256);
+  queue.complete(second, 1, 1, 1, 256);
+  CHECK(queue.stats().stalls == 0);
+
+  std::thread writer([&]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    ReadbackFrame frame;
+    if (queue.next(frame)) {
+      queue.release(frame.slot);
+    }
+  });
+  CHECK(queue.acquire() == first);
+  writer.join();
+  ReadbackStats stats = queue.stats();
+  CHECK(stats.acquired == 3 && stats.stalls == 1);
+  CHECK(stats.stallMilliseconds > 5.0);
+}
+
+// A writer that can't write still takes every frame, so the renderer
+// doesn't hang on it
+ENGINE_TEST("readback/failed_writer_drains_queue") {
+  const uint32_t width = 8, height = 8;
+  std::string blocker =
+      (std::filesystem::temp_directory_path() / "engine_tests_readback_file")
+          .string();
+  { std::ofstream file(blocker); }
+  ReadbackSlots slots(2, width, height);
+  ReadbackQueue queue(slots.pointers());
+  FrameWriterOptions options;
+  // A directory inside a file can't be created
+  options.directory = blocker + "/frames";
+  options.threads = 1;
+  FrameWriter writer(queue, options);
+  renderFrames(queue, 5, width, height);
+  writer.finish();
+  CHECK(writer.stats().failed);
+  CHECK(writer.stats().frames == 0);
+  CHECK(queue.stats().acquired == 5);
+  std::filesystem::remove(blocker);
+}
@@ -0,0 +1,245 @@
+#include "testing.hpp"
+
+#include "gpu_culling.hpp"
+#include "hiz_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+static Float4x4 hizViewProjection(uint32_t width, uint32_t height) {
+  return mul(makePerspectiveRightHand(M_PI / 3, (float)width / height, 0.1f,
+                                      100.0f),
+             makeLookAt({0, 0, 0}, {0, 0, -1}, {0, 1, 0}));
+}
+
+static float ndcDepth(const Float4x4 &viewProjection, Float3 point) {
+  Float4 clip = mul(viewProjection, Float4{point.x, point.y, point.z, 1.0f});
+  return clip.z / clip.w;
+}
+
+static CullObject cullSphere(Float3 center, float radius) {
+  CullObject object = {};
+  object.center[0] = center.x;
+  object.center[1] = center.y;
+  object.center[2] = center.z;
+  object.radius = radius;
+  Float4x4 model = makeTranslation(center);
+  memcpy(object.model, &model, sizeof(model));
+  return object;
+}
+
+ENGINE_TEST("hiz/mip_chain_sizes") {
+  CHECK(hizMipCount(1, 1) == 1);
+  CHECK(hizMipCount(2, 1) == 2);
+  CHECK(hizMipCount(1920, 1080) == 11);
+  CHECK(hizMipCount(1024, 1024) == 11);
+  CHECK(hizMipSize(1080, 10) == 1 && hizMipSize(1080, 3) == 135);
+}
+
+// Against the footprint of every destination texel worked out separately,
+// odd sizes included
+ENGINE_TEST("hiz/downsample_keeps_farthest") {
+  TestRandom random(47);
+  for (uint32_t width : {1u, 2u, 5u, 8u, 13u}) {
+    for (uint32_t height : {1u, 3u, 4u, 7u}) {
+      std::vector<float> source((size_t)width * height);
+      for (float &depth : source) {
+        depth = random.uniform(0, 1);
+      }
+      uint32_t destinationWidth = hizMipSize(width, 1);
+      uint32_t destinationHeight = hizMipSize(height, 1);
+      std::vector<float> destination(destinationWidth * destinationHeight);
+      downsampleHiZ(source.data(), width, height, destination.data());
+      for (uint32_t y = 0; y < destinationHeight; y++) {
+        for (uint32_t x = 0; x < destinationWidth; x++) {
+          float farthest = 0.0f;
+          for (uint32_t sy = 0; sy < height; sy++) {
+            for (uint32_t sx = 0; sx < width; sx++) {
+              // Which destination texel the source texel reduces into
+              uint32_t dx = std::min(sx / 2, destinationWidth - 1);
+              uint32_t dy = std::min(sy / 2, destinationHeight - 1);
+              if (dx == x && dy == y) {
+                farthest = std::max(farthest, source[sy * width + sx]);
+              }
+            }
+          }
+          CHECK(destination[y * destinationWidth + x] == farthest);
+        }
+      }
+    }
+  }
+}
+
+ENGINE_TEST("hiz/pyramid_top_is_farthest") {
+  const uint32_t width = 37, height = 21;
+  TestRandom random(48);
+  std::vector<float> depth(width * height);
+  for (float &value : depth) {
+    value = random.uniform(0, 0.9f);
+  }
+  depth[20 * width + 36] = 0.95f;
+  HiZPyramid pyramid = buildHiZPyramid(depth.data(), width, height);
+  CHECK(pyramid.levels.size() == hizMipCount(width, height));
+  CHECK(pyramid.levels[0] == depth);
+  CHECK(pyramid.levels.back().size() == 1);
+  CHECK(pyramid.texel((uint32_t)pyramid.levels.size() - 1, 0, 0) == 0.95f);
+}
+
+// A wall across the whole view at z = -10, with a hole on its left
+ENGINE_TEST("hiz/wall_occludes") {
+  const uint32_t width = 64, height = 32;
+  Float4x4 viewProjection = hizViewProjection(width, height);
+  std::vector<float> depth(width * height,
+                           ndcDepth(viewProjection, {0, 0, -10}));
+  for (uint32_t y = 8; y < 24; y++) {
+    for (uint32_t x = 4; x < 20; x++) {
+      depth[y * width + x] = 1.0f;
+    }
+  }
+  HiZPyramid pyramid = buildHiZPyramid(depth.data(), width, height);
+  HiZUniforms uniforms = makeHiZUniforms(viewProjection, width, height, true);
+  CHECK(uniforms.mipCount == pyramid.levels.size());
+
+  CHECK(hizOccluded(uniforms, pyramid, cullSphere({3, 0, -20}, 1)));
+  CHECK(!hizOccluded(uniforms, pyramid, cullSphere({3, 0, -6}, 1)));
+  // Straddling the wall
+  CHECK(!hizOccluded(uniforms, pyramid, cullSphere({3, 0, -10}, 1)));
+  // Behind the hole
+  CHECK(!hizOccluded(uniforms, pyramid, cullSphere({-12, 0, -20}, 1)));
+  // Crossing the near plane
+  CHECK(!hizOccluded(uniforms, pyramid, cullSphere({0, 0, -0.1f}, 1)));
+
+  HiZUniforms disabled = makeHiZUniforms(viewProjection, width, height, false);
+  CHECK(!hizOccluded(disabled, pyramid, cullSphere({3, 0, -20}, 1)));
+}
+
+// Whatever the pyramid mip picked, an occluded box is behind every depth
+// texel its screen rectangle touches
+ENGINE_TEST("hiz/occlusion_is_conservative") {
+  const uint32_t width = 96, height = 64;
+  Float4x4 viewProjection = hizViewProjection(width, height);
+  TestRandom random(49);
+  // Blocks of random depth
+  std::vector<float> depth(width * height);
+  for (uint32_t blockY = 0; blockY < height; blockY += 8) {
+    for (uint32_t blockX = 0; blockX < width; blockX += 8) {
+      float block = ndcDepth(viewProjection, {0, 0, random.uniform(-30, -3)});
+      for (uint32_t y = blockY; y < blockY + 8; y++) {
+        for (uint32_t x = blockX; x < blockX + 8; x++) {
+          depth[y * width + x] = block;
+        }
+      }
+    }
+  }
+  HiZPyramid pyramid = buildHiZPyramid(depth.data(), width, height);
+  HiZUniforms uniforms = makeHiZUniforms(viewProjection, width, height, true);
+
+  uint32_t occluded = 0;
+  for (int i = 0; i < 2000; i++) {
+    float z = random.uniform(-60, -4);
+    CullObject object = cullSphere({z * random.uniform(-0.8f, 0.8f),
+                                    z * random.uniform(-0.5f, 0.5f), z},
+                                   random.uniform(0.1f, 3.0f));
+    if (!hizOccluded(uniforms, pyramid, object)) {
+      continue;
+    }
+    occluded++;
+    float minX = INFINITY, maxX = -INFINITY, minY = INFINITY;
+    float maxY = -INFINITY, nearest = INFINITY;
+    for (int corner = 0; corner < 8; corner++) {
+      Float4 clip = mul(
+          viewProjection,
+          Float4{object.center[0] + (corner & 1 ? 1 : -1) * object.radius,
+                 object.center[1] + (corner & 2 ? 1 : -1) * object.radius,
+                 object.center[2] + (corner & 4 ? 1 : -1) * object.radius,
+                 1.0f});
+      float x = (clip.x / clip.w * 0.5f + 0.5f) * width;
+      float y = (0.5f - clip.y / clip.w * 0.5f) * height;
+      minX = std::min(minX, x);
+      maxX = std::max(maxX, x);
+      minY = std::min(minY, y);
+      maxY = std::max(maxY, y);
+      nearest = std::min(nearest, clip.z / clip.w);
+    }
+    int32_t firstX = std::clamp((int32_t)std::floor(minX), 0, (int)width - 1);
+    int32_t lastX = std::clamp((int32_t)std::floor(maxX), 0, (int)width - 1);
+    int32_t firstY = std::clamp((int32_t)std::floor(minY), 0, (int)height - 1);
+    int32_t lastY = std::clamp((int32_t)std::floor(maxY), 0, (int)height - 1);
+    bool hidden = true;
+    for (int32_t y = firstY; y <= lastY; y++) {
+      for (int32_t x = firstX; x <= lastX; x++) {
+        hidden = hidden && depth[y * width + x] < nearest + 1e-6f;
+      }
+    }
+    CHECK(hidden);
+  }
+  // The test has to hide something to mean anything
+  CHECK(occluded > 100);
+}
+
+// Objects hidden by last frame's depth wait for the late pass, and are drawn
+// there if this frame's depth doesn't hide them
+ENGINE_TEST("hiz/two_phase_misses_nothing") {
+  const uint32_t width = 64, height = 32, objectCount = 256;
+  Float4x4 viewProjection = hizViewProjection(width, height);
+  float wallDepth = ndcDepth(viewProjection, {0, 0, -10});
+  // Last frame a wall covered the view, this frame only its right half
+  std::vector<float> lastDepth(width * height, wallDepth);
+  std::vector<float> depth = lastDepth;
+  for (uint32_t y = 0; y < height; y++) {
+    std::fill(depth.begin() + y * width, depth.begin() + y * width + width / 2,
+              1.0f);
+  }
+  HiZPyramid lastPyramid = buildHiZPyramid(lastDepth.data(), width, height);
+  HiZPyramid pyramid = buildHiZPyramid(depth.data(), width, height);
+  HiZUniforms hizUniforms =
+      makeHiZUniforms(viewProjection, width, height, true);
+
+  TestRandom random(50);
+  std::vector<CullObject> objects;
+  for (uint32_t i = 0; i < objectCount; i++) {
+    float z = random.uniform(-40, -2);
+    objects.push_back(cullSphere({random.uniform(-0.6f, 0.6f) * -z,
+                                  random.uniform(-0.3f, 0.3f) * -z, z},
+                                 random.uniform(0.2f, 1.5f)));
+  }
+  CullLod lod = {0, 36, 1000.0f};
+  CullUniforms uniforms = makeCullUniforms(makeFrustum(viewProjection),
+                                           {0, 0, 0}, &lod, 1, objectCount,
+                                           objectCount);
+  IndirectDrawArguments early, late;
+  resetCullArguments(&early, &lod, 1, objectCount);
+  resetCullArguments(&late, &lod, 1, objectCount);
+  std::vector<Float4x4> earlyInstances(objectCount), lateInstances(objectCount);
+  std::vector<uint32_t> visibility(objectCount);
+  cullObjectsEarlyReference(uniforms, hizUniforms, lastPyramid, objects.data(),
+                            &early, earlyInstances.data(), visibility.data());
+  uint32_t waiting = 0;
+  for (uint32_t result : visibility) {
+    waiting += (result & CullVisibilityOccluded) ? 1 : 0;
+  }
+  cullObjectsLateReference(uniforms, hizUniforms, pyramid, objects.data(),
+                           &late, lateInstances.data(), visibility.data());
+  CHECK(waiting > 0);
+  CHECK(late.instanceCount > 0 && late.instanceCount <= waiting);
+
+  // Everything this frame's depth doesn't hide was drawn by one of them
+  std::vector<float> drawnX;
+  for (uint32_t i = 0; i < early.instanceCount; i++) {
+    drawnX.push_back(earlyInstances[i].columns[3].x);
+  }
+  for (uint32_t i = 0; i < late.instanceCount; i++) {
+    drawnX.push_back(lateInstances[i].columns[3].x);
+  }
+  for (uint32_t i = 0; i < objectCount; i++) {
+    const CullObject &object = objects[i];
+    if (cullObject(uniforms, object) == 0 ||
+        hizOccluded(hizUniforms, pyramid, object)) {
+      continue;
+    }
+    CHECK(std::find(drawnX.begin(), drawnX.end(), object.center[0]) !=
+          drawnX.end());
+    CHECK(!(visibility[i] & CullVisibilityOccluded));
+  }
+}
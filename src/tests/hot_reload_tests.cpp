@@ -0,0 +1,203 @@
+#include "testing.hpp"
+
+#include "hot_reload.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+// A directory of its own per test, removed again at the end
+struct TempDirectory {
+  std::filesystem::path path;
+
+  explicit TempDirectory(const char *name)
+      : path(std::filesystem::temp_directory_path() / name) {
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+  }
+  ~TempDirectory() {
+    std::error_code error;
+    std::filesystem::remove_all(path, error);
+  }
+
+  std::string file(const char *name) const { return (path / name).string(); }
+};
+
+static void writeFile(const std::string &path, const std::string &contents) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file << contents;
+}
+
+// Polls at 0.01 s steps of the watcher's clock from `start` until `end`,
+// collecting what it reports
+static std::vector<std::string> pollUntil(FileWatcher &watcher, double start,
+                                          double end) {
+  std::vector<std::string> reported;
+  for (double now = start; now <= end + 1e-9; now += 0.01) {
+    for (std::string &file : watcher.poll(now)) {
+      reported.push_back(std::move(file));
+    }
+  }
+  return reported;
+}
+
+ENGINE_TEST("hot_reload/change_reported_once_settled") {
+  TempDirectory directory("engine_tests_watch_settle");
+  writeFile(directory.file("obj.metal"), "v1");
+  FileWatcher watcher(0.2);
+  std::string watched = watcher.watch(directory.file("obj.metal"));
+  CHECK(!watched.empty());
+  CHECK(watched == FileWatcher::canonicalPath(directory.file("obj.metal")));
+  CHECK(watcher.poll(0.0).empty());
+
+  writeFile(directory.file("obj.metal"), "v2");
+  CHECK(pollUntil(watcher, 1.0, 1.15).empty());
+  // Written again before it settled, which starts the wait over
+  writeFile(directory.file("obj.metal"), "v3");
+  CHECK(pollUntil(watcher, 1.16, 1.3).empty());
+  std::vector<std::string> reported = pollUntil(watcher, 1.31, 1.5);
+  CHECK(reported == std::vector<std::string>{watched});
+  // Each change once
+  CHECK(pollUntil(watcher, 1.51, 3.0).empty());
+}
+
+// Saves that write a new file and rename it over the old one, and files in
+// the same directory that aren't watched
+ENGINE_TEST("hot_reload/rename_over_and_unwatched_neighbours") {
+  TempDirectory directory("engine_tests_watch_rename");
+  writeFile(directory.file("dragon.obj"), "v 0 0 0\n");
+  FileWatcher watcher(0.05);
+  std::string watched = watcher.watch(directory.file("dragon.obj"));
+  // Not there yet, which is fine as long as the directory is
+  std::string later = watcher.watch(directory.file("later.png"));
+  CHECK(!later.empty());
+  CHECK(watcher.watch(directory.file("missing/file.png")).empty());
+
+  writeFile(directory.file("notes.txt"), "not watched");
+  writeFile(directory.file("dragon.obj.tmp"), "v 1 1 1\n");
+  std::filesystem::rename(directory.file("dragon.obj.tmp"),
+                          directory.file("dragon.obj"));
+  CHECK(pollUntil(watcher, 0.0, 1.0) == std::vector<std::string>{watched});
+
+  writeFile(directory.file("later.png"), "png");
+  CHECK(pollUntil(watcher, 2.0, 3.0) == std::vector<std::string>{later});
+}
+
+ENGINE_TEST("hot_reload/retire_waits_for_frames_in_flight") {
+  uint32_t released = 0;
+  {
+    RetireQueue queue(3);
+    queue.retire([&]() { released++; });
+    for (int frame = 0; frame < 3; frame++) {
+      queue.endFrame();
+      CHECK(released == 0);
+    }
+    queue.endFrame();
+    CHECK(released == 1);
+    CHECK(queue.pending() == 0);
+
+    queue.retire([&]() { released++; });
+    queue.endFrame();
+  }
+  // What's left goes with the queue
+  CHECK(released == 2);
+}
+
+// Runs update() until `done` holds, the reloads run on the pool meanwhile
+template <typename Condition>
+static bool updateUntil(HotReloader &reloader, double &now, Condition done) {
+  for (int i = 0; i < 2000 && !done(); i++) {
+    now += 0.01;
+    reloader.update(now);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return done();
+}
+
+// Swaps only happen in update(), on the calling thread, and a failed reload
+// keeps what was there
+ENGINE_TEST("hot_reload/swap_between_frames") {
+  TempDirectory directory("engine_tests_reload_swap");
+  std::string path = directory.file("mesh.obj");
+  writeFile(path, "first");
+  FileWatcher watcher(0.05);
+  ThreadPool pool(2);
+  std::string current = "first";
+  std::thread::id swapThread;
+  {
+    HotReloader reloader(watcher, pool);
+    CHECK(reloader.add(path, [&]() -> std::function<void()> {
+      std::ifstream file(path);
+      std::string contents;
+      file >> contents;
+      if (contents == "broken") {
+        return {};
+      }
+      return [&, contents]() {
+        current = contents;
+        swapThread = std::this_thread::get_id();
+      };
+    }));
+    double now = 0.0;
+    reloader.update(now);
+
+    writeFile(path, "second");
+    CHECK(updateUntil(reloader, now,
+                      [&]() { return reloader.stats().applied == 1; }));
+    CHECK(current == "second");
+    CHECK(swapThread == std::this_thread::get_id());
+
+    writeFile(path, "broken");
+    CHECK(updateUntil(reloader, now,
+                      [&]() { return reloader.stats().failed == 1; }));
+    CHECK(current == "second");
+    CHECK(reloader.stats().started == 2);
+    CHECK(!reloader.busy());
+  }
+}
+
+// A file changing while its reload runs throws that reload's result away
+// and loads it again
+ENGINE_TEST("hot_reload/change_during_reload_supersedes") {
+  TempDirectory directory("engine_tests_reload_supersede");
+  std::string path = directory.file("shaders.metallib");
+  writeFile(path, "1");
+  FileWatcher watcher(0.05);
+  ThreadPool pool(2);
+  std::atomic<bool> blocked{true};
+  std::atomic<uint32_t> reloads{0};
+  std::vector<std::string> swapped;
+  HotReloader reloader(watcher, pool);
+  reloader.add(path, [&]() -> std::function<void()> {
+    reloads++;
+    while (blocked) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::ifstream file(path);
+    std::string contents;
+    file >> contents;
+    return [&, contents]() { swapped.push_back(contents); };
+  });
+  double now = 0.0;
+  reloader.update(now);
+
+  writeFile(path, "2");
+  CHECK(updateUntil(reloader, now, [&]() { return reloads == 1; }));
+  writeFile(path, "3");
+  // Long enough for the second change to settle while the reload is stuck
+  for (int i = 0; i < 20; i++) {
+    now += 0.01;
+    reloader.update(now);
+  }
+  CHECK(reloader.busy());
+  CHECK(swapped.empty());
+
+  blocked = false;
+  CHECK(updateUntil(reloader, now,
+                    [&]() { return reloader.stats().applied == 1; }));
+  CHECK(reloader.stats().superseded == 1);
+  CHECK(reloads == 2);
+  CHECK(swapped == std::vector<std::string>{"3"});
+}
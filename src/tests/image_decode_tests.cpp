@@ -0,0 +1,65 @@
+#include "testing.hpp"
+
+#include "image_decode.hpp"
+#include "image_encode.hpp"
+
+#include <algorithm>
+
+static std::vector<uint8_t> randomBytes(size_t count, uint64_t seed) {
+  TestRandom random(seed);
+  std::vector<uint8_t> bytes(count);
+  for (uint8_t &byte : bytes) {
+    byte = (uint8_t)random.next();
+  }
+  return bytes;
+}
+
+// Every length around the vector widths, so both the SIMD loop and the
+// scalar tail after it are covered
+ENGINE_TEST("decode/expand_rgb_to_rgba") {
+  for (size_t pixelCount = 0; pixelCount <= 70; pixelCount++) {
+    std::vector<uint8_t> rgb = randomBytes(pixelCount * 3, pixelCount + 1);
+    // One extra pixel that has to be left alone
+    std::vector<uint8_t> rgba(pixelCount * 4 + 4, 7);
+    expandRGBToRGBA(rgb.data(), rgba.data(), pixelCount);
+    bool matches = true;
+    for (size_t i = 0; i < pixelCount; i++) {
+      matches = matches && rgba[i * 4 + 0] == rgb[i * 3 + 0] &&
+                rgba[i * 4 + 1] == rgb[i * 3 + 1] &&
+                rgba[i * 4 + 2] == rgb[i * 3 + 2] && rgba[i * 4 + 3] == 255;
+    }
+    CHECK(matches);
+    CHECK(rgba[pixelCount * 4] == 7 && rgba[pixelCount * 4 + 3] == 7);
+  }
+}
+
+ENGINE_TEST("decode/png_flipped_on_pool") {
+  const uint32_t width = 67, height = 300;
+  std::vector<uint8_t> pixels = randomBytes((size_t)width * height * 4, 11);
+  std::vector<uint8_t> png =
+      encodePng(pixels.data(), width, height, width * 4, PixelOrder::Rgba);
+  ThreadPool pool(3);
+  DecodedImage image = decodeImageMemory(png.data(), png.size(), true, &pool);
+  CHECK(image.valid());
+  CHECK(image.width == (int)width && image.height == (int)height);
+  CHECK(image.channels == 4);
+  if (!image.valid()) {
+    return;
+  }
+  bool matches = true;
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t *expected = pixels.data() + (size_t)y * width * 4;
+    const uint8_t *actual =
+        image.pixels.data() + (size_t)(height - 1 - y) * width * 4;
+    matches = matches && std::equal(expected, expected + width * 4, actual);
+  }
+  CHECK(matches);
+}
+
+ENGINE_TEST("decode/invalid_data_reports_error") {
+  std::vector<uint8_t> garbage = randomBytes(256, 5);
+  DecodedImage image =
+      decodeImageMemory(garbage.data(), garbage.size(), false);
+  CHECK(!image.valid());
+  CHECK(!image.error.empty());
+}
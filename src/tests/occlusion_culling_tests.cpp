@@ -0,0 +1,185 @@
+#include "testing.hpp"
+
+#include "occlusion_culling.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Camera at the origin looking down -z, 90° vertically
+static Float4x4 occlusionViewProjection(uint32_t width, uint32_t height) {
+  return mul(makePerspectiveRightHand(M_PI / 2, (float)width / height, 0.1f,
+                                      100.0f),
+             makeLookAt({0, 0, 0}, {0, 0, -1}, {0, 1, 0}));
+}
+
+// An axis aligned quad facing the camera at z, as two triangles
+struct QuadOccluder {
+  float positions[12];
+  uint32_t indices[6] = {0, 1, 2, 0, 2, 3};
+
+  QuadOccluder(float minX, float minY, float maxX, float maxY, float z)
+      : positions{minX, minY, z, maxX, minY, z,
+                  maxX, maxY, z, minX, maxY, z} {}
+};
+
+ENGINE_TEST("occlusion/empty_buffer_hides_nothing") {
+  OcclusionCuller culler(100, 60);
+  CHECK(culler.width() == 104 && culler.height() == 64);
+  culler.beginFrame(occlusionViewProjection(104, 64));
+  culler.rasterize(nullptr);
+  CHECK(std::all_of(culler.depth(),
+                    culler.depth() + culler.width() * culler.height(),
+                    [](float depth) { return depth == 1.0f; }));
+  CHECK(!culler.isOccluded({-1, -1, -20}, {1, 1, -18}));
+}
+
+ENGINE_TEST("occlusion/wall_hides_what_is_behind_it") {
+  OcclusionCuller culler(128, 64);
+  culler.beginFrame(occlusionViewProjection(128, 64));
+  QuadOccluder wall(-4, -3, 4, 3, -10);
+  culler.addOccluder(wall.positions, 4, wall.indices, 6, makeIdentity());
+  culler.rasterize(nullptr);
+  CHECK(culler.stats().occluders == 1);
+  CHECK(culler.stats().rasterizedTriangles == 2);
+
+  CHECK(culler.isOccluded({-1, -1, -20}, {1, 1, -18}));
+  // In front of the wall
+  CHECK(!culler.isOccluded({-1, -1, -8}, {1, 1, -6}));
+  // Through the wall
+  CHECK(!culler.isOccluded({-1, -1, -12}, {1, 1, -9}));
+  // Behind it, but showing past its edge
+  CHECK(!culler.isOccluded({3, -1, -14}, {7, 1, -12}));
+  // Behind the camera, or crossing the near plane
+  CHECK(!culler.isOccluded({-1, -1, 2}, {1, 1, 4}));
+  CHECK(!culler.isOccluded({-1, -1, -20}, {1, 1, 1}));
+
+  // The model matrix moves the wall, and with it what it hides
+  culler.beginFrame(occlusionViewProjection(128, 64));
+  culler.addOccluder(wall.positions, 4, wall.indices, 6,
+                     makeTranslation({30, 0, 0}));
+  culler.rasterize(nullptr);
+  CHECK(!culler.isOccluded({-1, -1, -20}, {1, 1, -18}));
+}
+
+// An occluder crossing the near plane is dropped rather than clipped
+ENGINE_TEST("occlusion/near_plane_triangles_dropped") {
+  OcclusionCuller culler(64, 64);
+  culler.beginFrame(occlusionViewProjection(64, 64));
+  float positions[9] = {-50, -50, 1, 50, -50, -30, 0, 50, -30};
+  uint32_t indices[3] = {0, 1, 2};
+  culler.addOccluder(positions, 3, indices, 3, makeIdentity());
+  culler.rasterize(nullptr);
+  CHECK(culler.stats().occluderTriangles == 1);
+  CHECK(culler.stats().rasterizedTriangles == 0);
+  CHECK(!culler.isOccluded({-1, -1, -60}, {1, 1, -58}));
+}
+
+// Random tilted triangles against a reference computed at pixel centres:
+// every covered pixel stores a depth no nearer than the nearest triangle
+// over its centre, and no farther than that triangle gets. The tiles hold
+// the farthest depth of their pixels.
+ENGINE_TEST("occlusion/depth_is_conservative") {
+  const uint32_t width = 96, height = 64;
+  Float4x4 viewProjection = occlusionViewProjection(width, height);
+  TestRandom random(45);
+  std::vector<float> positions;
+  std::vector<uint32_t> indices;
+  for (uint32_t i = 0; i < 24 * 3; i++) {
+    positions.push_back(random.uniform(-8, 8));
+    positions.push_back(random.uniform(-6, 6));
+    positions.push_back(random.uniform(-14, -4));
+    indices.push_back(i);
+  }
+  OcclusionCuller culler(width, height);
+  culler.beginFrame(viewProjection);
+  culler.addOccluder(positions.data(), 24 * 3, indices.data(), 24 * 3,
+                     makeIdentity());
+  culler.rasterize(nullptr);
+
+  // Screen position and depth of every vertex
+  std::vector<Float3> screen;
+  for (uint32_t i = 0; i < 24 * 3; i++) {
+    Float4 clip = mul(viewProjection, Float4{positions[i * 3],
+                                             positions[i * 3 + 1],
+                                             positions[i * 3 + 2], 1.0f});
+    screen.push_back({(clip.x / clip.w * 0.5f + 0.5f) * width,
+                      (0.5f - clip.y / clip.w * 0.5f) * height,
+                      clip.z / clip.w});
+  }
+  uint32_t covered = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      float px = x + 0.5f, py = y + 0.5f;
+      // Over the triangles that may cover the centre, and those that surely
+      // do: centres right on an edge could go either way
+      float nearestMaybe = INFINITY;
+      float nearest = INFINITY, farthestOfNearest = INFINITY;
+      for (uint32_t t = 0; t < 24; t++) {
+        const Float3 &a = screen[t * 3], &b = screen[t * 3 + 1],
+                     &c = screen[t * 3 + 2];
+        float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+        if (std::fabs(area) < 1e-3f) {
+          continue;
+        }
+        float wa = ((b.x - px) * (c.y - py) - (b.y - py) * (c.x - px)) / area;
+        float wb = ((c.x - px) * (a.y - py) - (c.y - py) * (a.x - px)) / area;
+        float wc = 1.0f - wa - wb;
+        float depth = wa * a.z + wb * b.z + wc * c.z;
+        if (wa > -1e-3f && wb > -1e-3f && wc > -1e-3f) {
+          nearestMaybe = std::min(nearestMaybe, depth);
+        }
+        if (wa > 1e-3f && wb > 1e-3f && wc > 1e-3f && depth < nearest) {
+          nearest = depth;
+          farthestOfNearest = std::max({a.z, b.z, c.z});
+        }
+      }
+      float stored = culler.depth()[y * culler.width() + x];
+      CHECK(stored >= nearestMaybe - 1e-5f || stored == 1.0f);
+      if (nearest != INFINITY) {
+        covered++;
+        CHECK(stored <= farthestOfNearest + 1e-5f);
+      }
+    }
+  }
+  CHECK(covered > width * height / 4);
+
+  for (uint32_t tileY = 0; tileY < height / 8; tileY++) {
+    for (uint32_t tileX = 0; tileX < width / 8; tileX++) {
+      float farthest = 0.0f;
+      for (uint32_t y = tileY * 8; y < tileY * 8 + 8; y++) {
+        for (uint32_t x = tileX * 8; x < tileX * 8 + 8; x++) {
+          farthest = std::max(farthest, culler.depth()[y * width + x]);
+        }
+      }
+      CHECK(culler.tileDepth()[tileY * (width / 8) + tileX] == farthest);
+    }
+  }
+}
+
+// Bands of tile rows on the pool fill exactly what one thread does
+ENGINE_TEST("occlusion/parallel_matches_serial") {
+  const uint32_t width = 320, height = 192;
+  TestRandom random(46);
+  std::vector<float> positions;
+  std::vector<uint32_t> indices;
+  for (uint32_t i = 0; i < 300; i++) {
+    positions.push_back(random.uniform(-20, 20));
+    positions.push_back(random.uniform(-12, 12));
+    positions.push_back(random.uniform(-40, -5));
+    indices.push_back(i);
+  }
+  ThreadPool pool(3);
+  OcclusionCuller serial(width, height), parallel(width, height);
+  for (OcclusionCuller *culler : {&serial, &parallel}) {
+    culler->beginFrame(occlusionViewProjection(width, height));
+    culler->addOccluder(positions.data(), 300, indices.data(), 300,
+                        makeIdentity());
+  }
+  serial.rasterize(nullptr);
+  parallel.rasterize(&pool);
+  CHECK(std::equal(serial.depth(), serial.depth() + width * height,
+                   parallel.depth()));
+  CHECK(std::equal(serial.tileDepth(),
+                   serial.tileDepth() + width * height / 64,
+                   parallel.tileDepth()));
+}
@@ -0,0 +1,206 @@
+#include "testing.hpp"
+
+#include "pipeline_cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+// The obj pipeline's shape: MSAA BGRA8 colour with Depth32Float
+static PipelineDesc forwardDesc() {
+  PipelineDesc desc;
+  desc.label = "Forward";
+  desc.vertexFunction = "forwardVertexShader";
+  desc.fragmentFunction = "forwardFragmentShader";
+  desc.colorFormats[0] = 80;
+  desc.depthFormat = 252;
+  desc.sampleCount = 4;
+  desc.depthCompare = 1;
+  desc.depthWrite = true;
+  desc.specialized = true;
+  desc.shaderFeatures = 0b10101;
+  return desc;
+}
+
+// Stands in for the Metal compile, counting compiles and taking a little
+// while so that concurrent requests overlap it
+struct FakeCompiler {
+  std::atomic<uint32_t> compiles{0};
+  std::atomic<uint32_t> destroyed{0};
+  std::atomic<uintptr_t> nextPipeline{1};
+
+  PipelineCache::Backend backend() {
+    PipelineCache::Backend backend;
+    backend.compile = [this](const PipelineDesc &desc) {
+      compiles++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      CompiledPipeline pipeline;
+      // "broken" stands for a shader that doesn't compile
+      if (desc.fragmentFunction != "broken") {
+        pipeline.pipeline = (void *)nextPipeline++;
+      }
+      return pipeline;
+    };
+    backend.destroy = [this](const CompiledPipeline &) { destroyed++; };
+    return backend;
+  }
+};
+
+ENGINE_TEST("pipelines/key_covers_every_field") {
+  const PipelineDesc base = forwardDesc();
+  const uint64_t baseKey = hashPipelineDesc(base);
+
+  PipelineDesc relabelled = base;
+  relabelled.label = "Something else";
+  CHECK(relabelled == base);
+  CHECK(hashPipelineDesc(relabelled) == baseKey);
+
+  // Each of these changes what the descriptor compiles to
+  std::vector<void (*)(PipelineDesc &)> changes = {
+      [](PipelineDesc &d) { d.vertexFunction = "forwardVertexShader2"; },
+      [](PipelineDesc &d) { d.fragmentFunction.clear(); },
+      [](PipelineDesc &d) { d.colorFormats[0] = 81; },
+      [](PipelineDesc &d) { d.colorFormats[3] = 80; },
+      [](PipelineDesc &d) { d.blend[0].enabled = true; },
+      [](PipelineDesc &d) { d.blend[0].sourceRGBFactor = 4; },
+      [](PipelineDesc &d) { d.blend[2].writeMask = 0x7; },
+      [](PipelineDesc &d) { d.depthFormat = 0; },
+      [](PipelineDesc &d) { d.stencilFormat = 253; },
+      [](PipelineDesc &d) { d.sampleCount = 1; },
+      [](PipelineDesc &d) { d.depthCompare = 3; },
+      [](PipelineDesc &d) { d.depthWrite = false; },
+      [](PipelineDesc &d) { d.specialized = false; },
+      [](PipelineDesc &d) { d.shaderFeatures ^= 1; },
+  };
+  std::vector<uint64_t> keys = {baseKey};
+  for (auto change : changes) {
+    PipelineDesc changed = base;
+    change(changed);
+    CHECK(!(changed == base));
+    keys.push_back(hashPipelineDesc(changed));
+  }
+  std::sort(keys.begin(), keys.end());
+  CHECK(std::adjacent_find(keys.begin(), keys.end()) == keys.end());
+
+  // Strings are length prefixed, moving a character between them matters
+  PipelineDesc a = base, b = base;
+  a.vertexFunction = "ab";
+  a.fragmentFunction = "c";
+  b.vertexFunction = "a";
+  b.fragmentFunction = "bc";
+  CHECK(hashPipelineDesc(a) != hashPipelineDesc(b));
+}
+
+// Requests from several threads while the first compile is running all
+// end up with that one pipeline
+ENGINE_TEST("pipelines/concurrent_requests_share_compile") {
+  FakeCompiler compiler;
+  ThreadPool pool(2);
+  {
+    PipelineCache cache(compiler.backend(), pool);
+    std::vector<std::thread> threads;
+    std::vector<CompiledPipeline> results(6);
+    for (size_t i = 0; i < results.size(); i++) {
+      threads.emplace_back(
+          [&, i]() { results[i] = cache.acquire(forwardDesc()); });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    CHECK(compiler.compiles == 1);
+    for (const CompiledPipeline &result : results) {
+      CHECK(result.valid() && result.pipeline == results[0].pipeline);
+    }
+    PipelineCacheStats stats = cache.stats();
+    CHECK(stats.requests == 6 && stats.compiles == 1);
+    CHECK(stats.hits + stats.joined == 5);
+
+    // Done now, so answered straight away
+    CompiledPipeline pipeline;
+    CHECK(cache.tryAcquire(forwardDesc(), pipeline));
+    CHECK(pipeline.pipeline == results[0].pipeline);
+    CHECK(cache.compileNow(forwardDesc()).pipeline == results[0].pipeline);
+    CHECK(compiler.compiles == 1);
+  }
+  CHECK(compiler.destroyed == 1);
+}
+
+ENGINE_TEST("pipelines/failed_compile") {
+  FakeCompiler compiler;
+  ThreadPool pool(1);
+  PipelineCache cache(compiler.backend(), pool);
+  PipelineDesc broken = forwardDesc();
+  broken.fragmentFunction = "broken";
+  CHECK(!cache.acquire(broken).valid());
+  // Not retried on every request
+  CHECK(!cache.acquire(broken).valid());
+  CHECK(compiler.compiles == 1);
+  CHECK(cache.stats().failures == 1);
+}
+
+// A manifest written by one run prewarms the same pipelines in the next,
+// in first use order; failed pipelines and corrupted lines are left out
+ENGINE_TEST("pipelines/manifest_round_trip") {
+  std::string path =
+      (std::filesystem::temp_directory_path() / "engine_tests_pipelines.txt")
+          .string();
+  std::vector<PipelineDesc> used;
+  {
+    FakeCompiler compiler;
+    ThreadPool pool(2);
+    PipelineCache cache(compiler.backend(), pool);
+    PipelineDesc depthOnly = forwardDesc();
+    depthOnly.label = "Depth pre-pass";
+    depthOnly.fragmentFunction.clear();
+    depthOnly.colorFormats[0] = 0;
+    PipelineDesc blended = forwardDesc();
+    blended.label = "Light with a label of several words";
+    blended.blend[0].enabled = true;
+    blended.blend[0].destinationRGBFactor = 5;
+    PipelineDesc broken = forwardDesc();
+    broken.fragmentFunction = "broken";
+    used = {blended, forwardDesc(), depthOnly};
+    for (const PipelineDesc &desc : used) {
+      cache.request(desc);
+    }
+    cache.request(broken);
+    CHECK(cache.saveManifest(path.c_str()));
+  }
+  {
+    std::ofstream file(path, std::ios::app);
+    file << "0123 not a pipeline\n";
+  }
+
+  std::vector<PipelineDesc> loaded = PipelineCache::loadManifest(path.c_str());
+  CHECK(loaded.size() == used.size());
+  for (size_t i = 0; i < loaded.size() && i < used.size(); i++) {
+    CHECK(loaded[i] == used[i]);
+    CHECK(loaded[i].label == used[i].label);
+  }
+
+  FakeCompiler compiler;
+  ThreadPool pool(2);
+  PipelineCache cache(compiler.backend(), pool);
+  cache.prewarm(loaded);
+  CHECK(cache.stats().prewarmed == used.size());
+  CHECK(cache.acquire(forwardDesc()).valid());
+  CHECK(compiler.compiles == used.size());
+  std::remove(path.c_str());
+}
+
+ENGINE_TEST("pipelines/manifest_version_mismatch") {
+  std::string path = (std::filesystem::temp_directory_path() /
+                      "engine_tests_old_pipelines.txt")
+                         .string();
+  {
+    std::ofstream file(path, std::ios::trunc);
+    file << "pipeline-manifest 1\n";
+  }
+  CHECK(PipelineCache::loadManifest(path.c_str()).empty());
+  std::remove(path.c_str());
+  CHECK(PipelineCache::loadManifest(path.c_str()).empty());
+}
@@ -0,0 +1,51 @@
+#include "testing.hpp"
+
+#include "position_stream.hpp"
+#include "procedural_geometry.hpp"
+
+#include <cstring>
+
+// Counts around the four-at-a-time SIMD loop, its tail included, over the
+// strides the engine's vertex layouts use, from buffers that aren't 16 byte
+// aligned
+ENGINE_TEST("positions/matches_scalar_copy") {
+  TestRandom random(44);
+  for (size_t stride : {12, 16, 20, 32, 48}) {
+    for (size_t count = 0; count <= 37; count++) {
+      size_t floatsPerVertex = stride / 4;
+      // One float of offset on both sides
+      std::vector<float> vertices(1 + count * floatsPerVertex);
+      for (float &value : vertices) {
+        value = random.uniform(-100, 100);
+      }
+      std::vector<float> positions(1 + count * 3 + 1, -1.0f);
+      const float *source = vertices.data() + 1;
+      extractPositions(source, count, stride, positions.data() + 1);
+
+      CHECK(positions.front() == -1.0f && positions.back() == -1.0f);
+      for (size_t i = 0; i < count; i++) {
+        for (size_t c = 0; c < 3; c++) {
+          CHECK(positions[1 + i * 3 + c] == source[i * floatsPerVertex + c]);
+        }
+      }
+    }
+  }
+}
+
+// The engine's meshes, through the vector overload
+ENGINE_TEST("positions/mesh_vertices") {
+  Mesh sphere = generateUVSphere(17, 23, 2.0f, nullptr);
+  std::vector<float> positions =
+      extractPositions(sphere.vertices.data(), sphere.vertices.size(),
+                       sizeof(MeshVertex));
+  CHECK(positions.size() == sphere.vertices.size() * positionStreamComponents);
+  bool same = true;
+  for (size_t i = 0; i < sphere.vertices.size(); i++) {
+    const Float4 &position = sphere.vertices[i].position;
+    same = same && positions[i * 3] == position.x &&
+           positions[i * 3 + 1] == position.y &&
+           positions[i * 3 + 2] == position.z;
+  }
+  CHECK(same);
+  CHECK(extractPositions(nullptr, 0, sizeof(MeshVertex)).empty());
+}
@@ -0,0 +1,172 @@
+#include "testing.hpp"
+
+#include "profiler.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+static ProfileEvent profileEvent(const char *name, uint64_t start,
+                                 uint64_t end, uint32_t thread = 0,
+                                 ProfileTrack track = ProfileTrack::Cpu) {
+  ProfileEvent event;
+  event.name = name;
+  event.startNanoseconds = start;
+  event.endNanoseconds = end;
+  event.thread = thread;
+  event.track = track;
+  return event;
+}
+
+ENGINE_TEST("profiler/ring_drops_when_full") {
+  ProfileEventRing ring(5);
+  CHECK(ring.capacity() == 8);
+  for (uint64_t i = 0; i < 10; i++) {
+    CHECK(ring.push(profileEvent("zone", i, i + 1)) == (i < 8));
+  }
+  CHECK(ring.dropped() == 2);
+  std::vector<ProfileEvent> events;
+  CHECK(ring.drain(events) == 8);
+  for (uint64_t i = 0; i < events.size(); i++) {
+    CHECK(events[i].startNanoseconds == i);
+  }
+  // Drained slots can be used again
+  CHECK(ring.push(profileEvent("zone", 20, 21)));
+  CHECK(ring.drain(events) == 1);
+  CHECK(events.back().startNanoseconds == 20);
+}
+
+// Zones from several threads, each under the index of its thread
+ENGINE_TEST("profiler/collects_every_thread") {
+  Profiler profiler(64);
+  profiler.setThreadName("Main");
+  { ProfileScope zone("Main zone", profiler); }
+  std::thread worker([&]() {
+    profiler.setThreadName("Worker");
+    for (int i = 0; i < 3; i++) {
+      ProfileScope zone("Worker zone", profiler);
+    }
+  });
+  worker.join();
+  profiler.setEnabled(false);
+  { ProfileScope zone("Not recorded", profiler); }
+  profiler.record("Not recorded either", 1, 2);
+  profiler.setEnabled(true);
+
+  std::vector<ProfileEvent> events;
+  profiler.collect(events);
+  CHECK(events.size() == 4);
+  CHECK((profiler.threadNames() == std::vector<std::string>{"Main", "Worker"}));
+  uint32_t workerZones = 0;
+  for (const ProfileEvent &event : events) {
+    CHECK(event.endNanoseconds >= event.startNanoseconds);
+    CHECK(event.track == ProfileTrack::Cpu);
+    if (event.thread == 1) {
+      CHECK(std::string(event.name) == "Worker zone");
+      workerZones++;
+    }
+  }
+  CHECK(workerZones == 3);
+  events.clear();
+  profiler.collect(events);
+  CHECK(events.empty());
+  CHECK(profiler.droppedEvents() == 0);
+}
+
+ENGINE_TEST("profiler/chrome_trace_output") {
+  std::vector<ProfileEvent> events = {
+      profileEvent("Frame", 1000000, 17500000),
+      profileEvent("Say \"cheese\"\n", 2000000, 2001500, 1),
+      profileEvent("Command buffer", 3000000, 9000000, 0,
+                   ProfileTrack::GpuCommandBuffer),
+      profileEvent("Shadows", 3500000, 4250000, 0, ProfileTrack::GpuPass),
+  };
+  std::string json = chromeTraceJson(events, {"Main", ""});
+  const char *expected[] = {
+      "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":1,\"tid\":0,"
+      "\"args\":{\"name\":\"CPU\"}}",
+      "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":0,"
+      "\"args\":{\"name\":\"Main\"}}",
+      "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":1,"
+      "\"args\":{\"name\":\"Thread 1\"}}",
+      "{\"ph\":\"X\",\"name\":\"Frame\",\"pid\":1,\"tid\":0,\"ts\":0.000,"
+      "\"dur\":16500.000}",
+      "{\"ph\":\"X\",\"name\":\"Say \\\"cheese\\\"\\u000a\",\"pid\":1,"
+      "\"tid\":1,\"ts\":1000.000,\"dur\":1.500}",
+      "{\"ph\":\"X\",\"name\":\"Command buffer\",\"pid\":2,\"tid\":0,"
+      "\"ts\":2000.000,\"dur\":6000.000}",
+      "{\"ph\":\"X\",\"name\":\"Shadows\",\"pid\":2,\"tid\":1,"
+      "\"ts\":2500.000,\"dur\":750.000}",
+  };
+  for (const char *line : expected) {
+    CHECK(json.find(line) != std::string::npos);
+  }
+  CHECK(json.rfind("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", 0) == 0);
+  CHECK(json.compare(json.size() - 5, 5, "}\n]}\n") == 0);
+  CHECK(json.find(",\n]") == std::string::npos);
+
+  std::string path =
+      (std::filesystem::temp_directory_path() / "engine_tests_trace.json")
+          .string();
+  CHECK(writeChromeTrace(path.c_str(), events, {"Main", ""}));
+  std::ifstream file(path);
+  std::stringstream written;
+  written << file.rdbuf();
+  CHECK(written.str() == json);
+  std::remove(path.c_str());
+}
+
+ENGINE_TEST("profiler/gpu_zones") {
+  // A 24 MHz tick counter whose tick 1000 is 5 ms on the profiler's clock
+  GpuClockSample first = {1000, 5000000};
+  GpuClockSample second = {1000 + 24000, 6000000};
+  CHECK(gpuTicksToNanoseconds(first, second, 1000 + 12000) == 5500000);
+  CHECK(gpuTicksToNanoseconds(first, second, 1000 + 48000) == 7000000);
+  CHECK(gpuTicksToNanoseconds(first, second, 1000 - 2400) == 4900000);
+
+  GpuZoneRecorder recorder(3, 4);
+  CHECK(recorder.sampleCount() == 24);
+  recorder.beginFrame(4, first);
+  CHECK(recorder.addZone("Shadows") == 8);
+  CHECK(recorder.addZone("Forward") == 10);
+  CHECK(recorder.addZone("Skipped") == 12);
+  CHECK(recorder.addZone("Hi-Z") == 14);
+  CHECK(recorder.addZone("Too many") == GpuZoneRecorder::noSample);
+
+  Profiler profiler;
+  const uint64_t timestamps[8] = {
+      1000, 1000 + 2400, 1000 + 2400, 1000 + 24000,
+      GpuZoneRecorder::invalidTimestamp, GpuZoneRecorder::invalidTimestamp,
+      0, 0};
+  GpuZoneRecorder::resolve(recorder.frame(), second, timestamps, profiler);
+  std::vector<ProfileEvent> events;
+  profiler.collect(events);
+  CHECK(events.size() == 2);
+  if (events.size() == 2) {
+    CHECK(std::string(events[1].name) == "Forward");
+    CHECK(events[1].track == ProfileTrack::GpuPass);
+    CHECK(events[1].startNanoseconds == 5100000);
+    CHECK(events[1].endNanoseconds == 6000000);
+  }
+}
+
+ENGINE_TEST("profiler/frame_time_percentiles") {
+  FrameTimeHistory history(100);
+  CHECK(history.summary().frames == 0);
+  // Older than the window
+  for (int i = 0; i < 50; i++) {
+    history.add(1000.0);
+  }
+  for (int i = 1; i <= 100; i++) {
+    history.add(i);
+  }
+  FrameTimeSummary summary = history.summary();
+  CHECK(summary.frames == 100);
+  CHECK_NEAR(summary.mean, 50.5, 1e-9);
+  CHECK(summary.p50 == 50 && summary.p95 == 95 && summary.p99 == 99);
+  CHECK(summary.max == 100);
+  history.clear();
+  CHECK(history.summary().frames == 0);
+}
@@ -0,0 +1,229 @@
+#include "testing.hpp"
+
+#include "render_graph.hpp"
+
+#include <memory>
+#include <set>
+
+// Stands in for the Metal backend: no textureSizeAndAlign, so the graph
+// plans with 4 bytes per sample, and textures are just numbers
+struct FakeGraphBackend {
+  uintptr_t nextTexture = 1;
+  std::set<void *> live;
+  uint32_t memorylessCreated = 0;
+  uint64_t reservedHeap = 0;
+
+  RenderGraph::Backend backend() {
+    RenderGraph::Backend backend;
+    backend.reserveHeap = [this](uint64_t size) { reservedHeap = size; };
+    backend.createTransient = [this](const RGTextureDesc &desc,
+                                     uint64_t) -> void * {
+      void *texture = (void *)nextTexture++;
+      live.insert(texture);
+      memorylessCreated += desc.memoryless ? 1 : 0;
+      return texture;
+    };
+    backend.destroy = [this](const RGTextureDesc &, void *texture) {
+      live.erase(texture);
+    };
+    return backend;
+  }
+};
+
+static RGTextureDesc fullScreen(uint32_t sampleCount = 1) {
+  RGTextureDesc desc;
+  desc.width = 1920;
+  desc.height = 1080;
+  desc.sampleCount = sampleCount;
+  return desc;
+}
+
+static const uint64_t fullScreenBytes = 1920ull * 1080 * 4;
+
+// A post-processing chain, each pass reading the one before: the first and
+// last intermediate textures are never alive at the same time
+ENGINE_TEST("render_graph/aliasing_saves_memory") {
+  FakeGraphBackend fake;
+  RenderGraph graph(fake.backend());
+  RGResource output = graph.importTexture("Drawable", nullptr, fullScreen());
+  graph.markOutput(output);
+  RGResource scene = invalidRGResource, bloom = invalidRGResource,
+             tonemapped = invalidRGResource;
+  graph.addPass(
+      "Scene",
+      [&](RenderGraphBuilder &builder) {
+        scene = builder.create("Scene", fullScreen());
+      },
+      nullptr);
+  graph.addPass(
+      "Bloom",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(scene);
+        bloom = builder.create("Bloom", fullScreen());
+      },
+      nullptr);
+  graph.addPass(
+      "Tonemap",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(bloom);
+        tonemapped = builder.create("Tonemapped", fullScreen());
+      },
+      nullptr);
+  graph.addPass(
+      "Present",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(tonemapped);
+        builder.write(output);
+      },
+      nullptr);
+  CHECK(graph.compile());
+
+  const RenderGraphStats &stats = graph.stats();
+  CHECK(stats.transientTextures == 3);
+  CHECK(stats.unaliasedBytes == 3 * fullScreenBytes);
+  CHECK(stats.aliasedBytes == 2 * fullScreenBytes);
+  CHECK(graph.heapOffset(scene) == graph.heapOffset(tonemapped));
+  CHECK(graph.heapOffset(scene) != graph.heapOffset(bloom));
+
+  graph.execute(nullptr);
+  CHECK(fake.reservedHeap == stats.aliasedBytes);
+  CHECK(fake.live.size() == 3);
+  graph.reset();
+  CHECK(fake.live.empty());
+}
+
+// The engine's frame with Hi-Z culling, see MTLEngine::buildFrameGraph
+static void buildForwardFrame(RenderGraph &graph, bool hizCulling,
+                              bool memoryless, std::vector<void *> &targets) {
+  RGResource drawable = graph.importTexture("Drawable", nullptr, fullScreen());
+  RGResource shadows = graph.importTexture("Shadow Map", nullptr, {});
+  RGResource hiz = graph.importTexture("Hi-Z", nullptr, fullScreen());
+  graph.markOutput(drawable);
+  RGTextureDesc msaaDesc = fullScreen(4);
+  msaaDesc.memoryless = memoryless;
+  auto resources = std::make_shared<std::vector<RGResource>>();
+
+  graph.addPass(
+      "Cull",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(hiz);
+        builder.sideEffect();
+      },
+      nullptr);
+  graph.addPass(
+      "Shadows", [&](RenderGraphBuilder &builder) { builder.write(shadows); },
+      nullptr);
+  graph.addPass(
+      "Forward",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(shadows);
+        resources->push_back(builder.create("MSAA Color", msaaDesc));
+        resources->push_back(builder.create("Depth", msaaDesc));
+        builder.write(drawable);
+        if (hizCulling) {
+          resources->push_back(builder.create("Hi-Z Depth", fullScreen()));
+        }
+      },
+      [resources, &targets](RenderGraphPassContext &context) {
+        for (RGResource resource : *resources) {
+          targets.push_back(context.texture(resource));
+        }
+      });
+  if (!hizCulling) {
+    return;
+  }
+  graph.addPass(
+      "Hi-Z",
+      [&](RenderGraphBuilder &builder) {
+        builder.read((*resources)[2]);
+        builder.write(hiz);
+      },
+      nullptr);
+  graph.addPass(
+      "Cull Late",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(hiz);
+        builder.sideEffect();
+      },
+      nullptr);
+  graph.addPass(
+      "Forward Late",
+      [&](RenderGraphBuilder &builder) {
+        builder.read(shadows);
+        builder.write((*resources)[0]);
+        builder.write((*resources)[1]);
+        builder.write(drawable);
+      },
+      nullptr);
+}
+
+ENGINE_TEST("render_graph/forward_frame_transients") {
+  FakeGraphBackend fake;
+  RenderGraph graph(fake.backend());
+  std::vector<void *> targets;
+  buildForwardFrame(graph, true, false, targets);
+  CHECK(graph.compile());
+  CHECK(graph.executionOrder() ==
+        std::vector<std::string>({"Cull", "Shadows", "Forward", "Hi-Z",
+                                  "Cull Late", "Forward Late"}));
+  // All three are alive during the Hi-Z pass, so nothing can share
+  const RenderGraphStats &stats = graph.stats();
+  CHECK(stats.transientTextures == 3 && stats.memorylessTextures == 0);
+  CHECK(stats.unaliasedBytes == 9 * fullScreenBytes);
+  CHECK(stats.aliasedBytes == stats.unaliasedBytes);
+  graph.execute(nullptr);
+  CHECK(targets.size() == 3);
+  CHECK(fake.live.size() == 3);
+  for (void *target : targets) {
+    CHECK(target != nullptr && fake.live.count(target) == 1);
+  }
+  graph.reset();
+  CHECK(fake.live.empty());
+}
+
+// Without Hi-Z culling the attachments live in tile memory only, and the
+// heap isn't needed at all
+ENGINE_TEST("render_graph/memoryless_takes_no_heap") {
+  FakeGraphBackend fake;
+  RenderGraph graph(fake.backend());
+  std::vector<void *> targets;
+  buildForwardFrame(graph, false, true, targets);
+  CHECK(graph.compile());
+  const RenderGraphStats &stats = graph.stats();
+  CHECK(stats.transientTextures == 2 && stats.memorylessTextures == 2);
+  CHECK(stats.aliasedBytes == 0 && stats.unaliasedBytes == 0);
+  graph.execute(nullptr);
+  CHECK(fake.reservedHeap == 0);
+  CHECK(fake.memorylessCreated == 2);
+  CHECK(targets.size() == 2 && targets[0] && targets[1]);
+  graph.reset();
+  CHECK(fake.live.empty());
+}
+
+ENGINE_TEST("render_graph/culls_unused_passes") {
+  FakeGraphBackend fake;
+  RenderGraph graph(fake.backend());
+  RGResource output = graph.importTexture("Drawable", nullptr, fullScreen());
+  graph.markOutput(output);
+  RGResource unused = invalidRGResource;
+  graph.addPass(
+      "Debug View",
+      [&](RenderGraphBuilder &builder) {
+        unused = builder.create("Debug", fullScreen());
+      },
+      nullptr);
+  graph.addPass(
+      "Debug Overlay",
+      [&](RenderGraphBuilder &builder) { builder.read(unused); }, nullptr);
+  graph.addPass(
+      "Upload", [](RenderGraphBuilder &builder) { builder.sideEffect(); },
+      nullptr);
+  graph.addPass(
+      "Draw", [&](RenderGraphBuilder &builder) { builder.write(output); },
+      nullptr);
+  CHECK(graph.compile());
+  CHECK(graph.executionOrder() ==
+        std::vector<std::string>({"Upload", "Draw"}));
+  CHECK(graph.stats().culledPasses == 2);
+  CHECK(graph.stats().transientTextures == 0);
+}
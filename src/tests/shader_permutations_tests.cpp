@@ -0,0 +1,108 @@
+#include "testing.hpp"
+
+#include "shader_permutations.hpp"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+ENGINE_TEST("permutations/canonical_features") {
+  CHECK(canonicalShaderFeatures(0) == 0);
+  CHECK(canonicalShaderFeatures(ShaderFeatureAll) == ShaderFeatureAll);
+  // Bits past the last feature don't make a different permutation
+  CHECK(canonicalShaderFeatures(ShaderFeatureSpecular | (1u << 7) |
+                                (1u << 31)) == ShaderFeatureSpecular);
+  CHECK(shaderFeatureName(ShaderFeatureTextured | (1u << 12)) == "textured");
+}
+
+// Every one of the 32 masks has a name that parses back to it
+ENGINE_TEST("permutations/name_round_trip") {
+  CHECK(shaderFeatureName(0) == "base");
+  CHECK(shaderFeatureName(ShaderFeatureTextured | ShaderFeatureShadows) ==
+        "textured+shadows");
+  for (uint32_t features = 0; features <= ShaderFeatureAll; features++) {
+    uint32_t parsed = ~0u;
+    CHECK(parseShaderFeatureName(shaderFeatureName(features), parsed));
+    CHECK(parsed == features);
+  }
+
+  uint32_t features;
+  CHECK(parseShaderFeatureName("shadows+vertexcolor", features));
+  CHECK(features == (ShaderFeatureShadows | ShaderFeatureVertexColor));
+  CHECK(!parseShaderFeatureName("textured+normalmap", features));
+  CHECK(!parseShaderFeatureName("", features));
+  CHECK(!parseShaderFeatureName("Textured", features));
+}
+
+ENGINE_TEST("permutations/describe_fills_uber_shader") {
+  ShaderPermutationManager permutations("forwardVertexShader",
+                                        "forwardFragmentShader");
+  PipelineDesc base;
+  base.label = "Forward";
+  base.vertexFunction = "someOtherVertexShader";
+  base.colorFormats[0] = 80;
+  base.sampleCount = 4;
+
+  uint32_t features = ShaderFeatureSpecular | ShaderFeatureInstancing;
+  PipelineDesc desc = permutations.describe(features | (1u << 20), base);
+  CHECK(desc.vertexFunction == "forwardVertexShader");
+  CHECK(desc.fragmentFunction == "forwardFragmentShader");
+  CHECK(desc.specialized);
+  CHECK(desc.shaderFeatures == features);
+  CHECK(desc.label == "Forward (specular+instancing)");
+  // The rest of the state comes from the base
+  CHECK(desc.colorFormats[0] == 80 && desc.sampleCount == 4);
+
+  // Permutations differ in their pipeline key, and only in their features
+  PipelineDesc other = permutations.describe(ShaderFeatureSpecular, base);
+  CHECK(hashPipelineDesc(other) != hashPipelineDesc(desc));
+  other.shaderFeatures = features;
+  CHECK(other == desc);
+}
+
+ENGINE_TEST("permutations/requested_without_duplicates") {
+  ShaderPermutationManager permutations("vs", "fs");
+  PipelineDesc base;
+  permutations.describe(ShaderFeatureShadows, base);
+  permutations.describe(0, base);
+  permutations.describe(ShaderFeatureShadows | (1u << 9), base);
+  permutations.describe(ShaderFeatureTextured | ShaderFeatureVertexColor,
+                        base);
+  permutations.describe(0, base);
+  CHECK((permutations.requested() ==
+         std::vector<uint32_t>{ShaderFeatureShadows, 0,
+                               ShaderFeatureTextured |
+                                   ShaderFeatureVertexColor}));
+  CHECK(permutations.manifest() == "10 shadows\n"
+                                   "0 base\n"
+                                   "3 textured+vertexcolor\n");
+}
+
+// The manifest file reads back into the masks that were requested
+ENGINE_TEST("permutations/manifest_file") {
+  ShaderPermutationManager permutations("vs", "fs");
+  PipelineDesc base;
+  for (uint32_t features : {0x1fu, 0x4u, 0x18u}) {
+    permutations.describe(features, base);
+  }
+  std::string path = (std::filesystem::temp_directory_path() /
+                      "engine_tests_permutations.txt")
+                         .string();
+  CHECK(permutations.writeManifest(path.c_str()));
+
+  std::ifstream file(path);
+  std::vector<uint32_t> read;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    uint32_t mask, named;
+    std::string name;
+    fields >> std::hex >> mask >> name;
+    CHECK(parseShaderFeatureName(name, named));
+    CHECK(named == mask);
+    read.push_back(mask);
+  }
+  CHECK(read == permutations.requested());
+  std::remove(path.c_str());
+}
@@ -0,0 +1,149 @@
+#include "testing.hpp"
+
+#include "shadow_cascades.hpp"
+
+#include <cmath>
+#include <cstring>
+
+static ShadowCamera shadowCamera(Float3 eye, float yawRadians) {
+  ShadowCamera camera;
+  Float3 forward = {std::sin(yawRadians), -0.2f, -std::cos(yawRadians)};
+  camera.view = makeLookAt(eye, eye + forward, {0, 1, 0});
+  camera.fovyRadians = 90 * (M_PI / 180.0f);
+  camera.aspect = 16.0f / 9.0f;
+  camera.nearZ = 0.1f;
+  camera.farZ = 100.0f;
+  return camera;
+}
+
+static const Float3 sunDirection = {-0.4f, -1.0f, -0.3f};
+
+ENGINE_TEST("shadows/cascade_splits") {
+  float uniform[4], logarithmic[4], blended[4];
+  computeCascadeSplits(1.0f, 100.0f, 4, 0.0f, uniform);
+  computeCascadeSplits(1.0f, 100.0f, 4, 1.0f, logarithmic);
+  computeCascadeSplits(1.0f, 100.0f, 4, 0.75f, blended);
+  for (uint32_t i = 0; i < 4; i++) {
+    CHECK_NEAR(uniform[i], 1.0f + 99.0f * (i + 1) / 4, 1e-3);
+    // Each cascade as many times deeper than the last
+    CHECK_NEAR(logarithmic[i], std::pow(100.0f, (i + 1) / 4.0f), 1e-3);
+    CHECK(blended[i] <= uniform[i] && blended[i] >= logarithmic[i]);
+    CHECK(i == 0 || blended[i] > blended[i - 1]);
+  }
+  CHECK(uniform[3] == 100.0f && logarithmic[3] == 100.0f &&
+        blended[3] == 100.0f);
+}
+
+// Every corner of the camera's frustum piece is inside its cascade
+ENGINE_TEST("shadows/cascade_covers_its_depth_range") {
+  ShadowCamera camera = shadowCamera({3, 4, 5}, 0.7f);
+  ShadowCascade cascades[ShadowCascadeCount];
+  CHECK(fitShadowCascades(camera, sunDirection, 0.75f, 50.0f, cascades) ==
+        ShadowCascadeCount);
+  Float4x4 cameraToWorld = inverse(camera.view);
+  float tanY = std::tan(camera.fovyRadians * 0.5f);
+  float tanX = tanY * camera.aspect;
+  for (const ShadowCascade &cascade : cascades) {
+    CHECK_NEAR(cascade.texelSize,
+               2.0f * cascade.radius / (float)ShadowMapResolution, 1e-6);
+    for (float depth : {cascade.nearDepth, cascade.farDepth}) {
+      for (float sx : {-1.0f, 1.0f}) {
+        for (float sy : {-1.0f, 1.0f}) {
+          Float3 corner = transformPoint(
+              cameraToWorld, {sx * tanX * depth, sy * tanY * depth, -depth});
+          Float4 clip = mul(cascade.viewProjection,
+                            Float4{corner.x, corner.y, corner.z, 1.0f});
+          CHECK(std::fabs(clip.x) <= 1.0f && std::fabs(clip.y) <= 1.0f);
+          CHECK(clip.z >= 0.0f && clip.z <= 1.0f);
+          CHECK(shadowCasterVisible(cascade, corner, 0.0f));
+        }
+      }
+    }
+  }
+  CHECK(cascades[0].nearDepth == camera.nearZ);
+  CHECK(cascades[ShadowCascadeCount - 1].farDepth == camera.farZ);
+  CHECK(cascades[0].texelSize < cascades[ShadowCascadeCount - 1].texelSize);
+}
+
+// Turning the camera on the spot never resizes a cascade
+ENGINE_TEST("shadows/rotation_keeps_cascade_size") {
+  ShadowCascade first[ShadowCascadeCount];
+  fitShadowCascades(shadowCamera({0, 2, 0}, 0.0f), sunDirection, 0.75f,
+                    50.0f, first);
+  for (float yaw = 0.1f; yaw < 6.3f; yaw += 0.37f) {
+    ShadowCascade turned[ShadowCascadeCount];
+    fitShadowCascades(shadowCamera({0, 2, 0}, yaw), sunDirection, 0.75f,
+                      50.0f, turned);
+    for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+      CHECK(turned[i].radius == first[i].radius);
+      CHECK(turned[i].texelSize == first[i].texelSize);
+    }
+  }
+}
+
+// Moving the camera moves the shadow map by whole texels only: a fixed world
+// point lands at the same place within its texel every frame
+ENGINE_TEST("shadows/translation_snaps_to_texels") {
+  TestRandom random(43);
+  Float3 points[3] = {{1.3f, 0.2f, -4.1f}, {-7.7f, 1.1f, -12.9f},
+                      {15.2f, -0.6f, -31.4f}};
+  ShadowCascade reference[ShadowCascadeCount];
+  fitShadowCascades(shadowCamera({0, 2, 0}, 0.3f), sunDirection, 0.75f,
+                    50.0f, reference);
+  for (int frame = 0; frame < 50; frame++) {
+    Float3 eye = {random.uniform(-0.5f, 0.5f), 2 + random.uniform(-0.1f, 0.1f),
+                  random.uniform(-0.5f, 0.5f)};
+    ShadowCascade moved[ShadowCascadeCount];
+    fitShadowCascades(shadowCamera(eye, 0.3f), sunDirection, 0.75f, 50.0f,
+                      moved);
+    for (uint32_t i = 0; i < ShadowCascadeCount; i++) {
+      CHECK(moved[i].texelSize == reference[i].texelSize);
+      float texelsPerClip = (float)ShadowMapResolution * 0.5f;
+      for (Float3 point : points) {
+        Float4 p = {point.x, point.y, point.z, 1.0f};
+        Float4 before = mul(reference[i].viewProjection, p);
+        Float4 after = mul(moved[i].viewProjection, p);
+        for (float shift :
+             {(after.x - before.x) * texelsPerClip,
+              (after.y - before.y) * texelsPerClip}) {
+          CHECK_NEAR(shift, std::round(shift), 0.02);
+        }
+      }
+    }
+  }
+}
+
+// Casters outside the box on the light's side still cast into it, those
+// off to the side don't
+ENGINE_TEST("shadows/caster_culling") {
+  ShadowCamera camera = shadowCamera({0, 2, 0}, 0.0f);
+  ShadowCascade cascades[ShadowCascadeCount];
+  fitShadowCascades(camera, sunDirection, 0.75f, 50.0f, cascades);
+  const ShadowCascade &cascade = cascades[1];
+  Float3 center = transformPoint(
+      inverse(camera.view),
+      {0, 0, -(cascade.nearDepth + cascade.farDepth) * 0.5f});
+  Float3 towardsLight = -normalize(sunDirection);
+  Float3 side = normalize(cross(towardsLight, {0, 0, 1}));
+
+  CullObject objects[3] = {};
+  Float3 positions[3] = {center, center + towardsLight * 200.0f,
+                         center + side * (cascade.radius * 3.0f)};
+  for (int i = 0; i < 3; i++) {
+    objects[i].center[0] = positions[i].x;
+    objects[i].center[1] = positions[i].y;
+    objects[i].center[2] = positions[i].z;
+    objects[i].radius = 1.0f;
+    Float4x4 model = makeTranslation(positions[i]);
+    memcpy(objects[i].model, &model, sizeof(model));
+  }
+  CHECK(shadowCasterVisible(cascade, positions[0], 1.0f));
+  CHECK(shadowCasterVisible(cascade, positions[1], 1.0f));
+  CHECK(!shadowCasterVisible(cascade, positions[2], 1.0f));
+
+  Float4x4 instances[3];
+  CHECK(cullShadowCasters(cascade, objects, 3, instances, 3) == 2);
+  CHECK(instances[1].columns[3].x == positions[1].x);
+  // Capacity is respected
+  CHECK(cullShadowCasters(cascade, objects, 3, instances, 1) == 1);
+}
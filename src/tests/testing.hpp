@@ -0,0 +1,82 @@
+#pragma once
+// The test harness behind engine_tests.
+//
+// A test is a function registered under a name with ENGINE_TEST, grouped by
+// prefix like benchmarks, e.g. "streaming/first_promotion_over_cap". CHECK
+// and CHECK_NEAR report a failed expectation on std::cerr and let the test
+// carry on, so one run shows every broken expectation rather than the
+// first. engine_tests [filter] runs the tests whose name contains the
+// filter and exits with 1 if any check failed; CMake registers one ctest
+// per group.
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct TestCase {
+  std::string name;
+  std::function<void()> run;
+};
+
+std::vector<TestCase> &registeredTests();
+
+struct TestRegistration {
+  TestRegistration(const char *name, void (*run)()) {
+    registeredTests().push_back({name, run});
+  }
+};
+
+// Records a failed check of the test running
+void reportFailure(const char *file, int line, const std::string &message);
+
+#define ENGINE_TEST_CONCAT_(a, b) a##b
+#define ENGINE_TEST_CONCAT(a, b) ENGINE_TEST_CONCAT_(a, b)
+#define ENGINE_TEST(name)                                                      \
+  static void ENGINE_TEST_CONCAT(engineTest, __LINE__)();                      \
+  static TestRegistration ENGINE_TEST_CONCAT(engineTestRegistration,           \
+                                             __LINE__)(                        \
+      name, ENGINE_TEST_CONCAT(engineTest, __LINE__));                         \
+  static void ENGINE_TEST_CONCAT(engineTest, __LINE__)()
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      reportFailure(__FILE__, __LINE__, #condition);                           \
+    }                                                                          \
+  } while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance)                                \
+  do {                                                                         \
+    double checkActual = (actual);                                             \
+    double checkExpected = (expected);                                         \
+    if (!(std::fabs(checkActual - checkExpected) <= (tolerance))) {            \
+      reportFailure(__FILE__, __LINE__,                                        \
+                    std::string(#actual " is ") +                              \
+                        std::to_string(checkActual) + ", expected " +          \
+                        std::to_string(checkExpected));                        \
+    }                                                                          \
+  } while (0)
+
+// The same xorshift64* as the benchmarks', for inputs that don't change
+// from one standard library to another
+class TestRandom {
+public:
+  explicit TestRandom(uint64_t seed) : state(seed ? seed : 1) {}
+
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1Dull;
+  }
+  // In [low, high)
+  float uniform(float low, float high) {
+    return low + (high - low) * ((next() >> 40) * (1.0f / (1 << 24)));
+  }
+  // In [0, count)
+  uint32_t below(uint32_t count) { return (uint32_t)(next() % count); }
+
+private:
+  uint64_t state;
+};
@@ -0,0 +1,134 @@
+#include "testing.hpp"
+
+#include "streaming/streaming_simulation.hpp"
+#include "texture_streaming.hpp"
+
+// A 4K view, objects around the camera cover all of it
+static StreamingView closeUpView() {
+  StreamingView view;
+  view.cameraPosition = {0, 0, 0};
+  view.cameraForward = {0, 0, -1};
+  view.viewportHeight = 2160.0f;
+  return view;
+}
+
+ENGINE_TEST("streaming/first_promotion_over_cap") {
+  StreamingConfig config;
+  config.memoryBudget = 512u << 20;
+  // Mip 0 of a 4096² RGBA texture alone is 64 MB
+  config.maxPromotionBytesPerUpdate = 16u << 20;
+  TextureStreamer streamer(config);
+  uint32_t id = streamer.registerTexture(4096, 4096, 4);
+  streamer.setBounds(id, {0, 0, -2}, 3.0f);
+  for (int i = 0; i < 32 && streamer.residentMip(id) > 0; i++) {
+    streamer.update(closeUpView());
+    // The cap still holds back everything after the first promotion
+    CHECK(streamer.stats().promotions <= 1 ||
+          streamer.residentMip(id) >= 2);
+  }
+  CHECK(streamer.desiredMip(id) == 0);
+  CHECK(streamer.residentMip(id) == 0);
+}
+
+ENGINE_TEST("streaming/cap_spreads_promotions") {
+  StreamingConfig config;
+  config.memoryBudget = 512u << 20;
+  config.maxPromotionBytesPerUpdate = 1u << 20;
+  TextureStreamer streamer(config);
+  uint32_t id = streamer.registerTexture(1024, 1024, 4);
+  streamer.setBounds(id, {0, 0, -2}, 3.0f);
+  uint32_t updates = 0;
+  do {
+    streamer.update(closeUpView());
+    updates++;
+  } while (streamer.residentMip(id) > streamer.desiredMip(id) && updates < 32);
+  CHECK(streamer.residentMip(id) == 0);
+  // 4 MB of mip 0 and 1 MB of mip 1 can't come in the same update
+  CHECK(updates >= 3);
+}
+
+ENGINE_TEST("streaming/nearer_gets_finer_mip") {
+  TextureStreamer streamer;
+  uint32_t near = streamer.registerTexture(2048, 2048, 4);
+  uint32_t far = streamer.registerTexture(2048, 2048, 4);
+  streamer.setBounds(near, {0, 0, -4}, 1.0f);
+  streamer.setBounds(far, {0, 0, -64}, 1.0f);
+  StreamingView view = closeUpView();
+  view.viewportHeight = 1080.0f;
+  for (int i = 0; i < 64; i++) {
+    streamer.update(view);
+  }
+  CHECK(streamer.desiredMip(near) + 3 < streamer.desiredMip(far));
+  CHECK(streamer.residentMip(near) == streamer.desiredMip(near));
+  CHECK(streamer.residentMip(far) == streamer.desiredMip(far));
+}
+
+ENGINE_TEST("streaming/behind_camera_stays_at_tail") {
+  TextureStreamer streamer;
+  uint32_t id = streamer.registerTexture(2048, 2048, 4);
+  streamer.setBounds(id, {0, 0, 8}, 1.0f);
+  uint32_t tail = streamer.residentMip(id);
+  for (int i = 0; i < 8; i++) {
+    streamer.update(closeUpView());
+  }
+  CHECK(streamer.residentMip(id) == tail);
+}
+
+ENGINE_TEST("streaming/shrinking_budget_evicts_least_important") {
+  StreamingConfig config;
+  config.memoryBudget = 256u << 20;
+  config.maxPromotionBytesPerUpdate = 256u << 20;
+  TextureStreamer streamer(config);
+  uint32_t near = streamer.registerTexture(2048, 2048, 4);
+  uint32_t far = streamer.registerTexture(2048, 2048, 4);
+  streamer.setBounds(near, {0, 0, -3}, 1.0f);
+  streamer.setBounds(far, {0, 0, -6}, 1.0f);
+  StreamingView view = closeUpView();
+  streamer.update(view);
+  uint32_t nearMip = streamer.residentMip(near);
+  uint32_t farMip = streamer.residentMip(far);
+  CHECK(nearMip == streamer.desiredMip(near));
+
+  // Room for the near texture's mips and little else
+  size_t budget = TextureStreamer::bytesForMips(2048, 2048, 4, nearMip) +
+                  (1u << 20);
+  streamer.setMemoryBudget(budget);
+  streamer.update(view);
+  CHECK(streamer.residentBytes() <= budget);
+  CHECK(streamer.residentMip(near) == nearMip);
+  CHECK(streamer.residentMip(far) > farMip);
+}
+
+ENGINE_TEST("streaming/camera_path_stays_in_budget") {
+  StreamingConfig config;
+  config.memoryBudget = 96u << 20;
+  config.maxPromotionBytesPerUpdate = 8u << 20;
+  StreamingSimulation simulation(config, 16, 3);
+  // The budget has to matter for the test to mean anything
+  CHECK(simulation.fullResidencyBytes() > 2 * config.memoryBudget);
+
+  const uint32_t steps = 1500;
+  uint32_t promotions = 0, demotions = 0;
+  for (uint32_t i = 0; i <= steps; i++) {
+    simulation.step((float)i / steps);
+    const StreamingStats &stats = simulation.streamer().stats();
+    CHECK(stats.residentBytes <= config.memoryBudget);
+    promotions += stats.promotions;
+    demotions += stats.demotions;
+  }
+  // Planets were brought in as the camera passed, and let go behind it
+  CHECK(promotions > 16);
+  CHECK(demotions > 16);
+
+  // At the end of the path the camera has stopped next to the last planet,
+  // which by then has every mip it wants
+  for (int i = 0; i < 200; i++) {
+    simulation.step(1.0f);
+  }
+  const SimulatedPlanet &last = simulation.planets().back();
+  const TextureStreamer &streamer = simulation.streamer();
+  CHECK(streamer.residentMip(last.textureId) ==
+        streamer.desiredMip(last.textureId));
+  CHECK(streamer.desiredMip(last.textureId) <
+        streamer.mipCount(last.textureId) - 4);
+}
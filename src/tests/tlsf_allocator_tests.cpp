@@ -0,0 +1,167 @@
+#include "testing.hpp"
+
+#include "tlsf_allocator.hpp"
+
+#include <algorithm>
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// What GpuBufferAllocator does with a request larger than its pages: a page
+// of size + alignment + granularity bytes holding just that allocation
+ENGINE_TEST("allocator/oversized_request_fits_own_page") {
+  const uint64_t mib = 1024 * 1024;
+  struct Request {
+    uint64_t size;
+    uint64_t alignment;
+  };
+  const Request requests[] = {
+      {16 * mib + 1000, 16}, {16 * mib + 1000, 256}, {16 * mib + 1, 16},
+      {16 * mib + 1, 4},     {17 * mib, 256},        {20 * mib, 256},
+      {100 * mib, 256},      {100 * mib + 7, 4096},  {1000, 256},
+  };
+  for (const Request &request : requests) {
+    TlsfAllocator allocator(request.size + request.alignment +
+                            TlsfAllocator::granularity);
+    TlsfAllocator::Allocation allocation =
+        allocator.allocate(request.size, request.alignment);
+    CHECK(allocation.valid());
+    CHECK(allocation.offset % request.alignment == 0);
+    CHECK(allocation.size >= request.size);
+    CHECK(allocator.validate());
+  }
+}
+
+// A fresh allocator hands out its whole capacity in one allocation, whatever
+// size class the capacity falls in
+ENGINE_TEST("allocator/whole_capacity") {
+  TestRandom random(1);
+  for (int i = 0; i < 200; i++) {
+    uint64_t capacity =
+        (1 + random.below(1u << 30)) * TlsfAllocator::granularity;
+    TlsfAllocator allocator(capacity);
+    TlsfAllocator::Allocation allocation = allocator.allocate(capacity);
+    CHECK(allocation.valid());
+    CHECK(allocation.offset == 0 && allocation.size == capacity);
+    CHECK(allocator.allocate(1).valid() == false);
+  }
+}
+
+struct LiveAllocation {
+  TlsfAllocator::Allocation allocation;
+  uint64_t requested;
+};
+
+// Random sizes between 1 byte and 256 KB, mostly small, at random
+// power-of-two alignments
+static void randomRequest(TestRandom &random, uint64_t &size,
+                          uint64_t &alignment) {
+  size = 1 + random.below(1u << (4 + random.below(15)));
+  alignment = 1ull << random.below(13);
+}
+
+static bool noOverlaps(std::vector<LiveAllocation> live, uint64_t capacity) {
+  std::sort(live.begin(), live.end(),
+            [](const LiveAllocation &a, const LiveAllocation &b) {
+              return a.allocation.offset < b.allocation.offset;
+            });
+  uint64_t end = 0;
+  for (const LiveAllocation &entry : live) {
+    if (entry.allocation.offset < end) {
+      return false;
+    }
+    end = entry.allocation.offset + entry.allocation.size;
+  }
+  return end <= capacity;
+}
+
+// Random allocations and releases against a list of what's live, checking
+// placement and the allocator's own invariants as it goes
+ENGINE_TEST("allocator/fuzz") {
+  for (uint64_t seed = 1; seed <= 8; seed++) {
+    TestRandom random(seed);
+    const uint64_t capacity = 64ull << 20;
+    TlsfAllocator allocator(capacity);
+    std::vector<LiveAllocation> live;
+    bool placed = true, invariants = true;
+    for (int step = 0; step < 20000; step++) {
+      // Biased towards allocating until about half the steps are done, then
+      // towards releasing, so the allocator runs both full and empty
+      uint32_t allocateOdds = step < 10000 ? 3 : 1;
+      if (live.empty() || random.below(allocateOdds + 1) != 0) {
+        uint64_t size, alignment;
+        randomRequest(random, size, alignment);
+        TlsfAllocator::Allocation allocation =
+            allocator.allocate(size, alignment);
+        if (allocation.valid()) {
+          placed = placed && allocation.offset % alignment == 0 &&
+                   allocation.size >= size;
+          live.push_back({allocation, size});
+        }
+      } else {
+        size_t index = random.below((uint32_t)live.size());
+        allocator.release(live[index].allocation.id);
+        live[index] = live.back();
+        live.pop_back();
+      }
+      if (step % 500 == 0) {
+        invariants = invariants && allocator.validate() &&
+                     noOverlaps(live, capacity) &&
+                     allocator.stats().allocationCount == live.size();
+      }
+    }
+    CHECK(placed);
+    CHECK(invariants);
+
+    uint64_t used = 0;
+    for (const LiveAllocation &entry : live) {
+      used += entry.allocation.size;
+    }
+    CHECK(allocator.stats().usedBytes == used);
+    for (const LiveAllocation &entry : live) {
+      allocator.release(entry.allocation.id);
+    }
+    TlsfAllocator::Stats stats = allocator.stats();
+    CHECK(allocator.validate());
+    CHECK(stats.freeBlockCount == 1 && stats.freeBytes == capacity);
+    CHECK(stats.fragmentation == 0.0f);
+  }
+}
+
+// Filled until requests fail: a failed request must be one no free block
+// could have held, good fit rounding notwithstanding
+ENGINE_TEST("allocator/fails_only_when_nothing_fits") {
+  for (uint64_t seed = 1; seed <= 8; seed++) {
+    TestRandom random(seed * 77);
+    TlsfAllocator allocator(4ull << 20);
+    std::vector<uint32_t> live;
+    uint32_t failures = 0;
+    bool honest = true;
+    for (int step = 0; step < 5000; step++) {
+      uint64_t size, alignment;
+      randomRequest(random, size, alignment);
+      TlsfAllocator::Allocation allocation =
+          allocator.allocate(size, alignment);
+      if (allocation.valid()) {
+        live.push_back(allocation.id);
+      } else {
+        failures++;
+        uint64_t needed = alignUp(size, TlsfAllocator::granularity) +
+                          std::max(alignment, TlsfAllocator::granularity) -
+                          TlsfAllocator::granularity;
+        honest = honest && allocator.stats().largestFreeBlock < needed;
+      }
+      // Punch holes now and then so the free memory gets fragmented
+      if (!live.empty() && random.below(3) == 0) {
+        size_t index = random.below((uint32_t)live.size());
+        allocator.release(live[index]);
+        live[index] = live.back();
+        live.pop_back();
+      }
+    }
+    CHECK(failures > 0);
+    CHECK(honest);
+    CHECK(allocator.validate());
+  }
+}
@@ -1,23 +1,47 @@
 #include "texture.hpp"
 
-Texture::Texture(const char *filepath, MTL::Device *metalDevice) {
-  device = metalDevice;
+#include <algorithm>
+
+// Load image as RGBA8, asset that it's valid. Metal expects 0 coordinate to be
+// on the bottom of image rather than top, so flip it while decoding.
+static DecodedImage decodeTextureFile(const char *filepath) {
   char cwd[1024];
   getcwd(cwd, sizeof(cwd));
   printf("Current working directory: %s\n", cwd);
   printf("Trying to load texture: %s\n", filepath);
-  // Metal expects 0 coordinate to be on the bottom of image rather than top
-  stbi_set_flip_vertically_on_load(true);
+  DecodedImage decoded =
+      decodeImageFile(filepath, true, &ThreadPool::shared());
+  if (!decoded.valid()) {
+    printf("Failed to load image: %s\n", decoded.error.c_str());
+    printf("Full path attempted: %s/%s\n", cwd, filepath);
+  }
+  assert(decoded.valid());
+  return decoded;
+}
 
-  // Load image, asset that it's not null
-  unsigned char *image =
-      stbi_load(filepath, &width, &height, &channels, STBI_rgb_alpha);
+Texture::Texture(const char *filepath, MTL::Device *metalDevice,
+                 bool streamed)
+    : Texture(decodeTextureFile(filepath), metalDevice, streamed) {}
 
-  if (image == NULL) {
-    printf("Failed to load image: %s\n", stbi_failure_reason());
-    printf("Full path attempted: %s/%s\n", cwd, filepath);
+Texture::Texture(const DecodedImage &decoded, MTL::Device *metalDevice,
+                 bool streamed) {
+  device = metalDevice;
+  assert(decoded.valid());
+  width = decoded.width;
+  height = decoded.height;
+  channels = decoded.channels;
+
+  const unsigned char *image = decoded.pixels.data();
+
+  if (streamed) {
+    // Keep the decoded mips around and start off with only the smallest one
+    // on the GPU, the streamer promotes it once it knows how big it is on
+    // screen
+    mipChain = buildMipChain(image, width, height);
+    texture = nullptr;
+    setResidentMip(mipCount() - 1);
+    return;
   }
-  assert(image != NULL);
 
   // Create a texture descriptor that specifies texture properties
   // (format, dimensions, etc)
@@ -43,10 +67,44 @@ Texture::Texture(const char *filepath, MTL::Device *metalDevice) {
   // informatiion for data layout
   texture->replaceRegion(region, 0, image, bytesPerRow);
 
-  // Release the texture descriptor object from memory
+  // Release the texture descriptor object from memory. The CPU image data is
+  // owned by `decoded`, and can be freed now that it's on the GPU
   textureDescriptor->release();
-  // Free CPU image data since it's now on the GPU
-  stbi_image_free(image);
 };
 
+void Texture::setResidentMip(uint32_t mip) {
+  assert(!mipChain.empty() && mip < mipCount());
+  if (texture && mip == currentResidentMip) {
+    return;
+  }
+
+  NS::UInteger topWidth = std::max(1, width >> mip);
+  NS::UInteger topHeight = std::max(1, height >> mip);
+  MTL::TextureDescriptor *textureDescriptor =
+      MTL::TextureDescriptor::alloc()->init();
+  textureDescriptor->setPixelFormat(MTL::PixelFormatRGBA8Unorm);
+  textureDescriptor->setWidth(topWidth);
+  textureDescriptor->setHeight(topHeight);
+  textureDescriptor->setMipmapLevelCount(mipCount() - mip);
+  MTL::Texture *newTexture = device->newTexture(textureDescriptor);
+  textureDescriptor->release();
+
+  // Level 0 of the new texture is mip `mip` of the full chain
+  for (uint32_t level = mip; level < mipCount(); level++) {
+    NS::UInteger levelWidth = std::max(1, width >> level);
+    NS::UInteger levelHeight = std::max(1, height >> level);
+    MTL::Region region = MTL::Region(0, 0, 0, levelWidth, levelHeight, 1);
+    newTexture->replaceRegion(region, level - mip, mipChain[level].data(),
+                              4 * levelWidth);
+  }
+
+  // Command buffers retain the textures they use, so releasing the old one
+  // here is safe even if a frame using it is still in flight
+  if (texture) {
+    texture->release();
+  }
+  texture = newTexture;
+  currentResidentMip = mip;
+}
+
 Texture::~Texture() { texture->release(); }
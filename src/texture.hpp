@@ -1,14 +1,32 @@
 #pragma once
+#include "image_decode.hpp"
 #include <Metal/Metal.hpp>
-#include <stb/stb_image.h>
+
+#include <cstdint>
+#include <vector>
 
 class Texture {
 public:
-  Texture(const char *filepath, MTL::Device *metalDevice);
+  // A streamed texture keeps its full mip chain in CPU memory and only has
+  // the mips chosen by the TextureStreamer resident on the GPU (initially
+  // just the smallest one), see setResidentMip.
+  Texture(const char *filepath, MTL::Device *metalDevice,
+          bool streamed = false);
+  // From an image decoded elsewhere, e.g. on a pool thread
+  Texture(const DecodedImage &decoded, MTL::Device *metalDevice,
+          bool streamed = false);
   ~Texture();
   MTL::Texture *texture;
   int width, height, channels;
 
+  uint32_t mipCount() const { return (uint32_t)mipChain.size(); }
+  uint32_t residentMip() const { return currentResidentMip; }
+  // Recreates the GPU texture with mips [mip, mipCount) of a streamed texture
+  void setResidentMip(uint32_t mip);
+
 private:
   MTL::Device *device;
+  // RGBA8 data for every mip level, only filled in for streamed textures
+  std::vector<std::vector<unsigned char>> mipChain;
+  uint32_t currentResidentMip = 0;
 };
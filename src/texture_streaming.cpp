@@ -0,0 +1,253 @@
+#include "texture_streaming.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+TextureStreamer::TextureStreamer(StreamingConfig config) : config(config) {}
+
+uint32_t TextureStreamer::mipCountFor(uint32_t width, uint32_t height) {
+  uint32_t size = std::max(width, height);
+  uint32_t count = 1;
+  while (size > 1) {
+    size >>= 1;
+    count++;
+  }
+  return count;
+}
+
+size_t TextureStreamer::bytesForMips(uint32_t width, uint32_t height,
+                                     uint32_t bytesPerPixel,
+                                     uint32_t firstMip) {
+  size_t bytes = 0;
+  uint32_t count = mipCountFor(width, height);
+  for (uint32_t mip = firstMip; mip < count; mip++) {
+    size_t w = std::max(1u, width >> mip);
+    size_t h = std::max(1u, height >> mip);
+    bytes += w * h * bytesPerPixel;
+  }
+  return bytes;
+}
+
+size_t TextureStreamer::bytesAt(const Entry &entry, uint32_t firstMip) const {
+  return bytesForMips(entry.width, entry.height, entry.bytesPerPixel,
+                      firstMip);
+}
+
+uint32_t TextureStreamer::registerTexture(uint32_t width, uint32_t height,
+                                          uint32_t bytesPerPixel) {
+  Entry entry;
+  entry.width = width;
+  entry.height = height;
+  entry.bytesPerPixel = bytesPerPixel;
+  entry.mipCount = mipCountFor(width, height);
+  uint32_t tail = std::min(config.mipTailCount, entry.mipCount);
+  entry.tailMip = entry.mipCount - std::max(1u, tail);
+  entry.residentMip = entry.tailMip;
+  entry.desiredMip = entry.tailMip;
+  entry.priority = 0.0f;
+
+  totalResidentBytes += bytesAt(entry, entry.residentMip);
+  entries.push_back(entry);
+  return (uint32_t)entries.size() - 1;
+}
+
+void TextureStreamer::setBounds(uint32_t textureId, Float3 center,
+                                float radius) {
+  assert(textureId < entries.size());
+  entries[textureId].center = center;
+  entries[textureId].radius = radius;
+}
+
+void TextureStreamer::setMemoryBudget(size_t bytes) {
+  config.memoryBudget = bytes;
+}
+
+uint32_t TextureStreamer::residentMip(uint32_t textureId) const {
+  return entries[textureId].residentMip;
+}
+
+uint32_t TextureStreamer::desiredMip(uint32_t textureId) const {
+  return entries[textureId].desiredMip;
+}
+
+uint32_t TextureStreamer::mipCount(uint32_t textureId) const {
+  return entries[textureId].mipCount;
+}
+
+void TextureStreamer::computeDesired(Entry &entry,
+                                     const StreamingView &view) const {
+  Float3 toObject = entry.center - view.cameraPosition;
+  float distance = length(toObject);
+
+  // Entirely behind the camera, nothing to gain from extra detail
+  if (dot(toObject, view.cameraForward) < -entry.radius) {
+    entry.desiredMip = entry.tailMip;
+    entry.priority = 0.0f;
+    return;
+  }
+
+  // Projected diameter of the bounding sphere in pixels. Inside the sphere we
+  // treat the object as covering the whole viewport.
+  float pixelsPerUnit = view.viewportHeight / (2.0f * tanf(view.fovY * 0.5f));
+  float screenDiameter =
+      distance > entry.radius
+          ? 2.0f * entry.radius * pixelsPerUnit / distance
+          : view.viewportHeight;
+  screenDiameter = std::clamp(screenDiameter, 1.0f, view.viewportHeight);
+
+  // Pick the mip whose size is closest to the number of pixels covered
+  float texels = (float)std::max(entry.width, entry.height);
+  float mip = log2f(texels / screenDiameter) + config.mipBias;
+  int desired = (int)std::floor(std::max(mip, 0.0f));
+  entry.desiredMip = std::min((uint32_t)desired, entry.tailMip);
+  // Larger on screen means more important
+  entry.priority = screenDiameter * screenDiameter;
+}
+
+void TextureStreamer::setResident(uint32_t textureId, uint32_t mip) {
+  Entry &entry = entries[textureId];
+  if (entry.residentMip == mip) {
+    return;
+  }
+  totalResidentBytes -= bytesAt(entry, entry.residentMip);
+  totalResidentBytes += bytesAt(entry, mip);
+  if (mip < entry.residentMip) {
+    lastStats.promotions++;
+  } else {
+    lastStats.demotions++;
+  }
+  changes.push_back({textureId, entry.residentMip, mip});
+  entry.residentMip = mip;
+}
+
+size_t TextureStreamer::reclaimableBelow(float priority) const {
+  size_t reclaimable = 0;
+  for (const Entry &entry : entries) {
+    if (entry.priority < priority) {
+      reclaimable +=
+          bytesAt(entry, entry.residentMip) - bytesAt(entry, entry.tailMip);
+    }
+  }
+  return reclaimable;
+}
+
+void TextureStreamer::makeRoom(size_t bytesNeeded, float belowPriority) {
+  // First take back mips that are sharper than needed, and only then start
+  // evicting below the desired mip. `order` is sorted by descending priority,
+  // walk it backwards so the least important textures lose their mips first.
+  for (bool pastDesired : {false, true}) {
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+      Entry &entry = entries[*it];
+      if (entry.priority >= belowPriority) {
+        break;
+      }
+      uint32_t floorMip = pastDesired ? entry.tailMip : entry.desiredMip;
+      while (entry.residentMip < floorMip &&
+             totalResidentBytes + bytesNeeded > config.memoryBudget) {
+        setResident(*it, entry.residentMip + 1);
+      }
+      if (totalResidentBytes + bytesNeeded <= config.memoryBudget) {
+        return;
+      }
+    }
+  }
+}
+
+const std::vector<StreamingChange> &
+TextureStreamer::update(const StreamingView &view) {
+  changes.clear();
+  lastStats = {};
+
+  order.resize(entries.size());
+  for (uint32_t i = 0; i < entries.size(); i++) {
+    computeDesired(entries[i], view);
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return entries[a].priority > entries[b].priority;
+  });
+
+  // Textures that are sharper than needed are only kept around while there
+  // is room. Once they have been over resolved for a while, let them go.
+  for (uint32_t id : order) {
+    Entry &entry = entries[id];
+    if (entry.residentMip < entry.desiredMip) {
+      if (++entry.overResolvedUpdates >= config.demoteAfterUpdates) {
+        setResident(id, entry.desiredMip);
+        entry.overResolvedUpdates = 0;
+      }
+    } else {
+      entry.overResolvedUpdates = 0;
+    }
+  }
+
+  // Budget shrank (or was exceeded by new registrations): evict past the
+  // desired mip, lowest priority first
+  if (totalResidentBytes > config.memoryBudget) {
+    makeRoom(0, INFINITY);
+  }
+
+  // Promote one mip at a time in priority order so that an important texture
+  // gets its next level before a less important one gets its last
+  size_t promotedBytes = 0;
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (uint32_t id : order) {
+      Entry &entry = entries[id];
+      if (entry.residentMip <= entry.desiredMip) {
+        continue;
+      }
+      uint32_t next = entry.residentMip - 1;
+      size_t cost = bytesAt(entry, next) - bytesAt(entry, entry.residentMip);
+      // The first promotion of an update always goes ahead, or a mip larger
+      // than the whole per-update limit would never be promoted at all
+      if (promotedBytes > 0 &&
+          promotedBytes + cost > config.maxPromotionBytesPerUpdate) {
+        continue;
+      }
+      if (totalResidentBytes + cost > config.memoryBudget) {
+        // Only evict if it is enough to fit, otherwise we would throw away
+        // mips for a promotion that never happens
+        if (totalResidentBytes + cost >
+            config.memoryBudget + reclaimableBelow(entry.priority)) {
+          continue;
+        }
+        makeRoom(cost, entry.priority);
+      }
+      setResident(id, next);
+      promotedBytes += cost;
+      progress = true;
+    }
+  }
+
+  // A texture may have moved several times during the update, only report
+  // where it started and where it ended up
+  std::vector<StreamingChange> coalesced;
+  for (const StreamingChange &change : changes) {
+    auto existing = std::find_if(
+        coalesced.begin(), coalesced.end(),
+        [&](const StreamingChange &c) { return c.textureId == change.textureId; });
+    if (existing == coalesced.end()) {
+      coalesced.push_back(change);
+    } else {
+      existing->residentMip = change.residentMip;
+    }
+  }
+  changes.clear();
+  for (const StreamingChange &change : coalesced) {
+    if (change.previousMip != change.residentMip) {
+      changes.push_back(change);
+    }
+  }
+
+  for (const Entry &entry : entries) {
+    lastStats.wantedBytes += bytesAt(entry, entry.desiredMip);
+    if (entry.residentMip == entry.desiredMip) {
+      lastStats.texturesAtDesiredMip++;
+    }
+  }
+  lastStats.residentBytes = totalResidentBytes;
+  return changes;
+}
@@ -0,0 +1,116 @@
+#pragma once
+// Texture streaming bookkeeping.
+//
+// Textures are registered with their full resolution size; initially only the
+// lowest mips (the "mip tail") are resident. Every frame the streamer works out
+// how many texels each texture actually covers on screen, from the world space
+// bounding sphere of the object using it and the current projection, and
+// promotes textures towards the mip that matches that coverage. Promotions
+// are made in priority order under a global memory budget, and if the budget
+// is exceeded, the least important textures are demoted (evicted) first.
+//
+// Nothing in here touches Metal: the streamer only decides which mip should
+// be the finest resident one for every texture and reports the changes. The
+// Texture class applies them to the GPU resource.
+#include "engine_math.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct StreamingView {
+  Float3 cameraPosition;
+  Float3 cameraForward = {0, 0, -1};
+  // Vertical field of view in radians, as passed to the perspective matrix
+  float fovY = 90.0f * 3.14159265359f / 180.0f;
+  // Drawable height in pixels
+  float viewportHeight = 600.0f;
+};
+
+struct StreamingConfig {
+  // Total bytes that all resident mips are allowed to take up
+  size_t memoryBudget = 64 * 1024 * 1024;
+  // Every texture keeps at least this many of its smallest mips resident, so
+  // there is always something to sample
+  uint32_t mipTailCount = 4;
+  // Limit on bytes promoted per update, to spread uploads across frames. A
+  // single mip larger than this still goes, as the update's only promotion.
+  size_t maxPromotionBytesPerUpdate = 16 * 1024 * 1024;
+  // Bias added to the computed mip, positive values prefer lower resolution
+  float mipBias = 0.0f;
+  // A texture finer than it needs to be is only demoted once it has been over
+  // resolved for this many updates (or straight away under budget pressure)
+  uint32_t demoteAfterUpdates = 60;
+};
+
+struct StreamingChange {
+  uint32_t textureId;
+  uint32_t previousMip;
+  uint32_t residentMip;
+};
+
+struct StreamingStats {
+  size_t residentBytes = 0;
+  size_t wantedBytes = 0;
+  uint32_t promotions = 0;
+  uint32_t demotions = 0;
+  uint32_t texturesAtDesiredMip = 0;
+};
+
+class TextureStreamer {
+public:
+  explicit TextureStreamer(StreamingConfig config = {});
+
+  // Registers a texture and returns its id. Only the mip tail is resident.
+  uint32_t registerTexture(uint32_t width, uint32_t height,
+                           uint32_t bytesPerPixel);
+  // World space bounding sphere of the geometry the texture is mapped onto
+  void setBounds(uint32_t textureId, Float3 center, float radius);
+  void setMemoryBudget(size_t bytes);
+
+  // Re-prioritises every texture against the view and returns the resident
+  // mip changes to apply. The changes are assumed to be applied immediately.
+  const std::vector<StreamingChange> &update(const StreamingView &view);
+
+  uint32_t residentMip(uint32_t textureId) const;
+  uint32_t desiredMip(uint32_t textureId) const;
+  uint32_t mipCount(uint32_t textureId) const;
+  size_t residentBytes() const { return totalResidentBytes; }
+  const StreamingStats &stats() const { return lastStats; }
+
+  static uint32_t mipCountFor(uint32_t width, uint32_t height);
+  // Bytes taken up by mips [firstMip, mipCount)
+  static size_t bytesForMips(uint32_t width, uint32_t height,
+                             uint32_t bytesPerPixel, uint32_t firstMip);
+
+private:
+  struct Entry {
+    uint32_t width, height, bytesPerPixel;
+    uint32_t mipCount;
+    uint32_t tailMip; // Coarsest mip that never gets evicted
+    uint32_t residentMip;
+    uint32_t desiredMip;
+    float priority;
+    uint32_t overResolvedUpdates = 0;
+    Float3 center;
+    float radius = 1.0f;
+  };
+
+  size_t bytesAt(const Entry &entry, uint32_t firstMip) const;
+  void computeDesired(Entry &entry, const StreamingView &view) const;
+  void setResident(uint32_t textureId, uint32_t mip);
+  // Bytes that could be freed by demoting every texture less important than
+  // `priority` down to its mip tail
+  size_t reclaimableBelow(float priority) const;
+  // Demotes textures less important than `belowPriority`, least important
+  // first, until `bytesNeeded` more bytes fit in the budget (or nothing is
+  // left to evict)
+  void makeRoom(size_t bytesNeeded, float belowPriority);
+
+  StreamingConfig config;
+  std::vector<Entry> entries;
+  std::vector<StreamingChange> changes;
+  std::vector<uint32_t> order;
+  size_t totalResidentBytes = 0;
+  StreamingStats lastStats;
+};
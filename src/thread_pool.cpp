@@ -0,0 +1,102 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threadCount) {
+  if (threadCount == 0) {
+    size_t hardwareThreads = std::thread::hardware_concurrency();
+    threadCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+  }
+  for (size_t i = 0; i < threadCount; i++) {
+    workers.emplace_back([this]() { workerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  condition.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+ThreadPool &ThreadPool::shared() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::enqueue(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push(std::move(job));
+  }
+  condition.notify_one();
+}
+
+void ThreadPool::workerLoop() {
+  while (true) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (stopping && jobs.empty()) {
+        return;
+      }
+      job = std::move(jobs.front());
+      jobs.pop();
+    }
+    job();
+  }
+}
+
+void ThreadPool::parallelFor(
+    size_t count, size_t grainSize,
+    const std::function<void(size_t, size_t)> &function) {
+  if (count == 0) {
+    return;
+  }
+  grainSize = std::max<size_t>(1, grainSize);
+  size_t chunkCount = (count + grainSize - 1) / grainSize;
+  if (chunkCount == 1 || workers.empty()) {
+    function(0, count);
+    return;
+  }
+
+  // Shared between the caller and the helpers, helpers that only get to run
+  // after everything is done simply find no chunks left
+  struct State {
+    std::atomic<size_t> nextChunk{0};
+    std::atomic<size_t> finishedChunks{0};
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+  auto state = std::make_shared<State>();
+
+  auto runChunks = [state, count, grainSize, chunkCount, &function]() {
+    size_t chunk;
+    while ((chunk = state->nextChunk.fetch_add(1)) < chunkCount) {
+      size_t begin = chunk * grainSize;
+      size_t end = std::min(count, begin + grainSize);
+      function(begin, end);
+      if (state->finishedChunks.fetch_add(1) + 1 == chunkCount) {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->done.notify_all();
+      }
+    }
+  };
+
+  size_t helpers = std::min(workers.size(), chunkCount - 1);
+  for (size_t i = 0; i < helpers; i++) {
+    // Helpers capture `function` by reference, which is fine because they
+    // only touch it while a chunk is outstanding and we wait for those below
+    enqueue(runChunks);
+  }
+  runChunks();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done.wait(lock,
+                   [&]() { return state->finishedChunks.load() == chunkCount; });
+}
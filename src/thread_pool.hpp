@@ -0,0 +1,52 @@
+#pragma once
+// A small fixed size pool of worker threads shared by the CPU side systems
+// (image decoding, geometry generation, culling, ...).
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+  // 0 threads means one per hardware thread (minus the calling thread)
+  explicit ThreadPool(size_t threadCount = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t threadCount() const { return workers.size(); }
+
+  template <typename F> auto submit(F &&function) {
+    using Result = decltype(function());
+    auto task =
+        std::make_shared<std::packaged_task<Result()>>(std::forward<F>(function));
+    std::future<Result> future = task->get_future();
+    enqueue([task]() { (*task)(); });
+    return future;
+  }
+
+  // Runs function(begin, end) over [0, count) in chunks of `grainSize`.
+  // The calling thread takes chunks as well and only waits on chunks that
+  // are already running, so this is safe to call from inside a pool task.
+  void parallelFor(size_t count, size_t grainSize,
+                   const std::function<void(size_t, size_t)> &function);
+
+  // Process wide pool, created on first use
+  static ThreadPool &shared();
+
+private:
+  void enqueue(std::function<void()> job);
+  void workerLoop();
+
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool stopping = false;
+};
@@ -0,0 +1,313 @@
+#include "tlsf_allocator.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+TlsfAllocator::TlsfAllocator(uint64_t capacity)
+    : totalCapacity(capacity & ~(granularity - 1)) {
+  for (auto &lists : freeLists) {
+    std::fill(std::begin(lists), std::end(lists), invalidId);
+  }
+  if (totalCapacity > 0) {
+    uint32_t id = newBlock();
+    blocks[id].offset = 0;
+    blocks[id].size = totalCapacity;
+    insertFree(id);
+  }
+}
+
+// Sizes are bucketed in granularity units. Below secondLevelCount units the
+// second level is linear, above that each power of two is split into
+// secondLevelCount equally sized classes.
+void TlsfAllocator::mapping(uint64_t size, uint32_t &firstLevel,
+                            uint32_t &secondLevel) {
+  uint64_t units = size / granularity;
+  if (units < secondLevelCount) {
+    firstLevel = 0;
+    secondLevel = (uint32_t)units;
+    return;
+  }
+  uint32_t log2 = 63 - std::countl_zero(units);
+  firstLevel = log2 - secondLevelLog2 + 1;
+  secondLevel = (uint32_t)(units >> (log2 - secondLevelLog2)) ^ secondLevelCount;
+}
+
+uint32_t TlsfAllocator::findFreeBlock(uint64_t size) const {
+  // Round the request up to the next size class so that any block in the
+  // list we land on is large enough (good fit, not best fit)
+  uint64_t units = size / granularity;
+  if (units >= secondLevelCount) {
+    uint32_t log2 = 63 - std::countl_zero(units);
+    units += (1ull << (log2 - secondLevelLog2)) - 1;
+  }
+  uint32_t firstLevel, secondLevel;
+  mapping(units * granularity, firstLevel, secondLevel);
+  if (firstLevel < firstLevelCount) {
+    uint32_t secondMap =
+        secondLevelBitmaps[firstLevel] & (~0u << secondLevel);
+    if (secondMap == 0 && firstLevel + 1 < firstLevelCount) {
+      uint64_t firstMap = firstLevelBitmap & (~0ull << (firstLevel + 1));
+      if (firstMap != 0) {
+        firstLevel = std::countr_zero(firstMap);
+        secondMap = secondLevelBitmaps[firstLevel];
+      }
+    }
+    if (secondMap != 0) {
+      return freeLists[firstLevel][std::countr_zero(secondMap)];
+    }
+  }
+
+  // Nothing free in the classes above. The request's own class can still
+  // hold a block that's large enough, e.g. the single block of an allocator
+  // sized for exactly this request, so look through that list before giving
+  // up. This only happens once memory is nearly exhausted.
+  mapping(size, firstLevel, secondLevel);
+  if (firstLevel >= firstLevelCount) {
+    return invalidId;
+  }
+  for (uint32_t id = freeLists[firstLevel][secondLevel]; id != invalidId;
+       id = blocks[id].nextFree) {
+    if (blocks[id].size >= size) {
+      return id;
+    }
+  }
+  return invalidId;
+}
+
+void TlsfAllocator::insertFree(uint32_t id) {
+  Block &block = blocks[id];
+  uint32_t firstLevel, secondLevel;
+  mapping(block.size, firstLevel, secondLevel);
+  assert(firstLevel < firstLevelCount);
+
+  uint32_t head = freeLists[firstLevel][secondLevel];
+  block.free = true;
+  block.prevFree = invalidId;
+  block.nextFree = head;
+  if (head != invalidId) {
+    blocks[head].prevFree = id;
+  }
+  freeLists[firstLevel][secondLevel] = id;
+  firstLevelBitmap |= 1ull << firstLevel;
+  secondLevelBitmaps[firstLevel] |= 1u << secondLevel;
+
+  freeBytes += block.size;
+  freeBlockCount++;
+}
+
+void TlsfAllocator::removeFree(uint32_t id) {
+  Block &block = blocks[id];
+  uint32_t firstLevel, secondLevel;
+  mapping(block.size, firstLevel, secondLevel);
+
+  if (block.prevFree != invalidId) {
+    blocks[block.prevFree].nextFree = block.nextFree;
+  } else {
+    freeLists[firstLevel][secondLevel] = block.nextFree;
+  }
+  if (block.nextFree != invalidId) {
+    blocks[block.nextFree].prevFree = block.prevFree;
+  }
+  if (freeLists[firstLevel][secondLevel] == invalidId) {
+    secondLevelBitmaps[firstLevel] &= ~(1u << secondLevel);
+    if (secondLevelBitmaps[firstLevel] == 0) {
+      firstLevelBitmap &= ~(1ull << firstLevel);
+    }
+  }
+  block.free = false;
+  block.prevFree = block.nextFree = invalidId;
+
+  freeBytes -= block.size;
+  freeBlockCount--;
+}
+
+uint32_t TlsfAllocator::newBlock() {
+  uint32_t id;
+  if (!unusedBlocks.empty()) {
+    id = unusedBlocks.back();
+    unusedBlocks.pop_back();
+    blocks[id] = Block{};
+  } else {
+    id = (uint32_t)blocks.size();
+    blocks.emplace_back();
+  }
+  blocks[id].live = true;
+  return id;
+}
+
+void TlsfAllocator::deleteBlock(uint32_t id) {
+  blocks[id].live = false;
+  unusedBlocks.push_back(id);
+}
+
+uint32_t TlsfAllocator::split(uint32_t id, uint64_t size) {
+  uint32_t remainder = newBlock();
+  // `blocks` may have grown, don't hold references across newBlock()
+  Block &block = blocks[id];
+  Block &rest = blocks[remainder];
+  rest.offset = block.offset + size;
+  rest.size = block.size - size;
+  rest.prevPhysical = id;
+  rest.nextPhysical = block.nextPhysical;
+  if (block.nextPhysical != invalidId) {
+    blocks[block.nextPhysical].prevPhysical = remainder;
+  }
+  block.nextPhysical = remainder;
+  block.size = size;
+  return remainder;
+}
+
+TlsfAllocator::Allocation TlsfAllocator::allocate(uint64_t size,
+                                                  uint64_t alignment) {
+  assert(std::has_single_bit(alignment));
+  size = alignUp(std::max<uint64_t>(size, 1), granularity);
+  alignment = std::max(alignment, granularity);
+  // Over-allocate so any block we find can be aligned by trimming its front
+  uint64_t searchSize = size + (alignment - granularity);
+
+  uint32_t id = findFreeBlock(searchSize);
+  if (id == invalidId) {
+    return {};
+  }
+  removeFree(id);
+
+  uint64_t padding = alignUp(blocks[id].offset, alignment) - blocks[id].offset;
+  if (padding > 0) {
+    // The padding goes back on the free list. Its previous neighbour can't
+    // be free, since free blocks are always merged.
+    uint32_t aligned = split(id, padding);
+    insertFree(id);
+    id = aligned;
+  }
+  if (blocks[id].size - size >= granularity) {
+    insertFree(split(id, size));
+  }
+
+  allocationCount++;
+  return {id, blocks[id].offset, blocks[id].size};
+}
+
+void TlsfAllocator::release(uint32_t id) {
+  assert(id < blocks.size() && blocks[id].live && !blocks[id].free);
+  allocationCount--;
+
+  uint32_t prev = blocks[id].prevPhysical;
+  if (prev != invalidId && blocks[prev].free) {
+    removeFree(prev);
+    blocks[prev].size += blocks[id].size;
+    blocks[prev].nextPhysical = blocks[id].nextPhysical;
+    if (blocks[id].nextPhysical != invalidId) {
+      blocks[blocks[id].nextPhysical].prevPhysical = prev;
+    }
+    deleteBlock(id);
+    id = prev;
+  }
+
+  uint32_t next = blocks[id].nextPhysical;
+  if (next != invalidId && blocks[next].free) {
+    removeFree(next);
+    blocks[id].size += blocks[next].size;
+    blocks[id].nextPhysical = blocks[next].nextPhysical;
+    if (blocks[next].nextPhysical != invalidId) {
+      blocks[blocks[next].nextPhysical].prevPhysical = id;
+    }
+    deleteBlock(next);
+  }
+
+  insertFree(id);
+}
+
+TlsfAllocator::Stats TlsfAllocator::stats() const {
+  Stats stats;
+  stats.capacity = totalCapacity;
+  stats.freeBytes = freeBytes;
+  stats.usedBytes = totalCapacity - freeBytes;
+  stats.allocationCount = allocationCount;
+  stats.freeBlockCount = freeBlockCount;
+
+  // The largest block is in the highest non-empty size class
+  if (firstLevelBitmap != 0) {
+    uint32_t firstLevel = 63 - std::countl_zero(firstLevelBitmap);
+    uint32_t secondLevel =
+        31 - std::countl_zero(secondLevelBitmaps[firstLevel]);
+    for (uint32_t id = freeLists[firstLevel][secondLevel]; id != invalidId;
+         id = blocks[id].nextFree) {
+      stats.largestFreeBlock = std::max(stats.largestFreeBlock, blocks[id].size);
+    }
+  }
+  if (freeBytes > 0) {
+    stats.fragmentation =
+        1.0f - (float)((double)stats.largestFreeBlock / (double)freeBytes);
+  }
+  return stats;
+}
+
+bool TlsfAllocator::validate() const {
+  // Physical chain must tile [0, capacity) without gaps or adjacent frees
+  uint32_t first = invalidId;
+  for (uint32_t id = 0; id < blocks.size(); id++) {
+    if (blocks[id].live && blocks[id].prevPhysical == invalidId) {
+      if (first != invalidId) {
+        return false;
+      }
+      first = id;
+    }
+  }
+  uint64_t offset = 0;
+  uint64_t countedFree = 0;
+  uint32_t countedFreeBlocks = 0;
+  uint32_t countedAllocations = 0;
+  uint32_t prev = invalidId;
+  for (uint32_t id = first; id != invalidId; id = blocks[id].nextPhysical) {
+    const Block &block = blocks[id];
+    if (!block.live || block.offset != offset || block.size == 0 ||
+        block.size % granularity != 0 || block.prevPhysical != prev) {
+      return false;
+    }
+    if (block.free) {
+      if (prev != invalidId && blocks[prev].free) {
+        return false;
+      }
+      countedFree += block.size;
+      countedFreeBlocks++;
+    } else {
+      countedAllocations++;
+    }
+    offset += block.size;
+    prev = id;
+  }
+  if (offset != totalCapacity || countedFree != freeBytes ||
+      countedFreeBlocks != freeBlockCount ||
+      countedAllocations != allocationCount) {
+    return false;
+  }
+
+  // Every free list entry must be free and in the right size class
+  uint32_t listed = 0;
+  for (uint32_t fl = 0; fl < firstLevelCount; fl++) {
+    for (uint32_t sl = 0; sl < secondLevelCount; sl++) {
+      bool bit = secondLevelBitmaps[fl] & (1u << sl);
+      if (bit != (freeLists[fl][sl] != invalidId)) {
+        return false;
+      }
+      for (uint32_t id = freeLists[fl][sl]; id != invalidId;
+           id = blocks[id].nextFree) {
+        uint32_t blockFl, blockSl;
+        mapping(blocks[id].size, blockFl, blockSl);
+        if (!blocks[id].free || blockFl != fl || blockSl != sl) {
+          return false;
+        }
+        listed++;
+      }
+    }
+    if (((firstLevelBitmap >> fl) & 1) != (secondLevelBitmaps[fl] != 0)) {
+      return false;
+    }
+  }
+  return listed == freeBlockCount;
+}
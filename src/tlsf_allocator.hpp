@@ -0,0 +1,94 @@
+#pragma once
+// Two-Level Segregated Fit (TLSF) range allocator.
+//
+// Manages offsets inside a range of `capacity` bytes without touching the
+// memory itself, so it can carve sub-allocations out of a GPU buffer or heap.
+// Allocation and release are O(1): free blocks are kept in size class lists
+// indexed by a first level (power of two) and second level (linear
+// subdivision of that power of two), with bitmaps to find a non-empty list
+// with one bit scan. Freed blocks are merged with free physical neighbours
+// straight away. Only when no class above the request has a free block is
+// the request's own class searched block by block, so a request as large as
+// the remaining free memory still succeeds.
+#include <cstdint>
+#include <vector>
+
+class TlsfAllocator {
+public:
+  static constexpr uint32_t invalidId = UINT32_MAX;
+  // All offsets and sizes are multiples of this
+  static constexpr uint64_t granularity = 16;
+
+  struct Allocation {
+    uint32_t id = invalidId;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+
+    bool valid() const { return id != invalidId; }
+  };
+
+  struct Stats {
+    uint64_t capacity = 0;
+    uint64_t usedBytes = 0;
+    uint64_t freeBytes = 0;
+    uint64_t largestFreeBlock = 0;
+    uint32_t allocationCount = 0;
+    uint32_t freeBlockCount = 0;
+    // 0 when all free memory is one block, approaching 1 as it gets split up
+    // into many small holes. 1 - largestFreeBlock / freeBytes.
+    float fragmentation = 0.0f;
+  };
+
+  explicit TlsfAllocator(uint64_t capacity);
+
+  // Returns an invalid allocation if there is no free block large enough.
+  // `alignment` must be a power of two.
+  Allocation allocate(uint64_t size, uint64_t alignment = granularity);
+  void release(uint32_t id);
+
+  uint64_t capacity() const { return totalCapacity; }
+  Stats stats() const;
+
+  // Walks every block and checks the allocator's invariants (neighbours
+  // linked up, no two adjacent free blocks, free lists match the bitmaps).
+  // Expensive, meant for tests and debug builds.
+  bool validate() const;
+
+private:
+  static constexpr uint32_t secondLevelLog2 = 4;
+  static constexpr uint32_t secondLevelCount = 1 << secondLevelLog2;
+  static constexpr uint32_t firstLevelCount = 48;
+
+  struct Block {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint32_t prevPhysical = invalidId;
+    uint32_t nextPhysical = invalidId;
+    uint32_t prevFree = invalidId;
+    uint32_t nextFree = invalidId;
+    bool free = false;
+    bool live = false; // Slot in `blocks` is in use
+  };
+
+  static void mapping(uint64_t size, uint32_t &firstLevel,
+                      uint32_t &secondLevel);
+  uint32_t findFreeBlock(uint64_t size) const;
+  void insertFree(uint32_t id);
+  void removeFree(uint32_t id);
+  uint32_t newBlock();
+  void deleteBlock(uint32_t id);
+  // Splits `size` bytes off the front of block `id`, returning the new block
+  // holding the remainder
+  uint32_t split(uint32_t id, uint64_t size);
+
+  uint64_t totalCapacity;
+  std::vector<Block> blocks;
+  std::vector<uint32_t> unusedBlocks;
+  uint64_t firstLevelBitmap = 0;
+  uint32_t secondLevelBitmaps[firstLevelCount] = {};
+  uint32_t freeLists[firstLevelCount][secondLevelCount];
+
+  uint64_t freeBytes = 0;
+  uint32_t freeBlockCount = 0;
+  uint32_t allocationCount = 0;
+};
@@ -0,0 +1,44 @@
+#include "uniform_ring.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+UniformRingAllocator::UniformRingAllocator(uint64_t capacity,
+                                           uint32_t framesInFlight,
+                                           uint64_t alignment)
+    : framesInFlight(framesInFlight), defaultAlignment(alignment) {
+  assert(framesInFlight > 0);
+  // Keep every region start aligned so offsets inside it only need the
+  // alignment applied relative to the region
+  frameRegionSize = (capacity / framesInFlight) & ~(alignment - 1);
+  // Start on the last frame so the first beginFrame() lands on region 0
+  currentFrame = framesInFlight - 1;
+}
+
+void UniformRingAllocator::beginFrame() {
+  currentFrame = (currentFrame + 1) % framesInFlight;
+  regionStart = currentFrame * frameRegionSize;
+  head = 0;
+  stats = {};
+  stats.peakUsedBytes = peakUsedBytes;
+}
+
+uint64_t UniformRingAllocator::allocate(uint64_t size, uint64_t alignment) {
+  if (alignment == 0) {
+    alignment = defaultAlignment;
+  }
+  assert((alignment & (alignment - 1)) == 0);
+  uint64_t offset = (head + alignment - 1) & ~(alignment - 1);
+  if (offset + size > frameRegionSize) {
+    stats.failedAllocations++;
+    return invalidOffset;
+  }
+  head = offset + size;
+
+  stats.allocations++;
+  stats.requestedBytes += size;
+  stats.usedBytes = head;
+  peakUsedBytes = std::max(peakUsedBytes, head);
+  stats.peakUsedBytes = peakUsedBytes;
+  return regionStart + offset;
+}
@@ -0,0 +1,54 @@
+#pragma once
+// Per-frame linear allocator for uniform data.
+//
+// One persistently mapped buffer is split into a region per frame in flight.
+// During a frame, uniforms are bump allocated out of that frame's region and
+// bound by offset; when the frame comes around again (after its fence has
+// signalled) the region is simply reset. Allocation is a couple of adds, and
+// nothing ever writes into memory the GPU may still be reading.
+#include <cstdint>
+
+class UniformRingAllocator {
+public:
+  static constexpr uint64_t invalidOffset = UINT64_MAX;
+
+  struct Stats {
+    uint32_t allocations = 0;
+    uint32_t failedAllocations = 0;
+    // Bytes asked for vs. bytes consumed including alignment padding
+    uint64_t requestedBytes = 0;
+    uint64_t usedBytes = 0;
+    // High water mark of usedBytes over every frame so far
+    uint64_t peakUsedBytes = 0;
+
+    float paddingRatio() const {
+      return usedBytes ? 1.0f - (float)requestedBytes / (float)usedBytes : 0.0f;
+    }
+  };
+
+  UniformRingAllocator(uint64_t capacity, uint32_t framesInFlight,
+                       uint64_t alignment = 256);
+
+  // Moves to the next frame's region and resets it. The caller must have
+  // waited for the GPU to finish with the frame that last used the region.
+  void beginFrame();
+
+  // Returns an offset from the start of the buffer, or invalidOffset if the
+  // frame's region is full. `alignment` of 0 uses the default alignment.
+  uint64_t allocate(uint64_t size, uint64_t alignment = 0);
+
+  uint32_t frameIndex() const { return currentFrame; }
+  uint64_t regionSize() const { return frameRegionSize; }
+  // Statistics for the current frame (peakUsedBytes covers all frames)
+  const Stats &frameStats() const { return stats; }
+
+private:
+  uint64_t frameRegionSize;
+  uint32_t framesInFlight;
+  uint64_t defaultAlignment;
+  uint32_t currentFrame = 0;
+  uint64_t regionStart = 0;
+  uint64_t head = 0;
+  uint64_t peakUsedBytes = 0;
+  Stats stats;
+};